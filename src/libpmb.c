@@ -2,9 +2,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <usb.h>	// libusb
 
+#include "pmblog.h"
+#include "pmbtrace.h"
+
 static struct usb_bus *bus;
 static struct usb_bus *dev_bus;
 static struct usb_device *dev_dev;
@@ -16,6 +20,19 @@ static struct usb_endpoint_descriptor *dev_ep_in[2];
 static struct usb_dev_handle *dev_handle = NULL;
 static char found = 0;
 
+// which device was opened, as libusb names it: bus/device. the device number
+// is handed out anew whenever the device is plugged in, powered up or reset.
+char pmb_device[32] = "";
+
+// the pmb_device of a MovieBox the caller knows was left running, never
+// closed by PinnacleMovieBoxFree() (whose unsetup() leaves it unable to start
+// again, firmware or not). only such a device, and only if resident() finds
+// its firmware, is restarted without uploading it again. pmb_warm says
+// whether the last init did that; pmb_cold_init uploads it regardless.
+const char *pmb_left_running = NULL;
+int pmb_warm = 0;
+int pmb_cold_init = 0;
+
 // array of bytes in A9/AA memory
 static unsigned char AABuffer[256];
 
@@ -63,7 +80,7 @@ static int WriteA9(int index,int data)
 	buf[2] = index;
 	buf[3] = data;
 	if (usb_control_msg(dev_handle,0x40,0xAA,0x00,0,buf,4,1000) < 1) {
-		fprintf(stderr,"Cannot initiate AA write in WriteA9\n");
+		PMBLog(PMB_LOG_ERR,"Cannot initiate AA write in WriteA9\n");
 		return -1;
 	}
 
@@ -83,7 +100,7 @@ static int WriteA9W(int index,int data)
 	buf[3] = data >> 8;
 	buf[4] = data;
 	if (usb_control_msg(dev_handle,0x40,0xAA,0x00,0,buf,5,1000) < 1) {
-		fprintf(stderr,"Cannot initiate AA write in WriteA9W\n");
+		PMBLog(PMB_LOG_ERR,"Cannot initiate AA write in WriteA9W\n");
 		return -1;
 	}
 
@@ -132,7 +149,7 @@ static int ReadA9(int index)
 	buf[2] = 0x00;
 	buf[3] = index;
 	if (usb_control_msg(dev_handle,0x40,0xAA,0x00,0,buf,4,1000) < 1) {
-		fprintf(stderr,"Cannot initiate AA 1st packet in ReadA9\n");
+		PMBLog(PMB_LOG_ERR,"Cannot initiate AA 1st packet in ReadA9\n");
 		return -1;
 	}
 
@@ -140,7 +157,7 @@ static int ReadA9(int index)
 	buf[1] = 0x01;
 	buf[2] = 0x00;
 	if (usb_control_msg(dev_handle,0x40,0xAA,0x00,0,buf,3,1000) < 1) {
-		fprintf(stderr,"Cannot initiate AA 2nd packet in ReadA9\n");
+		PMBLog(PMB_LOG_ERR,"Cannot initiate AA 2nd packet in ReadA9\n");
 		return -1;
 	}
 
@@ -160,13 +177,13 @@ static int knock_knock()
 
 #define SPITA(a,b,c,d) \
 	if (usb_control_msg(dev_handle,USB_TYPE_VENDOR|USB_RECIP_DEVICE,a,b,c,d,sizeof(d),250) < sizeof(d)) { \
-		fprintf(stderr,"Cannot write %u bytes",sizeof(d)); \
+		PMBLog(PMB_LOG_ERR,"Cannot write %u bytes\n",(unsigned int)sizeof(d)); \
 		return -1; \
 	}
 #define SPITS(a,b,c,d) \
 	{ unsigned char *bin = monhex(d); \
 		if (usb_control_msg(dev_handle,USB_TYPE_VENDOR|USB_RECIP_DEVICE,a,b,c,bin,monhex_len,250) < monhex_len) { \
-			fprintf(stderr,"Cannot write %s\n",d); \
+			PMBLog(PMB_LOG_ERR,"Cannot write %s\n",d); \
 			return -1; \
 		} \
 	}
@@ -469,6 +486,33 @@ static int knock_knock()
 	return 0;
 }
 
+// code startup() loads into the 8051, read back through the same vendor
+// request. knock_knock()'s loader is no use for this, startup() writes over
+// it (0x0296-0x02E0 and on). these two are startup()'s alone and nothing
+// writes them afterwards, on either the PAL or the NTSC pass: the entry point
+// its reset vector jumps to (0x0FC4 -> 0x0851), and a routine well away from
+// the loader. the 8051 and the 2880 lose their firmware together when the
+// MovieBox is powered off, so if these are there the 2880's is too.
+static int resident()
+{
+	static struct { int addr; char *hex; } sig[] = {
+		{ 0x0851, "E4 F5 13 F5 12 F5 11 F5 10 C2 15 C2 12 D2 14 C2" },
+		{ 0x13FB, "90 E6 80 E0 44 08 F0 E5 80 30 E2 FB 7F F4 7E 01" },
+	};
+	unsigned char buf[64],*want;
+	int i;
+
+	for (i=0;i < (int)(sizeof(sig) / sizeof(sig[0]));i++) {
+		want = monhex(sig[i].hex);
+		if (usb_control_msg(dev_handle,0xC0,0xA0,sig[i].addr,0x00,buf,monhex_len,250) < monhex_len)
+			return 0;
+		if (memcmp(buf,want,monhex_len))
+			return 0;
+	}
+
+	return 1;
+}
+
 static int startup()
 {
 	int i,val;
@@ -724,13 +768,13 @@ static int startup()
 		int fd = open("../blob/2880fw.bin", O_RDONLY);
 		int len,ret=0;
 		if (fd < 0) {
-			fprintf(stderr,"Cannot open 2880 firmware image\n");
+			PMBLog(PMB_LOG_ERR,"Cannot open 2880 firmware image\n");
 			return -1;
 		}
 
 		while ((len = read(fd,buffer,8192)) > 0) {
 			if (usb_bulk_write(dev_handle,0x02,buffer,len,2000) < 0) {
-				fprintf(stderr,"Failed to write 2880 firmware image\n");
+				PMBLog(PMB_LOG_ERR,"Failed to write 2880 firmware image\n");
 				ret = -1;
 				break;
 			}
@@ -771,7 +815,7 @@ static int startup()
 	C5("B2 01");
 
 	if (usb_bulk_write(dev_handle,0x02,monhex("0B 00 10 01 00 02 10 03 04 04 B0 05 00 06 00 07 10 08 32 09 00 0A 00 0B 05 0C 00 0D 00 0E 7F 0F E3 10 16 11 E8 12 01 13 00 14 07 15 00 16 00 17 00 18 00 19 00 1A 00 1B 00 1C 10 1D 00 1E 05 1F 00 20 00 21 00 22 00 23 00 24 00 25 00 26 00 27 00 28 00 29 00 2A 00 2B 00 2C 02 2D 00 2E 10 2F 00 30 00 31 00 32 00 33 00 34 00 35 00 36 00 37 01 B8"),0x72,2500) < 0x72) {
-		fprintf(stderr,"Cannot upload 0x72 bytes of whatever\n");
+		PMBLog(PMB_LOG_ERR,"Cannot upload 0x72 bytes of whatever\n");
 		return -1;
 	}
 
@@ -1013,13 +1057,13 @@ static int startup()
 		int fd = open("../blob/2880ntscfw.bin",O_RDONLY);
 		int len,ret=0;
 		if (fd < 0) {
-			fprintf(stderr,"Cannot open 2880 NTSC firmware image\n");
+			PMBLog(PMB_LOG_ERR,"Cannot open 2880 NTSC firmware image\n");
 			return -1;
 		}
 
 		while ((len = read(fd,buffer,8192)) > 0) {
 			if (usb_bulk_write(dev_handle,0x02,buffer,len,2000) < 0) {
-				fprintf(stderr,"Failed to write 2880 firmware image\n");
+				PMBLog(PMB_LOG_ERR,"Failed to write 2880 firmware image\n");
 				ret = -1;
 				break;
 			}
@@ -1056,6 +1100,7 @@ int PinnacleMovieBoxReset()
 
 // according to UDA1380TT chipset register documentation,
 // register 0x10 is the master volume control
+static int master_volume = 0x0000;
 int PinnacleMovieBoxSetMasterVolume(int l,int r)
 {
 	if (l < 0) l = 0;
@@ -1068,6 +1113,7 @@ int PinnacleMovieBoxSetMasterVolume(int l,int r)
 	if (WriteA9W(0x10,w) < 0)
 		return -1;
 
+	master_volume = w;
 	return 0;
 }
 
@@ -1103,6 +1149,32 @@ static int unsetup()
 	return 0;
 }
 
+// throw away whatever the decoder has buffered and get it going again, so
+// that the next thing written plays right away. this is unsetup()'s stop
+// followed by the end of startup(), muted in between so the audio doesn't
+// pop.
+int PinnacleMovieBoxFlush()
+{
+	if (!dev_handle)
+		return -1;
+
+	A9_Byte = 0x18;
+	WriteA9W(0x10,0xFCFC);
+	C5("B1 08");
+	C5("AC 02 00");
+
+	usb_clear_halt(dev_handle,0x04);
+
+	C5("B1 08");
+	C5("AC 01 00");
+	C5("B4 01");
+	C5("B1 08");
+	C5("AC 03 00");
+	WriteA9W(0x10,master_volume);
+
+	return 0;
+}
+
 #undef X
 #undef SPIT
 
@@ -1115,7 +1187,7 @@ static int unsetup()
 int PinnacleMovieBoxInit()
 {
 	if (!(dev_bus = bus = usb_get_busses())) {
-		fprintf(stderr,"libusb did not return any USB busses\n");
+		PMBLog(PMB_LOG_ERR,"libusb did not return any USB busses\n");
 		return -1;
 	}
 
@@ -1126,7 +1198,7 @@ int PinnacleMovieBoxInit()
 		while (!found && dev_dev) {
 			dev_desc = &dev_dev->descriptor;
 			dev_conf =  dev_dev->config;
-			fprintf(stdout, "Bus %d\tidVendor %#x\tidProduct %#x\t\t", 
+			PMBLog(PMB_LOG_DEBUG,"Bus %d\tidVendor %#x\tidProduct %#x\t\t", 
 				dev_dev->bus->location, 
 				dev_desc->idVendor,
 				dev_desc->idProduct
@@ -1148,14 +1220,14 @@ int PinnacleMovieBoxInit()
 				// dev_desc->bNumConfigurations == 1 &&
 				// dev_conf->iConfiguration == 0
 			) {
-				fprintf(stdout, "Passed check\n");
+				PMBLog(PMB_LOG_DEBUG,"Passed check\n");
 				if (dev_conf->interface->num_altsetting > 0) {
 					dev_if = dev_conf->interface->altsetting;
-					fprintf(stdout, "\tOK\tAltsetting > 0\n");
+					PMBLog(PMB_LOG_DEBUG,"\tOK\tAltsetting > 0\n");
 				}
 			} else {
 				dev_if = NULL;
-				fprintf(stdout, "\n");
+				PMBLog(PMB_LOG_DEBUG,"\n");
 			}
 
 			if (	
@@ -1167,7 +1239,7 @@ int PinnacleMovieBoxInit()
 					dev_if->bNumEndpoints == 4
 				)
 			) {
-				fprintf(stdout, "\tOK\tInterfaces and endpoints fit\n");
+				PMBLog(PMB_LOG_DEBUG,"\tOK\tInterfaces and endpoints fit\n");
 				// Set all to NULL
 				for (int i=0; i < dev_if->bNumEndpoints; i++) {
 					dev_ep_out[i] = dev_ep_in[i] = NULL;
@@ -1179,21 +1251,21 @@ int PinnacleMovieBoxInit()
 
 					// all endpoints on these things are bulk transfers
 					if (d->bmAttributes != 2) {
-						fprintf(stdout, "Hop");
+						PMBLog(PMB_LOG_DEBUG,"Hop");
 						continue;
 					}
 					
 					// TODO add handling for DazzleTV Sat BDA Device
 					// dev_desc->idProduct == 0x0223 ||  // DazzleTV Sat BDA Device
 					// dev_desc->idProduct == 0x0204     // MovieBox USB
-					fprintf(stdout, "\t\taddr:%#x\n", d->bEndpointAddress);
+					PMBLog(PMB_LOG_DEBUG,"\t\taddr:%#x\n", d->bEndpointAddress);
 					switch (d->bEndpointAddress) {
 						case 0x02:	dev_ep_out[0] = d;	break;
 						case 0x04:	dev_ep_out[1] = d;	break;
 						case 0x86:	dev_ep_in[0] = d;	break;
 						case 0x88:	dev_ep_in[1] = d;	break;
 						default:
-							fprintf(stdout, "\t\t -> No match for addr:%#x\n", d->bEndpointAddress);
+							PMBLog(PMB_LOG_DEBUG,"\t\t -> No match for addr:%#x\n", d->bEndpointAddress);
 					}
 				}
 
@@ -1203,13 +1275,13 @@ int PinnacleMovieBoxInit()
 				) {
 					found = 1;
 				} else {
-					fprintf(stderr, "\t->\t%d\tEP Out");
+					PMBLog(PMB_LOG_DEBUG,"\t->\t%d\tEP Out\n",dev_if->bNumEndpoints);
 				}
 			} else if (dev_if != NULL) {
 				// We found the device but something was wrong
-				fprintf(stdout, "\t%s\t%d\t dev_if->bInterfaceClass == 255 \n", dev_if->bInterfaceClass == 255 ? "OK" : "->", dev_if->bInterfaceClass);
-				fprintf(stdout, "\t%s\t%d\t dev_if->iInterface == 0 \n", dev_if->iInterface == 0 ? "OK" : "->", dev_if->iInterface);
-				fprintf(stdout, "\t%s\t%d\t dev_if->bNumEndpoints == 4 \n", dev_if->bNumEndpoints == 4 ? "OK" : "->", dev_if->bNumEndpoints);
+				PMBLog(PMB_LOG_DEBUG,"\t%s\t%d\t dev_if->bInterfaceClass == 255 \n", dev_if->bInterfaceClass == 255 ? "OK" : "->", dev_if->bInterfaceClass);
+				PMBLog(PMB_LOG_DEBUG,"\t%s\t%d\t dev_if->iInterface == 0 \n", dev_if->iInterface == 0 ? "OK" : "->", dev_if->iInterface);
+				PMBLog(PMB_LOG_DEBUG,"\t%s\t%d\t dev_if->bNumEndpoints == 4 \n", dev_if->bNumEndpoints == 4 ? "OK" : "->", dev_if->bNumEndpoints);
 			}
 
 			if (!found)
@@ -1220,32 +1292,48 @@ int PinnacleMovieBoxInit()
 			dev_bus = dev_bus->next;
 	}
 
-	if (!found)
-		fprintf(stderr,"Cannot find device\n");
+	if (!found) {
+		PMBLog(PMB_LOG_ERR,"Cannot find device\n");
 		return -1;
+	}
 
 	if (!(dev_handle = usb_open(dev_dev))) {
-		fprintf(stderr,"Cannot open device\n");
+		PMBLog(PMB_LOG_ERR,"Cannot open device\n");
 		return -1;
 	}
 	if (usb_set_configuration(dev_handle,1) < 0) {
-		fprintf(stderr,"Cannot set configuration\n");
+		PMBLog(PMB_LOG_ERR,"Cannot set configuration\n");
 		return -1;
 	}
 	if (usb_claim_interface(dev_handle,0) < 0) {
-		fprintf(stderr,"Cannot claim interface\n");
+		PMBLog(PMB_LOG_ERR,"Cannot claim interface\n");
 		return -1;
 	}
 
+	snprintf(pmb_device,sizeof(pmb_device),"%.15s/%.15s",dev_bus->dirname,dev_dev->filename);
+
+	// left running (pmbpipe restarted, or died) and still set up: the
+	// decoder only needs restarting, it may have been left in the middle of
+	// a stream
+	pmb_warm = 0;
+	if (!pmb_cold_init && pmb_left_running && !strcmp(pmb_left_running,pmb_device) && resident()) {
+		if (PinnacleMovieBoxFlush() == 0) {
+			PMBLog(PMB_LOG_INFO,"Device %s still has its firmware, not uploading it again\n",pmb_device);
+			pmb_warm = 1;
+			return 0;
+		}
+		PMBLog(PMB_LOG_WARNING,"Device %s has its firmware but won't restart, uploading it again\n",pmb_device);
+	}
+
 // mimick the transfers that Pinnacle's device drivers send when it's first plugged in
 	if (knock_knock() < 0) {
-		fprintf(stderr,"Device initialization failed\n");
+		PMBLog(PMB_LOG_ERR,"Device initialization failed\n");
 		return -1;
 	}
 
 // mimick the additional packets sent when Studio 9 starts up
 	if (startup() < 0) {
-		fprintf(stderr,"Device secondary init failed\n");
+		PMBLog(PMB_LOG_ERR,"Device secondary init failed\n");
 		return -1;
 	}
 
@@ -1255,6 +1343,7 @@ int PinnacleMovieBoxInit()
 static unsigned char video_tmp[2048*32];
 int PinnacleMovieBoxWriteVideo(unsigned char *buf,int len)
 {
+	long long t = 0;
 	int ret = 0,i;
 
 	if (!dev_handle)
@@ -1269,6 +1358,7 @@ int PinnacleMovieBoxWriteVideo(unsigned char *buf,int len)
 		int s = len;
 		if (s > (2048*32)) s = 2048*32;
 
+		if (pmb_trace) t = PMBTraceClock();
 		for (i=0;i < s;i += 2) {
 			video_tmp[i+1] = buf[i  ];
 			video_tmp[i  ] = buf[i+1];
@@ -1276,9 +1366,42 @@ int PinnacleMovieBoxWriteVideo(unsigned char *buf,int len)
 		len -= s;
 		buf += s;
 
+		if (pmb_trace) {
+			PMBTraceSpan(PMB_TRACE_SWAP,t,trace_sent,s / 2048);
+			t = PMBTraceClock();
+		}
 		i = usb_bulk_write(dev_handle,0x04,video_tmp,s,5000);
+		if (pmb_trace) PMBTraceSpan(PMB_TRACE_BULK,t,trace_sent,s / 2048);
+		trace_sent += s / 2048;
+		if (i > 0) ret += i;
+		if (i < s) break;
+	}
+
+	return ret;
+}
+
+// the same for data already in the MovieBox's byte order (see pmbcache.c)
+int PinnacleMovieBoxWriteVideoRaw(unsigned char *buf,int len)
+{
+	long long t = 0;
+	int ret = 0,i;
+
+	if (!dev_handle)
+		return -1;
+
+	usb_clear_halt(dev_handle,0x04);
+	while (len > 0) {
+		int s = len;
+		if (s > (2048*32)) s = 2048*32;
+
+		if (pmb_trace) t = PMBTraceClock();
+		i = usb_bulk_write(dev_handle,0x04,buf,s,5000);
+		if (pmb_trace) PMBTraceSpan(PMB_TRACE_BULK,t,trace_sent,s / 2048);
+		trace_sent += s / 2048;
 		if (i > 0) ret += i;
 		if (i < s) break;
+		len -= s;
+		buf += s;
 	}
 
 	return ret;
@@ -1288,7 +1411,7 @@ int PinnacleMovieBoxFree()
 {
 	if (dev_handle) {
 		unsetup();
-		fprintf(stderr,"Closing device...\n");
+		PMBLog(PMB_LOG_INFO,"Closing device...\n");
 		usb_close(dev_handle);
 		dev_handle = NULL;
 	}
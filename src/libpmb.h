@@ -3,10 +3,20 @@ int PinnacleMovieBoxInit();
 int PinnacleMovieBoxFree();
 int PinnacleMovieBoxSetupPlayback();
 int PinnacleMovieBoxWriteVideo(unsigned char *buf,int len);
+int PinnacleMovieBoxWriteVideoRaw(unsigned char *buf,int len);
 int PinnacleMovieBoxWriteAudio(unsigned char *buf,int len);
 int PinnacleMovieBoxSetMasterVolume(int l,int r);
 int PinnacleMovieBoxDeviceRemoved();
 int PinnacleMovieBoxReset();
+int PinnacleMovieBoxFlush();
+
+// the device opened, bus/device. PinnacleMovieBoxInit() doesn't upload the
+// firmware again to the device named by pmb_left_running if it still has it
+// (pmb_warm), unless pmb_cold_init is set.
+extern char pmb_device[32];
+extern const char *pmb_left_running;
+extern int pmb_warm;
+extern int pmb_cold_init;
 
 int PinnacleMovieBoxEnableVideoOutputs(int flags);
 #define PMB_VO_COMPOSITE		0x20
@@ -0,0 +1,245 @@
+/* Pinnacle Moviebox USB pre-packed stream cache
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Looking up and playing cache entries (see pmbcache.h). The entries are
+ * made by the pmbcache tool (pmbcachetool.c).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbcache.h"
+
+// the key is taken over the size and this much of the start and the end of
+// the file. reading all of a 4GB file to find out if it is cached would cost
+// more than the cache saves.
+#define PMB_CACHE_SAMPLE	(1024 * 1024)
+
+void PMBCacheSwap(unsigned char *dst,unsigned char *src,int len)
+{
+	unsigned char c;
+	int i;
+
+	for (i=0;(i+1) < len;i += 2) {
+		c = src[i];
+		dst[i] = src[i+1];
+		dst[i+1] = c;
+	}
+}
+
+// 64-bit FNV-1a
+static unsigned long long KeyAdd(unsigned long long h,unsigned char *p,int len)
+{
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001B3ULL;
+	}
+
+	return h;
+}
+
+int PMBCacheKey(int fd,unsigned long long *key,unsigned long long *size,unsigned long long *mtime)
+{
+	unsigned long long h = 0xCBF29CE484222325ULL;
+	unsigned char *buf;
+	struct stat st;
+	off_t at;
+	int rd,i;
+
+	if (fstat(fd,&st) < 0)
+		return -1;
+	if ((buf = malloc(PMB_CACHE_SAMPLE)) == NULL)
+		return -1;
+
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	for (i=0;i < 8;i++)
+		h = KeyAdd(h,((unsigned char*)size)+i,1);
+
+	for (i=0;i < 2;i++) {
+		at = (i == 0) ? 0 : (st.st_size - PMB_CACHE_SAMPLE);
+		if (i == 1 && st.st_size <= PMB_CACHE_SAMPLE)
+			break;		// the first read had all of it
+		if (i == 1 && at < PMB_CACHE_SAMPLE)
+			at = PMB_CACHE_SAMPLE;
+
+		rd = pread(fd,buf,PMB_CACHE_SAMPLE,at);
+		if (rd < 0) {
+			free(buf);
+			return -1;
+		}
+		h = KeyAdd(h,buf,rd);
+	}
+
+	free(buf);
+	*key = h;
+	return 0;
+}
+
+char *PMBCachePath(const char *dir,unsigned long long key)
+{
+	char *path;
+
+	if ((path = malloc(strlen(dir) + 32)) != NULL)
+		sprintf(path,"%s/%016llx.pmbc",dir,key);
+
+	return path;
+}
+
+// the entry for the file at path, if there is one. NULL (quietly) if not.
+struct pmb_cache *PMBCacheOpen(const char *dir,const char *path)
+{
+	unsigned long long key,size,mtime;
+	struct pmb_cache *c;
+	struct stat st;
+	char *cpath;
+	int fd;
+
+	if ((fd = open(path,O_RDONLY)) < 0)
+		return NULL;
+	if (PMBCacheKey(fd,&key,&size,&mtime) < 0) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	if ((cpath = PMBCachePath(dir,key)) == NULL)
+		return NULL;
+	fd = open(cpath,O_RDONLY);
+	if (fd < 0) {
+		free(cpath);
+		return NULL;
+	}
+
+	if ((c = calloc(1,sizeof(*c))) == NULL) {
+		close(fd);
+		free(cpath);
+		return NULL;
+	}
+	c->fd = fd;
+
+	if (fstat(fd,&st) < 0 || st.st_size < PMB_CACHE_DATA)
+		goto bad;
+	c->map_len = st.st_size;
+	c->map = mmap(NULL,c->map_len,PROT_READ,MAP_SHARED,fd,0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		goto bad;
+	}
+
+	c->hdr = (struct pmb_cache_header*)c->map;
+	if (memcmp(c->hdr->magic,PMB_CACHE_MAGIC,8) || c->hdr->version != PMB_CACHE_VERSION)
+		goto bad;
+	if (c->hdr->key != key || c->hdr->source_size != size || c->hdr->source_mtime != mtime ||
+		c->hdr->packs == 0)
+		goto bad;
+	if ((unsigned long long)st.st_size < PMB_CACHE_DATA + (c->hdr->packs * 2048ULL) +
+		(c->hdr->marks * sizeof(struct pmb_cache_mark)))
+		goto bad;
+
+	c->packs = c->map + PMB_CACHE_DATA;
+	c->marks = (struct pmb_cache_mark*)(c->packs + (c->hdr->packs * 2048ULL));
+	c->next_mark = 0;
+
+	// it's read front to back, once
+	madvise(c->map,c->map_len,MADV_SEQUENTIAL);
+	madvise(c->packs,c->hdr->packs * 2048ULL < (4 << 20) ? c->hdr->packs * 2048ULL : (4 << 20),MADV_WILLNEED);
+	free(cpath);
+	return c;
+bad:
+	PMBLog(PMB_LOG_WARNING,"Cache: %s is not a usable entry for %s, ignoring it\n",cpath,path);
+	free(cpath);
+	PMBCacheClose(c);
+	return NULL;
+}
+
+void PMBCacheClose(struct pmb_cache *c)
+{
+	if (c->map != NULL) munmap(c->map,c->map_len);
+	if (c->fd >= 0) close(c->fd);
+	free(c);
+}
+
+// in the form MPEGSplice() wants. the clock starts at 0.
+void PMBCacheTimes(struct pmb_cache *c,struct mpeg_times *t)
+{
+	memset(t,0,sizeof(*t));
+	t->have_SCR = 1;
+	t->first_SCR = 0;
+	t->last_SCR = c->hdr->last_SCR;
+	t->have_PTS = c->hdr->have_PTS;
+	t->first_PTS = c->hdr->first_PTS;
+	t->last_PTS = c->hdr->last_PTS;
+	t->frame_ticks = c->hdr->frame_ticks;
+}
+
+// a PTS/DTS in a swapped pack. the 5 bytes are spread over 3 words.
+static unsigned long long PatchTimestamp(unsigned char *pack,int at,unsigned long long off)
+{
+	unsigned char tmp[6];
+	unsigned long long v;
+	int w = at & ~1;
+
+	PMBCacheSwap(tmp,pack+w,6);
+	if (!MPEGTimestamp(tmp+(at-w),&v))
+		return 0;
+	v = (v + off) % MPEG_CLOCK_WRAP;
+	MPEGPatchTimestamp(tmp+(at-w),v);
+	PMBCacheSwap(pack+w,tmp,6);
+	return v;
+}
+
+void PMBCachePack(struct pmb_cache *c,unsigned long long n,unsigned char *dst,
+	unsigned long long off,unsigned long long trim,struct pmb_cache_pack *info)
+{
+	struct pmb_cache_mark *m;
+	unsigned char tmp[14];
+	unsigned long long SCR,v;
+	unsigned long mux_rate;
+
+	memcpy(dst,c->packs + (n * 2048ULL),2048);
+	stat_bytes_copied += 2048;
+	memset(info,0,sizeof(*info));
+
+	// the pack header is always at the front
+	PMBCacheSwap(tmp,dst,14);
+	if (MPEGPackClock(tmp,&SCR,&mux_rate)) {
+		info->SCR = (SCR + off) % MPEG_CLOCK_WRAP;
+		MPEGPatchClock(tmp,info->SCR + trim);
+		PMBCacheSwap(dst,tmp,14);
+	}
+
+	while (c->next_mark < c->hdr->marks && c->marks[c->next_mark].pack < n)
+		c->next_mark++;
+	for (;c->next_mark < c->hdr->marks && (m=&c->marks[c->next_mark])->pack == n;c->next_mark++) {
+		switch (m->kind) {
+			case MPEG_MARK_VIDEO_PTS:
+				if (m->offset > (2048 - 6)) break;
+				v = PatchTimestamp(dst,m->offset,off);
+				if (!info->have_PTS || v > info->max_PTS)
+					info->max_PTS = v;
+				info->have_PTS = 1;
+				break;
+			case MPEG_MARK_TIMESTAMP:
+				if (m->offset > (2048 - 6)) break;
+				PatchTimestamp(dst,m->offset,off);
+				break;
+			case MPEG_MARK_PICTURE:
+				info->pictures++;
+				break;
+			case MPEG_MARK_GOP:
+				info->gop = 1;
+				break;
+		}
+	}
+}
@@ -0,0 +1,84 @@
+/* Pinnacle Moviebox USB pre-packed stream cache
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * A cache entry is a program stream already run through the parser once:
+ * 2048 byte packs exactly as pmbpipe would send them, with the stream's
+ * clock starting at 0, end codes dropped, and the bytes already swapped
+ * into the order the MovieBox wants. Playing it means copying packs out and
+ * adding one offset to the timestamps, whose places are listed in the mark
+ * table at the end of the file.
+ *
+ * Entries are named after a key made from the source file's size and its
+ * first and last megabyte (see PMBCacheKey), so a file renamed still finds
+ * its entry. The key alone can't see a change in the middle of the file, so
+ * the source's mtime is kept too and an entry is only used for a file with
+ * the same one, as for pmbindex: a copy made without keeping the mtime is
+ * cached anew, and a file rewritten in place doesn't find a stale entry.
+ *
+ * The file is in host byte order; it's a cache, not an interchange format.
+ */
+
+#define PMB_CACHE_DIR		"/var/cache/pmb"
+#define PMB_CACHE_MAGIC		"PMBCACHE"
+#define PMB_CACHE_VERSION	2
+#define PMB_CACHE_DATA		4096		// where the packs start, page aligned
+
+// the header, at the start of the file
+struct pmb_cache_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		mux_rate;		// of the first pack, units of 50 bytes/sec
+	unsigned long long	key;			// of the source
+	unsigned long long	source_size;
+	unsigned long long	packs;			// starting at PMB_CACHE_DATA
+	unsigned long long	marks;			// right after the packs
+	unsigned long long	frame_ticks;		// video frame period, 0 if unknown
+	unsigned long long	last_SCR;		// of the last pack, 27MHz ticks
+	unsigned long long	first_PTS,last_PTS;	// video, 27MHz ticks. first SCR is 0.
+	unsigned int		have_PTS;
+	unsigned int		reserved0;
+	unsigned long long	source_mtime;
+	unsigned int		reserved[12];
+};
+
+// a timestamp to patch, or a start code to know about, in pack order.
+// offsets are within the pack as the parser made it, before byte swapping.
+struct pmb_cache_mark {
+	unsigned int		pack;
+	unsigned short		offset;
+	unsigned short		kind;			// MPEG_MARK_*
+};
+
+// an entry open for playing
+struct pmb_cache {
+	int			fd;
+	unsigned char		*map;
+	size_t			map_len;
+	struct pmb_cache_header	*hdr;
+	unsigned char		*packs;
+	struct pmb_cache_mark	*marks;
+	unsigned long long	next_mark;		// first mark of the next pack PMBCachePack() copies
+};
+
+// what PMBCachePack() found in the pack it copied
+struct pmb_cache_pack {
+	unsigned long long	SCR;			// as patched, 27MHz ticks
+	unsigned long long	max_PTS;		// latest video PTS in it, as patched
+	int			have_PTS;
+	int			pictures;		// starting in it
+	int			gop;			// a sequence or GOP header starts in it
+};
+
+int PMBCacheKey(int fd,unsigned long long *key,unsigned long long *size,unsigned long long *mtime);
+char *PMBCachePath(const char *dir,unsigned long long key);
+struct pmb_cache *PMBCacheOpen(const char *dir,const char *path);
+void PMBCacheClose(struct pmb_cache *c);
+void PMBCacheTimes(struct pmb_cache *c,struct mpeg_times *t);
+
+// copy pack n to dst (in device byte order), moving its SCR by off+trim and
+// its PTS/DTS by off. packs have to be copied in order.
+void PMBCachePack(struct pmb_cache *c,unsigned long long n,unsigned char *dst,
+	unsigned long long off,unsigned long long trim,struct pmb_cache_pack *info);
+
+// the MovieBox's byte order: every 16-bit word swapped
+void PMBCacheSwap(unsigned char *dst,unsigned char *src,int len);
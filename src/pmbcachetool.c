@@ -0,0 +1,205 @@
+/* Pinnacle Moviebox USB pre-packed stream cache builder
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Runs program stream files through the same parser pmbpipe uses and stores
+ * the result as cache entries (see pmbcache.h), so that pmbpipe -cache can
+ * play them again without parsing, rewriting or byte swapping anything but
+ * a handful of timestamps.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pmbmpeg.h"
+#include "pmbcache.h"
+
+static int out_fd = -1;
+static int out_error = 0;
+static struct pmb_cache_header hdr;
+static struct mpeg_times times;
+static unsigned long mark_sync;
+
+static struct pmb_cache_mark *marks = NULL;
+static unsigned long long marks_alloc = 0;
+
+static void AddMark(int at,int kind,void *arg)
+{
+	struct pmb_cache_mark *m;
+
+	if (hdr.marks >= marks_alloc) {
+		marks_alloc = marks_alloc ? (marks_alloc * 2) : 65536;
+		if ((m = realloc(marks,marks_alloc * sizeof(*m))) == NULL) {
+			out_error = ENOMEM;
+			return;
+		}
+		marks = m;
+	}
+
+	m = &marks[hdr.marks++];
+	m->pack = hdr.packs;
+	m->offset = at;
+	m->kind = kind;
+}
+
+// finished packs from the parser
+static void CacheOutput(unsigned char *pack,int len)
+{
+	unsigned char swapped[2048];
+	unsigned long long SCR;
+	unsigned long mux_rate;
+
+	if (out_error || len != 2048)
+		return;
+
+	if (MPEGPackClock(pack,&SCR,&mux_rate)) {
+		if (hdr.packs == 0) hdr.mux_rate = mux_rate;
+		hdr.last_SCR = SCR;
+	}
+	MPEGScanTimes(pack,len,&times);
+	MPEGPackMarks(pack,len,&mark_sync,AddMark,NULL);
+
+	PMBCacheSwap(swapped,pack,2048);
+	if (write(out_fd,swapped,2048) != 2048) {
+		out_error = errno ? errno : ENOSPC;
+		return;
+	}
+	hdr.packs++;
+}
+
+static int CacheFile(const char *dir,const char *path)
+{
+	static unsigned char buf[65536];
+	unsigned long long key,size,mtime;
+	char *cpath,*tmp;
+	int fd,rd;
+
+	if ((fd = open(path,O_RDONLY)) < 0) {
+		fprintf(stderr,"Cannot open %s: %s\n",path,strerror(errno));
+		return -1;
+	}
+	if (PMBCacheKey(fd,&key,&size,&mtime) < 0 || (cpath = PMBCachePath(dir,key)) == NULL) {
+		fprintf(stderr,"Cannot read %s: %s\n",path,strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if ((tmp = malloc(strlen(cpath) + 8)) == NULL) {
+		close(fd);
+		free(cpath);
+		return -1;
+	}
+	sprintf(tmp,"%s.tmp",cpath);
+
+	if ((out_fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644)) < 0) {
+		fprintf(stderr,"Cannot create %s: %s\n",tmp,strerror(errno));
+		goto fail;
+	}
+
+	memset(&hdr,0,sizeof(hdr));
+	memset(&times,0,sizeof(times));
+	out_error = 0;
+	mark_sync = ~0UL;
+	lseek(out_fd,PMB_CACHE_DATA,SEEK_SET);
+
+	// a fresh start: the clock begins at 0 and the first GOP is taken
+	// care of, the way it would be when spliced on in pmbpipe
+	MPEGReset();
+	MPEGExternalEnd(0,0,0,0);
+	while ((rd = read(fd,buf,sizeof(buf))) > 0 && !out_error)
+		MPEGInput(buf,rd);
+	FlushMPEGOut();
+	if (rd < 0) out_error = errno;
+
+	if (!out_error && hdr.packs == 0) {
+		fprintf(stderr,"%s is not a MPEG program stream\n",path);
+		goto fail;
+	}
+
+	memcpy(hdr.magic,PMB_CACHE_MAGIC,8);
+	hdr.version = PMB_CACHE_VERSION;
+	hdr.key = key;
+	hdr.source_size = size;
+	hdr.source_mtime = mtime;
+	hdr.frame_ticks = times.frame_ticks;
+	hdr.have_PTS = times.have_PTS;
+	hdr.first_PTS = times.first_PTS;
+	hdr.last_PTS = times.last_PTS;
+	if (!out_error && write(out_fd,marks,hdr.marks * sizeof(*marks)) != (ssize_t)(hdr.marks * sizeof(*marks)))
+		out_error = errno ? errno : ENOSPC;
+	if (!out_error && pwrite(out_fd,&hdr,sizeof(hdr),0) != sizeof(hdr))
+		out_error = errno ? errno : ENOSPC;
+	if (!out_error && fsync(out_fd) < 0)
+		out_error = errno;
+	if (out_error) {
+		fprintf(stderr,"Cannot write %s: %s\n",tmp,strerror(out_error));
+		goto fail;
+	}
+	close(out_fd);
+	out_fd = -1;
+
+	if (rename(tmp,cpath) < 0) {
+		fprintf(stderr,"Cannot rename %s: %s\n",tmp,strerror(errno));
+		goto fail;
+	}
+
+	printf("%s: %s, %llu packs, %llu marks, %.1fs\n",path,cpath,hdr.packs,hdr.marks,hdr.last_SCR / 27000000.0);
+	close(fd);
+	free(cpath);
+	free(tmp);
+	return 0;
+fail:
+	if (out_fd >= 0) {
+		close(out_fd);
+		out_fd = -1;
+		unlink(tmp);
+	}
+	close(fd);
+	free(cpath);
+	free(tmp);
+	return -1;
+}
+
+static void usage()
+{
+	fprintf(stderr,"pmbcache [-d DIR] FILE...\n");
+	fprintf(stderr,"  -d DIR      cache directory (default %s)\n",PMB_CACHE_DIR);
+}
+
+int main(int argc,char **argv)
+{
+	const char *dir = PMB_CACHE_DIR;
+	int i,ret = 0,files = 0;
+
+	MPEGOutput = CacheOutput;
+
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-d") && (i+1) < argc) {
+			dir = argv[++i];
+		}
+		else if (argv[i][0] == '-') {
+			usage();
+			return 1;
+		}
+		else {
+			if (files++ == 0 && mkdir(dir,0755) < 0 && errno != EEXIST) {
+				fprintf(stderr,"Cannot create %s: %s\n",dir,strerror(errno));
+				return 1;
+			}
+			if (CacheFile(dir,argv[i]) < 0)
+				ret = 1;
+		}
+	}
+
+	if (files == 0) {
+		usage();
+		return 1;
+	}
+
+	free(marks);
+	return ret;
+}
@@ -0,0 +1,719 @@
+/* Pinnacle Moviebox USB command socket
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbcmd.h. The socket is served by a thread of its own, so requests
+ * are read and answered while the playback thread sits in a bulk write.
+ * A request the playback thread has to do is handed over whole and picked
+ * up by it between two packs; it kicks an eventfd when it's done so the
+ * reply goes out.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "pmbcmd.h"
+
+#define CMD_OUT			4096		// replies not sent yet
+#define CMD_REPLY		(sizeof(struct pmb_cmd_reply) + 256)	// the longest reply
+
+// where a client's request is
+#define CMD_IDLE		0
+#define CMD_QUEUED		1		// waiting for the playback thread
+#define CMD_DONE		2		// run by it, not answered yet
+
+struct cmd_client {
+	int			fd;		// -1 once gone, freed when its request is done
+	int			len;		// bytes in in[]
+	int			out_len;	// bytes in out[]
+	int			state;
+	int			closing;	// sent garbage, closed once the error is out
+	unsigned int		id;
+	long long		queued;
+	struct pmb_cmd_job	job;
+	unsigned char		in[PMB_CMD_MAX];
+	unsigned char		out[CMD_OUT];
+};
+
+unsigned long long stat_cmd_requests = 0,stat_cmd_errors = 0,stat_cmd_queued = 0;
+unsigned long long stat_cmd_wait_sum = 0,stat_cmd_wait_max = 0;
+
+static const char *cmd_names[PMB_OPS] = {
+	"ping","volume","enqueue","skip","clear","flush","pause","resume",
+	"step","seek","seekgop","loglevel","status","batch","outputs","at",
+	"atclear"
+};
+
+// cmd_lock covers cmd_client[] and the clients' state
+static struct cmd_client *cmd_client[PMB_CMD_CLIENTS];
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pmb_cmd_ops *cmd_ops = NULL;
+static int cmd_listen = -1,cmd_wake = -1;
+static int cmd_pending = 0;
+static int cmd_stop = 0;
+static int cmd_running = 0;
+static pthread_t cmd_thread;
+static char cmd_path[108];
+
+static long long CmdClock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((long long)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000L);
+}
+
+static void Wake(int efd)
+{
+	uint64_t one = 1;
+	if (write(efd,&one,sizeof(one)) < 0) { }
+}
+
+static void Drain(int efd)
+{
+	uint64_t v;
+	if (read(efd,&v,sizeof(v)) < 0) { }
+}
+
+const char *PMBCmdError(int status)
+{
+	switch (status) {
+		case PMB_CMD_OK:	return "ok";
+		case PMB_CMD_EPROTO:	return "malformed request";
+		case PMB_CMD_EOP:	return "unknown command";
+		case PMB_CMD_EARG:	return "wrong arguments";
+		case PMB_CMD_ESTATE:	return "not possible now";
+		case PMB_CMD_EFAIL:	return "failed";
+	}
+	return "?";
+}
+
+int PMBCmdOp(const char *name)
+{
+	int i;
+
+	for (i=0;i < PMB_OPS;i++) {
+		if (!strcmp(name,cmd_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+// "composite,svideo" and so on, as PMB_VO_* flags. -1 if it doesn't parse.
+int PMBCmdOutputs(const char *list)
+{
+	static const struct { const char *name; int flags; } out[] = {
+		{ "none",	0 },
+		{ "composite",	0x20 },
+		{ "svideo",	0x18 },
+		{ "rgb",	0x07 },
+		{ NULL,		0 }
+	};
+	const char *e;
+	int i,l,flags = 0;
+
+	while (*list) {
+		if ((e = strchr(list,',')) == NULL) e = list + strlen(list);
+		l = e - list;
+		for (i=0;out[i].name != NULL && (strncmp(list,out[i].name,l) || out[i].name[l] != 0);i++);
+		if (out[i].name == NULL)
+			return -1;
+		flags |= out[i].flags;
+		list = *e ? e+1 : e;
+	}
+
+	return flags;
+}
+
+// one command's arguments, checked for size only
+static int Decode(struct pmb_cmd_job *job,struct pmb_cmd *c,int op,unsigned char *p,unsigned int len)
+{
+	unsigned long long u64;
+	unsigned int u32;
+	int v[2];
+
+	c->op = op;
+	c->a = c->b = 0;
+	c->path[0] = 0;
+
+	switch (op) {
+		case PMB_OP_PING:
+		case PMB_OP_SKIP:
+		case PMB_OP_CLEAR:
+		case PMB_OP_FLUSH:
+		case PMB_OP_PAUSE:
+		case PMB_OP_RESUME:
+		case PMB_OP_STATUS:
+		case PMB_OP_ATCLEAR:
+			if (len != 0) goto args;
+			break;
+		case PMB_OP_VOLUME:
+			if (len != sizeof(v)) goto args;
+			memcpy(v,p,sizeof(v));
+			c->a = v[0];
+			c->b = v[1];
+			break;
+		case PMB_OP_ENQUEUE:
+			if (len == 0 || len >= sizeof(c->path) || memchr(p,0,len) != NULL) goto args;
+			memcpy(c->path,p,len);
+			c->path[len] = 0;
+			break;
+		case PMB_OP_STEP:
+			if (len == 0) {
+				c->a = 1;
+				break;
+			}
+			/* fall through */
+		case PMB_OP_LOGLEVEL:
+		case PMB_OP_OUTPUTS:
+			if (len != sizeof(u32)) goto args;
+			memcpy(&u32,p,sizeof(u32));
+			c->a = u32;
+			break;
+		case PMB_OP_SEEK:
+		case PMB_OP_SEEKGOP:
+			if (len != sizeof(u64)) goto args;
+			memcpy(&u64,p,sizeof(u64));
+			c->a = (long long)u64;
+			break;
+		default:
+			snprintf(job->msg,sizeof(job->msg),"no command %d",op);
+			return PMB_CMD_EOP;
+	}
+
+	return PMB_CMD_OK;
+args:
+	snprintf(job->msg,sizeof(job->msg),"%s: wrong arguments (%u bytes)",cmd_names[op],len);
+	return PMB_CMD_EARG;
+}
+
+static void Run(struct pmb_cmd_job *job)
+{
+	int i;
+
+	cmd_ops->lock();
+	if (job->timed) {
+		job->index = 0;
+		job->status = cmd_ops->cue(job);
+		cmd_ops->unlock();
+		return;
+	}
+	for (i=0;i < job->count;i++) {
+		job->index = i;
+		if ((job->status = cmd_ops->run(&job->cmd[i],job)) != PMB_CMD_OK)
+			break;
+	}
+	cmd_ops->unlock();
+
+	if (job->status == PMB_CMD_OK)
+		job->index = 0;
+}
+
+// there's always room: a request is only taken on with room for its reply
+static void Reply(struct cmd_client *c)
+{
+	struct pmb_cmd_job *job = &c->job;
+	struct pmb_cmd_reply r;
+	const void *data = job->reply;
+	unsigned int len = job->reply_len;
+
+	if (job->status != PMB_CMD_OK) {
+		__atomic_fetch_add(&stat_cmd_errors,1,__ATOMIC_RELAXED);
+		if (job->msg[0] == 0)
+			snprintf(job->msg,sizeof(job->msg),"%s",PMBCmdError(job->status));
+		data = job->msg;
+		len = strlen(job->msg);
+	}
+
+	r.len = len;
+	r.id = c->id;
+	r.status = job->status;
+	r.index = job->index;
+	memcpy(c->out+c->out_len,&r,sizeof(r));
+	memcpy(c->out+c->out_len+sizeof(r),data,len);
+	c->out_len += sizeof(r) + len;
+}
+
+// a whole request: decoded and checked, then run here or handed over
+static void Request(struct cmd_client *c,struct pmb_cmd_header *h,unsigned char *p)
+{
+	struct pmb_cmd_job *job = &c->job;
+	struct pmb_cmd_sub s;
+	unsigned int pos = 0;
+	int i,queue = 0;
+
+	__atomic_fetch_add(&stat_cmd_requests,1,__ATOMIC_RELAXED);
+	c->id = h->id;
+	job->count = 0;
+	job->status = PMB_CMD_OK;
+	job->index = 0;
+	job->msg[0] = 0;
+	job->reply_len = 0;
+
+	job->timed = 0;
+	if (h->op == PMB_OP_AT) {
+		// the time, then a batch
+		if (h->len < (sizeof(job->at) + sizeof(job->at_flags))) {
+			snprintf(job->msg,sizeof(job->msg),"at: no time");
+			job->status = PMB_CMD_EARG;
+		}
+		else {
+			memcpy(&job->at,p,sizeof(job->at));
+			memcpy(&job->at_flags,p+sizeof(job->at),sizeof(job->at_flags));
+			job->timed = 1;
+			pos = sizeof(job->at) + sizeof(job->at_flags);
+		}
+	}
+
+	if (h->op == PMB_OP_BATCH || job->timed) {
+		while (pos < h->len && job->status == PMB_CMD_OK) {
+			job->index = job->count;
+			if (job->count == PMB_CMD_BATCH) {
+				snprintf(job->msg,sizeof(job->msg),"batch: more than %d commands",PMB_CMD_BATCH);
+				job->status = PMB_CMD_EARG;
+				break;
+			}
+			if ((h->len - pos) >= sizeof(s))
+				memcpy(&s,p+pos,sizeof(s));
+			if ((h->len - pos) < sizeof(s) || s.len > (h->len - pos - sizeof(s))) {
+				snprintf(job->msg,sizeof(job->msg),"batch: command %d cut short",job->count);
+				job->status = PMB_CMD_EPROTO;
+				break;
+			}
+			pos += sizeof(s);
+			if (s.op == PMB_OP_BATCH || s.op == PMB_OP_AT) {
+				snprintf(job->msg,sizeof(job->msg),"batch: %s inside a batch",cmd_names[s.op]);
+				job->status = PMB_CMD_EARG;
+				break;
+			}
+			job->status = Decode(job,&job->cmd[job->count++],s.op,p+pos,s.len);
+			pos += s.len;
+		}
+		if (job->status == PMB_CMD_OK && job->count == 0) {
+			snprintf(job->msg,sizeof(job->msg),"batch: no commands");
+			job->status = PMB_CMD_EARG;
+		}
+	}
+	else if (job->status == PMB_CMD_OK) {
+		job->status = Decode(job,&job->cmd[0],h->op,p,h->len);
+		job->count = 1;
+	}
+
+	// all or nothing
+	for (i=0;i < job->count && job->status == PMB_CMD_OK;i++) {
+		job->index = i;
+		job->status = cmd_ops->check(&job->cmd[i],job);
+		if (!cmd_ops->inline_op(job->cmd[i].op)) queue = 1;
+	}
+	if (job->timed)
+		queue = 1;
+	if (job->status != PMB_CMD_OK) {
+		Reply(c);
+		return;
+	}
+	job->index = 0;
+
+	if (!queue) {
+		Run(job);
+		Reply(c);
+		return;
+	}
+
+	__atomic_fetch_add(&stat_cmd_queued,1,__ATOMIC_RELAXED);
+	pthread_mutex_lock(&cmd_lock);
+	c->state = CMD_QUEUED;
+	c->queued = CmdClock();
+	pthread_mutex_unlock(&cmd_lock);
+	__atomic_add_fetch(&cmd_pending,1,__ATOMIC_RELEASE);
+}
+
+static void Gone(int i)
+{
+	struct cmd_client *c = cmd_client[i];
+
+	close(c->fd);
+	pthread_mutex_lock(&cmd_lock);
+	if (c->state == CMD_QUEUED) {
+		// the playback thread may be at it. it's still done, nobody hears
+		// about it.
+		c->fd = -1;
+	}
+	else {
+		cmd_client[i] = NULL;
+		free(c);
+	}
+	pthread_mutex_unlock(&cmd_lock);
+}
+
+static int Send(struct cmd_client *c)
+{
+	int wr;
+
+	if (c->out_len == 0)
+		return 0;
+
+	wr = send(c->fd,c->out,c->out_len,MSG_NOSIGNAL|MSG_DONTWAIT);
+	if (wr < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+	memmove(c->out,c->out+wr,c->out_len-wr);
+	c->out_len -= wr;
+	return 0;
+}
+
+// the requests in a client's buffer, in order, as long as none is with the
+// playback thread and the replies have somewhere to go
+static int Serve(int i)
+{
+	struct cmd_client *c = cmd_client[i];
+	struct pmb_cmd_header h;
+	unsigned int n;
+
+	while (__atomic_load_n(&c->state,__ATOMIC_ACQUIRE) == CMD_IDLE && !c->closing && c->len >= (int)sizeof(h) && (CMD_OUT - c->out_len) >= (int)CMD_REPLY) {
+		memcpy(&h,c->in,sizeof(h));
+		if (h.len > (PMB_CMD_MAX - sizeof(h)) || h.flags != 0) {
+			// no telling where the next one starts
+			__atomic_fetch_add(&stat_cmd_requests,1,__ATOMIC_RELAXED);
+			c->id = h.id;
+			c->job.status = PMB_CMD_EPROTO;
+			c->job.index = 0;
+			snprintf(c->job.msg,sizeof(c->job.msg),"bad header (%u bytes, flags %x)",h.len,h.flags);
+			Reply(c);
+			c->closing = 1;
+			break;
+		}
+
+		n = sizeof(h) + h.len;
+		if ((unsigned int)c->len < n)
+			break;
+
+		Request(c,&h,c->in+sizeof(h));
+		memmove(c->in,c->in+n,c->len-n);
+		c->len -= n;
+	}
+
+	if (Send(c) < 0 || (c->closing && c->out_len == 0)) {
+		Gone(i);
+		return -1;
+	}
+	return 0;
+}
+
+static void Accept()
+{
+	struct cmd_client *c;
+	int i,s;
+
+	while ((s = accept4(cmd_listen,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		for (i=0;i < PMB_CMD_CLIENTS && cmd_client[i] != NULL;i++);
+		if (i == PMB_CMD_CLIENTS || (c = calloc(1,sizeof(*c))) == NULL) {
+			fprintf(stderr,"Command socket: too many clients\n");
+			close(s);
+			continue;
+		}
+
+		c->fd = s;
+		pthread_mutex_lock(&cmd_lock);
+		cmd_client[i] = c;
+		pthread_mutex_unlock(&cmd_lock);
+	}
+}
+
+// requests the playback thread is done with get their replies
+static void Done()
+{
+	struct cmd_client *c;
+	int i,done[PMB_CMD_CLIENTS];
+
+	pthread_mutex_lock(&cmd_lock);
+	for (i=0;i < PMB_CMD_CLIENTS;i++) {
+		done[i] = 0;
+		if ((c = cmd_client[i]) == NULL || c->state != CMD_DONE)
+			continue;
+
+		c->state = CMD_IDLE;
+		if (c->fd < 0) {
+			cmd_client[i] = NULL;
+			free(c);
+		}
+		else {
+			Reply(c);
+			done[i] = 1;
+		}
+	}
+	pthread_mutex_unlock(&cmd_lock);
+
+	// and whatever they sent in the meantime
+	for (i=0;i < PMB_CMD_CLIENTS;i++) {
+		if (done[i])
+			Serve(i);
+	}
+}
+
+static void *CmdThread(void *arg)
+{
+	struct pollfd pfd[PMB_CMD_CLIENTS + 2];
+	int slot[PMB_CMD_CLIENTS + 2];
+	struct cmd_client *c;
+	int i,n,rd;
+
+	while (!__atomic_load_n(&cmd_stop,__ATOMIC_ACQUIRE)) {
+		n = 0;
+		pfd[n].fd = cmd_wake;
+		pfd[n].events = POLLIN;
+		slot[n++] = -1;
+		pfd[n].fd = cmd_listen;
+		pfd[n].events = POLLIN;
+		slot[n++] = -1;
+		for (i=0;i < PMB_CMD_CLIENTS;i++) {
+			if ((c = cmd_client[i]) == NULL || c->fd < 0)
+				continue;
+			pfd[n].fd = c->fd;
+			pfd[n].events = (c->len < PMB_CMD_MAX ? POLLIN : 0) | (c->out_len > 0 ? POLLOUT : 0);
+			slot[n++] = i;
+		}
+
+		if (poll(pfd,n,-1) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"Command socket: poll: %s\n",strerror(errno));
+			break;
+		}
+
+		if (pfd[0].revents) {
+			Drain(cmd_wake);
+			Done();
+		}
+		if (pfd[1].revents)
+			Accept();
+
+		for (i=2;i < n;i++) {
+			if (pfd[i].revents == 0 || (c = cmd_client[slot[i]]) == NULL || c->fd < 0)
+				continue;
+
+			if (c->len < PMB_CMD_MAX && (pfd[i].revents & (POLLIN|POLLHUP|POLLERR))) {
+				rd = recv(c->fd,c->in+c->len,PMB_CMD_MAX-c->len,MSG_DONTWAIT);
+				if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR)) {
+					Gone(slot[i]);
+					continue;
+				}
+				if (rd > 0) c->len += rd;
+			}
+			Serve(slot[i]);
+		}
+	}
+
+	return NULL;
+}
+
+int PMBCmdServerOpen(const char *path,struct pmb_cmd_ops *ops)
+{
+	struct sockaddr_un sa;
+	struct sched_param sp;
+	pthread_attr_t attr;
+	int r;
+
+	cmd_ops = ops;
+	strncpy(cmd_path,path ? path : PMB_CMD_SOCKET,sizeof(cmd_path)-1);
+
+	if ((cmd_wake = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+		fprintf(stderr,"Cannot create command socket eventfd: %s\n",strerror(errno));
+		return -1;
+	}
+	if ((cmd_listen = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0)) < 0) {
+		PMBCmdServerClose();
+		return -1;
+	}
+
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,cmd_path);
+	unlink(cmd_path);
+	if (bind(cmd_listen,(struct sockaddr*)&sa,sizeof(sa)) < 0 || listen(cmd_listen,PMB_CMD_CLIENTS) < 0) {
+		fprintf(stderr,"Cannot listen on %s: %s\n",cmd_path,strerror(errno));
+		PMBCmdServerClose();
+		return -1;
+	}
+	chmod(cmd_path,0777);
+
+	// not at the real-time priority of the playback thread (pmbrt.h): it
+	// only ever waits for it
+	memset(&sp,0,sizeof(sp));
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr,SCHED_OTHER);
+	pthread_attr_setschedparam(&attr,&sp);
+	r = pthread_create(&cmd_thread,&attr,CmdThread,NULL);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		fprintf(stderr,"Cannot start command socket thread\n");
+		PMBCmdServerClose();
+		return -1;
+	}
+	cmd_running = 1;
+
+	return 0;
+}
+
+void PMBCmdServerClose()
+{
+	int i;
+
+	if (cmd_running) {
+		__atomic_store_n(&cmd_stop,1,__ATOMIC_RELEASE);
+		Wake(cmd_wake);
+		pthread_join(cmd_thread,NULL);
+		cmd_running = 0;
+	}
+
+	for (i=0;i < PMB_CMD_CLIENTS;i++) {
+		if (cmd_client[i] != NULL) {
+			if (cmd_client[i]->fd >= 0) close(cmd_client[i]->fd);
+			free(cmd_client[i]);
+			cmd_client[i] = NULL;
+		}
+	}
+
+	if (cmd_listen >= 0) {
+		close(cmd_listen);
+		cmd_listen = -1;
+		unlink(cmd_path);
+	}
+	if (cmd_wake >= 0) {
+		close(cmd_wake);
+		cmd_wake = -1;
+	}
+}
+
+// requests waiting for the playback thread
+int PMBCmdServerPending()
+{
+	return __atomic_load_n(&cmd_pending,__ATOMIC_ACQUIRE);
+}
+
+// the playback thread: runs what was handed over, in the order the clients
+// were accepted. returns how many requests were run.
+int PMBCmdServerPoll()
+{
+	struct cmd_client *c;
+	long long w;
+	int i,n = 0;
+
+	if (!PMBCmdServerPending())
+		return 0;
+
+	pthread_mutex_lock(&cmd_lock);
+	for (i=0;i < PMB_CMD_CLIENTS;i++) {
+		if ((c = cmd_client[i]) == NULL || c->state != CMD_QUEUED)
+			continue;
+
+		w = CmdClock() - c->queued;
+		stat_cmd_wait_sum += w;
+		if ((unsigned long long)w > stat_cmd_wait_max) stat_cmd_wait_max = w;
+
+		Run(&c->job);
+		__atomic_store_n(&c->state,CMD_DONE,__ATOMIC_RELEASE);
+		n++;
+	}
+	pthread_mutex_unlock(&cmd_lock);
+
+	if (n > 0) {
+		__atomic_sub_fetch(&cmd_pending,n,__ATOMIC_RELEASE);
+		Wake(cmd_wake);
+	}
+
+	return n;
+}
+
+int PMBCmdConnect(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if ((fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0)) < 0)
+		return -1;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path,path ? path : PMB_CMD_SOCKET,sizeof(sa.sun_path)-1);
+	if (connect(fd,(struct sockaddr*)&sa,sizeof(sa)) < 0) {
+		fprintf(stderr,"PMBCmdConnect: cannot connect to %s: %s\n",sa.sun_path,strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int Full(int fd,void *buf,unsigned int len,int wr)
+{
+	unsigned char *p = buf;
+	int r;
+
+	while (len > 0) {
+		r = wr ? send(fd,p,len,MSG_NOSIGNAL) : recv(fd,p,len,0);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+// a request: op with len bytes of arguments (for a batch, the commands)
+int PMBCmdSend(int fd,unsigned int id,int op,const void *args,unsigned int len)
+{
+	struct pmb_cmd_header h;
+
+	if ((sizeof(h) + len) > PMB_CMD_MAX)
+		return -1;
+
+	h.len = len;
+	h.id = id;
+	h.op = op;
+	h.flags = 0;
+	if (Full(fd,&h,sizeof(h),1) < 0 || Full(fd,(void*)args,len,1) < 0)
+		return -1;
+
+	return 0;
+}
+
+// the next reply. up to len bytes of what comes with it go into buf (an
+// error message is terminated), the rest is skipped. returns -1 if the
+// connection is gone.
+int PMBCmdRecv(int fd,struct pmb_cmd_reply *r,void *buf,unsigned int len)
+{
+	unsigned char skip[256];
+	unsigned int n;
+
+	if (Full(fd,r,sizeof(*r),0) < 0)
+		return -1;
+
+	n = (r->len < len) ? r->len : len;
+	if (Full(fd,buf,n,0) < 0)
+		return -1;
+	if (r->status != PMB_CMD_OK && len > 0)
+		((char*)buf)[n < len ? n : len-1] = 0;
+
+	for (n=r->len-n;n > 0;) {
+		unsigned int s = (n < sizeof(skip)) ? n : sizeof(skip);
+		if (Full(fd,skip,s,0) < 0)
+			return -1;
+		n -= s;
+	}
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+/* Pinnacle Moviebox USB command socket
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * The command FIFO takes lines from whoever writes them and never says
+ * whether a command worked. This is the same set of commands on a Unix
+ * socket, as small binary frames: any number of clients, every request
+ * answered with a status (and why, if it failed), and several commands in
+ * one request applied together.
+ *
+ * A request is a header followed by len bytes of arguments. Everything is
+ * in host byte order, it never leaves the machine.
+ *
+ *   request  u32 len, u32 id, u16 op, u16 flags (0)
+ *   reply    u32 len, u32 id, s32 status, u32 index
+ *
+ * The reply carries the request's id, so a client may have several
+ * requests outstanding; replies to one client come in request order. Its
+ * len bytes are the status (PMB_OP_STATUS) or the error message.
+ *
+ * PMB_OP_BATCH's arguments are the commands of the batch, each a u16 op and
+ * u16 len followed by its arguments. A batch is checked as a whole before
+ * anything is done, and then run in one go: nothing is played in between.
+ * If a command fails while running, the ones after it are not run. index
+ * is the command of the batch the status is about.
+ *
+ * PMB_OP_AT holds a batch (its commands follow, as above) until the stream
+ * gets to a time (pmbcue.h). It's checked and answered right away; a
+ * command that then fails when its time comes is only logged.
+ */
+
+#define PMB_CMD_SOCKET		"/var/video/command.sock"
+#define PMB_CMD_CLIENTS		16
+#define PMB_CMD_MAX		8192		// longest request, header included
+#define PMB_CMD_BATCH		32		// most commands in a batch
+
+struct pmb_cmd_header {
+	unsigned int		len;
+	unsigned int		id;
+	unsigned short		op;
+	unsigned short		flags;
+};
+
+struct pmb_cmd_reply {
+	unsigned int		len;
+	unsigned int		id;
+	int			status;
+	unsigned int		index;
+};
+
+// in a batch
+struct pmb_cmd_sub {
+	unsigned short		op;
+	unsigned short		len;
+};
+
+// arguments
+#define PMB_OP_PING		0		// none
+#define PMB_OP_VOLUME		1		// s32 left, s32 right: 0 to -255, as the volume command
+#define PMB_OP_ENQUEUE		2		// the path, not terminated
+#define PMB_OP_SKIP		3		// none
+#define PMB_OP_CLEAR		4		// none
+#define PMB_OP_FLUSH		5		// none
+#define PMB_OP_PAUSE		6		// none
+#define PMB_OP_RESUME		7		// none
+#define PMB_OP_STEP		8		// u32 pictures, or none for 1
+#define PMB_OP_SEEK		9		// u64 27MHz ticks into the file
+#define PMB_OP_SEEKGOP		10		// u64 GOP number
+#define PMB_OP_LOGLEVEL		11		// u32 PMB_LOG_ERR to PMB_LOG_DEBUG
+#define PMB_OP_STATUS		12		// none, the reply has a struct pmb_cmd_status
+#define PMB_OP_BATCH		13		// commands, see above
+#define PMB_OP_OUTPUTS		14		// u32 PMB_VO_* flags (libpmb.h)
+#define PMB_OP_AT		15		// u64 27MHz ticks, u32 PMB_AT_*, commands as in a batch
+#define PMB_OP_ATCLEAR		16		// none: drop everything waiting for its time
+#define PMB_OPS			17
+
+#define PMB_AT_RELATIVE		0x01		// the time is from where the decoder is now
+
+struct pmb_cmd_status {
+	unsigned long long	SCR;		// of the last pack made, 27MHz ticks
+	unsigned long long	bytes_in;
+	unsigned long long	packs_out;	// written to the device
+	unsigned int		queued;		// files waiting in the playlist
+	unsigned int		flags;
+	long long		clock;		// where the decoder is (pmbcue.h), -1 if not known
+	unsigned int		cues;		// timed commands waiting
+	unsigned int		reserved;
+};
+#define PMB_STATUS_PLAYLIST	0x01		// files are being played
+#define PMB_STATUS_PACED	0x02
+#define PMB_STATUS_PAUSED	0x04
+
+// status
+#define PMB_CMD_OK		0
+#define PMB_CMD_EPROTO		-1		// the request doesn't make sense as a frame
+#define PMB_CMD_EOP		-2		// no such op
+#define PMB_CMD_EARG		-3		// wrong arguments
+#define PMB_CMD_ESTATE		-4		// not possible as pmbpipe runs (-pace, input type)
+#define PMB_CMD_EFAIL		-5		// tried and failed
+
+// one decoded command
+struct pmb_cmd {
+	int			op;
+	long long		a,b;		// numeric arguments
+	char			path[1024];
+};
+
+// a request being served
+struct pmb_cmd_job {
+	int			count;		// 1 unless it's a batch
+	struct pmb_cmd		cmd[PMB_CMD_BATCH];
+	int			timed;		// PMB_OP_AT: the commands wait for at
+	unsigned long long	at;
+	unsigned int		at_flags;
+	int			status,index;
+	char			msg[256];
+	int			reply_len;	// bytes of reply in reply[]
+	unsigned char		reply[sizeof(struct pmb_cmd_status)];
+};
+
+// the server. check() is called for every command of a request on the
+// command thread and says whether it can be done (setting job->msg if not).
+// run() does a command and returns its status. a request whose commands are
+// all inline_op() is run right there on the command thread; anything else
+// waits for the playback thread to call PMBCmdServerPoll(). lock() is held
+// around the run() calls of a request, on either thread. a PMB_OP_AT
+// request is handed to cue() on the playback thread instead.
+struct pmb_cmd_ops {
+	int	(*check)(struct pmb_cmd *c,struct pmb_cmd_job *job);
+	int	(*run)(struct pmb_cmd *c,struct pmb_cmd_job *job);
+	int	(*cue)(struct pmb_cmd_job *job);
+	int	(*inline_op)(int op);
+	void	(*lock)();
+	void	(*unlock)();
+};
+
+int PMBCmdServerOpen(const char *path,struct pmb_cmd_ops *ops);
+void PMBCmdServerClose();
+int PMBCmdServerPending();
+int PMBCmdServerPoll();
+
+// accounting. requests run by the playback thread, and how long they
+// waited for it (microseconds).
+extern unsigned long long stat_cmd_requests,stat_cmd_errors,stat_cmd_queued;
+extern unsigned long long stat_cmd_wait_sum,stat_cmd_wait_max;
+
+// client
+int PMBCmdConnect(const char *path);
+int PMBCmdSend(int fd,unsigned int id,int op,const void *args,unsigned int len);
+int PMBCmdRecv(int fd,struct pmb_cmd_reply *r,void *buf,unsigned int len);
+const char *PMBCmdError(int status);
+int PMBCmdOp(const char *name);
+int PMBCmdOutputs(const char *list);
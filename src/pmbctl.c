@@ -0,0 +1,194 @@
+/* Pinnacle Moviebox USB command socket client
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Sends the commands on its command line to pmbpipe's command socket and
+ * says how they went. Commands separated by a lone comma go as one batch,
+ * and at puts them off until the stream gets to a time:
+ *
+ *   pmbctl volume -20 -20 , enqueue /video/next.mpg
+ *   pmbctl at 3605.24 volume -40 -40 , skip
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pmblog.h"
+#include "pmbcmd.h"
+
+static unsigned char args[PMB_CMD_MAX];
+static int argslen = 0;
+
+static void usage()
+{
+	fprintf(stderr,"pmbctl [-s SOCKET] [at [+]SECS] COMMAND [ARGS] [, COMMAND [ARGS]]...\n");
+	fprintf(stderr,"  volume L R    0 to -255 each\n");
+	fprintf(stderr,"  enqueue PATH\n");
+	fprintf(stderr,"  skip, clear, flush, pause, resume\n");
+	fprintf(stderr,"  step [N]      N pictures (default 1)\n");
+	fprintf(stderr,"  seek SECS     into the current file\n");
+	fprintf(stderr,"  seekgop N\n");
+	fprintf(stderr,"  loglevel L    err, warning, notice, info or debug\n");
+	fprintf(stderr,"  outputs LIST  none, composite, svideo, rgb, several with commas\n");
+	fprintf(stderr,"  status, ping\n");
+	fprintf(stderr,"  atclear       drop the commands waiting for their time\n");
+	fprintf(stderr,"Several commands separated by \",\" are sent as one batch, done together or not at all.\n");
+	fprintf(stderr,"With at they wait until the stream gets to SECS on its clock (see status), or\n");
+	fprintf(stderr,"with + SECS from where the decoder is now.\n");
+}
+
+static int Put(const void *p,int len)
+{
+	if ((argslen + len) > (int)(PMB_CMD_MAX - sizeof(struct pmb_cmd_header)))
+		return -1;
+	memcpy(args+argslen,p,len);
+	argslen += len;
+	return 0;
+}
+
+// one command's arguments into args. returns its op, -1 if it makes no sense.
+static int Encode(int argc,char **argv)
+{
+	unsigned long long u64;
+	unsigned int u32;
+	int op,v[2],l;
+
+	if (argc < 1 || (op = PMBCmdOp(argv[0])) < 0 || op == PMB_OP_BATCH || op == PMB_OP_AT)
+		return -1;
+
+	switch (op) {
+		case PMB_OP_VOLUME:
+			if (argc != 3) return -1;
+			v[0] = atoi(argv[1]);
+			v[1] = atoi(argv[2]);
+			if (Put(v,sizeof(v)) < 0) return -1;
+			break;
+		case PMB_OP_ENQUEUE:
+			if (argc != 2 || Put(argv[1],strlen(argv[1])) < 0) return -1;
+			break;
+		case PMB_OP_STEP:
+			if (argc == 1) break;
+			if (argc != 2) return -1;
+			u32 = atoi(argv[1]);
+			if (Put(&u32,sizeof(u32)) < 0) return -1;
+			break;
+		case PMB_OP_SEEK:
+		case PMB_OP_SEEKGOP:
+			if (argc != 2) return -1;
+			if (op == PMB_OP_SEEK)
+				u64 = (atof(argv[1]) > 0) ? (unsigned long long)(atof(argv[1]) * 27000000.0) : 0;
+			else
+				u64 = strtoull(argv[1],NULL,10);
+			if (Put(&u64,sizeof(u64)) < 0) return -1;
+			break;
+		case PMB_OP_LOGLEVEL:
+			if (argc != 2 || (l = PMBLogParseLevel(argv[1])) < 0) return -1;
+			u32 = l;
+			if (Put(&u32,sizeof(u32)) < 0) return -1;
+			break;
+		case PMB_OP_OUTPUTS:
+			if (argc != 2 || (l = PMBCmdOutputs(argv[1])) < 0) return -1;
+			u32 = l;
+			if (Put(&u32,sizeof(u32)) < 0) return -1;
+			break;
+		default:
+			if (argc != 1) return -1;
+			break;
+	}
+
+	return op;
+}
+
+int main(int argc,char **argv)
+{
+	struct pmb_cmd_status st;
+	struct pmb_cmd_reply r;
+	struct pmb_cmd_sub sub;
+	char *path = NULL,msg[512];
+	int first = 1,i,j,n,op,fd,at,count = 0,timed = 0;
+	unsigned long long when = 0;
+	unsigned int flags = 0;
+
+	if (argc >= 3 && !strcmp(argv[1],"-s")) {
+		path = argv[2];
+		first = 3;
+	}
+	if ((first + 2) < argc && !strcmp(argv[first],"at")) {
+		// the time goes in front of the commands
+		if (argv[first+1][0] == '+') flags |= PMB_AT_RELATIVE;
+		when = (unsigned long long)(atof(argv[first+1] + (flags & PMB_AT_RELATIVE ? 1 : 0)) * 27000000.0);
+		Put(&when,sizeof(when));
+		Put(&flags,sizeof(flags));
+		timed = 1;
+		first += 2;
+	}
+	if (first >= argc) {
+		usage();
+		return 1;
+	}
+
+	// each command, and in front of it (for a batch) room for its sub header
+	for (i=first;i < argc;i=j+1) {
+		for (j=i;j < argc && strcmp(argv[j],",");j++);
+
+		at = argslen;
+		if (Put(&sub,sizeof(sub)) < 0 || (op = Encode(j-i,argv+i)) < 0) {
+			fprintf(stderr,"Cannot make sense of command %d\n",count+1);
+			usage();
+			return 1;
+		}
+		sub.op = op;
+		sub.len = argslen - at - sizeof(sub);
+		memcpy(args+at,&sub,sizeof(sub));
+		count++;
+	}
+
+	if ((fd = PMBCmdConnect(path)) < 0)
+		return 1;
+
+	if (timed)
+		n = PMBCmdSend(fd,1,PMB_OP_AT,args,argslen);
+	else if (count == 1) {
+		// not a batch, there's no sub header
+		memcpy(&sub,args,sizeof(sub));
+		n = PMBCmdSend(fd,1,sub.op,args+sizeof(sub),sub.len);
+	}
+	else
+		n = PMBCmdSend(fd,1,PMB_OP_BATCH,args,argslen);
+	if (n < 0) {
+		fprintf(stderr,"Cannot send the request\n");
+		return 1;
+	}
+
+	n = PMBCmdRecv(fd,&r,msg,sizeof(msg));
+	close(fd);
+	if (n < 0) {
+		fprintf(stderr,"No reply from pmbpipe\n");
+		return 1;
+	}
+
+	if (r.status != PMB_CMD_OK) {
+		if (r.len == 0) strcpy(msg,PMBCmdError(r.status));
+		if (count > 1 || timed)
+			fprintf(stderr,"Command %u failed: %s\n",r.index+1,msg);
+		else
+			fprintf(stderr,"Failed: %s\n",msg);
+		return 2;
+	}
+
+	if (!timed && count == 1 && sub.op == PMB_OP_STATUS) {
+		memset(&st,0,sizeof(st));
+		memcpy(&st,msg,r.len < sizeof(st) ? r.len : sizeof(st));
+		if (st.clock >= 0)
+			printf("Decoder at %.3fs, ",st.clock / 27000000.0);
+		printf("SCR %.3fs, %llu bytes in, %llu packs out, %u files queued, %u timed commands%s%s%s\n",
+			st.SCR / 27000000.0,st.bytes_in,st.packs_out,st.queued,st.cues,
+			(st.flags & PMB_STATUS_PLAYLIST) ? ", playing files" : "",
+			(st.flags & PMB_STATUS_PACED) ? ", paced" : "",
+			(st.flags & PMB_STATUS_PAUSED) ? ", paused" : "");
+	}
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/* Pinnacle Moviebox USB timed commands
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbcue.h. There are only ever a few cues, they're kept in a small
+ * table and looked through whole. Times are compared half a clock wrap
+ * either way, so a cue set just before the 33-bit SCR wraps still fires.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pmbmpeg.h"
+#include "pmbcue.h"
+
+struct cue {
+	unsigned long long	at;
+	unsigned long		seq;		// same time: in the order they came
+	void			(*fire)(void *arg,long long late);
+	void			*arg;
+};
+
+long long (*CueClock)() = NULL;
+
+unsigned long long stat_cues_fired = 0,stat_cues_dropped = 0;
+struct mpeg_latency lat_cue = { 0, 0, 0 };
+
+static struct cue cue_list[PMB_CUES];
+static int cue_count = 0;
+static unsigned long cue_seq = 0;
+
+// how far clock is past at, negative if it's not there yet
+static long long CueAfter(unsigned long long at,long long clock)
+{
+	long long d = (long long)(((unsigned long long)clock + MPEG_CLOCK_WRAP - at) % MPEG_CLOCK_WRAP);
+
+	if (d >= (long long)(MPEG_CLOCK_WRAP / 2ULL))
+		d -= (long long)MPEG_CLOCK_WRAP;
+	return d;
+}
+
+int CueAdd(unsigned long long at,void (*fire)(void *arg,long long late),void *arg)
+{
+	if (cue_count == PMB_CUES)
+		return -1;
+
+	cue_list[cue_count].at = at % MPEG_CLOCK_WRAP;
+	cue_list[cue_count].seq = cue_seq++;
+	cue_list[cue_count].fire = fire;
+	cue_list[cue_count].arg = arg;
+	cue_count++;
+	return 0;
+}
+
+// the next one due, -1 if none is
+static int CueNext(long long clock)
+{
+	long long late,best_late = 0;
+	int i,best = -1;
+
+	for (i=0;i < cue_count;i++) {
+		late = CueAfter(cue_list[i].at,clock);
+		if (late < 0)
+			continue;
+		if (best < 0 || late > best_late || (late == best_late && cue_list[i].seq < cue_list[best].seq)) {
+			best = i;
+			best_late = late;
+		}
+	}
+
+	return best;
+}
+
+// fires whatever is due, earliest first. returns how many were fired.
+int CuePoll()
+{
+	long long clock,late;
+	struct cue c;
+	int i,n = 0;
+
+	if (cue_count == 0 || CueClock == NULL || (clock = CueClock()) < 0)
+		return 0;
+
+	while ((i = CueNext(clock)) >= 0) {
+		// off the list first, fire() may add more
+		c = cue_list[i];
+		cue_list[i] = cue_list[--cue_count];
+
+		late = CueAfter(c.at,clock);
+		MPEGLatencyAdd(&lat_cue,late);
+		stat_cues_fired++;
+		c.fire(c.arg,late);
+		n++;
+	}
+
+	return n;
+}
+
+// how long until the next cue is due if the clock runs in real time, for
+// the idle sleep. -1 if there's none.
+long CueIdleUsec()
+{
+	long long clock,late,soonest = 0;
+	int i,any = 0;
+
+	if (cue_count == 0 || CueClock == NULL || (clock = CueClock()) < 0)
+		return -1;
+
+	for (i=0;i < cue_count;i++) {
+		late = CueAfter(cue_list[i].at,clock);
+		if (late >= 0)
+			return 0;
+		if (!any || -late < soonest) {
+			soonest = -late;
+			any = 1;
+		}
+	}
+
+	return (long)(soonest / 27LL);
+}
+
+int CueCount()
+{
+	return cue_count;
+}
+
+void CueClear()
+{
+	struct cue c;
+
+	while (cue_count > 0) {
+		c = cue_list[--cue_count];
+		stat_cues_dropped++;
+		c.fire(c.arg,-1);
+	}
+}
@@ -0,0 +1,29 @@
+/* Pinnacle Moviebox USB timed commands
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Commands that wait for the stream: each is held until the decoder's
+ * clock, as far as it can be told from the host, reaches its time, and then
+ * fired from the playback loop. Times are on the clock of the stream as the
+ * parser makes it (SCR and PTS after rebasing, what the status command and
+ * pmb_scr_seconds show), in 27MHz ticks.
+ *
+ * CueClock says where the decoder is. With -pace the scheduler knows
+ * (SchedClock()), otherwise pmbpipe guesses from the last pack written.
+ */
+
+#define PMB_CUES		64
+
+// the decoder's clock now, or -1 if nothing has been played yet
+extern long long (*CueClock)();
+
+// fire(arg,late) is called once at is reached, late being how far the clock
+// was past it. late is -1 if the cue was dropped instead. -1 if there are
+// too many cues already.
+int CueAdd(unsigned long long at,void (*fire)(void *arg,long long late),void *arg);
+int CuePoll();
+long CueIdleUsec();
+int CueCount();
+void CueClear();
+
+extern unsigned long long stat_cues_fired,stat_cues_dropped;
+extern struct mpeg_latency lat_cue;		// how late they fired
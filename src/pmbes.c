@@ -0,0 +1,665 @@
+/* Pinnacle Moviebox USB MPEG stream massaging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * MPEG elementary stream packetizer. Cuts raw MPEG-1/2 video into access
+ * units at the sequence/GOP/picture headers and works out PTS/DTS for each
+ * picture from the frame rate, picture types and repeat_first_field. MPEG
+ * audio frames get their PTS from the running sample count. Both are put
+ * into program stream packs paced at a mux rate derived from the sequence
+ * header's bit_rate, and handed to MPEGInput().
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbes.h"
+
+#define ES_VBUF			(4*1024*1024)
+#define ES_ABUF			(256*1024)
+#define ES_MAX_AU		256
+
+// how far ahead of its decode time data may be sent, 27MHz ticks. this
+// is also where the first picture is shown on the clock.
+#define ES_DELAY		(27000000ULL / 2)
+
+int es_audio = 0;
+
+unsigned long long stat_es_pictures = 0,stat_es_audio_frames = 0;
+unsigned long long stat_es_late = 0,stat_es_dropped = 0,stat_es_junk = 0;
+
+// video bytes, es_vbuf[es_vhead...es_vlen) haven't been sent yet
+static unsigned char es_vbuf[ES_VBUF];
+static int es_vhead = 0,es_vlen = 0;
+static int es_vscan = 0;		// start code scan position
+static int es_video_done = 0;
+
+// one access unit (picture, with whatever headers came before it) in
+// decode order. timestamps are 27MHz ticks.
+struct es_au {
+	int start,end;
+	int type;			// picture_coding_type: 1=I 2=P 3=B
+	int structure;			// picture_structure, 3 = frame
+	int rff,tff;
+	int has_ts;			// 0 for the second field of a frame
+	int ready;			// timestamps are known
+	unsigned long long dur;		// display duration
+	unsigned long long PTS,DTS;
+};
+static struct es_au es_au[ES_MAX_AU];
+static int es_au_count = 0;
+static int es_held = -1;		// the I or P picture waiting to be displayed
+
+// the AU being parsed
+static int es_cur_start = -1;
+static int es_cur_pic = 0;
+static struct es_au es_cur;
+static int es_field_pending = 0;	// last picture was the first field of a frame
+
+// from the sequence header/extension
+static unsigned long long es_frame_ticks = 0;
+static unsigned long es_bit_rate = 0;	// units of 400 bits/sec
+static int es_progressive = 0;
+
+// display clock: when the next picture in display order goes on screen
+static unsigned long long es_display = ES_DELAY;
+static unsigned long long es_last_DTS = 0;
+
+// audio bytes, es_abuf[es_ahead...es_alen) haven't been sent yet
+static unsigned char es_abuf[ES_ABUF];
+static int es_ahead = 0,es_alen = 0;
+static int es_audio_done = 0;
+static int es_realign = 0;		// line audio and video up again once both have ended
+static unsigned long long es_audio_clock = ES_DELAY;
+static unsigned long es_audio_rate = 0;	// bytes/sec of the audio stream
+
+// output clock
+static unsigned long long es_scr = 0;
+
+static unsigned long ESMuxRate()
+{
+	unsigned long mux;
+
+	if (es_bit_rate == 0 || es_bit_rate == 0x3FFFF)
+		mux = 25200;			// VBR, assume 10.08Mbit/sec DVD rates
+	else
+		mux = es_bit_rate + (es_bit_rate / 10);	// 400 bits == 50 bytes, plus room for headers
+
+	return mux + (es_audio_rate / 50);
+}
+
+static void ESPutTS(unsigned char *p,int prefix,unsigned long long ticks)
+{
+	unsigned long long v = (ticks / 300ULL) & 0x1FFFFFFFFULL;
+
+	p[0] = (prefix << 4) | (((v >> 30) & 0x07) << 1) | 0x01;
+	p[1] = v >> 22;
+	p[2] = (((v >> 15) & 0x7F) << 1) | 0x01;
+	p[3] = v >> 7;
+	p[4] = ((v & 0x7F) << 1) | 0x01;
+}
+
+// put one PES out as one pack. pts_flags is 0, 2 (PTS) or 3 (PTS and DTS).
+static void ESPack(unsigned long sync,int first,int pts_flags,
+	unsigned long long PTS,unsigned long long DTS,unsigned char *data,int len)
+{
+	unsigned char pack[2048];
+	unsigned long mux_rate = ESMuxRate();
+	int i,hl = (pts_flags == 3) ? 10 : ((pts_flags == 2) ? 5 : 0);
+
+	i = MPEGPackHeader(pack,es_scr,mux_rate);
+	pack[i++] = sync >> 24;
+	pack[i++] = sync >> 16;
+	pack[i++] = sync >>  8;
+	pack[i++] = sync      ;
+	pack[i++] = (3 + hl + len) >> 8;
+	pack[i++] = (3 + hl + len);
+	pack[i++] = first ? 0x85 : 0x81;	// '10', data_alignment_indicator on the first, original
+	pack[i++] = pts_flags << 6;
+	pack[i++] = hl;
+	if (pts_flags == 3) {
+		ESPutTS(pack+i,3,PTS);
+		ESPutTS(pack+i+5,1,DTS);
+	}
+	else if (pts_flags == 2) {
+		ESPutTS(pack+i,2,PTS);
+	}
+	i += hl;
+	memcpy(pack+i,data,len);
+	i += len;
+	stat_bytes_copied += len;
+
+	es_scr += ((unsigned long long)i * 27000000ULL) / ((unsigned long long)mux_rate * 50ULL);
+	MPEGInput(pack,i);
+}
+
+// send data that has to be decoded at DTS. holds the clock back so we don't
+// run further ahead of the decoder than ES_DELAY.
+static void ESPace(unsigned long long DTS)
+{
+	if (DTS > ES_DELAY && es_scr < (DTS - ES_DELAY))
+		es_scr = DTS - ES_DELAY;
+	if (es_scr > DTS)
+		stat_es_late++;
+}
+
+static void ESSendVideo(struct es_au *au)
+{
+	unsigned char *p = es_vbuf + au->start;
+	int len = au->end - au->start;
+	int first = 1;
+
+	ESPace(au->has_ts ? au->DTS : es_last_DTS);
+	if (au->has_ts) es_last_DTS = au->DTS;
+
+	while (len > 0 || first) {
+		int flags = 0,room,n;
+
+		if (first && au->has_ts)
+			flags = (au->PTS != au->DTS) ? 3 : 2;
+		room = 2048 - 14 - 6 - 3 - ((flags == 3) ? 10 : ((flags == 2) ? 5 : 0));
+		n = len;
+		if (n > room) n = room;
+
+		ESPack(0x000001E0,first,flags,au->PTS,au->DTS,p,n);
+		p += n;
+		len -= n;
+		first = 0;
+	}
+
+	stat_es_pictures++;
+}
+
+// MPEG audio frame header. returns the frame length, or 0 if it isn't one.
+static int ESAudioFrame(unsigned char *h,int *samples,int *sample_rate,int *bytes_per_sec)
+{
+	static const int rates[3][3] = {
+		{ 44100, 48000, 32000 },	// MPEG-1
+		{ 22050, 24000, 16000 },	// MPEG-2
+		{ 11025, 12000,  8000 }		// MPEG-2.5
+	};
+	static const int kbps[5][15] = {
+		{ 0,32,64,96,128,160,192,224,256,288,320,352,384,416,448 },	// MPEG-1 layer I
+		{ 0,32,48,56, 64, 80, 96,112,128,160,192,224,256,320,384 },	// MPEG-1 layer II
+		{ 0,32,40,48, 56, 64, 80, 96,112,128,160,192,224,256,320 },	// MPEG-1 layer III
+		{ 0,32,48,56, 64, 80, 96,112,128,144,160,176,192,224,256 },	// MPEG-2 layer I
+		{ 0, 8,16,24, 32, 40, 48, 56, 64, 80, 96,112,128,144,160 }	// MPEG-2 layer II/III
+	};
+	int version,layer,br,sr,pad,v;
+
+	if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+		return 0;
+
+	version = (h[1] >> 3) & 3;		// 3 = MPEG-1, 2 = MPEG-2, 0 = MPEG-2.5
+	layer = 4 - ((h[1] >> 1) & 3);		// 1, 2 or 3
+	br = h[2] >> 4;
+	sr = (h[2] >> 2) & 3;
+	pad = (h[2] >> 1) & 1;
+	if (version == 1 || layer == 4 || br == 0 || br == 15 || sr == 3)
+		return 0;			// reserved, or free format which we can't size
+
+	v = (version == 3) ? 0 : ((version == 2) ? 1 : 2);
+	*sample_rate = rates[v][sr];
+	br = kbps[(v == 0) ? (layer - 1) : ((layer == 1) ? 3 : 4)][br] * 1000;
+	*bytes_per_sec = br / 8;
+
+	if (layer == 1) {
+		*samples = 384;
+		return ((12 * br) / *sample_rate + pad) * 4;
+	}
+	if (layer == 3 && v != 0) {
+		*samples = 576;
+		return (72 * br) / *sample_rate + pad;
+	}
+
+	*samples = 1152;
+	return (144 * br) / *sample_rate + pad;
+}
+
+// find the next whole audio frame. returns its length, 0 if more data is
+// needed. junk in front of it is thrown away.
+static int ESAudioNext(int *samples,int *sample_rate)
+{
+	int bps,n,s2,r2,b2,avail;
+
+	while ((avail = es_alen - es_ahead) >= 4) {
+		n = ESAudioFrame(es_abuf+es_ahead,samples,sample_rate,&bps);
+		if (n > 0) {
+			// a sync word alone means little, the next frame has to
+			// follow right after. at the end of the stream take it as is.
+			if (avail < (n+4)) {
+				if (!es_audio_done || avail < n)
+					return 0;
+				es_audio_rate = bps;
+				return n;
+			}
+			if (ESAudioFrame(es_abuf+es_ahead+n,&s2,&r2,&b2) > 0) {
+				es_audio_rate = bps;
+				return n;
+			}
+		}
+
+		es_ahead++;
+		stat_es_junk++;
+	}
+
+	return 0;
+}
+
+// put as many whole audio frames into a pack as fit, stamped with the PTS
+// of the first one
+static void ESSendAudio()
+{
+	unsigned long long PTS = es_audio_clock;
+	int room = 2048 - 14 - 6 - 3 - 5;
+	int samples,sample_rate,n,len = 0,first = 1;
+	unsigned char *p = NULL;
+
+	while ((n = ESAudioNext(&samples,&sample_rate)) > 0) {
+		if (len > 0 && ((len + n) > room || (es_abuf + es_ahead) != (p + len)))
+			break;			// full, or junk was skipped in between
+		if (len == 0) {
+			p = es_abuf + es_ahead;
+			PTS = es_audio_clock;
+		}
+		len += n;
+		es_ahead += n;
+		es_audio_clock += ((unsigned long long)samples * 27000000ULL) / sample_rate;
+		stat_es_audio_frames++;
+	}
+
+	if (len == 0)
+		return;
+
+	ESPace(PTS);
+	while (len > 0) {
+		// a single frame bigger than a pack (layer I at high rates) gets split
+		n = len;
+		if (n > (room + (first ? 0 : 5))) n = room + (first ? 0 : 5);
+		ESPack(0x000001C0,first,first ? 2 : 0,PTS,0,p,n);
+		p += n;
+		len -= n;
+		first = 0;
+	}
+}
+
+// decode time of the next thing the video side wants to send, if it has
+// anything ready
+static int ESVideoReady(unsigned long long *t)
+{
+	if (es_au_count == 0 || !es_au[0].ready)
+		return 0;
+
+	*t = es_au[0].has_ts ? es_au[0].DTS : es_last_DTS;
+	return 1;
+}
+
+static int ESAudioReady(unsigned long long *t)
+{
+	int samples,sample_rate;
+
+	if (ESAudioNext(&samples,&sample_rate) <= 0)
+		return 0;
+
+	*t = es_audio_clock;
+	return 1;
+}
+
+// interleave whatever we have, in timestamp order
+static void ESMux()
+{
+	unsigned long long vt,at;
+	int v,a,i;
+
+	for (;;) {
+		v = ESVideoReady(&vt);
+		a = es_audio ? ESAudioReady(&at) : 0;
+
+		if (v && a) {
+			if (at < vt) ESSendAudio();
+			else v = 2;
+		}
+		else if (v) {
+			// wait for the audio that goes with it, unless there won't be
+			// any or we're running out of room
+			if (!es_audio || es_audio_done || (es_vlen - es_vhead) > (ES_VBUF/2) || es_au_count >= (ES_MAX_AU/2))
+				v = 2;
+			else
+				break;
+		}
+		else if (a) {
+			if (es_video_done || (es_alen - es_ahead) > (ES_ABUF/2))
+				ESSendAudio();
+			else
+				break;
+		}
+		else {
+			break;
+		}
+
+		if (v == 2) {
+			ESSendVideo(&es_au[0]);
+			es_vhead = es_au[0].end;
+			for (i=1;i < es_au_count;i++) es_au[i-1] = es_au[i];
+			es_au_count--;
+			if (es_held >= 0) es_held--;
+		}
+	}
+}
+
+// a picture is complete. work out when it's decoded and shown.
+static void ESFinishAU(int end)
+{
+	struct es_au *au;
+
+	if (es_cur_start < 0 || !es_cur_pic)
+		return;
+	if (es_au_count >= ES_MAX_AU) {
+		PMBLog(PMB_LOG_WARNING,"ES: too many pictures queued, dropping one\n");
+		stat_es_dropped++;
+		es_cur_start = -1;
+		es_cur_pic = 0;
+		return;
+	}
+
+	au = &es_au[es_au_count++];
+	*au = es_cur;
+	au->start = es_cur_start;
+	au->end = end;
+	au->ready = 0;
+	au->has_ts = 1;
+
+	if (au->structure != 3) {
+		// field pictures: the pair is one frame, the second one carries no
+		// timestamps of its own
+		if (es_field_pending) {
+			au->has_ts = 0;
+			au->dur = 0;
+			es_field_pending = 0;
+		}
+		else {
+			au->dur = es_frame_ticks;
+			es_field_pending = 1;
+		}
+	}
+	else if (es_progressive) {
+		au->dur = es_frame_ticks * (au->rff ? (au->tff ? 3 : 2) : 1);
+		es_field_pending = 0;
+	}
+	else {
+		au->dur = au->rff ? ((es_frame_ticks * 3) / 2) : es_frame_ticks;
+		es_field_pending = 0;
+	}
+
+	if (!au->has_ts) {
+		au->ready = 1;
+	}
+	else if (au->type == 3) {
+		// B pictures are shown as soon as they're decoded
+		au->PTS = au->DTS = es_display;
+		es_display += au->dur;
+		au->ready = 1;
+	}
+	else {
+		// I and P pictures are decoded now and shown when the next I or P
+		// picture comes in
+		if (es_held >= 0) {
+			au->DTS = es_display;
+			es_au[es_held].PTS = es_display;
+			es_display += es_au[es_held].dur;
+		}
+		else {
+			au->DTS = es_display - au->dur;
+		}
+		es_held = es_au_count - 1;
+	}
+
+	es_cur_start = -1;
+	es_cur_pic = 0;
+}
+
+// everything in decode order up to the held picture can go out. the held
+// one (and its second field) has to wait until we know its PTS.
+static void ESReady()
+{
+	int i;
+
+	for (i=0;i < es_au_count;i++) {
+		if (i == es_held)
+			break;
+		es_au[i].ready = 1;
+	}
+}
+
+static void ESVideoParse()
+{
+	unsigned char *b = es_vbuf;
+	int i = es_vscan;
+
+	while ((i+4+8) <= es_vlen) {
+		int c;
+
+		if (b[i] != 0x00 || b[i+1] != 0x00 || b[i+2] != 0x01) {
+			i++;
+			continue;
+		}
+
+		c = b[i+3];
+		if (c == 0xB3 || c == 0xB8 || c == 0x00) {
+			if (es_cur_pic)
+				ESFinishAU(i);
+
+			if (es_cur_start < 0) {
+				if (es_frame_ticks != 0 || c == 0xB3)
+					es_cur_start = i;	// nothing goes out until the first sequence header
+				else if (es_au_count == 0)
+					es_vhead = i + 4;
+			}
+
+			if (c == 0xB3) {
+				unsigned long long ft = MPEGFrameTicks(b[i+7] & 0x0F);
+
+				if (ft != 0)
+					es_frame_ticks = ft;
+				else if (es_frame_ticks == 0)
+					es_frame_ticks = MPEGFrameTicks(4);
+				es_bit_rate = (((unsigned long)b[i+8]) << 10) | (((unsigned long)b[i+9]) << 2) | (b[i+10] >> 6);
+				es_progressive = 0;
+			}
+			else if (c == 0x00 && es_cur_start >= 0) {
+				memset(&es_cur,0,sizeof(es_cur));
+				es_cur.type = (b[i+5] >> 3) & 7;
+				es_cur.structure = 3;
+				es_cur_pic = 1;
+			}
+		}
+		else if (c == 0xB5) {
+			int id = b[i+4] >> 4;
+
+			if (id == 1)			// sequence extension
+				es_progressive = (b[i+5] >> 3) & 1;
+			else if (id == 8 && es_cur_pic) {	// picture coding extension
+				es_cur.structure = b[i+6] & 3;
+				es_cur.tff = (b[i+7] >> 7) & 1;
+				es_cur.rff = (b[i+7] >> 1) & 1;
+			}
+		}
+		else if (c == 0xB7) {			// sequence_end_code
+			if (es_cur_pic)
+				ESFinishAU(i+4);
+			es_cur_start = -1;
+			if (es_au_count == 0) es_vhead = i + 4;
+		}
+
+		i += 4;
+	}
+
+	es_vscan = i;
+	ESReady();
+}
+
+int ESVideoInputSpace(unsigned char **p)
+{
+	// slide the unsent part down first if we're close to the end
+	if (es_vhead > 0 && (ES_VBUF - es_vlen) < (ES_VBUF/4)) {
+		int i,keep = es_vhead;
+
+		memmove(es_vbuf,es_vbuf+keep,es_vlen-keep);
+		stat_bytes_copied += es_vlen - keep;
+		es_vlen -= keep;
+		es_vscan -= keep;
+		es_vhead = 0;
+		if (es_cur_start >= 0) es_cur_start -= keep;
+		for (i=0;i < es_au_count;i++) {
+			es_au[i].start -= keep;
+			es_au[i].end -= keep;
+		}
+	}
+
+	*p = es_vbuf + es_vlen;
+	return ES_VBUF - es_vlen;
+}
+
+void ESVideoInputCommit(int len)
+{
+	es_vlen += len;
+	es_video_done = 0;
+	ESVideoParse();
+
+	if (es_vlen == ES_VBUF && es_vhead == 0) {
+		// a single picture that doesn't fit. nothing sane to do with it
+		PMBLog(PMB_LOG_WARNING,"ES: video buffer overflow, dropping\n");
+		stat_es_dropped++;
+		es_vlen = es_vscan = 0;
+		es_cur_start = -1;
+		es_cur_pic = 0;
+		es_au_count = 0;
+		es_held = -1;
+	}
+
+	ESMux();
+}
+
+void ESVideoInput(unsigned char *cbuf,int clen)
+{
+	while (clen > 0) {
+		unsigned char *p;
+		int n = ESVideoInputSpace(&p);
+
+		if (n > clen) n = clen;
+		memcpy(p,cbuf,n);
+		stat_bytes_copied += n;
+		ESVideoInputCommit(n);
+		cbuf += n;
+		clen -= n;
+	}
+}
+
+void ESAudioInput(unsigned char *cbuf,int clen)
+{
+	es_audio_done = 0;
+	while (clen > 0) {
+		int n;
+
+		// slide the unsent part down to make room
+		if (es_ahead > 0 && (ES_ABUF - es_alen) < clen) {
+			memmove(es_abuf,es_abuf+es_ahead,es_alen-es_ahead);
+			stat_bytes_copied += es_alen - es_ahead;
+			es_alen -= es_ahead;
+			es_ahead = 0;
+		}
+
+		n = ES_ABUF - es_alen;
+		if (n <= 0) {
+			// video isn't keeping up. ESMux lets audio go on its own at
+			// half full, so this is junk without a single frame header
+			PMBLog(PMB_LOG_WARNING,"ES: audio buffer overflow, dropping\n");
+			stat_es_dropped++;
+			es_alen = es_ahead = 0;
+			continue;
+		}
+
+		if (n > clen) n = clen;
+		memcpy(es_abuf+es_alen,cbuf,n);
+		stat_bytes_copied += n;
+		es_alen += n;
+		cbuf += n;
+		clen -= n;
+		ESMux();
+	}
+}
+
+// the next video and audio streams start together, after whatever the
+// longer of the last two was
+static void ESRealign()
+{
+	if (es_audio_clock < es_display)
+		es_audio_clock = es_display;
+	else
+		es_display = es_audio_clock;
+	es_realign = 0;
+}
+
+void ESAudioEnd()
+{
+	es_audio_done = 1;
+	ESMux();
+	if (es_realign && es_video_done)
+		ESRealign();
+}
+
+// throw away everything queued and start over as if nothing had come in
+void ESReset()
+{
+	es_vhead = es_vlen = es_vscan = 0;
+	es_video_done = 0;
+	es_au_count = 0;
+	es_held = -1;
+	es_cur_start = -1;
+	es_cur_pic = 0;
+	es_field_pending = 0;
+	es_frame_ticks = 0;
+	es_bit_rate = 0;
+	es_progressive = 0;
+	es_display = es_audio_clock = ES_DELAY;
+	es_last_DTS = 0;
+	es_ahead = es_alen = 0;
+	es_audio_done = 0;
+	es_realign = 0;
+	es_audio_rate = 0;
+	es_scr = 0;
+}
+
+void ESFlush()
+{
+	// the last picture ends where the data does
+	if (es_cur_pic)
+		ESFinishAU(es_vlen);
+	if (es_held >= 0) {
+		es_au[es_held].PTS = es_display;
+		es_display += es_au[es_held].dur;
+		es_held = -1;
+	}
+	ESReady();
+
+	es_video_done = 1;
+	ESMux();
+
+	// start the next stream on the same clock, audio lined up with video.
+	// pictures still waiting for their audio stay where they are, the next
+	// stream's data goes in after them
+	if (es_au_count == 0)
+		es_vhead = es_vlen = 0;
+	es_vscan = es_vlen;
+	es_cur_start = -1;
+	es_cur_pic = 0;
+	es_field_pending = 0;
+	es_frame_ticks = 0;
+	es_realign = 1;
+	if (!es_audio || es_audio_done)
+		ESRealign();
+}
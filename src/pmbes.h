@@ -0,0 +1,30 @@
+// MPEG elementary stream packetizer (pmbes.c)
+//
+// Raw MPEG-1/2 video (and optionally a MPEG audio elementary stream next to
+// it) go in here. Pictures get PTS/DTS from the frame rate and picture types,
+// audio frames from their sample count, and the result is fed to MPEGInput()
+// as a program stream.
+
+void ESVideoInput(unsigned char *buf,int len);
+int ESVideoInputSpace(unsigned char **p);
+void ESVideoInputCommit(int len);
+void ESAudioInput(unsigned char *buf,int len);
+
+// the audio stream has ended (or will never come). video stops waiting for it.
+void ESAudioEnd();
+
+// the video stream has ended. pushes out everything still queued, then
+// gets ready for the next one, which continues on the same clock.
+void ESFlush();
+
+// drop everything, queued video and audio included (the flush command)
+void ESReset();
+
+// set if a paired audio stream is expected. video is held back until audio
+// with the same timestamps is there to interleave with.
+extern int es_audio;
+
+// accounting. late counts packs sent after their decode time, junk the
+// bytes skipped looking for audio frame sync.
+extern unsigned long long stat_es_pictures,stat_es_audio_frames;
+extern unsigned long long stat_es_late,stat_es_dropped,stat_es_junk;
@@ -0,0 +1,357 @@
+/* Pinnacle Moviebox USB program stream index
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Making, keeping and looking things up in FILE.pmbi (see pmbindex.h).
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pmbmpeg.h"
+#include "pmbindex.h"
+
+// bytes past a start code that its header can need: a MPEG-1 PES header
+// with all the stuffing and a PTS and DTS
+#define PMB_INDEX_LOOK		32
+#define PMB_INDEX_BUF		(64 * 1024)
+
+// a jump in SCR bigger than this is a discontinuity, not time gone by
+#define PMB_INDEX_MAX_GAP	(27000000ULL * 2)
+
+struct pmb_index_builder {
+	struct pmb_index_entry	*e;
+	unsigned long long	count,alloc;
+	unsigned long long	frame_ticks;
+	unsigned long		mux_rate;		// of the last pack that had one
+	unsigned long long	base;			// file offset of buf[0]
+	int			len;
+	int			failed;
+	unsigned char		buf[PMB_INDEX_BUF + PMB_INDEX_LOOK];
+};
+
+struct pmb_index_builder *PMBIndexBegin()
+{
+	return calloc(1,sizeof(struct pmb_index_builder));
+}
+
+// look through the buffer for start codes. everything but the last few
+// bytes, unless there won't be any more.
+static void PMBIndexScan(struct pmb_index_builder *b,int last)
+{
+	struct pmb_index_entry *cur,*prev,*e;
+	struct mpeg_times t;
+	unsigned long long v,d;
+	unsigned long mux_rate;
+	int end = last ? b->len : (b->len - PMB_INDEX_LOOK);
+	int i,avail;
+
+	for (i=0;i < end && (i+3) < b->len;i++) {
+		if (b->buf[i] != 0x00 || b->buf[i+1] != 0x00 || b->buf[i+2] != 0x01)
+			continue;
+
+		avail = b->len - i;
+		cur = (b->count > 0) ? &b->e[b->count-1] : NULL;
+		switch (b->buf[i+3]) {
+			case 0xBA:
+				if (b->count >= b->alloc) {
+					b->alloc = b->alloc ? (b->alloc * 2) : 4096;
+					if ((e = realloc(b->e,b->alloc * sizeof(*e))) == NULL) {
+						b->failed = 1;
+						break;
+					}
+					b->e = e;
+				}
+				cur = &b->e[b->count++];
+				memset(cur,0,sizeof(*cur));
+				cur->offset = b->base + i;
+				mux_rate = 0;
+				if (avail >= 14 && MPEGPackClock(b->buf+i,&v,&mux_rate))
+					cur->SCR = v;
+				else if (b->count > 1)
+					cur->SCR = b->e[b->count-2].SCR;
+
+				if (b->count > 1) {
+					prev = &b->e[b->count-2];
+					d = (cur->SCR + MPEG_CLOCK_WRAP - prev->SCR) % MPEG_CLOCK_WRAP;
+					if (d == 0 || d > PMB_INDEX_MAX_GAP) {
+						// SCR stood still, went backwards, or jumped. go
+						// on at the mux rate over the bytes since the last pack.
+						d = b->mux_rate ? (((cur->offset - prev->offset) * 27000000ULL) / (b->mux_rate * 50ULL)) : 0;
+					}
+					cur->st = prev->st + d;
+				}
+				if (mux_rate != 0)
+					b->mux_rate = mux_rate;
+				break;
+			case 0xE0:
+				if (cur == NULL || (cur->flags & PMB_INDEX_PTS))
+					break;
+				memset(&t,0,sizeof(t));
+				MPEGScanTimes(b->buf+i,(avail < PMB_INDEX_LOOK) ? avail : PMB_INDEX_LOOK,&t);
+				if (t.have_PTS) {
+					cur->PTS = t.first_PTS;
+					cur->flags |= PMB_INDEX_PTS;
+				}
+				break;
+			case 0xB3:
+				if (cur != NULL)
+					cur->flags |= PMB_INDEX_SEQ;
+				if (avail >= 8 && (v = MPEGFrameTicks(b->buf[i+7] & 0x0F)) != 0)
+					b->frame_ticks = v;
+				break;
+			case 0xB8:
+				if (cur != NULL)
+					cur->flags |= PMB_INDEX_GOP;
+				break;
+		}
+	}
+
+	memmove(b->buf,b->buf+i,b->len-i);
+	b->base += i;
+	b->len -= i;
+}
+
+void PMBIndexFeed(struct pmb_index_builder *b,unsigned char *buf,int len)
+{
+	int n;
+
+	while (len > 0 && !b->failed) {
+		n = sizeof(b->buf) - b->len;
+		if (n > len) n = len;
+		memcpy(b->buf+b->len,buf,n);
+		b->len += n;
+		buf += n;
+		len -= n;
+
+		if (b->len == sizeof(b->buf))
+			PMBIndexScan(b,0);
+	}
+}
+
+void PMBIndexAbort(struct pmb_index_builder *b)
+{
+	free(b->e);
+	free(b);
+}
+
+// the file is over. NULL if there was nothing to index.
+struct pmb_index *PMBIndexEnd(struct pmb_index_builder *b)
+{
+	struct pmb_index *x;
+
+	PMBIndexScan(b,1);
+	if (b->failed || b->count == 0 || (x = calloc(1,sizeof(*x))) == NULL) {
+		PMBIndexAbort(b);
+		return NULL;
+	}
+
+	memcpy(x->hdr.magic,PMB_INDEX_MAGIC,8);
+	x->hdr.version = PMB_INDEX_VERSION;
+	x->hdr.entries = b->count;
+	x->hdr.frame_ticks = b->frame_ticks;
+	x->e = b->e;
+	free(b);
+	return x;
+}
+
+struct pmb_index *PMBIndexBuild(const char *media)
+{
+	static unsigned char buf[PMB_INDEX_BUF];
+	struct pmb_index_builder *b;
+	int fd,rd;
+
+	if ((fd = open(media,O_RDONLY)) < 0) {
+		fprintf(stderr,"Index: cannot open %s: %s\n",media,strerror(errno));
+		return NULL;
+	}
+	if ((b = PMBIndexBegin()) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	while ((rd = read(fd,buf,sizeof(buf))) > 0)
+		PMBIndexFeed(b,buf,rd);
+	close(fd);
+	if (rd < 0) {
+		fprintf(stderr,"Index: error reading %s: %s\n",media,strerror(errno));
+		PMBIndexAbort(b);
+		return NULL;
+	}
+
+	return PMBIndexEnd(b);
+}
+
+static char *PMBIndexPath(const char *media)
+{
+	char *path;
+
+	if ((path = malloc(strlen(media) + sizeof(PMB_INDEX_SUFFIX) + 4)) != NULL)
+		sprintf(path,"%s%s",media,PMB_INDEX_SUFFIX);
+
+	return path;
+}
+
+int PMBIndexSave(struct pmb_index *x,const char *media)
+{
+	size_t len = x->hdr.entries * sizeof(struct pmb_index_entry);
+	struct stat st;
+	char *path,*tmp;
+	int fd,ok = 0;
+
+	if (stat(media,&st) < 0)
+		return -1;
+	x->hdr.source_size = st.st_size;
+	x->hdr.source_mtime = st.st_mtime;
+
+	if ((path = PMBIndexPath(media)) == NULL)
+		return -1;
+	if ((tmp = malloc(strlen(path) + 8)) == NULL) {
+		free(path);
+		return -1;
+	}
+	sprintf(tmp,"%s.tmp",path);
+
+	if ((fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644)) >= 0) {
+		ok =	write(fd,&x->hdr,sizeof(x->hdr)) == sizeof(x->hdr) &&
+			write(fd,x->e,len) == (ssize_t)len;
+		close(fd);
+		if (ok && rename(tmp,path) < 0)
+			ok = 0;
+		if (!ok)
+			unlink(tmp);
+	}
+	if (!ok)
+		fprintf(stderr,"Index: cannot write %s: %s\n",path,strerror(errno));
+
+	free(tmp);
+	free(path);
+	return ok ? 0 : -1;
+}
+
+// FILE.pmbi, if there is one and it still fits FILE. NULL (quietly) if not.
+struct pmb_index *PMBIndexLoad(const char *media)
+{
+	struct pmb_index *x;
+	struct stat st;
+	size_t len;
+	char *path;
+	int fd;
+
+	if (stat(media,&st) < 0 || (path = PMBIndexPath(media)) == NULL)
+		return NULL;
+	fd = open(path,O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	if ((x = calloc(1,sizeof(*x))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (read(fd,&x->hdr,sizeof(x->hdr)) != sizeof(x->hdr) ||
+		memcmp(x->hdr.magic,PMB_INDEX_MAGIC,8) || x->hdr.version != PMB_INDEX_VERSION ||
+		x->hdr.source_size != (unsigned long long)st.st_size ||
+		x->hdr.source_mtime != (unsigned long long)st.st_mtime ||
+		x->hdr.entries == 0)
+		goto bad;
+
+	len = x->hdr.entries * sizeof(struct pmb_index_entry);
+	if ((x->e = malloc(len)) == NULL || read(fd,x->e,len) != (ssize_t)len)
+		goto bad;
+
+	close(fd);
+	return x;
+bad:
+	close(fd);
+	PMBIndexFree(x);
+	return NULL;
+}
+
+void PMBIndexFree(struct pmb_index *x)
+{
+	free(x->e);
+	free(x);
+}
+
+// where a decoder can start: a sequence header, or a GOP header in streams
+// that only have one sequence header at the very start
+static unsigned int PMBIndexKey(struct pmb_index *x)
+{
+	unsigned long long i,gops = 0;
+
+	for (i=0;i < x->hdr.entries;i++) {
+		if (x->e[i].flags & PMB_INDEX_SEQ) {
+			if (++gops > 1)
+				return PMB_INDEX_SEQ;
+		}
+	}
+
+	return PMB_INDEX_SEQ | PMB_INDEX_GOP;
+}
+
+long long PMBIndexSeekTime(struct pmb_index *x,unsigned long long ticks)
+{
+	unsigned int key = PMBIndexKey(x);
+	long long lo = 0,hi = (long long)x->hdr.entries - 1,mid;
+
+	// the last pack that starts at or before the time
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (x->e[mid].st <= ticks)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	// back to where its GOP started
+	while (lo > 0 && !(x->e[lo].flags & key))
+		lo--;
+	if (!(x->e[lo].flags & key))
+		return PMBIndexSeekGOP(x,0);
+
+	return lo;
+}
+
+long long PMBIndexSeekGOP(struct pmb_index *x,unsigned long long n)
+{
+	unsigned int key = PMBIndexKey(x);
+	unsigned long long i;
+
+	for (i=0;i < x->hdr.entries;i++) {
+		if ((x->e[i].flags & key) && n-- == 0)
+			return (long long)i;
+	}
+
+	return -1;
+}
+
+void PMBIndexTimes(struct pmb_index *x,long long i,struct mpeg_times *t)
+{
+	unsigned int key = PMBIndexKey(x);
+	unsigned long long j;
+
+	memset(t,0,sizeof(*t));
+	t->have_SCR = 1;
+	t->first_SCR = x->e[i].SCR;
+	t->last_SCR = x->e[x->hdr.entries-1].SCR;
+	t->frame_ticks = x->hdr.frame_ticks;
+
+	// the earliest picture of the GOP, leading B pictures included
+	for (j=i;j < x->hdr.entries;j++) {
+		if (j > (unsigned long long)i && (x->e[j].flags & key) && t->have_PTS)
+			break;
+		if (!(x->e[j].flags & PMB_INDEX_PTS))
+			continue;
+		if (!t->have_PTS || x->e[j].PTS < t->first_PTS)
+			t->first_PTS = x->e[j].PTS;
+		if (!t->have_PTS || x->e[j].PTS > t->last_PTS)
+			t->last_PTS = x->e[j].PTS;
+		t->have_PTS = 1;
+	}
+}
@@ -0,0 +1,68 @@
+/* Pinnacle Moviebox USB program stream index
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * FILE.pmbi next to a program stream FILE lists every pack in it: where it
+ * starts, its SCR and stream time, the first video PTS in it, and whether a
+ * sequence or GOP header starts in it. With it a player can start at any GOP without
+ * reading up to it. It is made in one pass over the file, either on its own
+ * (pmbplay -index) or on the side while the file is played the first time.
+ *
+ * The file is in host byte order, and only good for the file it was made
+ * from as long as that has the same size and modification time.
+ */
+
+#define PMB_INDEX_MAGIC		"PMBINDEX"
+#define PMB_INDEX_VERSION	2
+#define PMB_INDEX_SUFFIX	".pmbi"
+
+struct pmb_index_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		reserved0;
+	unsigned long long	source_size;
+	unsigned long long	source_mtime;
+	unsigned long long	entries;		// right after the header
+	unsigned long long	frame_ticks;		// video frame period, 0 if unknown
+	unsigned long long	reserved[3];
+};
+
+#define PMB_INDEX_PTS		0x01		// PTS is valid
+#define PMB_INDEX_SEQ		0x02		// a sequence header starts in this pack
+#define PMB_INDEX_GOP		0x04		// a GOP header starts in this pack
+
+struct pmb_index_entry {
+	unsigned long long	offset;			// of the pack start code
+	unsigned long long	SCR;			// 27MHz ticks
+	unsigned long long	st;			// stream time, see below
+	unsigned long long	PTS;			// first video PTS, 27MHz ticks
+	unsigned int		flags;
+	unsigned int		reserved;
+};
+
+// stream time is the SCR unwrapped and smoothed over discontinuities, in
+// 27MHz ticks from the first pack: where the SCR wraps, goes back or jumps
+// it carries on at the mux rate instead. unlike SCR it only ever goes up,
+// so it is what times into the file are looked up by.
+
+struct pmb_index {
+	struct pmb_index_header	hdr;
+	struct pmb_index_entry	*e;
+};
+
+// building one as the file goes by, from the start
+struct pmb_index_builder *PMBIndexBegin();
+void PMBIndexFeed(struct pmb_index_builder *b,unsigned char *buf,int len);
+struct pmb_index *PMBIndexEnd(struct pmb_index_builder *b);
+void PMBIndexAbort(struct pmb_index_builder *b);
+
+struct pmb_index *PMBIndexBuild(const char *media);
+int PMBIndexSave(struct pmb_index *x,const char *media);
+struct pmb_index *PMBIndexLoad(const char *media);
+void PMBIndexFree(struct pmb_index *x);
+
+// the entry to start at for a stream time, or the n-th GOP. -1 if there's nowhere to start.
+long long PMBIndexSeekTime(struct pmb_index *x,unsigned long long ticks);
+long long PMBIndexSeekGOP(struct pmb_index *x,unsigned long long n);
+
+// the start of the stream from entry i on, for MPEGSplice()
+void PMBIndexTimes(struct pmb_index *x,long long i,struct mpeg_times *t);
@@ -0,0 +1,297 @@
+/* Pinnacle Moviebox USB logging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * The ring (see pmblog.h) is a bounded queue for any number of producers
+ * and the one log thread. Each slot carries a sequence number: a producer
+ * claims a slot by moving head along, fills it, then hands it to the log
+ * thread by bumping its sequence; the log thread hands it back the same
+ * way. Like the input ring (pmbring.c) the log thread sleeps on an eventfd
+ * that producers only touch when it's actually asleep.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pmblog.h"
+
+int pmb_log_level = PMB_LOG_INFO;
+int pmb_log_rate = PMB_LOG_RATE;
+
+unsigned long long stat_log_written = 0,stat_log_suppressed = 0,stat_log_dropped = 0;
+
+struct log_slot {
+	volatile unsigned int	seq;
+	int			len;
+	char			text[PMB_LOG_TEXT];
+};
+
+static struct log_slot log_ring[PMB_LOG_SLOTS];
+static volatile unsigned int log_head = 0;		// next slot a producer claims
+static unsigned int log_tail = 0;			// next slot the log thread reads
+static volatile unsigned int log_waiting = 0;		// log thread sleeps on log_efd
+static volatile int log_running = 0;
+static volatile int log_stop = 0;
+static int log_efd = -1;
+static pthread_t log_thread;
+
+static struct pmb_log_site *log_sites = NULL;
+
+static const char *level_names[8] = {
+	NULL,NULL,NULL,"err","warning","notice","info","debug"
+};
+
+static void Wake()
+{
+	unsigned long long one = 1;
+
+	if (write(log_efd,&one,sizeof(one)) < 0) { }
+}
+
+static void Drain()
+{
+	unsigned long long v;
+
+	if (read(log_efd,&v,sizeof(v)) < 0) { }
+}
+
+// each PMBLog() is put on the list the first time it's used, for the stats
+static void Register(struct pmb_log_site *s)
+{
+	struct pmb_log_site *head;
+
+	if (__atomic_exchange_n(&s->registered,1,__ATOMIC_ACQ_REL))
+		return;
+
+	head = __atomic_load_n(&log_sites,__ATOMIC_ACQUIRE);
+	do {
+		s->next = head;
+	} while (!__atomic_compare_exchange_n(&log_sites,&head,s,0,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE));
+}
+
+// whether this one is over its site's rate and gets counted instead
+static int RateLimited(struct pmb_log_site *s)
+{
+	struct timespec ts;
+	unsigned long long w,now;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	now = ts.tv_sec;
+
+	// a new second. whoever gets here first starts the count over.
+	w = __atomic_load_n(&s->window,__ATOMIC_ACQUIRE);
+	if (w != now && __atomic_compare_exchange_n(&s->window,&w,now,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+		__atomic_store_n(&s->count,0,__ATOMIC_RELEASE);
+
+	if (pmb_log_rate > 0 && __atomic_fetch_add(&s->count,1,__ATOMIC_RELAXED) >= (unsigned int)pmb_log_rate) {
+		__atomic_fetch_add(&s->suppressed,1,__ATOMIC_RELAXED);
+		__atomic_fetch_add(&s->total_suppressed,1,__ATOMIC_RELAXED);
+		__atomic_fetch_add(&stat_log_suppressed,1,__ATOMIC_RELAXED);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int Format(char *text,struct pmb_log_site *s,const char *fmt,va_list va)
+{
+	unsigned long long sup = __atomic_exchange_n(&s->suppressed,0,__ATOMIC_ACQ_REL);
+	int len,nl;
+
+	len = vsnprintf(text,PMB_LOG_TEXT,fmt,va);
+	if (len < 0) len = 0;
+	if (len >= PMB_LOG_TEXT) len = PMB_LOG_TEXT - 1;
+
+	// say how many weren't written, in front of the newline
+	if (sup > 0) {
+		nl = (len > 0 && text[len-1] == '\n');
+		if (nl) len--;
+		len += snprintf(text+len,PMB_LOG_TEXT-len," (%llu more suppressed)%s",sup,nl ? "\n" : "");
+		if (len >= PMB_LOG_TEXT) len = PMB_LOG_TEXT - 1;
+	}
+
+	return len;
+}
+
+void PMBLogSite(struct pmb_log_site *s,const char *fmt,...)
+{
+	struct log_slot *slot;
+	unsigned int pos,seq;
+	va_list va;
+	int diff;
+
+	Register(s);
+	if (RateLimited(s))
+		return;
+
+	// no log thread (the tools): straight out
+	if (!__atomic_load_n(&log_running,__ATOMIC_ACQUIRE)) {
+		char text[PMB_LOG_TEXT];
+		int len;
+
+		va_start(va,fmt);
+		len = Format(text,s,fmt,va);
+		va_end(va);
+		fwrite(text,1,len,stderr);
+		__atomic_fetch_add(&stat_log_written,1,__ATOMIC_RELAXED);
+		return;
+	}
+
+	// claim a slot
+	pos = __atomic_load_n(&log_head,__ATOMIC_RELAXED);
+	for (;;) {
+		slot = &log_ring[pos & (PMB_LOG_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log_head,&pos,pos + 1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			// full. the log thread is behind, don't wait for it.
+			__atomic_fetch_add(&stat_log_dropped,1,__ATOMIC_RELAXED);
+			return;
+		}
+		else {
+			pos = __atomic_load_n(&log_head,__ATOMIC_RELAXED);
+		}
+	}
+
+	va_start(va,fmt);
+	slot->len = Format(slot->text,s,fmt,va);
+	va_end(va);
+	__atomic_store_n(&slot->seq,pos + 1,__ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_waiting,__ATOMIC_SEQ_CST))
+		Wake();
+}
+
+// everything that's in the ring. returns how many.
+static int LogDrain()
+{
+	struct log_slot *slot;
+	int n = 0;
+
+	for (;;) {
+		slot = &log_ring[log_tail & (PMB_LOG_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) != (log_tail + 1))
+			break;
+
+		fwrite(slot->text,1,slot->len,stderr);
+		__atomic_store_n(&slot->seq,log_tail + PMB_LOG_SLOTS,__ATOMIC_RELEASE);
+		log_tail++;
+		n++;
+	}
+
+	if (n > 0) {
+		fflush(stderr);
+		__atomic_fetch_add(&stat_log_written,n,__ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+static void *LogThread(void *arg)
+{
+	struct pollfd pfd;
+
+	for (;;) {
+		if (LogDrain() > 0)
+			continue;
+		if (__atomic_load_n(&log_stop,__ATOMIC_ACQUIRE))
+			break;
+
+		__atomic_store_n(&log_waiting,1,__ATOMIC_SEQ_CST);
+		if (LogDrain() == 0 && !__atomic_load_n(&log_stop,__ATOMIC_ACQUIRE)) {	// raced with a producer?
+			pfd.fd = log_efd;
+			pfd.events = POLLIN;
+			if (poll(&pfd,1,1000) > 0)
+				Drain();
+		}
+		__atomic_store_n(&log_waiting,0,__ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int PMBLogOpen()
+{
+	unsigned int i;
+
+	if (log_running)
+		return 0;
+
+	for (i=0;i < PMB_LOG_SLOTS;i++)
+		log_ring[i].seq = i;
+	log_head = log_tail = 0;
+	log_stop = 0;
+
+	if ((log_efd = eventfd(0,EFD_NONBLOCK)) < 0) {
+		fprintf(stderr,"Log: cannot create eventfd: %s\n",strerror(errno));
+		return -1;
+	}
+	if (pthread_create(&log_thread,NULL,LogThread,NULL) != 0) {
+		fprintf(stderr,"Log: cannot start log thread\n");
+		close(log_efd);
+		log_efd = -1;
+		return -1;
+	}
+
+	__atomic_store_n(&log_running,1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+// what's still in the ring goes out first
+void PMBLogClose()
+{
+	if (!log_running)
+		return;
+
+	__atomic_store_n(&log_running,0,__ATOMIC_RELEASE);
+	__atomic_store_n(&log_stop,1,__ATOMIC_RELEASE);
+	Wake();
+	pthread_join(log_thread,NULL);
+	LogDrain();
+	close(log_efd);
+	log_efd = -1;
+}
+
+// "err", "warning", "notice", "info", "debug" or 3-7. -1 if it's neither.
+int PMBLogParseLevel(const char *s)
+{
+	int i;
+
+	for (i=PMB_LOG_ERR;i <= PMB_LOG_DEBUG;i++) {
+		if (!strcasecmp(s,level_names[i]))
+			return i;
+	}
+
+	i = atoi(s);
+	if (i >= PMB_LOG_ERR && i <= PMB_LOG_DEBUG && s[0] >= '0' && s[0] <= '9')
+		return i;
+
+	return -1;
+}
+
+const char *PMBLogLevelName(int level)
+{
+	if (level < PMB_LOG_ERR || level > PMB_LOG_DEBUG)
+		return "?";
+
+	return level_names[level];
+}
+
+struct pmb_log_site *PMBLogSites()
+{
+	return __atomic_load_n(&log_sites,__ATOMIC_ACQUIRE);
+}
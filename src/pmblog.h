@@ -0,0 +1,56 @@
+/* Pinnacle Moviebox USB logging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * PMBLog() looks like fprintf(stderr,...) with a severity in front. The
+ * message is formatted by the caller into a slot of a lock-free ring and
+ * written out by a thread of its own (once PMBLogOpen() started it), so a
+ * damaged stream complaining thousands of times a second never blocks the
+ * playback thread on a slow terminal or journald. Each PMBLog() in the
+ * source gets its own rate limit; what's over it is counted, not written,
+ * and the count goes out with the next one that is. When the ring is full
+ * messages are dropped, and counted, rather than waited for.
+ */
+
+// the same order as syslog's
+#define PMB_LOG_ERR		3
+#define PMB_LOG_WARNING		4
+#define PMB_LOG_NOTICE		5
+#define PMB_LOG_INFO		6
+#define PMB_LOG_DEBUG		7
+
+#define PMB_LOG_SLOTS		1024		// must be a power of 2
+#define PMB_LOG_TEXT		256
+#define PMB_LOG_RATE		10		// per PMBLog() per second, default
+
+// one for every PMBLog() in the source
+struct pmb_log_site {
+	int			level;
+	const char		*fmt;
+	unsigned long long	window;			// the second count is for
+	unsigned int		count;
+	unsigned long long	suppressed;		// since the last one written
+	unsigned long long	total_suppressed;
+	struct pmb_log_site	*next;			// all that have been used
+	int			registered;
+};
+
+#define PMBLog(lvl,fmt,...) do { \
+		static struct pmb_log_site pmb_log_site_ = { (lvl),(fmt) }; \
+		if ((lvl) <= pmb_log_level) \
+			PMBLogSite(&pmb_log_site_,fmt,##__VA_ARGS__); \
+	} while (0)
+
+// messages above this level are dropped where they're made. can be changed
+// at any time.
+extern int pmb_log_level;
+extern int pmb_log_rate;
+
+void PMBLogSite(struct pmb_log_site *s,const char *fmt,...) __attribute__((format(printf,2,3)));
+int PMBLogOpen();
+void PMBLogClose();
+int PMBLogParseLevel(const char *s);
+const char *PMBLogLevelName(int level);
+struct pmb_log_site *PMBLogSites();
+
+// accounting
+extern unsigned long long stat_log_written,stat_log_suppressed,stat_log_dropped;
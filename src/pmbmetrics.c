@@ -0,0 +1,219 @@
+/* Pinnacle Moviebox USB metrics socket
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbmetrics.h. Clients are never waited for: the listening socket and
+ * the connections are non-blocking, and a client is answered as soon as its
+ * request is complete, it shuts down its side, or it has said nothing for a
+ * little while (socat, nc).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pmblog.h"
+#include "pmbmetrics.h"
+
+// how often to look for new clients, how long to wait for a request and
+// for the rest of one. milliseconds.
+#define METRICS_POLL		10
+#define METRICS_QUIET		100
+#define METRICS_TIMEOUT		1000
+
+struct metrics_client {
+	int		fd;
+	long long	since;
+	int		len;
+	char		req[512];
+};
+
+static struct metrics_client met_client[PMB_METRICS_CLIENTS];
+static int met_listen = -1;
+static long long met_polled = 0;
+static char met_path[108];
+
+static char met_text[PMB_METRICS_TEXT];
+static int met_len = 0;
+
+static long long MetricsClock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((long long)ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000L);
+}
+
+int PMBMetricsOpen(const char *path)
+{
+	struct sockaddr_un sa;
+	int i;
+
+	strncpy(met_path,path ? path : PMB_METRICS_SOCKET,sizeof(met_path)-1);
+	for (i=0;i < PMB_METRICS_CLIENTS;i++)
+		met_client[i].fd = -1;
+
+	if ((met_listen = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0)) < 0)
+		return -1;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,met_path);
+	unlink(met_path);
+	if (bind(met_listen,(struct sockaddr*)&sa,sizeof(sa)) < 0 || listen(met_listen,PMB_METRICS_CLIENTS) < 0) {
+		fprintf(stderr,"Cannot listen on %s: %s\n",met_path,strerror(errno));
+		close(met_listen);
+		met_listen = -1;
+		return -1;
+	}
+	chmod(met_path,0777);
+
+	return 0;
+}
+
+void PMBMetricsClose()
+{
+	int i;
+
+	for (i=0;i < PMB_METRICS_CLIENTS;i++) {
+		if (met_client[i].fd >= 0) {
+			close(met_client[i].fd);
+			met_client[i].fd = -1;
+		}
+	}
+
+	if (met_listen >= 0) {
+		close(met_listen);
+		met_listen = -1;
+		unlink(met_path);
+	}
+}
+
+static void MetricsPrintf(const char *fmt,...)
+{
+	va_list va;
+	int n;
+
+	if (met_len >= (PMB_METRICS_TEXT - 1))
+		return;
+
+	va_start(va,fmt);
+	n = vsnprintf(met_text+met_len,PMB_METRICS_TEXT-met_len,fmt,va);
+	va_end(va);
+	if (n > 0) met_len += n;
+	if (met_len > (PMB_METRICS_TEXT - 1)) met_len = PMB_METRICS_TEXT - 1;
+}
+
+void PMBMetric(const char *name,const char *type,const char *help)
+{
+	MetricsPrintf("# HELP %s %s\n# TYPE %s %s\n",name,help,name,type);
+}
+
+void PMBMetricValue(const char *name,const char *labels,double v)
+{
+	if (labels)
+		MetricsPrintf("%s{%s} %.9g\n",name,labels,v);
+	else
+		MetricsPrintf("%s %.9g\n",name,v);
+}
+
+void PMBMetricCount(const char *name,const char *labels,unsigned long long v)
+{
+	if (labels)
+		MetricsPrintf("%s{%s} %llu\n",name,labels,v);
+	else
+		MetricsPrintf("%s %llu\n",name,v);
+}
+
+static void MetricsAnswer(struct metrics_client *c,void (*collect)())
+{
+	char hdr[128];
+	int http = (c->len >= 4 && (!memcmp(c->req,"GET ",4) || !memcmp(c->req,"HEAD",4)));
+	int n;
+
+	met_len = 0;
+	collect();
+
+	// one go, and whatever doesn't fit in the socket buffer is lost. a
+	// scrape is a few KB.
+	if (http) {
+		n = snprintf(hdr,sizeof(hdr),"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",met_len);
+		if (send(c->fd,hdr,n,MSG_NOSIGNAL|MSG_DONTWAIT) < 0) { }
+	}
+	if (!http || memcmp(c->req,"HEAD",4)) {
+		if (send(c->fd,met_text,met_len,MSG_NOSIGNAL|MSG_DONTWAIT) < 0) { }
+	}
+
+	close(c->fd);
+	c->fd = -1;
+}
+
+int PMBMetricsPoll(void (*collect)())
+{
+	struct metrics_client *c;
+	long long now;
+	int i,s,rd,done,answered = 0;
+
+	if (met_listen < 0)
+		return 0;
+
+	now = MetricsClock();
+	if ((now - met_polled) < METRICS_POLL)
+		return 0;
+	met_polled = now;
+
+	while ((s = accept4(met_listen,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		for (i=0;i < PMB_METRICS_CLIENTS && met_client[i].fd >= 0;i++);
+		if (i == PMB_METRICS_CLIENTS) {
+			PMBLog(PMB_LOG_WARNING,"Metrics: too many clients\n");
+			close(s);
+			continue;
+		}
+
+		met_client[i].fd = s;
+		met_client[i].since = now;
+		met_client[i].len = 0;
+	}
+
+	for (i=0;i < PMB_METRICS_CLIENTS;i++) {
+		c = &met_client[i];
+		if (c->fd < 0)
+			continue;
+
+		done = 0;
+		rd = recv(c->fd,c->req+c->len,sizeof(c->req)-1-c->len,MSG_DONTWAIT);
+		if (rd > 0) {
+			c->len += rd;
+			c->req[c->len] = 0;
+			// the end of the request headers. nothing we need is in them.
+			if (strstr(c->req,"\r\n\r\n") || strstr(c->req,"\n\n") || c->len == (int)sizeof(c->req)-1)
+				done = 1;
+		}
+		else if (rd == 0) {
+			done = 1;		// the client shut down its side
+		}
+		else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			close(c->fd);
+			c->fd = -1;
+			continue;
+		}
+
+		if ((now - c->since) >= (c->len ? METRICS_TIMEOUT : METRICS_QUIET))
+			done = 1;
+
+		if (done) {
+			MetricsAnswer(c,collect);
+			answered++;
+		}
+	}
+
+	return answered;
+}
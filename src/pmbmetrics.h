@@ -0,0 +1,29 @@
+/* Pinnacle Moviebox USB metrics socket
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Live numbers for monitoring, in the Prometheus text exposition format, on
+ * a Unix socket. Every connection gets one scrape and is closed. A client
+ * that sends a HTTP request (curl --unix-socket, a scraper through a proxy)
+ * gets a HTTP response, one that sends nothing gets the bare text.
+ *
+ * The socket is served from the caller's loop by PMBMetricsPoll(), so the
+ * numbers are read where they're kept, without locking.
+ */
+
+#define PMB_METRICS_SOCKET	"/var/video/metrics.sock"
+#define PMB_METRICS_CLIENTS	8
+#define PMB_METRICS_TEXT	(64 * 1024)
+
+int PMBMetricsOpen(const char *path);
+void PMBMetricsClose();
+
+// accepts and answers clients. collect() is called once per scrape and
+// writes the metrics with the functions below. returns how many were
+// answered.
+int PMBMetricsPoll(void (*collect)());
+
+// "# HELP" and "# TYPE" for a metric, then its samples. labels is what goes
+// inside the braces (reason="short") or NULL.
+void PMBMetric(const char *name,const char *type,const char *help);
+void PMBMetricValue(const char *name,const char *labels,double v);
+void PMBMetricCount(const char *name,const char *labels,unsigned long long v);
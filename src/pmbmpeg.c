@@ -0,0 +1,1609 @@
+/* Pinnacle Moviebox USB MPEG stream massaging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Program stream parser, timestamp rebasing and 2048 byte repacketizer
+ * used by pmbpipe. Finished packs are handed to MPEGOutput().
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbtrace.h"
+
+// the MovieBox does not handle SCR resets very well.
+// if you play an MPEG file into it and then play another without filtering
+// and the other MPEG also starts with a SCR of 0, the MovieBox will stall,
+// waiting until it's internal clock matches (which won't in a LONG time).
+// 
+// Now the purpose of this daemon is to accept arbitrary MPEGs through a FIFO.
+// That can easily happen, so we must massage the SCR, PTS, and DTS timestamps
+// in the stream before sending it on to the Pinnacle MovieBox.
+unsigned long long monotonic_SCR = 0;
+
+static int mpeg_state = 0;
+static unsigned int mpeg_sync = 0;	// exactly 32 bits, or the sync compare never matches on 64-bit
+static unsigned char mpeg_in[8192];	// PES payload is streamed, only headers wait in here
+static int mpeg_in_remain = 0;
+static unsigned char mpeg_out[4096];
+static int mpeg_outi = 0;
+unsigned long long last_SCR = 0,last_SCR_delta = 0,last_SCR_difference = 0;
+
+// live mode: run the SCR this far ahead of the stream's own, so the decoder
+// gets to each PTS sooner. same units as SCR (base << 9).
+unsigned long long scr_trim = 0;
+static int warn_nonmpa = 0;
+
+// where finished 2048 byte packs go
+void (*MPEGOutput)(unsigned char *pack,int len) = NULL;
+
+// copies made in user space, see stat_bytes_in in pmbpipe.c
+unsigned long long stat_bytes_copied = 0;
+
+// repacketizer accounting. the MovieBox only takes 2048 byte packs, so
+// anything that doesn't line up is padded out or split across packs instead
+// of being thrown away.
+unsigned long long stat_padded_bytes = 0,stat_padded_packs = 0;
+unsigned long long stat_resplit_bytes = 0,stat_resplit_pes = 0;
+unsigned long long stat_dropped_short = 0,stat_dropped_long = 0,stat_dropped_pes = 0;
+unsigned long long stat_dropped_junk = 0,stat_dropped_overflow = 0;
+
+// how long packs take to fill up, from the first byte to MPEGOutput()
+struct mpeg_latency lat_pack = { 0, 0, 0 };
+static long long pack_started = -1;
+static long long trace_pack_started = 0;	// the same for pmbtrace
+
+// the pack header most recently seen on input (already rebased). every
+// output pack starts with a copy of it, with the SCR advanced by however
+// long it takes to deliver the packs we made out of the same input pack.
+static unsigned char pack_hdr[10];
+static int pack_hdr_len = 0;
+static int pack_hdr_MPEG2 = 0;
+static unsigned long long pack_SCR = 0;
+static unsigned long pack_mux_rate = 0;		// units of 50 bytes/sec
+static int pack_continuations = 0;
+
+// where the last PES in mpeg_out starts, so FlushMPEGOut can stuff its header
+static int last_pes_pos = -1;
+static int last_pes_MPEG2 = 0;
+
+// the PES currently being written out. the input side only ever has the
+// header and whatever part of the payload has arrived so far, so the
+// payload is passed through in pieces as it comes in (see OutPESData).
+static int pes_out_sync = 0;
+static int pes_out_MPEG2 = 0;
+static unsigned char pes_out_hdr[3+255];
+static int pes_out_hdr_len = 0;
+static int pes_out_remain = 0;		// payload bytes not yet written
+static int pes_out_frag_remain = 0;	// of those, how many the open fragment still expects
+static int pes_out_first = 0;
+static int pes_out_resplit = 0;		// open fragment is a continuation
+
+// host clock, 27MHz ticks
+long long MPEGHostClock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((long long)ts.tv_sec * 27000000LL) + (((long long)ts.tv_nsec * 27LL) / 1000LL);
+}
+
+void MPEGLatencyAdd(struct mpeg_latency *l,long long t)
+{
+	if (t < 0) t = 0;
+	l->count++;
+	l->sum += t;
+	if ((unsigned long long)t > l->max) l->max = t;
+}
+
+// SCR values in this file are kept the way the pack header lays them out:
+// the 33-bit 90KHz base shifted up by 9, with the 27MHz extension in the low
+// bits. These convert to and from plain 27MHz ticks for arithmetic.
+static unsigned long long SCRToTicks(unsigned long long SCR)
+{
+	return (SCR >> 9) * 300ULL + (SCR & 0x1FF);
+}
+
+static unsigned long long TicksToSCR(unsigned long long t)
+{
+	return ((t / 300ULL) << 9) | (t % 300ULL);
+}
+
+static void PatchSCR(unsigned char *header,int MPEG2,unsigned long long SCR)
+{
+	if (MPEG2) {
+		header[0] = (header[0] & ~(0x07 <<  3)) | (((SCR >> 39) & 0x07) <<  3);
+		header[0] = (header[0] &  ~0x03       ) | (((SCR >> 37) & 0x03)      );
+		header[1] =                                  SCR >> 29;
+		header[2] = (header[2] & ~(0x1F <<  3)) | (((SCR >> 24) & 0x1F) <<  3);
+		header[2] = (header[2] &  ~0x03       ) | (((SCR >> 22) & 0x03)      );
+		header[3] =                                  SCR >> 14;
+		header[4] = (header[4] & ~(0x1F <<  3)) | (((SCR >>  9) & 0x1F) <<  3);
+		header[4] = (header[4] &  ~0x03       ) | (((SCR >>  7) & 0x03)      );
+		header[5] = (header[5] & ~(0x7F <<  1)) | (( SCR        & 0x7F) <<  1);
+	}
+	else {
+		header[0] = (header[0] & ~(0x07 <<  1)) | (((SCR >> 39) & 0x07) <<  1);
+		header[1] =                                  SCR >> 31;
+		header[2] = (header[2] & ~(0x7F <<  1)) | (((SCR >> 24) & 0x7F) <<  1);
+		header[3] =                                  SCR >> 16;
+		header[4] = (header[4] & ~(0x7F <<  1)) | (((SCR >>  9) & 0x7F) <<  1);
+	}
+}
+
+// build a MPEG-2 pack header (with start code, 14 bytes) for the given
+// clock in 27MHz ticks. for the input side modules that make up their own
+// program stream (pmbts.c, pmbes.c).
+int MPEGPackHeader(unsigned char *p,unsigned long long ticks,unsigned long mux_rate)
+{
+	unsigned long long SCR = TicksToSCR(ticks % MPEG_CLOCK_WRAP);
+
+	if (mux_rate == 0) mux_rate = 1;
+	if (mux_rate > 0x3FFFFF) mux_rate = 0x3FFFFF;
+
+	p[0] = 0x00;
+	p[1] = 0x00;
+	p[2] = 0x01;
+	p[3] = 0xBA;
+	p[4] = 0x44;			// '01', markers are set below
+	p[5] = 0x00;
+	p[6] = 0x04;
+	p[7] = 0x00;
+	p[8] = 0x04;
+	p[9] = 0x01;
+	PatchSCR(p+4,1,SCR);
+	p[10] = mux_rate >> 14;
+	p[11] = mux_rate >> 6;
+	p[12] = ((mux_rate & 0x3F) << 2) | 0x03;
+	p[13] = 0xF8;			// no pack stuffing
+	return 14;
+}
+
+// read the clock and mux_rate back out of a finished pack (with start code).
+// returns 0 if it doesn't start with a pack header.
+int MPEGPackClock(unsigned char *p,unsigned long long *ticks,unsigned long *mux_rate)
+{
+	unsigned char *h = p + 4;
+
+	if (p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01 || p[3] != 0xBA)
+		return 0;
+
+	if ((h[0] >> 6) == 1) {		// MPEG-2
+		*ticks = SCRToTicks(
+			(((unsigned long long)((h[0] >>  3) & 0x07)) << 39) |
+			(((unsigned long long)( h[0]        & 0x03)) << 37) |
+			(((unsigned long long)( h[1]              )) << 29) |
+			(((unsigned long long)((h[2] >>  3) & 0x1F)) << 24) |
+			(((unsigned long long)( h[2]        & 0x03)) << 22) |
+			(((unsigned long long)( h[3]              )) << 14) |
+			(((unsigned long long)((h[4] >>  3) & 0x1F)) <<  9) |
+			(((unsigned long long)( h[4]        & 0x03)) <<  7) |
+			(((unsigned long long)((h[5] >>  1) & 0x7F))      ));
+		*mux_rate = (((unsigned long)h[6]) << 14) | (((unsigned long)h[7]) << 6) | (((unsigned long)h[8]) >> 2);
+	}
+	else if ((h[0] >> 4) == 2) {	// MPEG-1
+		*ticks = SCRToTicks(
+			(((unsigned long long)((h[0] >>  1) & 0x07)) << (30+9)) |
+			(((unsigned long long)( h[1]              )) << (22+9)) |
+			(((unsigned long long)((h[2] >>  1) & 0x7F)) << (15+9)) |
+			(((unsigned long long)( h[3]              )) <<  (7+9)) |
+			(((unsigned long long)((h[4] >>  1) & 0x7F)) <<  (0+9)));
+		*mux_rate = (((unsigned long)(h[5] & 0x7F)) << 15) | (((unsigned long)h[6]) << 7) | (((unsigned long)h[7]) >> 1);
+	}
+	else {
+		return 0;
+	}
+
+	return 1;
+}
+
+// parse a pack header, h pointing right after its start code. returns the
+// bytes it takes up with its stuffing, 0 if it's junk, or -1 if len isn't
+// enough to tell. nothing is kept between calls, so anything can use it.
+int MPEGParsePack(unsigned char *h,int len,struct mpeg_pack *pk)
+{
+	// don't bother if there's not enough to parse.
+	if (len < 10) return -1;
+
+	memset(pk,0,sizeof(*pk));
+	// okay, so is this an MPEG-1 pack or MPEG-2 pack?
+	if ((*h >> 6) == 1) {	// MPEG-2 '01'
+		pk->MPEG2 = 1;
+		pk->hlen = 10;
+
+		// h[0] = {
+		//   '01'			 2 bits
+		//   SCR[32...30]		 3 bits
+		//   marker			 1 bit
+		//   SCR[29...28]		 2 bits
+		// };
+		// h[1] = {
+		//   SCR[27...20]		 8 bits
+		// };
+		// h[2] = {
+		//   SCR[19...15]		 5 bits
+		//   marker			 1 bit
+		//   SCR[14...13]		 2 bits
+		// };
+		// h[3] = {
+		//   SCR[12...5]		 8 bits
+		// };
+		// h[4] = {
+		//   SCR[4...0]			 5 bits
+		//   marker			 1 bit
+		//   SCRext[8...7]		 2 bits
+		// };
+		// h[5] = {
+		//   SCRext[6...0]		 7 bits
+		//   marker			 1 bit
+		// };
+		// h[6] = {
+		//   muxrate[21...14]		 8 bits
+		// };
+		// h[7] = {
+		//   muxrate[13...6]		 8 bits
+		// };
+		// h[8] = {
+		//   muxrate[5...0]		 6 bits
+		//   marker			 1 bit
+		//   marker			 1 bit
+		// };
+		// h[9] = {
+		//   reserved			 5 bits
+		//   pack_stuffing_length	 3 bits
+		// };
+		// ignoring the padding, we get 10 bytes
+		if (	(h[0] & 0x04) == 0 ||
+			(h[2] & 0x04) == 0 ||
+			(h[4] & 0x04) == 0 ||
+			(h[5] & 0x01) == 0 ||
+			(h[8] & 0x03) != 3) {
+			return 0;		// marker bits fail, junk
+		}
+
+		pk->SCR =	(((unsigned long long)((h[0] >>  3) & 0x07)) << 39) |
+				(((unsigned long long)( h[0]        & 0x03)) << 37) |
+				(((unsigned long long)( h[1]              )) << 29) |
+				(((unsigned long long)((h[2] >>  3) & 0x1F)) << 24) |
+				(((unsigned long long)( h[2]        & 0x03)) << 22) |
+				(((unsigned long long)( h[3]              )) << 14) |
+				(((unsigned long long)((h[4] >>  3) & 0x1F)) <<  9) |
+				(((unsigned long long)( h[4]        & 0x03)) <<  7) |
+				(((unsigned long long)((h[5] >>  1) & 0x7F))      );
+		pk->mux_rate =
+			(((unsigned long)h[6]) << 14) |
+			(((unsigned long)h[7]) <<  6) |
+			(((unsigned long)h[8]) >>  2);
+	}
+	else if ((*h >> 4) == 2) { // MPEG-1 '0010'
+		pk->hlen = 8;
+		pk->MPEG2 = 0;
+		// h[0] = {
+		//   '0010'			 4 bits
+		//   SCR[32...30]		 3 bits
+		//   marker			 1 bit
+		// };
+		// h[1...2] = {
+		//   SCR[29...15]		15 bits
+		//   marker			 1 bit
+		// };
+		// h[3...4] = {
+		//   SCR[14...0]		15 bits
+		//   marker			 1 bit
+		// };
+		// h[5...7] = {
+		//   marker			 1 bit
+		//   mux_rate			22 bits
+		//   marker			 1 bit
+		// };
+		if (	(h[0] &    1) == 0 ||
+			(h[2] &    1) == 0 ||
+			(h[4] &    1) == 0 ||
+			(h[5] & 0x80) == 0 ||
+			(h[7] &    1) == 0) {
+			return 0;		// marker bits fail, it's junk
+		}
+
+		// shift over by 9 to convert 90KHz to 27MHz
+		pk->SCR =	(((unsigned long long)((h[0] >>  1) & 0x07)) << (30+9)) |
+				(((unsigned long long)( h[1]              )) << (22+9)) |
+				(((unsigned long long)((h[2] >>  1) & 0x7F)) << (15+9)) |
+				(((unsigned long long)( h[3]              )) <<  (7+9)) |
+				(((unsigned long long)((h[4] >>  1) & 0x7F)) <<  (0+9));
+		pk->mux_rate =
+			(((unsigned long)(h[5] & 0x7F)) << 15) |
+			(((unsigned long)h[6]) << 7) |
+			(((unsigned long)h[7]) >> 1);
+	}
+	else {
+		return 0;		// it's nonsense
+	}
+
+	// MPEG-2 pack stuffing has to be here too
+	if (pk->MPEG2) pk->stuffing = h[9] & 7;
+	if (len < (pk->hlen + pk->stuffing)) return -1;
+
+	pk->ticks = SCRToTicks(pk->SCR);
+	return pk->hlen + pk->stuffing;
+}
+
+// video frame period in 27MHz ticks for a sequence header frame_rate_code,
+// 0 if the code is reserved
+static unsigned long long frame_rate_ticks[9] = {
+	0,
+	1126125,		// 23.976
+	1125000,		// 24
+	1080000,		// 25
+	900900,			// 29.97
+	900000,			// 30
+	540000,			// 50
+	450450,			// 59.94
+	450000			// 60
+};
+
+unsigned long long MPEGFrameTicks(int frame_rate_code)
+{
+	if (frame_rate_code < 1 || frame_rate_code > 8)
+		return 0;
+
+	return frame_rate_ticks[frame_rate_code];
+}
+
+// time (27MHz ticks) it takes to deliver one 2048 byte pack at the mux rate
+static unsigned long long PackTicks()
+{
+	if (pack_mux_rate == 0)
+		return 0;
+
+	return (2048ULL * 27000000ULL) / (pack_mux_rate * 50ULL);
+}
+
+// make sure mpeg_out has a pack header at the front
+static void OutPackStart()
+{
+	if (mpeg_outi > 0 || pack_hdr_len == 0)
+		return;
+
+	unsigned char header[10];
+	memcpy(header,pack_hdr,pack_hdr_len);
+	if (pack_continuations > 0) {
+		unsigned long long t = SCRToTicks(pack_SCR) + PackTicks() * pack_continuations;
+		PatchSCR(header,pack_hdr_MPEG2,TicksToSCR(t));
+	}
+
+	mpeg_out[0] = mpeg_out[1] = 0x00;
+	mpeg_out[2] = 0x01;
+	mpeg_out[3] = 0xBA;
+	memcpy(mpeg_out+4,header,pack_hdr_len);
+	mpeg_outi = 4 + pack_hdr_len;
+	last_pes_pos = -1;
+	pack_continuations++;
+	pack_started = MPEGHostClock();
+	if (pmb_trace) trace_pack_started = PMBTraceClock();
+}
+
+// fill the rest of mpeg_out so it is exactly 2048 bytes
+static int PadMPEGOut()
+{
+	int gap = 2048 - mpeg_outi;
+
+	if (gap >= 6) {
+		// padding stream PES
+		mpeg_out[mpeg_outi++] = 0x00;
+		mpeg_out[mpeg_outi++] = 0x00;
+		mpeg_out[mpeg_outi++] = 0x01;
+		mpeg_out[mpeg_outi++] = 0xBE;
+		mpeg_out[mpeg_outi++] = (gap - 6) >> 8;
+		mpeg_out[mpeg_outi++] = (gap - 6);
+		memset(mpeg_out+mpeg_outi,0xFF,gap - 6);
+		mpeg_outi += gap - 6;
+	}
+	else if (last_pes_pos >= 0) {
+		// too small for a padding packet. put stuffing bytes in the header
+		// of the last PES instead.
+		unsigned char *p = mpeg_out + last_pes_pos;
+		int at,pkt_len;
+
+		if (last_pes_MPEG2) {
+			at = last_pes_pos + 9 + p[8];
+			p[8] += gap;
+		}
+		else {
+			at = last_pes_pos + 6;
+		}
+		memmove(mpeg_out+at+gap,mpeg_out+at,mpeg_outi-at);
+		memset(mpeg_out+at,0xFF,gap);
+		mpeg_outi += gap;
+
+		pkt_len = ((p[4] << 8) | p[5]) + gap;
+		p[4] = pkt_len >> 8;
+		p[5] = pkt_len;
+	}
+	else {
+		return -1;
+	}
+
+	stat_padded_bytes += gap;
+	stat_padded_packs++;
+	return 0;
+}
+
+//static int debug_fd = -1;
+void FlushMPEGOut()
+{
+	if (mpeg_outi <= 0)
+		return;
+
+//	if (debug_fd < 0) {
+//		debug_fd = open("/tmp/test.mpg",O_WRONLY|O_CREAT|O_TRUNC,0644);
+//		if (debug_fd < 0) {
+//			fprintf(stderr,"Cannot create test MPEG %s\n",strerror(errno));
+//		}
+//	}
+
+	if (mpeg_outi < 2048 && PadMPEGOut() < 0) {
+		PMBLog(PMB_LOG_WARNING,"Packet too short\n");
+		stat_dropped_short++;
+		mpeg_outi = 0;
+		return;
+	}
+	else if (mpeg_outi > 2048) {
+		PMBLog(PMB_LOG_WARNING,"Packet too long\n");
+		stat_dropped_long++;
+		mpeg_outi = 0;
+		return;
+	}
+
+//	if (debug_fd >= 0)
+//		write(debug_fd,mpeg_out,2048);
+
+	if (pack_started >= 0)
+		MPEGLatencyAdd(&lat_pack,MPEGHostClock() - pack_started);
+	pack_started = -1;
+
+	if (pmb_trace) {
+		long long t = PMBTraceClock();
+
+		if (trace_pack_started > 0)
+			PMBTraceSpan(PMB_TRACE_ASSEMBLE,trace_pack_started,trace_made,1);
+		if (MPEGOutput != NULL)
+			MPEGOutput(mpeg_out,2048);
+		PMBTraceSpan(PMB_TRACE_FLUSH,t,trace_made,1);
+		trace_pack_started = 0;
+	}
+	else if (MPEGOutput != NULL)
+		MPEGOutput(mpeg_out,2048);
+	trace_made++;
+	mpeg_outi = 0;
+	last_pes_pos = -1;
+}
+
+// host clock when the pack being filled was started, -1 if there isn't one
+long long MPEGPendingSince()
+{
+	return (mpeg_outi > 0) ? pack_started : -1;
+}
+
+// send the pack being filled now, padded out, instead of waiting for the
+// rest of it. for live feeds that would rather waste bandwidth than time.
+void MPEGFlushPartial()
+{
+	if (mpeg_outi <= 0)
+		return;
+
+	if (pes_out_frag_remain > 0 && last_pes_pos >= 0) {
+		// the open fragment claims more payload than has arrived. end it
+		// here, the rest goes out as a new fragment in the next pack.
+		unsigned char *p = mpeg_out + last_pes_pos;
+		int pkt_len = ((p[4] << 8) | p[5]) - pes_out_frag_remain;
+
+		p[4] = pkt_len >> 8;
+		p[5] = pkt_len;
+		pes_out_frag_remain = 0;
+	}
+
+	FlushMPEGOut();
+}
+
+// throw away the partially built pack and whatever is left of the PES
+// currently being written
+void MPEGDiscardOutput()
+{
+	mpeg_outi = 0;
+	last_pes_pos = -1;
+	pes_out_remain = 0;
+	pes_out_frag_remain = 0;
+	pack_started = -1;
+}
+
+// start writing a PES packet. hdr/hdr_len are the header bytes between
+// PES_packet_length and the payload. the payload follows through OutPESData,
+// split across as many packs as it takes: the first fragment keeps the
+// original header (and with it the timestamps), the rest get a minimal
+// header with no timestamps.
+static void OutPESFragment();
+static void OutPESBegin(int syncword,int MPEG2,unsigned char *hdr,int hdr_len,int payload_len)
+{
+	pes_out_sync = syncword;
+	pes_out_MPEG2 = MPEG2;
+	memcpy(pes_out_hdr,hdr,hdr_len);
+	pes_out_hdr_len = hdr_len;
+	pes_out_remain = payload_len;
+	pes_out_frag_remain = 0;
+	pes_out_first = 1;
+
+	if (payload_len == 0)
+		OutPESFragment();
+}
+
+// open the next fragment of the current PES in mpeg_out
+static void OutPESFragment()
+{
+	unsigned char cont[3],*h;
+	int h_len,room,n;
+
+	if (pes_out_first) {
+		h = pes_out_hdr;
+		h_len = pes_out_hdr_len;
+	}
+	else if (pes_out_MPEG2) {
+		cont[0] = pes_out_hdr[0] & ~0x04;	// data_alignment_indicator no longer holds
+		cont[1] = 0x00;				// no PTS/DTS/ESCR/etc.
+		cont[2] = 0x00;				// PES_header_data_length
+		h = cont;
+		h_len = 3;
+	}
+	else {
+		cont[0] = 0x0F;				// MPEG-1 '00001111', no timestamps
+		h = cont;
+		h_len = 1;
+	}
+
+	OutPackStart();
+	room = 2048 - mpeg_outi - 6 - h_len;
+	if (mpeg_outi > 0 && (room < 0 || (room == 0 && pes_out_remain > 0))) {
+		FlushMPEGOut();
+		OutPackStart();
+		room = 2048 - mpeg_outi - 6 - h_len;
+	}
+
+	n = pes_out_remain;
+	if (n > room) n = room;
+
+	last_pes_pos = mpeg_outi;
+	last_pes_MPEG2 = pes_out_MPEG2;
+	mpeg_out[mpeg_outi++] = pes_out_sync >> 24;
+	mpeg_out[mpeg_outi++] = pes_out_sync >> 16;
+	mpeg_out[mpeg_outi++] = pes_out_sync >>  8;
+	mpeg_out[mpeg_outi++] = pes_out_sync      ;
+	mpeg_out[mpeg_outi++] = (h_len + n) >> 8;
+	mpeg_out[mpeg_outi++] = (h_len + n);
+	memcpy(mpeg_out+mpeg_outi,h,h_len);
+	mpeg_outi += h_len;
+
+	if (pes_out_first && n < pes_out_remain) stat_resplit_pes++;
+	pes_out_resplit = !pes_out_first;
+	pes_out_first = 0;
+	pes_out_frag_remain = n;
+
+	if (mpeg_outi >= 2048)
+		FlushMPEGOut();
+}
+
+static void OutPESData(unsigned char *payload,int len)
+{
+	while (len > 0 && pes_out_remain > 0) {
+		int n;
+
+		if (pes_out_frag_remain == 0)
+			OutPESFragment();
+
+		n = len;
+		if (n > pes_out_frag_remain) n = pes_out_frag_remain;
+		memcpy(mpeg_out+mpeg_outi,payload,n);
+		mpeg_outi += n;
+		stat_bytes_copied += n;
+		if (pes_out_resplit) stat_resplit_bytes += n;
+		pes_out_frag_remain -= n;
+		pes_out_remain -= n;
+		payload += n;
+		len -= n;
+
+		if (mpeg_outi >= 2048)
+			FlushMPEGOut();
+	}
+}
+
+// leave the next n bytes of the current PES's payload out. if the open
+// fragment was counting on them, it gets shorter.
+static void OutPESDrop(int n)
+{
+	if (n > pes_out_remain) n = pes_out_remain;
+	pes_out_remain -= n;
+
+	if (pes_out_frag_remain > pes_out_remain && last_pes_pos >= 0) {
+		unsigned char *p = mpeg_out + last_pes_pos;
+		int cut = pes_out_frag_remain - pes_out_remain;
+		int pkt_len = ((p[4] << 8) | p[5]) - cut;
+
+		p[4] = pkt_len >> 8;
+		p[5] = pkt_len;
+		pes_out_frag_remain -= cut;
+	}
+}
+
+// what we know about the video elementary stream going out, so streams can
+// be spliced together where the decoder can take it: in front of a GOP,
+// with the pictures of the next stream lined up after ours.
+
+// latest video PTS sent out, after rebasing (SCR units). where the picture
+// after it is due is what the next stream spliced on has to line up with.
+static unsigned long long out_max_PTS = 0;
+static int out_have_PTS = 0;
+
+// the PTS of the last video PES header, waiting for its picture to go out
+static unsigned long long video_PTS = 0;
+static int video_PTS_pending = 0;
+
+// frame period from the last sequence header, 27MHz ticks
+static unsigned long long video_frame_ticks = 0;
+
+// MPEGSplice() has worked out the timestamp offset for the next stream,
+// the next pack header takes it instead of guessing from the SCR delta
+static int splice_pending = 0;
+static unsigned long long splice_difference = 0;
+
+// a new stream started without warning, its first video PTS decides where
+// its pictures go
+static int splice_check_PTS = 0;
+
+// the next GOP header is the first of a new stream. if it isn't closed, its
+// leading B pictures refer to a picture the decoder never got.
+static int splice_open_gop = 0;
+
+// MPEGReset(): whatever comes next is a new stream, not a jump in this one
+static int new_stream = 0;
+
+// MPEGCut(): stop in front of the next sequence or GOP header
+static int splice_cut = 0,splice_cut_done = 0;
+
+unsigned long long stat_splices = 0,stat_splice_gap = 0,stat_splice_broken = 0;
+unsigned long long stat_end_codes = 0;
+unsigned long long stat_scr_jumps = 0;
+
+// bytes of the video start code at buf that we need to look at
+#define VIDEO_HOLD		8
+
+// pass n bytes of video payload on, minding the start codes in it. avail is
+// how much can be looked at from buf, at least n + VIDEO_HOLD unless this is
+// the end of the PES. returns how many bytes were used up, which is more than
+// n if an end code we dropped reached past it, or -1 if the stream was cut
+// (see MPEGCut()).
+static int OutVideoData(unsigned char *buf,int n,int avail)
+{
+	int from = 0,i;
+
+	for (i=0;i < n && (i+3) < avail;i++) {
+		if (buf[i] != 0x00 || buf[i+1] != 0x00 || buf[i+2] != 0x01)
+			continue;
+
+		switch (buf[i+3]) {
+			case 0x00:	// picture: the PES header's PTS was for this one
+				if (video_PTS_pending) {
+					if (!out_have_PTS || video_PTS > out_max_PTS)
+						out_max_PTS = video_PTS;
+					out_have_PTS = 1;
+					video_PTS_pending = 0;
+				}
+				break;
+			case 0xB3:	// sequence header
+				if (splice_cut) goto cut;
+				if ((i+7) < avail && MPEGFrameTicks(buf[i+7] & 0x0F) != 0)
+					video_frame_ticks = MPEGFrameTicks(buf[i+7] & 0x0F);
+				break;
+			case 0xB8:	// GOP header
+				if (splice_cut) goto cut;
+				if (splice_open_gop && (i+7) < avail) {
+					if ((buf[i+7] & 0x40) == 0) {	// !closed_gop
+						buf[i+7] |= 0x20;	// broken_link
+						stat_splice_broken++;
+					}
+					splice_open_gop = 0;
+				}
+				break;
+			case 0xB7:	// sequence end. the MovieBox stalls on it
+			case 0xB9:	// program end, doesn't belong in here anyway
+				OutPESData(buf+from,i-from);
+				OutPESDrop(4);
+				stat_end_codes++;
+				from = i + 4;
+				i += 3;
+				break;
+		}
+	}
+
+	if (from < n)
+		OutPESData(buf+from,n-from);
+	return (from > n) ? from : n;
+
+cut:
+	// the rest of this stream doesn't go out at all
+	OutPESData(buf+from,i-from);
+	OutPESDrop(pes_out_remain);
+	splice_cut = 0;
+	splice_cut_done = 1;
+	return -1;
+}
+
+// PTS and DTS are 33 bits in 5 bytes behind a 4 bit prefix, the same in
+// MPEG-1 and MPEG-2. like the SCR they are kept shifted up by 9.
+static int ReadPTS(unsigned char *p,unsigned long long *v)
+{
+	if (	(p[0] & 0x01) == 0 ||
+		(p[2] & 0x01) == 0 ||
+		(p[4] & 0x01) == 0)
+		return 0;
+
+	*v =	(((unsigned long long)((p[0] >> 1) & 0x07)) << (30+9)) |
+		(((unsigned long long)( p[1]             )) << (22+9)) |
+		(((unsigned long long)((p[2] >> 1) & 0x7F)) << (15+9)) |
+		(((unsigned long long)( p[3]             )) <<  (7+9)) |
+		(((unsigned long long)((p[4] >> 1) & 0x7F)) <<  (0+9));
+	return 1;
+}
+
+static void PatchPTS(unsigned char *p,unsigned long long v)
+{
+	p[0] = (p[0] & ~(0x07 << 1)) | (((v >> (30+9)) & 0x07) << 1);
+	p[1] =                            v >> (22+9);
+	p[2] = (p[2] & ~(0x7F << 1)) | (((v >> (15+9)) & 0x7F) << 1);
+	p[3] =                            v >>  (7+9);
+	p[4] = (p[4] & ~(0x7F << 1)) | (((v >>     9 ) & 0x7F) << 1);
+}
+
+// look through a chunk of program stream (the head or tail of a file) for
+// its clock: first and last SCR, earliest and latest video PTS, frame rate.
+// start codes are searched for blindly, so a chunk that starts in the middle
+// of a pack is fine.
+void MPEGScanTimes(unsigned char *buf,int len,struct mpeg_times *t)
+{
+	unsigned long long v;
+	unsigned long mux_rate;
+	int i;
+
+	for (i=0;(i+14) <= len;i++) {
+		if (buf[i] != 0x00 || buf[i+1] != 0x00 || buf[i+2] != 0x01)
+			continue;
+
+		if (buf[i+3] == 0xBA) {
+			if (!MPEGPackClock(buf+i,&v,&mux_rate))
+				continue;
+			if (!t->have_SCR) t->first_SCR = v;
+			t->last_SCR = v;
+			t->have_SCR = 1;
+		}
+		else if (buf[i+3] == 0xB3) {
+			v = MPEGFrameTicks(buf[i+7] & 0x0F);
+			if (v != 0) t->frame_ticks = v;
+		}
+		else if (buf[i+3] == 0xE0) {
+			unsigned char *h = buf + i + 6;
+			unsigned char *end = buf + len;
+
+			if ((h[0] >> 6) == 2) {		// MPEG-2, PTS if PTS_DTS_flags is '1x'
+				if ((h[1] & 0x80) == 0 || (h+8) > end || (h[3] >> 4) != (h[1] >> 6))
+					continue;
+				h += 3;
+			}
+			else {
+				while (h < end && *h == 0xFF) h++;
+				if (h < end && (*h >> 6) == 1) h += 2;
+				if ((h+5) > end || ((*h >> 4) != 2 && (*h >> 4) != 3))
+					continue;
+			}
+			if (!ReadPTS(h,&v))
+				continue;
+
+			v = SCRToTicks(v);
+			if (!t->have_PTS || v < t->first_PTS) t->first_PTS = v;
+			if (!t->have_PTS || v > t->last_PTS) t->last_PTS = v;
+			t->have_PTS = 1;
+		}
+	}
+}
+
+// where the timestamps and payload of a PES in one of our packs are.
+// h points at the byte after PES_packet_length. returns the payload offset
+// from h, or -1 if the header doesn't fit in len.
+static int PESHeaderTimes(unsigned char *h,int len,unsigned char **PTS,unsigned char **DTS)
+{
+	int i = 0;
+
+	*PTS = *DTS = NULL;
+	if (len >= 3 && (h[0] >> 6) == 2) {		// MPEG-2
+		if ((3 + h[2]) > len)
+			return -1;
+		if ((h[1] & 0x80) && h[2] >= 5) *PTS = h + 3;
+		if ((h[1] & 0xC0) == 0xC0 && h[2] >= 10) *DTS = h + 8;
+		return 3 + h[2];
+	}
+
+	while (i < len && h[i] == 0xFF) i++;
+	if (i < len && (h[i] >> 6) == 1) i += 2;
+	if (i >= len)
+		return -1;
+	if ((h[i] >> 4) == 2) {
+		if ((i+5) > len) return -1;
+		*PTS = h + i;
+		i += 5;
+	}
+	else if ((h[i] >> 4) == 3) {
+		if ((i+10) > len) return -1;
+		*PTS = h + i;
+		*DTS = h + i + 5;
+		i += 10;
+	}
+	else {
+		i++;
+	}
+
+	return i;
+}
+
+// move a finished pack in time: its SCR and the PTS/DTS of every PES in it
+// go up by the given 27MHz ticks (rounded down to the 90KHz clock, so that
+// they stay in step). for the scheduler, which slides everything it holds
+// back out past a pause.
+void MPEGRetime(unsigned char *pack,int len,unsigned long long ticks)
+{
+	unsigned long long SCR,v;
+	unsigned long mux_rate;
+	unsigned char *PTS,*DTS;
+	int i,l,MPEG2;
+
+	ticks -= ticks % 300ULL;
+	if (ticks == 0 || !MPEGPackClock(pack,&SCR,&mux_rate))
+		return;
+
+	MPEG2 = (pack[4] >> 6) == 1;
+	PatchSCR(pack+4,MPEG2,TicksToSCR((SCR + ticks) % MPEG_CLOCK_WRAP));
+
+	i = MPEG2 ? (14 + (pack[13] & 7)) : 12;
+	while ((i+6) <= len && pack[i] == 0x00 && pack[i+1] == 0x00 && pack[i+2] == 0x01) {
+		l = (pack[i+4] << 8) | pack[i+5];
+		if ((i+6+l) > len)
+			break;
+
+		if (pack[i+3] == 0xBD || (pack[i+3] >= 0xC0 && pack[i+3] <= 0xEF)) {
+			if (PESHeaderTimes(pack+i+6,l,&PTS,&DTS) >= 0) {
+				if (PTS != NULL && ReadPTS(PTS,&v))
+					PatchPTS(PTS,TicksToSCR((SCRToTicks(v) + ticks) % MPEG_CLOCK_WRAP));
+				if (DTS != NULL && ReadPTS(DTS,&v))
+					PatchPTS(DTS,TicksToSCR((SCRToTicks(v) + ticks) % MPEG_CLOCK_WRAP));
+			}
+		}
+
+		i += 6 + l;
+	}
+}
+
+// find what a pack of ours has in it: the timestamps of its PES headers and
+// the picture, sequence and GOP start codes in its video payload. mark is
+// called with the offset of each in the pack (for a start code, of its last
+// byte). sync carries the last bytes over from the previous pack, for a start
+// code split between the two.
+void MPEGPackMarks(unsigned char *pack,int len,unsigned long *sync,void (*mark)(int at,int kind,void *arg),void *arg)
+{
+	unsigned char *PTS,*DTS;
+	int i,j,l,h;
+
+	if (pack[0] != 0x00 || pack[1] != 0x00 || pack[2] != 0x01 || pack[3] != 0xBA)
+		return;
+
+	i = ((pack[4] >> 6) == 1) ? (14 + (pack[13] & 7)) : 12;
+	while ((i+6) <= len && pack[i] == 0x00 && pack[i+1] == 0x00 && pack[i+2] == 0x01) {
+		l = (pack[i+4] << 8) | pack[i+5];
+		if ((i+6+l) > len)
+			break;
+
+		if (pack[i+3] == 0xBD || (pack[i+3] >= 0xC0 && pack[i+3] <= 0xEF)) {
+			if ((h = PESHeaderTimes(pack+i+6,l,&PTS,&DTS)) < 0) {
+				i += 6 + l;
+				continue;
+			}
+			if (PTS != NULL) mark(PTS - pack,(pack[i+3] == 0xE0) ? MPEG_MARK_VIDEO_PTS : MPEG_MARK_TIMESTAMP,arg);
+			if (DTS != NULL) mark(DTS - pack,MPEG_MARK_TIMESTAMP,arg);
+
+			if (pack[i+3] == 0xE0) {
+				for (j=i+6+h;j < (i+6+l);j++) {
+					*sync = (*sync << 8) | pack[j];
+					if ((*sync & 0xFFFFFF00UL) != 0x00000100UL)
+						continue;
+					if ((*sync & 0xFF) == 0x00)
+						mark(j,MPEG_MARK_PICTURE,arg);
+					else if ((*sync & 0xFF) == 0xB3 || (*sync & 0xFF) == 0xB8)
+						mark(j,MPEG_MARK_GOP,arg);
+				}
+			}
+		}
+
+		i += 6 + l;
+	}
+}
+
+static void CountPictures(int at,int kind,void *arg)
+{
+	if (kind == MPEG_MARK_PICTURE)
+		(*((int*)arg))++;
+}
+
+// how many pictures start in a finished pack (sync as above)
+int MPEGPackPictures(unsigned char *pack,int len,unsigned long *sync)
+{
+	int n = 0;
+
+	MPEGPackMarks(pack,len,sync,CountPictures,&n);
+	return n;
+}
+
+// timestamps in our packs, for code that patches them in place (pmbcache.c).
+// p points at the pack start code, or a PTS/DTS field.
+void MPEGPatchClock(unsigned char *p,unsigned long long ticks)
+{
+	PatchSCR(p+4,(p[4] >> 6) == 1,TicksToSCR(ticks % MPEG_CLOCK_WRAP));
+}
+
+int MPEGTimestamp(unsigned char *p,unsigned long long *ticks)
+{
+	unsigned long long v;
+
+	if (!ReadPTS(p,&v))
+		return 0;
+
+	*ticks = SCRToTicks(v);
+	return 1;
+}
+
+void MPEGPatchTimestamp(unsigned char *p,unsigned long long ticks)
+{
+	PatchPTS(p,TicksToSCR(ticks % MPEG_CLOCK_WRAP));
+}
+
+// payload bytes of the current input PES that still have to be passed through
+static int pes_in_remain = 0;
+
+// first video PTS of a stream that came in without MPEGSplice(). the SCR
+// has carried on from ours, now move the timestamps up if its pictures would
+// otherwise come before ours are done.
+static void SpliceCheckPTS(unsigned long long PTS)
+{
+	unsigned long long want,got;
+
+	if (!splice_check_PTS)
+		return;
+	splice_check_PTS = 0;
+	if (!out_have_PTS)
+		return;
+
+	want = (out_max_PTS >> 9) + (video_frame_ticks / 300ULL);	// 90KHz
+	got = (PTS + last_SCR_difference) >> 9;
+	if (got < want) {
+		last_SCR_difference += (want - got) << 9;
+		monotonic_SCR += (want - got) << 9;
+	}
+	else {
+		stat_splice_gap += (got - want) * 300ULL;
+	}
+}
+
+// a PES header, buf pointing directly after the syncword (at the packet
+// length). only the header has to be there. returns -1 if more of it is
+// needed, 0 if the packet is junk (pes->err says why), and 1 with the
+// payload and timestamps found. nothing is kept between calls.
+int MPEGParsePES(unsigned char *buf,int len,struct mpeg_pes *pes)
+{
+	if (len < 3)
+		return -1;
+
+	int pkt_len = (((int)buf[0]) << 8) | ((int)buf[1]);
+	unsigned char *fence = buf + 2 + pkt_len;
+	unsigned char *hdr = buf + 2;
+	unsigned char *payload = NULL;
+
+	memset(pes,0,sizeof(*pes));
+	pes->length = pkt_len;
+	pes->MPEG2 = 1;
+
+	// pick through the various packet header flags
+	if ((*hdr >> 6) == 2) {	// MPEG-2 '10'
+		unsigned char b;
+
+		if (len < 5 || len < (5 + buf[4]))
+			return -1;
+		if (pkt_len < (3 + buf[4])) {
+			snprintf(pes->err,sizeof(pes->err),"PES header longer than the packet");
+			return 0;
+		}
+		if (buf[4] < (((buf[3] >> 6) == 3 ? 10 : (buf[3] >> 6) == 2 ? 5 : 0) + ((buf[3] >> 5) & 1) * 6)) {
+			snprintf(pes->err,sizeof(pes->err),"PES header too short for its flags");
+			return 0;
+		}
+
+		b = *hdr++;
+		// '10'						bits[7...6]
+		// PES_scrambling_control			bits[5...4]
+		// PES_priority					bits[3]
+		// data_alignment_indicator			bits[2]
+		// copyright					bits[1]
+		// original_or_copy				bits[0]
+		b = *hdr++;
+		unsigned char PTS_DTS_flags =			b >> 6;
+		unsigned char ESCR_flag =			(b >> 5) & 1;
+		// ES_rate_flag					bits[4]
+		// DSM_trick_mode_flag				bits[3]
+		// additional_copy_info_flag			bits[2]
+		// PES_CRC_flag					bits[1]
+		// PES_extension_flag				bits[0]
+		unsigned char PES_header_data_length = *hdr++;
+
+		// yay, we know where the payload is now
+		payload = hdr + PES_header_data_length;
+
+		// PTS, if present
+		if (PTS_DTS_flags == 2 || PTS_DTS_flags == 3) {	// '10' or '11'
+			if ((*hdr >> 4) != PTS_DTS_flags) {	// should be followed by '0010' if '10' or '0011' if '11'
+				snprintf(pes->err,sizeof(pes->err),"PTS_DTS_flags = %u, next is %u not %u",
+					PTS_DTS_flags,*hdr >> 4,PTS_DTS_flags);
+				return 0;
+			}
+
+			if (!ReadPTS(hdr,&pes->PTS)) {
+				snprintf(pes->err,sizeof(pes->err),"Marker bits in PTS timestamp don't line up");
+				return 0;
+			}
+
+			pes->PTS_at = hdr - buf;
+			hdr += 5;
+		}
+		// DTS if present
+		if (PTS_DTS_flags == 3) {
+			if ((*hdr >> 4) != 1) {
+				snprintf(pes->err,sizeof(pes->err),"PTS_DTS_flags = %u, next is %u not 1",
+					PTS_DTS_flags,*hdr >> 4);
+				return 0;
+			}
+
+			if (!ReadPTS(hdr,&pes->DTS)) {
+				snprintf(pes->err,sizeof(pes->err),"Marker bits in DTS timestamp don't line up");
+				return 0;
+			}
+
+			pes->DTS_at = hdr - buf;
+			hdr += 5;
+		}
+		// ESCR
+		if (ESCR_flag) {
+			if (	(hdr[0] & 0x04) == 0 ||
+				(hdr[2] & 0x04) == 0 ||
+				(hdr[4] & 0x04) == 0 ||
+				(hdr[5] & 0x01) == 0) {
+				snprintf(pes->err,sizeof(pes->err),"Marker bits in ESCR don't line up");
+				return 0;
+			}
+
+			pes->ESCR_at = hdr - buf;
+			pes->ESCR =
+				(((unsigned long long)((hdr[0] >> 3) & 0x03)) << (30+9)) |
+				(((unsigned long long)( hdr[0]       & 0x03)) << (28+9)) |
+				(((unsigned long long)( hdr[1]             )) << (20+9)) |
+				(((unsigned long long)((hdr[2] >> 3) & 0x1F)) << (15+9)) |
+				(((unsigned long long)( hdr[2]       & 0x03)) << (13+9)) |
+				(((unsigned long long)( hdr[3]             )) <<  (5+9)) |
+				(((unsigned long long)((hdr[4] >> 3) & 0x1F)) <<    (9)) |
+				(((unsigned long long)( hdr[4]       & 0x03)) <<    (7)) |
+				(((unsigned long long)((hdr[5] >> 1) & 0x7F))          );
+		}
+	}
+	else {			// MPEG-1
+		unsigned char *end = buf + len;
+		int stuffing = 0,n;
+
+		pes->MPEG2 = 0;
+
+		// stuffing_byte (up to 16)
+		while (hdr < end && hdr < fence && *hdr == 0xFF && stuffing < 16) {
+			hdr++;
+			stuffing++;
+		}
+		if (hdr >= fence) {
+			snprintf(pes->err,sizeof(pes->err),"MPEG-1 PES is all stuffing");
+			return 0;
+		}
+		if (hdr >= end) return -1;
+
+		// '01' STD_buffer_scale STD_buffer_size. we don't care what the
+		// decoder buffer is supposed to be, just skip over it
+		if ((*hdr >> 6) == 1) {
+			if ((hdr+2) >= fence) {
+				snprintf(pes->err,sizeof(pes->err),"MPEG-1 PES ends in its STD buffer size");
+				return 0;
+			}
+			if ((hdr+2) >= end) return -1;
+			hdr += 2;
+		}
+
+		if ((*hdr >> 4) == 2 || (*hdr >> 4) == 3) {	// '0010' PTS or '0011' PTS+DTS
+			n = ((*hdr >> 4) == 3) ? 10 : 5;
+			if ((hdr+n) > fence) {
+				snprintf(pes->err,sizeof(pes->err),"MPEG-1 PES ends in its timestamps");
+				return 0;
+			}
+			if ((hdr+n) > end) return -1;
+
+			if (!ReadPTS(hdr,&pes->PTS)) {
+				snprintf(pes->err,sizeof(pes->err),"Marker bits in MPEG-1 PTS timestamp don't line up");
+				return 0;
+			}
+			pes->PTS_at = hdr - buf;
+			if (n == 10) {
+				if ((hdr[5] >> 4) != 1) {
+					snprintf(pes->err,sizeof(pes->err),"MPEG-1 PTS is followed by %u not 1",hdr[5] >> 4);
+					return 0;
+				}
+				if (!ReadPTS(hdr+5,&pes->DTS)) {
+					snprintf(pes->err,sizeof(pes->err),"Marker bits in MPEG-1 DTS timestamp don't line up");
+					return 0;
+				}
+				pes->DTS_at = (hdr+5) - buf;
+			}
+
+			hdr += n;
+		}
+		else if (*hdr == 0x0F) {			// '00001111' no timestamps
+			hdr++;
+		}
+		else {
+			snprintf(pes->err,sizeof(pes->err),"MPEG-1 PES header is malformed (0x%02X)",*hdr);
+			return 0;
+		}
+
+		payload = hdr;
+	}
+
+	pes->payload = payload - buf;
+	return 1;
+}
+
+static void PatchESCR(unsigned char *p,unsigned long long ESCR)
+{
+	p[0] = (p[0] & ~(0x03 << 3)) | (((ESCR >> (30+9)) & 0x03) << 3);
+	p[0] = (p[0] & ~(0x03     )) | (((ESCR >> (28+9)) & 0x03)     );
+	p[1] =                            ESCR >> (20+9);
+	p[2] = (p[2] & ~(0x1F << 3)) | (((ESCR >> (15+9)) & 0x1F) << 3);
+	p[2] = (p[2] & ~(0x03     )) | (((ESCR >> (13+9)) & 0x03)     );
+	p[3] =                            ESCR >>  (5+9);
+	p[4] = (p[4] & ~(0x1F << 3)) | (((ESCR >>    (9)) & 0x1F) << 3);
+	p[4] = (p[4] & ~(0x03     )) | (((ESCR >>    (7)) & 0x03)     );
+	p[5] = (p[5] & ~(0x7F << 1)) | (((ESCR          ) & 0x7F) << 1);
+}
+
+// here, buf points directly after the syncword. only the PES header has to be
+// here; the payload is streamed through afterwards by MPEGInputCommit.
+// returns -1 if more of the header is needed, 0 if the packet is junk, and 1
+// once the header is rewritten and handed to the repacketizer, with *skipped
+// set to the header size and pes_in_remain to the payload size.
+int CheckModPacket(unsigned char *buf,int len,int syncword,int *skipped)
+{
+	struct mpeg_pes pes;
+	long long t = pmb_trace ? PMBTraceClock() : 0;
+	int r;
+
+	if ((r = MPEGParsePES(buf,len,&pes)) <= 0) {
+		if (r == 0 && pes.err[0] != 0) {
+			PMBLog(PMB_LOG_WARNING,"CheckModPacket: %s, rejecting\n",pes.err);
+			stat_dropped_pes++;
+		}
+		return r;
+	}
+
+	// move the timestamps along with the SCR
+	if (pes.PTS_at) {
+		if (syncword == 0x000001E0) {
+			SpliceCheckPTS(pes.PTS);
+			video_PTS = pes.PTS + last_SCR_difference;
+			video_PTS_pending = 1;
+		}
+		PatchPTS(buf+pes.PTS_at,pes.PTS + last_SCR_difference);
+	}
+	if (pes.DTS_at)
+		PatchPTS(buf+pes.DTS_at,pes.DTS + last_SCR_difference);
+	if (pes.ESCR_at)
+		PatchESCR(buf+pes.ESCR_at,pes.ESCR + last_SCR_difference);
+
+	// stuff it in. if it doesn't fit in what's left of the pack, the
+	// repacketizer splits it rather than dropping it.
+	OutPESBegin(syncword,pes.MPEG2,buf+2,pes.payload-2,2+pes.length-pes.payload);
+	pes_in_remain = 2 + pes.length - pes.payload;
+	if (skipped != NULL) *skipped = pes.payload;
+
+	if (pmb_trace)
+		PMBTraceSpan(PMB_TRACE_REWRITE,t,trace_made,pes.payload);
+
+	return 1;
+}
+
+// the stream coming in ends here. whatever is left of it (a PES cut short,
+// a half read header) is dropped and the last pack goes out.
+void MPEGEndStream()
+{
+	MPEGFlushPartial();
+	pes_out_remain = 0;
+	pes_in_remain = 0;
+	mpeg_in_remain = 0;
+	mpeg_state = 0;
+	mpeg_sync = 0;
+	video_PTS_pending = 0;
+	splice_cut = splice_cut_done = 0;
+	splice_check_PTS = 0;
+	splice_open_gop = 1;
+}
+
+// how far the next stream's timestamps have to move so that its first
+// picture comes right after our last one and its SCR carries on from ours.
+// 27MHz ticks, in whole 90KHz ticks so the SCR extension and PTS stay exact.
+static long long SpliceOffset(struct mpeg_times *next)
+{
+	unsigned long long frame_ticks = video_frame_ticks;
+	long long scr_end,off,off_pts;
+
+	// the old stream's clock where its last pack finished arriving
+	scr_end = (long long)SCRToTicks(monotonic_SCR);
+	if (pack_hdr_len > 0)
+		scr_end += (long long)(PackTicks() * pack_continuations);
+	off = scr_end - (long long)next->first_SCR;
+
+	if (next->have_PTS && out_have_PTS) {
+		if (frame_ticks == 0) frame_ticks = next->frame_ticks;
+		off_pts = (long long)(SCRToTicks(out_max_PTS) + frame_ticks) - (long long)next->first_PTS;
+
+		// the SCR can't go backwards. if the new stream wants more time
+		// between its first pack and first picture than we have left
+		// buffered, the pictures wait.
+		if (off_pts >= off)
+			off = off_pts;
+		else
+			stat_splice_gap += off - off_pts;
+	}
+
+	if (off >= 0)
+		off = (off + 299) / 300;
+	else
+		off = -((-off) / 300);
+	return off * 300LL;
+}
+
+// the stream coming in ends here and the next one starts with the next byte.
+// the next is rebased to line up with ours (see SpliceOffset()). next
+// describes the start of the new stream (see MPEGScanTimes).
+void MPEGSplice(struct mpeg_times *next)
+{
+	MPEGEndStream();
+	if (!next->have_SCR)
+		return;		// nothing to go by, the pack header handler guesses
+
+	splice_difference = ((unsigned long long)(SpliceOffset(next) / 300LL)) << 9;
+	splice_pending = 1;
+	stat_splices++;
+}
+
+// a stream that goes to the output without passing through here (a
+// pmbcache entry, already packed). ours ends, and the other one has to move
+// its timestamps by the ticks returned.
+long long MPEGSpliceExternal(struct mpeg_times *next)
+{
+	MPEGEndStream();
+	stat_splices++;
+	return SpliceOffset(next);
+}
+
+// and whatever comes after it carries on from where it left off: its last
+// pack finished arriving at end_SCR, its latest picture was max_PTS (27MHz
+// ticks, as sent, -trim not included)
+void MPEGExternalEnd(unsigned long long end_SCR,int have_PTS,unsigned long long max_PTS,unsigned long long frame_ticks)
+{
+	monotonic_SCR = TicksToSCR(end_SCR % MPEG_CLOCK_WRAP);
+	pack_hdr_len = 0;
+	pack_continuations = 0;
+	if (have_PTS) {
+		out_max_PTS = TicksToSCR(max_PTS % MPEG_CLOCK_WRAP);
+		out_have_PTS = 1;
+	}
+	if (frame_ticks != 0)
+		video_frame_ticks = frame_ticks;
+	new_stream = 1;
+}
+
+// end the stream coming in at the next point the decoder can take it: in
+// front of the next sequence or GOP header. until then it goes on as usual;
+// after, everything is thrown away until MPEGSplice().
+void MPEGCut()
+{
+	if (!splice_cut_done)
+		splice_cut = 1;
+}
+
+int MPEGCutDone()
+{
+	return splice_cut_done;
+}
+
+// magic reset string that can be sent in
+static char *reset_string = "[RESET MPEG NOW]";
+int reset_string_i=0;
+int reset_ding=0;
+
+// where the next input bytes should go if the caller wants to read() directly
+// into the parser's buffer instead of handing us a copy (see -z).
+int MPEGInputSpace(unsigned char **p)
+{
+	*p = mpeg_in + mpeg_in_remain;
+	return sizeof(mpeg_in) - mpeg_in_remain;
+}
+
+static int first_BB=0;
+void MPEGInputCommit(int clen)
+{
+	unsigned char *buf = mpeg_in;
+	int len = mpeg_in_remain + clen;
+	long long t = pmb_trace ? PMBTraceClock() : 0;
+	unsigned int made = trace_made;
+	int skip;
+
+	while (len > 0) {
+		// the stream was cut, nothing more of it goes anywhere
+		if (splice_cut_done) {
+			len = 0;
+			break;
+		}
+
+		// scan for magic reset sequence. a byte that doesn't fit starts
+		// over, or any old stream slowly spells it out.
+		if (*buf == reset_string[reset_string_i]) {
+			reset_string_i++;
+			if (reset_string[reset_string_i] == 0) {
+				PMBLog(PMB_LOG_NOTICE,"Received reset string\n");
+				reset_string_i=0;
+				reset_ding++;
+			}
+		}
+		else {
+			reset_string_i = (*buf == reset_string[0]) ? 1 : 0;
+		}
+
+		if (mpeg_state == 0) {		// looking for sync pattern
+			mpeg_sync = (mpeg_sync << 8) | *buf++; len--;
+			if (	mpeg_sync == 0x000001BA ||	// pack header? (2.5.3.3)
+				mpeg_sync == 0x000001BB ||	// system header? (2.5.3.5)
+				mpeg_sync == 0x000001C0 ||	// audio stream?
+				mpeg_sync == 0x000001E0)	// video stream?
+				mpeg_state = mpeg_sync;		// LOL how clever of me :)
+			else if (mpeg_sync == 0x000001BD) {
+				// no we do not use Dobly Digital AC-3 or other formats
+				if (!warn_nonmpa) {
+					PMBLog(PMB_LOG_WARNING,"WARNING: MPEG stream has private stream BD. This daemon does not support AC-3 audio.\n");
+					warn_nonmpa = 1;
+				}
+			}
+		}
+		else if (mpeg_state == 0x000001BB) {
+			int hl;
+
+			if (len < 2) break;
+			hl = (((int)buf[0]) << 8) | ((int)buf[1]);
+			if (hl > 1024) {		// no real system header is that big
+				mpeg_state = 0;
+				continue;
+			}
+			if (len < (2+hl)) break;
+
+			// pass the first one along in the pack it came in, throw
+			// the rest away
+			if (!first_BB && (mpeg_outi+6+hl) <= 2048) {
+				OutPackStart();
+				mpeg_out[mpeg_outi++] = 0x00;
+				mpeg_out[mpeg_outi++] = 0x00;
+				mpeg_out[mpeg_outi++] = 0x01;
+				mpeg_out[mpeg_outi++] = 0xBB;
+				memcpy(mpeg_out+mpeg_outi,buf,2+hl);
+				mpeg_outi += 2+hl;
+				first_BB=1;
+			}
+
+			buf += 2+hl;
+			len -= 2+hl;
+			mpeg_state = 0;
+		}
+		else if ((mpeg_state == 0x000001E0 || mpeg_state == 0x000001C0) && pes_in_remain == 0) {
+			// PES packets can be any size up to 64KB. all we need up
+			// front is the header, the payload is passed through as it
+			// arrives and the repacketizer makes 2048 byte packs of it.
+			int r = CheckModPacket(buf,len,mpeg_state,&skip);
+			if (r < 0) break;		// header not all here yet
+			if (r > 0) {
+				buf += skip;
+				len -= skip;
+			}
+			if (pes_in_remain == 0)
+				mpeg_state = 0;
+		}
+		else if (mpeg_state == 0x000001E0 || mpeg_state == 0x000001C0) {
+			int n = len;
+			int scan;
+
+			if (n > pes_in_remain) n = pes_in_remain;
+			scan = n;
+
+			// the Pinnacle MovieBox is so god damn finicky we must strip things out
+			// or it will stall and freeze between MPEGs if we're not careful.
+			if (mpeg_state == 0x000001E0) {
+				// hold back the last few bytes until we know what follows
+				// them, so a start code split across reads still gets seen
+				if (n < pes_in_remain) {
+					scan = n - VIDEO_HOLD;
+					if (scan <= 0) break;
+				}
+				if ((scan = OutVideoData(buf,scan,n)) < 0)
+					break;		// cut, see below
+			}
+			else {
+				OutPESData(buf,scan);
+			}
+			buf += scan;
+			len -= scan;
+			pes_in_remain -= scan;
+			if (pes_in_remain == 0)
+				mpeg_state = 0;
+		}
+		else if (mpeg_state == 0x000001BA) {
+			struct mpeg_pack pk;
+			unsigned long long SCR;
+			unsigned char header[10];
+			int r;
+
+			// processing of pack header.
+			if ((r = MPEGParsePack(buf,len,&pk)) < 0) break;
+			if (r == 0) {
+				stat_dropped_junk++;
+				mpeg_state = 0;		// junk, chuck it and move on
+				continue;
+			}
+			memcpy(header,buf,10);
+			SCR = pk.SCR;
+
+			if (splice_pending) {
+				// first pack of a spliced on stream, MPEGSplice() knows
+				// exactly where it goes
+				last_SCR_difference = splice_difference;
+				monotonic_SCR = SCR + splice_difference;
+				splice_pending = 0;
+				new_stream = 0;
+			}
+			else {
+				if (new_stream || SCR < last_SCR || SCR > (last_SCR+270000000LL)) {
+					// another stream starts here. its SCR carries on
+					// from where our last pack finished arriving.
+					unsigned long long t = SCRToTicks(monotonic_SCR);
+					if (pack_hdr_len > 0)
+						t += PackTicks() * pack_continuations;
+					monotonic_SCR = TicksToSCR(t);
+					stat_scr_jumps++;
+
+					// more than jitter: line its pictures up with ours
+					// once the first PTS shows, and mind its first GOP
+					if (new_stream || (SCR + (90000ULL << 9)) < last_SCR || SCR > (last_SCR+270000000LL)) {
+						new_stream = 0;
+						splice_check_PTS = 1;
+						splice_open_gop = 1;
+						video_PTS_pending = 0;
+						stat_splices++;
+					}
+				}
+				else {
+					last_SCR_delta = (SCR - last_SCR);
+					monotonic_SCR += last_SCR_delta;
+				}
+				last_SCR_difference = monotonic_SCR - SCR;	// this is needed also for proper
+										// PTS/DTS timestamp adjustment
+			}
+			last_SCR = SCR;
+			SCR = monotonic_SCR + scr_trim;
+
+			// patch in the new SCR value
+			PatchSCR(header,pk.MPEG2,SCR);
+
+			// we don't carry pack stuffing bytes over, so don't claim any
+			if (pk.MPEG2)
+				header[9] &= ~7;
+
+			// the modified header becomes the template for output packs.
+			// input packs don't have to be 2048 bytes; if the output pack
+			// isn't full yet we simply keep filling it, and the next one
+			// gets stamped with this header's SCR.
+			memcpy(pack_hdr,header,pk.hlen);
+			pack_hdr_len = pk.hlen;
+			pack_hdr_MPEG2 = pk.MPEG2;
+			pack_SCR = SCR;
+			pack_mux_rate = pk.mux_rate;
+			pack_continuations = 0;
+			OutPackStart();
+
+			buf += r;
+			len -= r;
+			mpeg_state = 0;
+		}
+		else {
+			PMBLog(PMB_LOG_ERR,"MPEG processing error: Unknown state 0x%08X\n",mpeg_state);
+			mpeg_state = 0;
+		}
+	}
+
+	mpeg_in_remain = len;
+	if (len > 0 && buf != mpeg_in) {
+		memmove(mpeg_in,buf,len);
+		stat_bytes_copied += len;
+	}
+
+	if (pmb_trace)
+		PMBTraceSpan(PMB_TRACE_PARSE,t,made,clen);
+}
+
+void MPEGInput(unsigned char *cbuf,int clen)
+{
+	while (clen > 0) {
+		unsigned char *p;
+		int n = MPEGInputSpace(&p);
+
+		if (n <= 0) {
+			PMBLog(PMB_LOG_ERR,"MPEG processing error: Buffer input overflow. Data dropped\n");
+			stat_dropped_overflow += mpeg_in_remain;
+			mpeg_in_remain = 0;
+			continue;
+		}
+
+		if (n > clen) n = clen;
+		memcpy(p,cbuf,n);
+		stat_bytes_copied += n;
+		MPEGInputCommit(n);
+		cbuf += n;
+		clen -= n;
+	}
+}
+
+// forget everything about the stream coming in, for the flush command: the
+// parser starts looking for a pack header, nothing is held for output, and
+// the next pack header starts a new stream. the SCR going out carries on
+// from where it was, so the device never sees it go backwards whether or
+// not its own clock was restarted.
+void MPEGReset()
+{
+	MPEGDiscardOutput();
+	mpeg_state = 0;
+	mpeg_sync = 0;
+	mpeg_in_remain = 0;
+	pes_in_remain = 0;
+	reset_string_i = 0;
+	first_BB = 0;
+
+	out_have_PTS = 0;
+	video_PTS_pending = 0;
+	video_frame_ticks = 0;
+	splice_pending = splice_check_PTS = 0;
+	splice_cut = splice_cut_done = 0;
+	splice_open_gop = 1;
+	new_stream = 1;
+}
@@ -0,0 +1,100 @@
+// MPEG program stream massaging (pmbmpeg.c)
+
+// every finished 2048 byte pack is handed to this
+extern void (*MPEGOutput)(unsigned char *pack,int len);
+
+void MPEGInput(unsigned char *buf,int len);
+int MPEGInputSpace(unsigned char **p);
+void MPEGInputCommit(int len);
+void FlushMPEGOut();
+void MPEGDiscardOutput();
+void MPEGReset();
+void MPEGFlushPartial();
+long long MPEGPendingSince();
+
+// for modules that make up program stream themselves, or look at ours
+#define MPEG_CLOCK_WRAP		((1ULL << 33) * 300ULL)	// 33-bit 90KHz clock, in 27MHz ticks
+int MPEGPackHeader(unsigned char *p,unsigned long long ticks,unsigned long mux_rate);
+int MPEGPackClock(unsigned char *p,unsigned long long *ticks,unsigned long *mux_rate);
+unsigned long long MPEGFrameTicks(int frame_rate_code);
+
+// the parser's own pack and PES header checks, for anything that wants to
+// look through program stream on its own. p points right after the start
+// code; see pmbmpeg.c for what they return.
+struct mpeg_pack {
+	int MPEG2;
+	int hlen,stuffing;			// header without start code, and the stuffing after it
+	unsigned long long SCR;			// 90KHz base shifted up by 9, extension in the low bits
+	unsigned long long ticks;		// the same in 27MHz ticks
+	unsigned long mux_rate;			// 50 bytes/sec
+};
+struct mpeg_pes {
+	int MPEG2;
+	int length;				// PES_packet_length
+	int payload;				// offsets from p, 0 if not there
+	int PTS_at,DTS_at,ESCR_at;
+	unsigned long long PTS,DTS,ESCR;	// shifted up by 9, like the SCR
+	char err[80];				// why it's junk
+};
+int MPEGParsePack(unsigned char *p,int len,struct mpeg_pack *pk);
+int MPEGParsePES(unsigned char *p,int len,struct mpeg_pes *pes);
+
+// gapless splicing of one program stream onto the next. the times are
+// 27MHz ticks, PTS are of the video stream.
+struct mpeg_times {
+	int have_SCR,have_PTS;
+	unsigned long long first_SCR,last_SCR;
+	unsigned long long first_PTS,last_PTS;	// earliest and latest
+	unsigned long long frame_ticks;		// 0 if no sequence header was seen
+};
+void MPEGScanTimes(unsigned char *buf,int len,struct mpeg_times *t);
+void MPEGSplice(struct mpeg_times *next);
+long long MPEGSpliceExternal(struct mpeg_times *next);
+void MPEGExternalEnd(unsigned long long end_SCR,int have_PTS,unsigned long long max_PTS,unsigned long long frame_ticks);
+void MPEGEndStream();
+void MPEGCut();
+int MPEGCutDone();
+
+// finished packs: shift all their timestamps, find the timestamps and
+// start codes in them, count the pictures starting in them (sync is carried
+// from one pack to the next, start it at ~0UL)
+#define MPEG_MARK_VIDEO_PTS	1
+#define MPEG_MARK_TIMESTAMP	2		// any other PTS or DTS
+#define MPEG_MARK_PICTURE	3
+#define MPEG_MARK_GOP		4		// sequence or GOP header
+void MPEGRetime(unsigned char *pack,int len,unsigned long long ticks);
+void MPEGPackMarks(unsigned char *pack,int len,unsigned long *sync,void (*mark)(int at,int kind,void *arg),void *arg);
+int MPEGPackPictures(unsigned char *pack,int len,unsigned long *sync);
+void MPEGPatchClock(unsigned char *p,unsigned long long ticks);
+int MPEGTimestamp(unsigned char *p,unsigned long long *ticks);
+void MPEGPatchTimestamp(unsigned char *p,unsigned long long ticks);
+
+// set when the magic reset string shows up in the stream
+extern int reset_ding;
+
+// timestamp rebasing state
+extern unsigned long long monotonic_SCR;
+extern unsigned long long last_SCR,last_SCR_delta,last_SCR_difference;
+extern unsigned long long scr_trim;
+
+// host clock (CLOCK_MONOTONIC) in 27MHz ticks, and per stage latency
+// accounting on it
+struct mpeg_latency {
+	unsigned long long count,sum,max;
+};
+long long MPEGHostClock();
+void MPEGLatencyAdd(struct mpeg_latency *l,long long t);
+extern struct mpeg_latency lat_pack;
+
+// accounting
+extern unsigned long long stat_bytes_copied;
+extern unsigned long long stat_padded_bytes,stat_padded_packs;
+extern unsigned long long stat_resplit_bytes,stat_resplit_pes;
+extern unsigned long long stat_splices,stat_splice_gap;	// gap: 27MHz ticks of pictures held back
+extern unsigned long long stat_splice_broken,stat_end_codes;	// open GOPs marked broken_link, end codes dropped
+extern unsigned long long stat_scr_jumps;			// SCR discontinuities smoothed over
+// thrown away: output packs that came out too short or too long, PES packets
+// with broken headers, pack headers that were junk, and bytes of input that
+// didn't fit
+extern unsigned long long stat_dropped_short,stat_dropped_long,stat_dropped_pes;
+extern unsigned long long stat_dropped_junk,stat_dropped_overflow;
@@ -4,7 +4,7 @@
  * Since the current code only knows how to initialize and cannot
  * re-initialize per MPEG file, we run as a daemon that is fed MPEG
  * via a FIFO from other programs. We also accept commands from another
- * FIFO.
+ * FIFO, or with -cmdsock from a Unix socket (pmbcmd.h).
  */
 
 #include <stdio.h>
@@ -20,22 +20,115 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <usb.h>
 
 #include "libpmb.h"
+#include "pmbmpeg.h"
+#include "pmbring.h"
+#include "pmbts.h"
+#include "pmbes.h"
+#include "pmbsched.h"
+#include "pmbplaylist.h"
+#include "pmbcache.h"
+#include "pmblog.h"
+#include "pmbmetrics.h"
+#include "pmbtrace.h"
+#include "pmbrt.h"
+#include "pmbcmd.h"
+#include "pmbcue.h"
+#include "pmbstate.h"
 
-// the MovieBox does not handle SCR resets very well.
-// if you play an MPEG file into it and then play another without filtering
-// and the other MPEG also starts with a SCR of 0, the MovieBox will stall,
-// waiting until it's internal clock matches (which won't in a LONG time).
-// 
-// Now the purpose of this daemon is to accept arbitrary MPEGs through a FIFO.
-// That can easily happen, so we must massage the SCR, PTS, and DTS timestamps
-// in the stream before sending it on to the Pinnacle MovieBox.
-static unsigned long long monotonic_SCR = 0;
 static char *pipename,*cmdpipe;
+static int src_fd = -1,audio_fd = -1,audio_feeding = 0;
+
+// feed FIFO input waiting to make up 2048 bytes for the parser
+static unsigned char mpeg[2048];
+static int mpegi = 0;
+
+// every byte that comes in from the feed is counted once here, and every
+// time it gets copied around in user space once in stat_bytes_copied.
+// the ratio is our per-byte copy count.
+static unsigned long long stat_bytes_in = 0;
+
+// a shared memory ring producer may feed us too (-ring)
+static int use_ring = 0;
+
+// feed is a MPEG transport stream (-ts) or raw video elementary stream (-es)
+// rather than a program stream
+static int ts_input = 0;
+static int es_input = 0;
+static int es_feeding = 0;	// a writer is sending us an elementary stream
+
+// files queued with the enqueue command are played by us (program streams only)
+static int playlist = 0;
+
+// release packs against the SCR instead of as fast as they come (-pace)
+static int pace = 0;
+
+// live feed (-live): latency over throughput. a pack that has been waiting
+// this long (27MHz ticks) for the rest of its data goes out padded.
+static int live = 0;
+#define LIVE_HOLD		(27000LL * 2)
+
+// per stage latency: input sitting in the staging buffer, bulk writes
+static struct mpeg_latency lat_input = { 0, 0, 0 };
+static struct mpeg_latency lat_usb = { 0, 0, 0 };
+
+// how much later than asked for the idle sleeps wake up: the scheduling
+// jitter the real-time profile (-rt, -mlock, -cpu) is there to keep down
+static struct mpeg_latency lat_wake = { 0, 0, 0 };
+static int rt_failed = 0;
+
+// flush command: everything on its way to the screen is thrown away. how
+// long until the first picture after it is up is measured from the command
+// to when its pack reached the device, plus the time the stream leaves the
+// decoder to buffer it (PTS - SCR).
+static int flush_request = 0;
+static long long flush_started = -1;
+static long long flush_first_write = -1;
+static unsigned long long flush_first_SCR = 0;
+static struct mpeg_latency lat_flush = { 0, 0, 0 };
+static unsigned long long stat_flushes = 0,stat_flush_dropped = 0;
+
+// seek and seekgop commands: the current playlist file goes on from another
+// GOP. what was on its way out is flushed, and timed like a flush.
+static int seek_request = 0,seek_gop = 0;
+static unsigned long long seek_where = 0;
+static unsigned long long stat_seeks = 0;
+
+// what went out to the device, for the metrics socket (-metrics). the
+// input rate is taken once a second.
+static int metrics = 0;
+static unsigned long long stat_packs_out = 0,stat_usb_errors = 0;
+static long long last_write = -1;
+static long long rate_at = -1;
+static unsigned long long rate_bytes = 0;
+static double input_rate = 0;
+
+// pack tracing (-trace FILE, trace command): where the ring goes at exit
+static char *trace_file = NULL;
+
+// command socket (-cmdsock). pipe_lock is held by whichever thread is running
+// commands or talking to the device's control endpoint: the command thread
+// for the commands it runs itself, the playback thread otherwise.
+static int cmdsock = 0;
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// timed commands (at). without -pace the decoder is taken to be cue_delay
+// behind the last pack written (-cuedelay), that being about what the
+// MovieBox buffers before bulk writes block. decoder_clock is CueClock() as
+// of this time around the loop, for the command thread.
+static long long cue_delay = 27000000LL / 2;
+static long long written_SCR = -1,written_at = 0;
+static long long decoder_clock = -1;
+
+// daemon state (-state): the clock and the device, for the next run
+static int state = 0;
+
 static int sigpipe = 0;
 static int die = 0;
+static int report_stats = 0;
 
 void sigma(int x)
 {
@@ -45,558 +138,954 @@ void sigma(int x)
 	else if (x == SIGTERM || x == SIGQUIT || x == SIGINT) {
 		die = 1;
 	}
+	else if (x == SIGUSR1) {
+		report_stats = 1;
+	}
 }
 
-static int mpeg_state = 0;
-static unsigned long mpeg_sync = 0;
-static unsigned char mpeg_in[4096];
-static int mpeg_in_remain = 0;
-static unsigned char mpeg_out[4096];
-static int mpeg_outi = 0;
-static unsigned long long last_SCR = 0,last_SCR_delta = 0,last_SCR_difference = 0;
-static int warn_nonmpa = 0;
+static void CommandAt(int argc,char **argv);
 
-//static int debug_fd = -1;
-void FlushMPEGOut()
+static void command(int argc,char **argv)
 {
-	if (mpeg_outi <= 0)
+	if (argc < 1)
 		return;
 
-//	if (debug_fd < 0) {
-//		debug_fd = open("/tmp/test.mpg",O_WRONLY|O_CREAT|O_TRUNC,0644);
-//		if (debug_fd < 0) {
-//			fprintf(stderr,"Cannot create test MPEG %s\n",strerror(errno));
-//		}
-//	}
+	if (!strcmp(argv[0],"volume")) {
+		if (argc == 3) {
+			int vl = -atoi(argv[1]);
+			if (vl < 0)   vl = 0;
+			if (vl > 255) vl = 255;
+			int vr = -atoi(argv[2]);
+			if (vr < 0)   vr = 0;
+			if (vr > 255) vr = 255;
+			PinnacleMovieBoxSetMasterVolume(vl,vr);
+		}
+	}
+	else if (!strcmp(argv[0],"enqueue")) {
+		if (argc >= 2) {
+			char path[1024];
+			int i;
+
+			// CMDInput split the path up at its spaces
+			path[0] = 0;
+			for (i=1;i < argc;i++) {
+				if (i > 1) strncat(path," ",sizeof(path)-strlen(path)-1);
+				strncat(path,argv[i],sizeof(path)-strlen(path)-1);
+			}
 
-	if (mpeg_outi < 2048) {
-		fprintf(stderr,"Packet too short\n");
-		return;
+			if (!playlist)
+				PMBLog(PMB_LOG_WARNING,"Command pipe: enqueue only works with program stream input\n");
+			else if (PlaylistEnqueue(path) < 0)
+				PMBLog(PMB_LOG_WARNING,"Command pipe: cannot enqueue %s\n",path);
+		}
 	}
-	else if (mpeg_outi > 2048) {
-		fprintf(stderr,"Packet too long\n");
-		return;
+	else if (!strcmp(argv[0],"flush")) {
+		flush_request = 1;
 	}
+	else if (!strcmp(argv[0],"pause") || !strcmp(argv[0],"resume") || !strcmp(argv[0],"step")) {
+		if (!pace)
+			PMBLog(PMB_LOG_WARNING,"Command pipe: %s needs -pace\n",argv[0]);
+		else if (!strcmp(argv[0],"pause"))
+			SchedPause();
+		else if (!strcmp(argv[0],"resume"))
+			SchedResume();
+		else
+			SchedStep(argc >= 2 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 1);
+	}
+	else if (!strcmp(argv[0],"seek") || !strcmp(argv[0],"seekgop")) {
+		if (!playlist)
+			PMBLog(PMB_LOG_WARNING,"Command pipe: %s only works with program stream input\n",argv[0]);
+		else if (argc >= 2) {
+			seek_gop = !strcmp(argv[0],"seekgop");
+			if (seek_gop)
+				seek_where = strtoull(argv[1],NULL,10);
+			else
+				seek_where = (atof(argv[1]) > 0) ? (unsigned long long)(atof(argv[1]) * 27000000.0) : 0;
+			seek_request = 1;
+		}
+	}
+	else if (!strcmp(argv[0],"trace")) {
+		if (argc >= 2 && !strcmp(argv[1],"on")) {
+			PMBTraceResync();
+			pmb_trace = 1;
+		}
+		else if (argc >= 2 && !strcmp(argv[1],"off"))
+			pmb_trace = 0;
+		else if (argc >= 2 && !strcmp(argv[1],"clear"))
+			PMBTraceClear();
+		else if (argc >= 2 && !strcmp(argv[1],"dump") && (argc >= 3 || trace_file != NULL))
+			PMBTraceDump(argc >= 3 ? argv[2] : trace_file,0);
+		else
+			PMBLog(PMB_LOG_WARNING,"Command pipe: trace needs on, off, clear or dump FILE\n");
+	}
+	else if (!strcmp(argv[0],"loglevel")) {
+		int l = (argc >= 2) ? PMBLogParseLevel(argv[1]) : -1;
+
+		if (l < 0)
+			PMBLog(PMB_LOG_WARNING,"Command pipe: loglevel needs err, warning, notice, info or debug\n");
+		else
+			pmb_log_level = l;
+	}
+	else if (!strcmp(argv[0],"outputs")) {
+		int f = (argc >= 2) ? PMBCmdOutputs(argv[1]) : -1;
+
+		if (f < 0)
+			PMBLog(PMB_LOG_WARNING,"Command pipe: outputs needs none, composite, svideo or rgb (or several, with commas)\n");
+		else if (PinnacleMovieBoxEnableVideoOutputs(f) < 0)
+			PMBLog(PMB_LOG_WARNING,"Command pipe: cannot switch video outputs\n");
+	}
+	else if (!strcmp(argv[0],"at")) {
+		if (argc == 2 && !strcmp(argv[1],"clear"))
+			CueClear();
+		else if (argc >= 3)
+			CommandAt(argc,argv);
+		else
+			PMBLog(PMB_LOG_WARNING,"Command pipe: at needs a time and a command, or clear\n");
+	}
+	else if (!strcmp(argv[0],"skip")) {
+		if (playlist) PlaylistSkip();
+	}
+	else if (!strcmp(argv[0],"clear")) {
+		if (playlist) PlaylistClear();
+	}
+	else {
+		PMBLog(PMB_LOG_WARNING,"Command pipe: Unknown command %s\n",argv[0]);
+	}
+}
 
-//	if (debug_fd >= 0)
-//		write(debug_fd,mpeg_out,2048);
+// one line of the command pipe, split up at its spaces
+static void CommandLine(char *line)
+{
+	char *argv[32],*t;
+	int argc=0;
 
-	PinnacleMovieBoxWriteVideo(mpeg_out,2048);
-	mpeg_outi = 0;
+	argv[argc++] = line;
+	while (argc < 31 && (t=strchr(argv[argc-1],' ')) != NULL) {
+		while (*t == ' ') *t++ = 0;
+		argv[argc++] = t;
+	}
+	argv[argc] = NULL;
+	command(argc,argv);
 }
 
-static int AlreadyB3=0;
-void StripThings(unsigned char *buf,unsigned char *fence)
+// a time for at: seconds on the stream's clock, or from where the decoder
+// is now with a +. -1 if there's no telling where that is.
+static int AtTime(const char *s,unsigned long long *at)
 {
-	while (buf < (fence-3)) {
-		// allow only ONE occurence of Sequence Header. MovieBox stalls on second occurence
+	double secs = atof(s + (*s == '+'));
+	long long clock = 0;
+
+	if (secs < 0)
+		return -1;
+	if (*s == '+' && (clock = CueClock()) < 0)
+		return -1;
 
-		// remove "end of sequence code"
-		if (	buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x01 &&
-			(buf[3] == 0xB7 || buf[3] == 0xB8 || buf[3] == 0xB9)) {
-			fprintf(stderr,"Filtered out 0x000001%02X (AlreadyB3=%d)\n",buf[3],AlreadyB3);
-			buf[0] = buf[1] = buf[2] = buf[3] = 0x00;
+	*at = ((unsigned long long)clock + (unsigned long long)(secs * 27000000.0)) % MPEG_CLOCK_WRAP;
+	return 0;
+}
+
+static void CommandCue(void *arg,long long late)
+{
+	if (late >= 0) {
+		PMBLog(PMB_LOG_DEBUG,"Command pipe: %s, %.1fms late\n",(char*)arg,late / 27000.0);
+		CommandLine(arg);
+	}
+	free(arg);
+}
+
+// at TIME COMMAND...: the rest of the line, again, once it's time
+static void CommandAt(int argc,char **argv)
+{
+	unsigned long long at;
+	char line[1024];
+	char *copy;
+	int i;
+
+	if (AtTime(argv[1],&at) < 0) {
+		PMBLog(PMB_LOG_WARNING,"Command pipe: at %s: no such time, or nothing playing yet\n",argv[1]);
+		return;
+	}
+
+	line[0] = 0;
+	for (i=2;i < argc;i++) {
+		if (i > 2) strncat(line," ",sizeof(line)-strlen(line)-1);
+		strncat(line,argv[i],sizeof(line)-strlen(line)-1);
+	}
+	if ((copy = strdup(line)) == NULL || CueAdd(at,CommandCue,copy) < 0) {
+		PMBLog(PMB_LOG_WARNING,"Command pipe: too many timed commands waiting\n");
+		free(copy);
+	}
+}
+
+static int cmd_tmpi=0;
+static char cmd_tmp[1024];		// enough for a path
+void CMDInput(unsigned char *buf,int len)
+{
+	char c,*cb = (char*)buf;	// so the C compiler shuts the hell up about signed/unsigned char typecasting
+
+	while (len-- > 0) {
+		c = *cb++;
+		if (c >= 32 || c < 0) {
+			if (cmd_tmpi < (int)sizeof(cmd_tmp)-1)
+				cmd_tmp[cmd_tmpi++] = c;
+		}
+		else if (c == 10) {
+			cmd_tmp[cmd_tmpi] = 0;
+			CommandLine(cmd_tmp);
+			cmd_tmpi = 0;
 		}
+	}
+}
+
+static void ReportLatency(const char *name,struct mpeg_latency *l)
+{
+	fprintf(stderr," %s %.2f/%.2fms",name,
+		l->count ? ((double)l->sum / l->count / 27000.0) : 0.0,
+		l->max / 27000.0);
+}
 
-		buf++;
+static void ReportStats()
+{
+	struct pmb_log_site *s;
+
+	fprintf(stderr,"Input: %llu bytes, copied %llu bytes in user space (%.2f copies per byte)\n",
+		stat_bytes_in,stat_bytes_copied,
+		stat_bytes_in ? ((double)stat_bytes_copied / stat_bytes_in) : 0.0);
+	fprintf(stderr,"Repacketizer: padded %llu bytes in %llu packs, resplit %llu bytes from %llu PES packets\n",
+		stat_padded_bytes,stat_padded_packs,stat_resplit_bytes,stat_resplit_pes);
+	fprintf(stderr,"Splicer: %llu splices, %.1fms of pictures held back, %llu open GOPs marked broken, %llu end codes dropped\n",
+		stat_splices,stat_splice_gap / 27000.0,stat_splice_broken,stat_end_codes);
+	if (ts_input)
+		fprintf(stderr,"Transport stream: %llu packets, %llu resyncs, %llu continuity errors, %llu PES dropped\n",
+			stat_ts_packets,stat_ts_resyncs,stat_ts_cc_errors,stat_ts_dropped);
+	if (es_input)
+		fprintf(stderr,"Elementary streams: %llu pictures, %llu audio frames, %llu packs late, %llu dropped, %llu junk bytes\n",
+			stat_es_pictures,stat_es_audio_frames,stat_es_late,stat_es_dropped,stat_es_junk);
+	if (playlist)
+		fprintf(stderr,"Playlist: %llu files played (%llu from the cache), %llu failed, %llu stalls\n",
+			stat_pl_items,stat_pl_cached,stat_pl_failed,stat_pl_stalls);
+	if (pace)
+		fprintf(stderr,"Scheduler: %llu packs, %llu late (worst %.1fms), %llu resyncs, queue peaked at %d packs\n",
+			stat_sched_packs,stat_sched_late,stat_sched_max_late / 27000.0,stat_sched_resyncs,stat_sched_max_queue);
+	if (stat_sched_pauses)
+		fprintf(stderr,"Pause: %llu pauses, %llu pictures stepped, %.1fs paused%s\n",
+			stat_sched_pauses,stat_sched_steps,stat_sched_paused / 27000000.0,sched_paused ? " (paused now)" : "");
+
+	if (stat_flushes || stat_seeks)
+		fprintf(stderr,"Flush: %llu flushes, %llu seeks, %llu bytes dropped from the feed, first picture after %.1fms avg, %.1fms max\n",
+			stat_flushes,stat_seeks,stat_flush_dropped,
+			lat_flush.count ? ((double)lat_flush.sum / lat_flush.count / 27000.0) : 0.0,
+			lat_flush.max / 27000.0);
+
+	if (stat_cues_fired || stat_cues_dropped || CueCount())
+		fprintf(stderr,"Timed commands: %llu fired %.2f/%.2fms late avg/max, %llu dropped, %d waiting\n",
+			stat_cues_fired,
+			lat_cue.count ? ((double)lat_cue.sum / lat_cue.count / 27000.0) : 0.0,
+			lat_cue.max / 27000.0,stat_cues_dropped,CueCount());
+	if (cmdsock)
+		fprintf(stderr,"Commands: %llu requests, %llu failed, %llu run by the playback thread after %.2f/%.2fms avg/max\n",
+			stat_cmd_requests,stat_cmd_errors,stat_cmd_queued,
+			stat_cmd_queued ? ((double)stat_cmd_wait_sum / stat_cmd_queued / 1000.0) : 0.0,
+			stat_cmd_wait_max / 1000.0);
+
+	fprintf(stderr,"Latency (avg/max):");
+	ReportLatency("input",&lat_input);
+	ReportLatency("pack",&lat_pack);
+	if (pace) ReportLatency("queue",&lat_queue);
+	ReportLatency("usb",&lat_usb);
+	ReportLatency("wakeup",&lat_wake);
+	fprintf(stderr,"\n");
+
+	fprintf(stderr,"Log: %llu written, %llu suppressed, %llu dropped (level %s)\n",
+		stat_log_written,stat_log_suppressed,stat_log_dropped,PMBLogLevelName(pmb_log_level));
+	for (s=PMBLogSites();s != NULL;s=s->next) {
+		if (s->total_suppressed > 0)
+			fprintf(stderr,"  %llu suppressed: %.60s\n",s->total_suppressed,s->fmt);
 	}
 }
 
-// here, buf points directly after the syncword.
-int CheckModPacket(unsigned char *buf,int len,int syncword,int *skipped)
+static void MetricsLatency(const char *name,const char *help,struct mpeg_latency *l)
+{
+	char max[64];
+
+	PMBMetric(name,"summary",help);
+	snprintf(max,sizeof(max),"%s_sum",name);
+	PMBMetricValue(max,NULL,l->sum / 27000000.0);
+	snprintf(max,sizeof(max),"%s_count",name);
+	PMBMetricCount(max,NULL,l->count);
+
+	snprintf(max,sizeof(max),"%s_max",name);
+	PMBMetric(max,"gauge","Longest so far");
+	PMBMetricValue(max,NULL,l->max / 27000000.0);
+}
+
+// one scrape of the metrics socket
+static void Metrics()
 {
-	int pkt_len = (((int)buf[0]) << 8) | ((int)buf[1]);
-	if ((pkt_len+2) > len) {
-		fprintf(stderr,"CheckModPacket: Packet too long for input buffer (%u bytes > %u), rejecting\n",
-			pkt_len+2,len);
-		return 0;
+	PMBMetric("pmb_input_bytes_total","counter","Bytes of MPEG taken in from the feed, the ring and the playlist");
+	PMBMetricCount("pmb_input_bytes_total",NULL,stat_bytes_in);
+	PMBMetric("pmb_input_bytes_per_second","gauge","Input rate over the last second");
+	PMBMetricValue("pmb_input_bytes_per_second",NULL,input_rate);
+	PMBMetric("pmb_packs_sent_total","counter","2048 byte packs written to the MovieBox");
+	PMBMetricCount("pmb_packs_sent_total",NULL,stat_packs_out);
+
+	PMBMetric("pmb_dropped_total","counter","Packs and PES packets thrown away, by why");
+	PMBMetricCount("pmb_dropped_total","reason=\"pack_short\"",stat_dropped_short);
+	PMBMetricCount("pmb_dropped_total","reason=\"pack_long\"",stat_dropped_long);
+	PMBMetricCount("pmb_dropped_total","reason=\"pack_header\"",stat_dropped_junk);
+	PMBMetricCount("pmb_dropped_total","reason=\"pes_header\"",stat_dropped_pes);
+	if (ts_input)
+		PMBMetricCount("pmb_dropped_total","reason=\"ts_pes\"",stat_ts_dropped);
+	if (es_input) {
+		PMBMetricCount("pmb_dropped_total","reason=\"es_late\"",stat_es_late);
+		PMBMetricCount("pmb_dropped_total","reason=\"es\"",stat_es_dropped);
+	}
+	PMBMetric("pmb_dropped_bytes_total","counter","Bytes of input thrown away, by why");
+	PMBMetricCount("pmb_dropped_bytes_total","reason=\"overflow\"",stat_dropped_overflow);
+	PMBMetricCount("pmb_dropped_bytes_total","reason=\"flush\"",stat_flush_dropped);
+
+	PMBMetric("pmb_scr_discontinuities_total","counter","SCR jumps in the input smoothed over");
+	PMBMetricCount("pmb_scr_discontinuities_total",NULL,stat_scr_jumps);
+	PMBMetric("pmb_splices_total","counter","Streams spliced on to the one before");
+	PMBMetricCount("pmb_splices_total",NULL,stat_splices);
+	PMBMetric("pmb_scr_seconds","gauge","SCR of the last pack, as sent (monotonic_SCR)");
+	PMBMetricValue("pmb_scr_seconds",NULL,(monotonic_SCR >> 9) / 90000.0);
+	PMBMetric("pmb_scr_offset_seconds","gauge","What is added to the input's SCR, PTS and DTS (last_SCR_difference)");
+	PMBMetricValue("pmb_scr_offset_seconds",NULL,((long long)last_SCR_difference / 512.0) / 90000.0);
+
+	PMBMetric("pmb_queue_packs","gauge","Packs waiting, by queue");
+	if (pace)
+		PMBMetricCount("pmb_queue_packs","queue=\"scheduler\"",SchedQueued());
+	if (use_ring)
+		PMBMetricCount("pmb_queue_packs","queue=\"ring\"",PMBRingServerQueued());
+	if (playlist) {
+		PMBMetric("pmb_playlist_files","gauge","Files enqueued that haven't started playing");
+		PMBMetricCount("pmb_playlist_files",NULL,PlaylistQueued());
+	}
+	if (pace) {
+		PMBMetric("pmb_late_packs_total","counter","Packs that went out after their SCR had passed");
+		PMBMetricCount("pmb_late_packs_total",NULL,stat_sched_late);
+		PMBMetric("pmb_paused","gauge","1 while paused");
+		PMBMetricCount("pmb_paused",NULL,sched_paused);
 	}
 
-	unsigned char *fence = buf + 2 + pkt_len;
-	unsigned char *hdr = buf + 2;
-	unsigned char *payload = NULL;
+	MetricsLatency("pmb_usb_write_seconds","Time spent in bulk writes to the MovieBox",&lat_usb);
+	MetricsLatency("pmb_pack_seconds","Time from the first byte of a pack to its bulk write",&lat_pack);
+	if (pace)
+		MetricsLatency("pmb_queue_seconds","Time packs wait in the scheduler",&lat_queue);
+
+	MetricsLatency("pmb_wakeup_late_seconds","How much later than asked for idle sleeps end",&lat_wake);
+	PMBMetric("pmb_rt_profile_ok","gauge","1 if the real-time profile was applied in full");
+	PMBMetricCount("pmb_rt_profile_ok",NULL,!rt_failed);
+
+	PMBMetric("pmb_device_up","gauge","1 while the MovieBox is there");
+	PMBMetricCount("pmb_device_up",NULL,!PinnacleMovieBoxDeviceRemoved());
+	PMBMetric("pmb_usb_errors_total","counter","Bulk writes that didn't take all of the data");
+	PMBMetricCount("pmb_usb_errors_total",NULL,stat_usb_errors);
+	PMBMetric("pmb_last_write_age_seconds","gauge","Time since the last pack went to the MovieBox, -1 if none has");
+	PMBMetricValue("pmb_last_write_age_seconds",NULL,last_write >= 0 ? (MPEGHostClock() - last_write) / 27000000.0 : -1.0);
+
+	PMBMetric("pmb_decoder_clock_seconds","gauge","Where the decoder is on the stream's clock, -1 if not known");
+	PMBMetricValue("pmb_decoder_clock_seconds",NULL,decoder_clock >= 0 ? decoder_clock / 27000000.0 : -1.0);
+	PMBMetric("pmb_timed_commands","gauge","Timed commands waiting");
+	PMBMetricCount("pmb_timed_commands",NULL,CueCount());
+	MetricsLatency("pmb_timed_command_late_seconds","How late timed commands fired",&lat_cue);
+
+	if (cmdsock) {
+		PMBMetric("pmb_command_requests_total","counter","Requests on the command socket");
+		PMBMetricCount("pmb_command_requests_total",NULL,stat_cmd_requests);
+		PMBMetric("pmb_command_errors_total","counter","Requests on the command socket that failed");
+		PMBMetricCount("pmb_command_errors_total",NULL,stat_cmd_errors);
+		PMBMetric("pmb_command_wait_seconds_max","gauge","Longest a request waited for the playback thread");
+		PMBMetricValue("pmb_command_wait_seconds_max",NULL,stat_cmd_wait_max / 1000000.0);
+	}
 
-	// pick through the various packet header flags
-	if ((*hdr >> 6) == 2) {	// MPEG-2 '10'
-		unsigned char b;
+	PMBMetric("pmb_log_dropped_total","counter","Log messages dropped with the log ring full");
+	PMBMetricCount("pmb_log_dropped_total",NULL,stat_log_dropped);
+	PMBMetric("pmb_log_suppressed_total","counter","Log messages over their rate limit");
+	PMBMetricCount("pmb_log_suppressed_total",NULL,stat_log_suppressed);
+}
 
-		b = *hdr++;
-		// '10'						bits[7...6]
-		// PES_scrambling_control			bits[5...4]
-		// PES_priority					bits[3]
-		// data_alignment_indicator			bits[2]
-		// copyright					bits[1]
-		// original_or_copy				bits[0]
-		b = *hdr++;
-		unsigned char PTS_DTS_flags =			b >> 6;
-		unsigned char ESCR_flag =			(b >> 5) & 1;
-		// ES_rate_flag					bits[4]
-		// DSM_trick_mode_flag				bits[3]
-		// additional_copy_info_flag			bits[2]
-		// PES_CRC_flag					bits[1]
-		// PES_extension_flag				bits[0]
-		unsigned char PES_header_data_length = *hdr++;
+// packs written to the device since a flush, looking for the first picture
+static void FlushLatency(unsigned char *pack,int len,long long t)
+{
+	struct mpeg_times times;
+	unsigned long long SCR;
+	unsigned long mux_rate;
+	long long wait;
+
+	for (;len >= 2048 && flush_started >= 0;pack += 2048,len -= 2048) {
+		if (!MPEGPackClock(pack,&SCR,&mux_rate))
+			continue;
+		if (flush_first_write < 0) {
+			flush_first_write = t;
+			flush_first_SCR = SCR;
+		}
 
-		// yay, we know where the payload is now
-		payload = hdr + PES_header_data_length;
+		memset(&times,0,sizeof(times));
+		MPEGScanTimes(pack,2048,&times);
+		if (times.have_PTS) {
+			wait = (long long)times.first_PTS - (long long)flush_first_SCR;
+			if (wait < 0) wait = 0;
+			MPEGLatencyAdd(&lat_flush,(flush_first_write - flush_started) + wait);
+			flush_started = -1;
+		}
+	}
+}
 
-		// decode and modify the PTS/DTS/ESCR timestamps
-		unsigned long long PTS=0,DTS=0,ESCR=0;
-		unsigned char *pPTS=NULL,*pDTS=NULL,*pESCR=NULL;
+// finished packs from the MPEG massaging code
+// the SCR of the last pack written, for the decoder clock without -pace and
+// for the state file. with -pace that's the SCR as the scheduler retimed
+// it, time spent paused included, not monotonic_SCR.
+static void Written(unsigned char *last,int len)
+{
+	unsigned long long SCR;
+	unsigned long mux_rate;
 
-		// PTS, if present
-		if (PTS_DTS_flags == 2 || PTS_DTS_flags == 3) {	// '10' or '11'
-			if ((*hdr >> 4) != PTS_DTS_flags) {	// should be followed by '0010' if '10' or '0011' if '11'
-				fprintf(stderr,"PTS_DTS_flags = %u, next is %u not %u\n",
-					PTS_DTS_flags,*hdr >> 4,PTS_DTS_flags);
-				return 0;
-			}
+	if (len >= 2048 && MPEGPackClock(last,&SCR,&mux_rate)) {
+		written_SCR = (long long)SCR;
+		written_at = last_write;
+		PMBStateSave(SCR);
+	}
+}
 
-			if (	(hdr[0] & 0x01) == 0 ||
-				(hdr[2] & 0x01) == 0 ||
-				(hdr[4] & 0x01) == 0) {
-				fprintf(stderr,"Marker bits in PTS timestamp don't line up\n");
-				return 0;
-			}
+// where the decoder is without -pace: cue_delay behind the last pack
+// written, catching up with it if nothing more is written
+static long long WrittenClock()
+{
+	long long behind;
 
-			pPTS =	hdr;
-			PTS =	(((unsigned long long)((hdr[0] >> 1) & 0x07)) << (30+9)) |
-				(((unsigned long long)( hdr[1]             )) << (22+9)) |
-				(((unsigned long long)((hdr[2] >> 1) & 0x7F)) << (15+9)) |
-				(((unsigned long long)( hdr[3]             )) <<  (7+9)) |
-				(((unsigned long long)((hdr[4] >> 1) & 0x7F))          );
-
-			hdr += 5;
-		}
-		// DTS if present
-		if (PTS_DTS_flags == 3) {
-			if ((*hdr >> 4) != 1) {
-				fprintf(stderr,"PTS_DTS_flags = %u, next is %u not 1\n",
-					PTS_DTS_flags,*hdr >> 4);
-				return 0;
-			}
+	if (written_SCR < 0)
+		return -1;
 
-			if (	(hdr[0] & 0x01) == 0 ||
-				(hdr[2] & 0x01) == 0 ||
-				(hdr[4] & 0x01) == 0) {
-				fprintf(stderr,"Marker bits in DTS timestamp don't line up\n");
-				return 0;
-			}
+	behind = cue_delay - (MPEGHostClock() - written_at);
+	if (behind < 0) behind = 0;
+	return (long long)(((unsigned long long)written_SCR + MPEG_CLOCK_WRAP - (unsigned long long)behind) % MPEG_CLOCK_WRAP);
+}
 
-			pDTS =	hdr;
-			DTS =	(((unsigned long long)((hdr[0] >> 1) & 0x07)) << (30+9)) |
-				(((unsigned long long)( hdr[1]             )) << (22+9)) |
-				(((unsigned long long)((hdr[2] >> 1) & 0x7F)) << (15+9)) |
-				(((unsigned long long)( hdr[3]             )) <<  (7+9)) |
-				(((unsigned long long)((hdr[4] >> 1) & 0x7F))          );
-
-			hdr += 5;
-		}
-		// ESCR
-		if (ESCR_flag) {
-			if (	(hdr[0] & 0x04) == 0 ||
-				(hdr[2] & 0x04) == 0 ||
-				(hdr[4] & 0x04) == 0 ||
-				(hdr[5] & 0x01) == 0) {
-				fprintf(stderr,"Marker bits in ESCR don't line up\n");
-				return 0;
-			}
+static void DeviceOutput(unsigned char *pack,int len)
+{
+	long long t = MPEGHostClock();
+
+	if (flush_started >= 0)
+		FlushLatency(pack,len,t);
+
+	if (PinnacleMovieBoxWriteVideo(pack,len) < len)
+		stat_usb_errors++;
+	stat_bytes_copied += len;	// libpmb byte-swaps into its own buffer
+	stat_packs_out += len / 2048;
+	last_write = MPEGHostClock();
+	MPEGLatencyAdd(&lat_usb,last_write - t);
+	Written(pack+len-2048,len);
+}
 
-			pESCR =	hdr;
-			ESCR =	(((unsigned long long)((hdr[0] >> 3) & 0x03)) << (30+9)) |
-				(((unsigned long long)( hdr[0]       & 0x03)) << (28+9)) |
-				(((unsigned long long)( hdr[1]             )) << (20+9)) |
-				(((unsigned long long)((hdr[2] >> 3) & 0x1F)) << (15+9)) |
-				(((unsigned long long)( hdr[2]       & 0x03)) << (13+9)) |
-				(((unsigned long long)( hdr[3]             )) <<  (5+9)) |
-				(((unsigned long long)((hdr[4] >> 3) & 0x1F)) <<    (9)) |
-				(((unsigned long long)( hdr[4]       & 0x03)) <<    (7)) |
-				(((unsigned long long)((hdr[5] >> 1) & 0x7F))          );
-		}
-
-		// perform the adjustment
-		PTS  += last_SCR_difference;
-		DTS  += last_SCR_difference;
-		ESCR += last_SCR_difference;
-
-		// patch the new values back in
-		if (pPTS != NULL) {
-			pPTS[0] = (pPTS[0] & ~(0x07 << 1)) | (((PTS >> (30+9)) & 0x07) << 1);
-			pPTS[1] =                               PTS >> (22+9);
-			pPTS[2] = (pPTS[2] & ~(0x7F << 1)) | (((PTS >> (15+9)) & 0x7F) << 1);
-			pPTS[3] =                               PTS >>  (7+9);
-			pPTS[4] = (pPTS[4] & ~(0x7F << 1)) | (((PTS >>     9 ) & 0x7F) << 1);
-		}
-		if (pDTS != NULL) {
-			pDTS[0] = (pDTS[0] & ~(0x07 << 1)) | (((DTS >> (30+9)) & 0x07) << 1);
-			pDTS[1] =                               DTS >> (22+9);
-			pDTS[2] = (pDTS[2] & ~(0x7F << 1)) | (((DTS >> (15+9)) & 0x7F) << 1);
-			pDTS[3] =                               DTS >>  (7+9);
-			pDTS[4] = (pDTS[4] & ~(0x7F << 1)) | (((DTS >>     9 ) & 0x7F) << 1);
-		}
-		if (pESCR != NULL) {
-			pESCR[0] = (pESCR[0] & ~(0x03 << 3)) | (((ESCR >> (30+9)) & 0x03) << 3);
-			pESCR[0] = (pESCR[0] & ~(0x03     )) | (((ESCR >> (28+9)) & 0x03)     );
-			pESCR[1] =                                ESCR >> (20+9);
-			pESCR[2] = (pESCR[2] & ~(0x1F << 3)) | (((ESCR >> (15+9)) & 0x1F) << 3);
-			pESCR[2] = (pESCR[2] & ~(0x03     )) | (((ESCR >> (13+9)) & 0x03)     );
-			pESCR[3] =                                ESCR >>  (5+9);
-			pESCR[4] = (pESCR[4] & ~(0x1F << 3)) | (((ESCR >>    (9)) & 0x1F) << 3);
-			pESCR[4] = (pESCR[4] & ~(0x03     )) | (((ESCR >>    (7)) & 0x03)     );
-			pESCR[5] = (pESCR[5] & ~(0x7F << 1)) | (((ESCR          ) & 0x7F) << 1);
-		}
-
-		// the Pinnacle MovieBox is so god damn finicky we must strip things out
-		// or it will stall and freeze between MPEGs if we're not careful.
-		if (syncword == 0x000001E0) {
-			StripThings(payload,fence);
-		}
-	}
-	else {			// MPEG-1
-		while (hdr < fence && *hdr == 0xFF) hdr++;	// MPEG-1 stuffing
-		if (hdr >= fence) return 0;
-		// TODO: Handle MPEG-1
-		return 0;
-	}
-
-	// make sure there's room
-	if ((mpeg_outi+pkt_len+6) > sizeof(mpeg_out))
-		FlushMPEGOut();
-	if ((mpeg_outi+pkt_len+6) > sizeof(mpeg_out)) {
-		fprintf(stderr,"MPEG output packet overflow, dropping packet\n");
-		return 0;
-	}
-
-	// stuff it in
-	mpeg_out[mpeg_outi++] = syncword >> 24;
-	mpeg_out[mpeg_outi++] = syncword >> 16;
-	mpeg_out[mpeg_outi++] = syncword >>  8;
-	mpeg_out[mpeg_outi++] = syncword      ;
-	memcpy(mpeg_out+mpeg_outi,buf,pkt_len+2);
-	if (skipped != NULL) *skipped = pkt_len+2;
-	mpeg_outi += pkt_len+2;
-
-	if (mpeg_outi >= 2048)
-		FlushMPEGOut();
-
-	return 1;
-}
-
-// magic reset string that can be sent in
-static char *reset_string = "[RESET MPEG NOW]";
-int reset_string_i=0;
-int reset_ding=0;
-
-static int first_BB=0;
-void MPEGInput(unsigned char *cbuf,int clen)
-{
-	unsigned char *buf;
-	int len,skip;
-
-	if ((mpeg_in_remain+clen) <= 4096) {
-		buf = mpeg_in;
-		len = mpeg_in_remain;
+// packs from a cache entry, in the MovieBox's byte order already
+static void DeviceOutputRaw(unsigned char *pack,int len)
+{
+	long long t = MPEGHostClock();
+	unsigned char tmp[2048];
+	int i;
+
+	for (i=0;(i+2048) <= len && flush_started >= 0;i += 2048) {
+		PMBCacheSwap(tmp,pack+i,2048);
+		FlushLatency(tmp,2048,t);
 	}
-	else {
-		fprintf(stderr,"MPEG processing error: Buffer input overflow. Data dropped\n");
-		buf = mpeg_in;
-		len = 0;
-	}
-
-	memcpy(buf+len,cbuf,clen);
-	len += clen;
-	while (len > 0) {
-		// scan for magic reset sequence
-		if (*buf == reset_string[reset_string_i]) {
-			reset_string_i++;
-			if (reset_string[reset_string_i] == 0) {
-				fprintf(stderr,"Received reset string\n");
-				reset_string_i=0;
-				reset_ding++;
-			}
-		}
 
-		if (mpeg_state == 0) {		// looking for sync pattern
-			mpeg_sync = (mpeg_sync << 8) | *buf++; len--;
-			if (	mpeg_sync == 0x000001BA ||	// pack header? (2.5.3.3)
-				mpeg_sync == 0x000001BB ||	// system header? (2.5.3.5)
-				mpeg_sync == 0x000001C0 ||	// audio stream?
-				mpeg_sync == 0x000001E0)	// video stream?
-				mpeg_state = mpeg_sync;		// LOL how clever of me :)
-			else if (mpeg_sync == 0x000001BD) {
-				// no we do not use Dobly Digital AC-3 or other formats
-				if (!warn_nonmpa) {
-					fprintf(stderr,"WARNING: MPEG stream has private stream BD. This daemon does not support AC-3 audio.\n");
-					warn_nonmpa = 1;
-				}
+	if (PinnacleMovieBoxWriteVideoRaw(pack,len) < len)
+		stat_usb_errors++;
+	stat_packs_out += len / 2048;
+	last_write = MPEGHostClock();
+	MPEGLatencyAdd(&lat_usb,last_write - t);
+	if ((!pace || pmb_state) && len >= 2048) {
+		PMBCacheSwap(tmp,pack+len-2048,2048);
+		Written(tmp,2048);
+	}
+}
+
+// packs from a cache entry don't come out of the parser, they're numbered
+// for pmbtrace here
+static void CacheOutput(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures)
+{
+	DeviceOutputRaw(pack,2048);
+	trace_made++;
+}
+
+static void CacheOutputPaced(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures)
+{
+	SchedOutputRaw(pack,SCR,mux_rate,pictures);
+	trace_made++;
+}
+
+// feed data goes to the program stream parser, or through the transport
+// stream demuxer first
+static void FeedInput(unsigned char *buf,int len)
+{
+	if (ts_input)
+		TSInput(buf,len);
+	else if (es_input)
+		ESVideoInput(buf,len);
+	else
+		MPEGInput(buf,len);
+}
+
+static int FeedInputSpace(unsigned char **p)
+{
+	if (ts_input)
+		return TSInputSpace(p);
+	if (es_input)
+		return ESVideoInputSpace(p);
+	return MPEGInputSpace(p);
+}
+
+static void FeedInputCommit(int len)
+{
+	if (ts_input)
+		TSInputCommit(len);
+	else if (es_input)
+		ESVideoInputCommit(len);
+	else
+		MPEGInputCommit(len);
+}
+
+// ring packs thrown away by a flush
+static void DiscardInput(unsigned char *buf,int len)
+{
+	stat_flush_dropped += len;
+}
+
+// packs handed over by a shared memory ring producer
+static void RingInput(unsigned char *buf,int len)
+{
+	stat_bytes_in += len;
+	FeedInput(buf,len);
+}
+
+// the feed, our staging buffer, the parser and the scheduler queue, then
+// the device's own buffer
+static void Flush()
+{
+	unsigned char junk[2048];
+	int rd;
+
+	while ((rd = read(src_fd,junk,sizeof(junk))) > 0)
+		stat_flush_dropped += rd;
+	if (audio_fd >= 0)
+		while (read(audio_fd,junk,sizeof(junk)) > 0);
+	if (use_ring)
+		while (PMBRingServerPoll(DiscardInput,64) > 0);
+	stat_flush_dropped += mpegi;
+	mpegi = 0;
+
+	MPEGReset();
+	if (playlist) PlaylistStop();
+	if (ts_input) TSReset();
+	if (es_input) ESReset();
+	es_feeding = audio_feeding = 0;
+	if (pace) SchedReset();
+	PinnacleMovieBoxFlush();
+	PMBTraceResync();
+	written_SCR = -1;
+
+	flush_started = MPEGHostClock();
+	flush_first_write = -1;
+	stat_flushes++;
+}
+
+// nothing is thrown away unless the file can go there
+static int Seek(int gop,unsigned long long where)
+{
+	if (PlaylistSeek(gop,where) < 0)
+		return -1;
+
+	MPEGReset();
+	if (pace) SchedReset();
+	PinnacleMovieBoxFlush();
+	PMBTraceResync();
+	written_SCR = -1;
+
+	flush_started = MPEGHostClock();
+	flush_first_write = -1;
+	stat_seeks++;
+	return 0;
+}
+
+// command socket. the checks are all made before any command of a request
+// is run, so that a batch is done entirely or not at all.
+static int SocketCheck(struct pmb_cmd *c,struct pmb_cmd_job *job)
+{
+	switch (c->op) {
+		case PMB_OP_VOLUME:
+			if (c->a < -255 || c->a > 0 || c->b < -255 || c->b > 0) {
+				snprintf(job->msg,sizeof(job->msg),"volume: %lld %lld is not 0 to -255",c->a,c->b);
+				return PMB_CMD_EARG;
 			}
-		}
-		else if (mpeg_state == 0x000001BB) {
-			if (!first_BB) {
-				mpeg_out[mpeg_outi++] = 0x00;
-				mpeg_out[mpeg_outi++] = 0x00;
-				mpeg_out[mpeg_outi++] = 0x01;
-				mpeg_out[mpeg_outi++] = 0xBB;
-				memcpy(mpeg_out+mpeg_outi,buf,8);
-				mpeg_outi += 8;
-				FlushMPEGOut();
-				first_BB=1;
+			break;
+		case PMB_OP_ENQUEUE:
+			if (access(c->path,R_OK) < 0) {
+				snprintf(job->msg,sizeof(job->msg),"enqueue: %.200s: %s",c->path,strerror(errno));
+				return PMB_CMD_EARG;
 			}
-
-			// throw these away
-			mpeg_state = 0;
-		}
-		else if (mpeg_state == 0x000001E0) {
-			// we assume 2048 byte/packet PES packets.
-			// to keep our sanity require that at least 2048 bytes are known.
-			if (len < 2048) break;
-			if (CheckModPacket(buf,len,mpeg_state,&skip)) {
-				buf += skip;
-				len -= skip;
+			/* fall through */
+		case PMB_OP_SKIP:
+		case PMB_OP_CLEAR:
+		case PMB_OP_SEEK:
+		case PMB_OP_SEEKGOP:
+			if (!playlist) {
+				snprintf(job->msg,sizeof(job->msg),"only works with program stream input");
+				return PMB_CMD_ESTATE;
 			}
-			mpeg_state = 0;
-		}
-		else if (mpeg_state == 0x000001C0) {
-			// ditto (see comments for 0x000001E0)
-			if (len < 2048) break;
-			if (CheckModPacket(buf,len,mpeg_state,&skip)) {
-				buf += skip;
-				len -= skip;
+			break;
+		case PMB_OP_STEP:
+			if (c->a <= 0) {
+				snprintf(job->msg,sizeof(job->msg),"step: %lld pictures",c->a);
+				return PMB_CMD_EARG;
 			}
-			mpeg_state = 0;
-		}
-		else if (mpeg_state == 0x000001BA) {
-			unsigned long long SCR = 0;
-			unsigned char header[10];
-			int MPEG2 = 0,hlen = 0;
-
-			// processing of pack header.
-			// don't bother if there's not enough to parse.
-			if (len < 24) break;
-
-			// okay, so is this an MPEG-1 pack or MPEG-2 pack?
-			memcpy(header,buf,10);
-			if ((*buf >> 6) == 1) {	// MPEG-2 '01'
-				MPEG2 = 1;
-				hlen = 10;
-
-				// header[0] = {
-				//   '01'			 2 bits
-				//   SCR[32...30]		 3 bits
-				//   marker			 1 bit
-				//   SCR[29...28]		 2 bits
-				// };
-				// header[1] = {
-				//   SCR[27...20]		 8 bits
-				// };
-				// header[2] = {
-				//   SCR[19...15]		 5 bits
-				//   marker			 1 bit
-				//   SCR[14...13]		 2 bits
-				// };
-				// header[3] = {
-				//   SCR[12...5]		 8 bits
-				// };
-				// header[4] = {
-				//   SCR[4...0]			 5 bits
-				//   marker			 1 bit
-				//   SCRext[8...7]		 2 bits
-				// };
-				// header[5] = {
-				//   SCRext[6...0]		 7 bits
-				//   marker			 1 bit
-				// };
-				// header[6] = {
-				//   muxrate[21...14]		 8 bits
-				// };
-				// header[7] = {
-				//   muxrate[13...6]		 8 bits
-				// };
-				// header[8] = {
-				//   muxrate[5...0]		 6 bits
-				//   marker			 1 bit
-				//   marker			 1 bit
-				// };
-				// header[9] = {
-				//   reserved			 5 bits
-				//   pack_stuffing_length	 3 bits
-				// };
-				// ignoring the padding, we get 10 bytes
-				if (	(header[0] & 0x04) == 0 ||
-					(header[2] & 0x04) == 0 ||
-					(header[4] & 0x04) == 0 ||
-					(header[5] & 0x01) == 0 ||
-					(header[8] & 0x03) != 3)
-					continue;		// marker bits fail, junk
-
-				SCR =	(((unsigned long long)((header[0] >>  3) & 0x07)) << 39) |
-					(((unsigned long long)( header[0]        & 0x03)) << 37) |
-					(((unsigned long long)( header[1]              )) << 29) |
-					(((unsigned long long)((header[2] >>  3) & 0x1F)) << 24) |
-					(((unsigned long long)( header[2]        & 0x03)) << 22) |
-					(((unsigned long long)( header[3]              )) << 14) |
-					(((unsigned long long)((header[4] >>  3) & 0x1F)) <<  9) |
-					(((unsigned long long)( header[4]        & 0x03)) <<  7) |
-					(((unsigned long long)((header[5] >>  1) & 0x7F))      );
+			/* fall through */
+		case PMB_OP_PAUSE:
+		case PMB_OP_RESUME:
+			if (!pace) {
+				snprintf(job->msg,sizeof(job->msg),"needs -pace");
+				return PMB_CMD_ESTATE;
 			}
-			else if ((*buf >> 4) == 2) { // MPEG-1 '0010'
-				hlen = 8;
-				MPEG2 = 0;
-				// header[0] = {
-				//   '0010'			 4 bits
-				//   SCR[32...30]		 3 bits
-				//   marker			 1 bit
-				// };
-				// header[1...2] = {
-				//   SCR[29...15]		15 bits
-				//   marker			 1 bit
-				// };
-				// header[3...4] = {
-				//   SCR[14...0]		15 bits
-				//   marker			 1 bit
-				// };
-				// header[5...7] = {
-				//   marker			 1 bit
-				//   mux_rate			22 bits
-				//   marker			 1 bit
-				// };
-				if (	(header[0] &    1) == 0 ||
-					(header[2] &    1) == 0 ||
-					(header[4] &    1) == 0 ||
-					(header[5] & 0x80) == 0 ||
-					(header[7] &    1) == 0)
-					continue;	// marker bits fail, it's junk
-
-				// shift over by 9 to convert 90KHz to 27MHz
-				SCR =	(((unsigned long long)((header[0] >>  1) & 0x07)) << (30+9)) |
-					(((unsigned long long)( header[1]              )) << (22+9)) |
-					(((unsigned long long)((header[2] >>  1) & 0x7F)) << (15+9)) |
-					(((unsigned long long)( header[3]              )) <<  (7+9)) |
-					(((unsigned long long)((header[4] >>  1) & 0x7F)) <<  (0+9));
+			break;
+		case PMB_OP_LOGLEVEL:
+			if (c->a < PMB_LOG_ERR || c->a > PMB_LOG_DEBUG) {
+				snprintf(job->msg,sizeof(job->msg),"loglevel: no level %lld",c->a);
+				return PMB_CMD_EARG;
 			}
-			else {
-				// it's nonsense. chuck it and move on.
-				mpeg_state = 0;
-				continue;
+			break;
+		case PMB_OP_OUTPUTS:
+			if (c->a & ~0x3FLL) {
+				snprintf(job->msg,sizeof(job->msg),"outputs: no outputs %llx",(unsigned long long)c->a);
+				return PMB_CMD_EARG;
 			}
+			break;
+	}
 
-			unsigned long long delta = 0;
-			if (SCR < last_SCR || SCR > (last_SCR+270000000LL))
-				delta = last_SCR_delta;
-			else
-				delta = last_SCR_delta = (SCR - last_SCR);
-
-			monotonic_SCR += delta;
-			last_SCR_difference = monotonic_SCR - SCR;	// this is needed also for proper
-									// PTS/DTS timestamp adjustment
-			last_SCR = SCR;
-			SCR = monotonic_SCR;
-
-			// patch in the new SCR value
-			if (MPEG2) {
-				header[0] = (header[0] & ~(0x07 <<  3)) | (((SCR >> 39) & 0x07) <<  3);
-				header[0] = (header[0] &  ~0x03       ) | (((SCR >> 37) & 0x03)      );
-				header[1] =                                  SCR >> 29;
-				header[2] = (header[2] & ~(0x1F <<  3)) | (((SCR >> 24) & 0x1F) <<  3);
-				header[2] = (header[2] &  ~0x03       ) | (((SCR >> 22) & 0x03)      );
-				header[3] =                                  SCR >> 14;
-				header[4] = (header[4] & ~(0x1F <<  3)) | (((SCR >>  9) & 0x1F) <<  3);
-				header[4] = (header[4] &  ~0x03       ) | (((SCR >>  7) & 0x03)      );
-				header[5] = (header[5] & ~(0x7F <<  1)) | (( SCR        & 0x7F)      );
+	return PMB_CMD_OK;
+}
+
+// what the command thread may do itself: nothing that touches the parser,
+// the scheduler or the current playlist file
+static int SocketInline(int op)
+{
+	return op == PMB_OP_PING || op == PMB_OP_VOLUME || op == PMB_OP_ENQUEUE || op == PMB_OP_CLEAR ||
+		op == PMB_OP_LOGLEVEL || op == PMB_OP_STATUS || op == PMB_OP_OUTPUTS;
+}
+
+static int SocketRun(struct pmb_cmd *c,struct pmb_cmd_job *job)
+{
+	struct pmb_cmd_status st;
+
+	switch (c->op) {
+		case PMB_OP_VOLUME:
+			if (PinnacleMovieBoxSetMasterVolume(-c->a,-c->b) < 0) {
+				snprintf(job->msg,sizeof(job->msg),"volume: the MovieBox didn't take it");
+				return PMB_CMD_EFAIL;
 			}
-			else {
-				header[0] = (header[0] & ~(0x07 <<  1)) | (((SCR >> 39) & 0x07) <<  1);
-				header[1] =                                  SCR >> 31;
-				header[2] = (header[2] & ~(0x7F <<  1)) | (((SCR >> 24) & 0x7F) <<  1);
-				header[3] =                                  SCR >> 16;
-				header[4] = (header[4] & ~(0x7F <<  1)) | (((SCR >>  9) & 0x7F) <<  1);
+			break;
+		case PMB_OP_ENQUEUE:
+			if (PlaylistEnqueue(c->path) < 0) {
+				snprintf(job->msg,sizeof(job->msg),"enqueue: cannot enqueue %.200s",c->path);
+				return PMB_CMD_EFAIL;
 			}
+			break;
+		case PMB_OP_SKIP:
+			PlaylistSkip();
+			break;
+		case PMB_OP_CLEAR:
+			PlaylistClear();
+			break;
+		case PMB_OP_FLUSH:
+			Flush();
+			break;
+		case PMB_OP_PAUSE:
+			SchedPause();
+			break;
+		case PMB_OP_RESUME:
+			SchedResume();
+			break;
+		case PMB_OP_STEP:
+			SchedStep(c->a);
+			break;
+		case PMB_OP_SEEK:
+		case PMB_OP_SEEKGOP:
+			if (Seek(c->op == PMB_OP_SEEKGOP,c->a) < 0) {
+				snprintf(job->msg,sizeof(job->msg),"seek: cannot go there in this file");
+				return PMB_CMD_EFAIL;
+			}
+			break;
+		case PMB_OP_LOGLEVEL:
+			pmb_log_level = c->a;
+			break;
+		case PMB_OP_OUTPUTS:
+			if (PinnacleMovieBoxEnableVideoOutputs(c->a) < 0) {
+				snprintf(job->msg,sizeof(job->msg),"outputs: the MovieBox didn't take it");
+				return PMB_CMD_EFAIL;
+			}
+			break;
+		case PMB_OP_ATCLEAR:
+			CueClear();
+			break;
+		case PMB_OP_STATUS:
+			// read from the command thread while they change: near enough
+			memset(&st,0,sizeof(st));
+			st.SCR = ((monotonic_SCR >> 9) * 300ULL) + (monotonic_SCR & 0x1FF);
+			st.bytes_in = stat_bytes_in;
+			st.packs_out = stat_packs_out;
+			if (playlist) {
+				st.queued = PlaylistQueued();
+				if (PlaylistActive()) st.flags |= PMB_STATUS_PLAYLIST;
+			}
+			if (pace) st.flags |= PMB_STATUS_PACED;
+			if (pace && sched_paused) st.flags |= PMB_STATUS_PAUSED;
+			st.clock = __atomic_load_n(&decoder_clock,__ATOMIC_RELAXED);
+			st.cues = CueCount();
+			memcpy(job->reply,&st,sizeof(st));
+			job->reply_len = sizeof(st);
+			break;
+	}
 
-			FlushMPEGOut();
-
-			// place the modified header in the buffer for output.
-			// since this code is optimized for 2048 byte/packet streams,
-			// and these streams have pack headers, we consider this
-			// a reset of the buffer.
-			mpeg_out[0] = mpeg_out[1] = 0x00;
-			mpeg_out[2] = 0x01;
-			mpeg_out[3] = 0xBA;
-			memcpy(mpeg_out+4,header,hlen);
-			mpeg_outi = 4 + hlen;
-			buf += hlen;
-			len -= hlen;
-			mpeg_state = 0;
-		}
-		else {
-			fprintf(stderr,"MPEG processing error: Unknown state 0x%08X\n",mpeg_state);
-			mpeg_state = 0;
+	return PMB_CMD_OK;
+}
+
+// a PMB_OP_AT request's commands, once it's time. what fails now can only
+// be logged.
+static void SocketFire(void *arg,long long late)
+{
+	struct pmb_cmd_job *job = arg;
+	int i;
+
+	if (late >= 0) {
+		pthread_mutex_lock(&pipe_lock);
+		for (i=0;i < job->count;i++) {
+			job->msg[0] = 0;
+			if (SocketRun(&job->cmd[i],job) != PMB_CMD_OK) {
+				PMBLog(PMB_LOG_WARNING,"Command socket: timed command %d failed: %s\n",i+1,job->msg);
+				break;
+			}
 		}
+		pthread_mutex_unlock(&pipe_lock);
+		PMBLog(PMB_LOG_DEBUG,"Command socket: %d timed commands, %.1fms late\n",job->count,late / 27000.0);
 	}
-
-	mpeg_in_remain = len;
-	if (len > 0) memmove(mpeg_in,buf,len);
+	free(job);
 }
 
-static void command(int argc,char **argv)
+static int SocketCue(struct pmb_cmd_job *job)
 {
-	if (argc < 1)
-		return;
+	struct pmb_cmd_job *copy;
+	unsigned long long at = job->at;
+	long long clock = 0;
 
-	if (!strcmp(argv[0],"volume")) {
-		if (argc == 3) {
-			int vl = -atoi(argv[1]);
-			if (vl < 0)   vl = 0;
-			if (vl > 255) vl = 255;
-			int vr = -atoi(argv[2]);
-			if (vr < 0)   vr = 0;
-			if (vr > 255) vr = 255;
-			PinnacleMovieBoxSetMasterVolume(vl,vr);
-		}
+	if ((job->at_flags & PMB_AT_RELATIVE) && (clock = CueClock()) < 0) {
+		snprintf(job->msg,sizeof(job->msg),"at: nothing playing yet");
+		return PMB_CMD_ESTATE;
 	}
-	else {
-		fprintf(stderr,"Command pipe: Unknown command %s\n",argv[0]);
+	at = ((unsigned long long)clock + at) % MPEG_CLOCK_WRAP;
+
+	if ((copy = malloc(sizeof(*copy))) == NULL) {
+		snprintf(job->msg,sizeof(job->msg),"at: out of memory");
+		return PMB_CMD_EFAIL;
+	}
+	memcpy(copy,job,sizeof(*copy));
+	if (CueAdd(at,SocketFire,copy) < 0) {
+		free(copy);
+		snprintf(job->msg,sizeof(job->msg),"at: %d timed commands waiting already",PMB_CUES);
+		return PMB_CMD_EFAIL;
 	}
+
+	return PMB_CMD_OK;
 }
 
-static int cmd_tmpi=0;
-static char cmd_tmp[64];
-void CMDInput(unsigned char *buf,int len)
+static void SocketLock()
 {
-	char c,*cb = (char*)buf;	// so the C compiler shuts the hell up about signed/unsigned char typecasting
+	pthread_mutex_lock(&pipe_lock);
+}
 
-	while (len-- > 0) {
-		c = *cb++;
-		if (c >= 32 || c < 0) {
-			if (cmd_tmpi < 63)
-				cmd_tmp[cmd_tmpi++] = c;
-		}
-		else if (c == 10) {
-			char *argv[32],*t;
-			int argc=0;
+static void SocketUnlock()
+{
+	pthread_mutex_unlock(&pipe_lock);
+}
 
-			cmd_tmp[cmd_tmpi] = 0;
-			argv[argc++] = cmd_tmp;
-			while (argc < 31 && (t=strchr(argv[argc-1],' ')) != NULL) {
-				while (*t == ' ') *t++ = 0;
-				argv[argc++] = t;
-			}
-			argv[argc] = NULL;
-			command(argc,argv);
-			cmd_tmpi = 0;
-		}
+static struct pmb_cmd_ops socket_ops = {
+	SocketCheck,SocketRun,SocketCue,SocketInline,SocketLock,SocketUnlock
+};
+
+// how long to sleep when there's nothing to do: 1ms, or less if the
+// scheduler has a pack or a timed command is due sooner
+static long IdleUsec()
+{
+	long us = 1000;
+
+	if (pace) {
+		long due = SchedIdleUsec();
+		if (due >= 0 && due < us) us = due;
 	}
+	if (CueCount() > 0) {
+		long due = CueIdleUsec();
+		if (due >= 0 && due < us) us = due;
+	}
+
+	return us;
+}
+
+// a sleep of us microseconds that started at t is over
+static void WakeLatency(long long t,long us)
+{
+	long long late = (MPEGHostClock() - t) - (us * 27LL);
+
+	MPEGLatencyAdd(&lat_wake,late > 0 ? late : 0);
+}
+
+static void usage()
+{
+	fprintf(stderr,"pmbpipe [options]\n");
+	fprintf(stderr,"  -z          read the feed FIFO straight into the parser buffer (no staging copy)\n");
+	fprintf(stderr,"  -ring       also accept a shared memory ring producer on %s\n",PMB_RING_SOCKET);
+	fprintf(stderr,"  -ts         feed is a MPEG transport stream\n");
+	fprintf(stderr,"  -program N  with -ts, play program_number N instead of the first in the PAT\n");
+	fprintf(stderr,"  -es         feed is a raw MPEG-1/2 video elementary stream\n");
+	fprintf(stderr,"  -es-audio   with -es, mux in a MPEG audio elementary stream from /var/video/mpeg.audio.fifo\n");
+	fprintf(stderr,"  -pace       release packs to the device by their SCR instead of as fast as possible\n");
+	fprintf(stderr,"  -lead MS    with -pace, run this far ahead of the decoder (default %llu)\n",sched_lead / 27000ULL);
+	fprintf(stderr,"  -burst N    with -pace, send at most N packs at once (default %d)\n",sched_burst);
+	fprintf(stderr,"  -live       low latency for live feeds: -z -pace -lead 100 -burst 1, partial packs\n");
+	fprintf(stderr,"              are sent padded instead of waiting for more data\n");
+	fprintf(stderr,"  -trim MS    run the SCR this much closer to the PTS, so decoding starts sooner\n");
+	fprintf(stderr,"  -cache DIR  play enqueued files from their pmbcache entries in DIR when there are any\n");
+	fprintf(stderr,"  -loglevel L only log messages up to L: err, warning, notice, info or debug (default %s)\n",PMBLogLevelName(pmb_log_level));
+	fprintf(stderr,"  -rt POLICY  run the playback thread as fifo or rr (real-time) instead of at nice -20\n");
+	fprintf(stderr,"  -rtprio N   with -rt, at priority N (default %d)\n",PMB_RT_PRIO);
+	fprintf(stderr,"  -mlock      lock all memory and fault it in ahead of time\n");
+	fprintf(stderr,"  -cpu LIST   run the playback thread on these CPUs (0,2-3), the other threads on the rest\n");
+	fprintf(stderr,"  -trace FILE trace every pack through each stage, written to FILE as Chrome trace JSON at exit\n");
+	fprintf(stderr,"  -metrics    serve Prometheus metrics on %s\n",PMB_METRICS_SOCKET);
+	fprintf(stderr,"  -cmdsock    also take commands on %s, answered, in batches\n",PMB_CMD_SOCKET);
+	fprintf(stderr,"  -state      keep the clock and device state in %s, and carry on from it\n",PMB_STATE_FILE);
+	fprintf(stderr,"  -coldinit   upload the firmware even if the MovieBox still has it\n");
+	fprintf(stderr,"  -cuedelay MS without -pace, timed commands take the decoder to be this far behind\n");
+	fprintf(stderr,"              the last pack written (default %lld)\n",cue_delay / 27000LL);
+	fprintf(stderr,"  -lograte N  write each message at most N times a second, 0 for no limit (default %d)\n",pmb_log_rate);
 }
 
 int main(int argc,char **argv)
 {
 	int idle = 1;
+	int zerocopy = 0;
+	int lead_set = 0,burst_set = 0;
+	struct pmb_state prev;
+	int resumed = 0;
+	int i;
 
-	unsigned char mpeg[2048];
-	int mpegi = 0;
+	long long staged = 0;
 
 	unsigned char input[2048];
 	int rd;
 
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-z")) {
+			zerocopy = 1;
+		}
+		else if (!strcmp(argv[i],"-ring")) {
+			use_ring = 1;
+		}
+		else if (!strcmp(argv[i],"-ts")) {
+			ts_input = 1;
+		}
+		else if (!strcmp(argv[i],"-program") && (i+1) < argc) {
+			ts_program = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-es")) {
+			es_input = 1;
+		}
+		else if (!strcmp(argv[i],"-es-audio")) {
+			es_input = 1;
+			es_audio = 1;
+		}
+		else if (!strcmp(argv[i],"-pace")) {
+			pace = 1;
+		}
+		else if (!strcmp(argv[i],"-lead") && (i+1) < argc) {
+			sched_lead = strtoull(argv[++i],NULL,0) * 27000ULL;
+			lead_set = 1;
+		}
+		else if (!strcmp(argv[i],"-burst") && (i+1) < argc) {
+			sched_burst = atoi(argv[++i]);
+			if (sched_burst < 1) sched_burst = 1;
+			burst_set = 1;
+		}
+		else if (!strcmp(argv[i],"-live")) {
+			live = 1;
+		}
+		else if (!strcmp(argv[i],"-trim") && (i+1) < argc) {
+			scr_trim = (strtoull(argv[++i],NULL,0) * 90ULL) << 9;	// 90KHz base, no extension
+		}
+		else if (!strcmp(argv[i],"-cache") && (i+1) < argc) {
+			pl_cache_dir = argv[++i];
+		}
+		else if (!strcmp(argv[i],"-loglevel") && (i+1) < argc) {
+			if ((pmb_log_level = PMBLogParseLevel(argv[++i])) < 0) {
+				usage();
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i],"-rt") && (i+1) < argc) {
+			if ((rt_policy = PMBRTParsePolicy(argv[++i])) < 0) {
+				usage();
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i],"-rtprio") && (i+1) < argc) {
+			rt_priority = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-mlock")) {
+			rt_mlock = 1;
+		}
+		else if (!strcmp(argv[i],"-cpu") && (i+1) < argc) {
+			if (PMBRTParseCPUs(argv[++i],&rt_cpus) < 0) {
+				usage();
+				return 1;
+			}
+			rt_have_cpus = 1;
+		}
+		else if (!strcmp(argv[i],"-trace") && (i+1) < argc) {
+			trace_file = argv[++i];
+			pmb_trace = 1;
+		}
+		else if (!strcmp(argv[i],"-metrics")) {
+			metrics = 1;
+		}
+		else if (!strcmp(argv[i],"-cmdsock")) {
+			cmdsock = 1;
+		}
+		else if (!strcmp(argv[i],"-state")) {
+			state = 1;
+		}
+		else if (!strcmp(argv[i],"-coldinit")) {
+			pmb_cold_init = 1;
+		}
+		else if (!strcmp(argv[i],"-cuedelay") && (i+1) < argc) {
+			cue_delay = atoi(argv[++i]) * 27000LL;
+			if (cue_delay < 0) cue_delay = 0;
+		}
+		else if (!strcmp(argv[i],"-lograte") && (i+1) < argc) {
+			pmb_log_rate = atoi(argv[++i]);
+			if (pmb_log_rate < 0) pmb_log_rate = 0;
+		}
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (live) {
+		// no staging buffer, nothing held back, small device queue
+		zerocopy = 1;
+		pace = 1;
+		if (!lead_set) sched_lead = 27000000ULL / 10;
+		if (!burst_set) sched_burst = 1;
+	}
+
 	if (mkdir("/var/video",0777) < 0 && errno != EEXIST) {
 		fprintf(stderr,"Cannot create /var/video\n");
 		return 1;
@@ -609,17 +1098,73 @@ int main(int argc,char **argv)
 		fprintf(stderr,"Cannot create /var/video/command fifo\n");
 		return 1;
 	}
+	if (es_audio && mkfifo("/var/video/mpeg.audio.fifo",0777) < 0 && errno != EEXIST) {
+		fprintf(stderr,"Cannot create /var/video/mpeg audio fifo\n");
+		return 1;
+	}
 
-	int src_fd = open(pipename="/var/video/mpeg.pes.feed.fifo",O_RDONLY|O_NONBLOCK);
+	// from here on messages from the playback loop are written by the log thread
+	if (PMBLogOpen() < 0)
+		return 1;
+
+	src_fd = open(pipename="/var/video/mpeg.pes.feed.fifo",O_RDONLY|O_NONBLOCK);
 	if (src_fd < 0) return 1;
 	int cmd_fd = open(cmdpipe="/var/video/command.fifo",O_RDONLY|O_NONBLOCK);
 	if (cmd_fd < 0) return 1;
+	if (es_audio) {
+		audio_fd = open("/var/video/mpeg.audio.fifo",O_RDONLY|O_NONBLOCK);
+		if (audio_fd < 0) return 1;
+	}
 	int s;
 
+	if (use_ring && PMBRingServerOpen(PMB_RING_SOCKET) < 0) {
+		fprintf(stderr,"Cannot set up shared memory ring input\n");
+		return 1;
+	}
+
+	if (metrics && PMBMetricsOpen(PMB_METRICS_SOCKET) < 0) {
+		fprintf(stderr,"Cannot set up the metrics socket\n");
+		return 1;
+	}
+
+	// before anything is parsed, so the first pack already carries on
+	if (state) {
+		if ((resumed = PMBStateOpen(PMB_STATE_FILE,&prev)) < 0) {
+			fprintf(stderr,"Cannot set up the state file\n");
+			return 1;
+		}
+		if (resumed > 0) {
+			long long gone = PMBStateResume(&prev);
+
+			PMBLog(PMB_LOG_INFO,"State: carrying on from SCR %.3fs, saved %.1fs ago\n",
+				(monotonic_SCR >> 9) / 90000.0,gone / 27000000.0);
+			if (prev.flags & PMB_STATE_DEVICE_UP)
+				pmb_left_running = prev.device;
+		}
+	}
+
+	if (!ts_input && !es_input) {
+		if (PlaylistOpen() < 0) return 1;
+		playlist = 1;
+	}
+
 	signal(SIGPIPE,sigma);
 	signal(SIGQUIT,sigma);
 	signal(SIGTERM,sigma);
 	signal(SIGINT,sigma);
+	signal(SIGUSR1,sigma);
+
+	CueClock = pace ? SchedClock : WrittenClock;
+	if (pace) {
+		MPEGOutput = SchedOutput;
+		SchedWrite = DeviceOutput;
+		SchedWriteRaw = DeviceOutputRaw;
+		PlaylistCacheOutput = CacheOutputPaced;
+	}
+	else {
+		MPEGOutput = DeviceOutput;
+		PlaylistCacheOutput = CacheOutput;
+	}
 
 	// initialize libusb
 	usb_init();
@@ -630,52 +1175,232 @@ int main(int argc,char **argv)
 		fprintf(stderr,"Cannot initialize Pinnacle MovieBox device\n");
 		return 1;
 	}
+	if (resumed > 0 && (prev.flags & PMB_STATE_DEVICE_UP) && !strcmp(prev.device,pmb_device) && !pmb_warm)
+		PMBLog(PMB_LOG_WARNING,"State: device %s was left running but had to be set up again\n",pmb_device);
+	if (pmb_state) {
+		strcpy(pmb_state->device,pmb_device);
+		pmb_state->flags |= PMB_STATE_DEVICE_UP;
+	}
+
+	// commands may talk to the device from here on
+	if (cmdsock && PMBCmdServerOpen(PMB_CMD_SOCKET,&socket_ops) < 0) {
+		fprintf(stderr,"Cannot set up the command socket\n");
+		PinnacleMovieBoxFree();
+		if (pmb_state) pmb_state->flags &= ~PMB_STATE_DEVICE_UP;
+		return 1;
+	}
 
-	// we need high priority in the system to ensure glitch-free playback
-	nice(-20);
+	// we need high priority in the system to ensure glitch-free playback.
+	// every other thread is running by now.
+	rt_failed = PMBRTApply();
 	while (!die) {
 		idle = 1;
 		if (PinnacleMovieBoxDeviceRemoved()) {
-			fprintf(stderr,"Device was removed! Exiting now!\n");
+			PMBLog(PMB_LOG_ERR,"Device was removed! Exiting now!\n");
 			break;
 		}
 
-		// read MPEG input. For the MPEG handler's sanity, don't feed it
-		// the stream until we have 2048 bytes ready.
-		if (mpegi < 2048) {
-			int rd = 2048 - mpegi;
-			rd = read(src_fd,mpeg+mpegi,rd);
+		// whatever is due goes to the device first. while the scheduler
+		// is holding plenty, input is left in the FIFO/ring so that the
+		// producer blocks instead of us.
+		if (pace && SchedRun() > 0)
+			idle = 0;
+
+		// and whatever timed command the decoder has got to
+		__atomic_store_n(&decoder_clock,CueClock(),__ATOMIC_RELAXED);
+		if (CueCount() > 0 && CuePoll() > 0)
+			idle = 0;
+		int hold = pace && SchedSpace() < 64;
+
+		// the playlist, or a ring producer while it is attached, owns
+		// the parser. mixing their packs with FIFO data would only
+		// produce garbage.
+		int playing = playlist && PlaylistActive();
+		if (use_ring && !hold && !playing && PMBRingServerPoll(RingInput,64) > 0)
+			idle = 0;
+
+		if (playing) {
+			if (!hold && (rd = PlaylistPoll()) > 0) {
+				idle = 0;
+				stat_bytes_in += rd;
+			}
+		}
+		else if (use_ring && PMBRingServerAttached()) {
+			// nothing from the FIFO
+		}
+		else if (hold) {
+			// nothing from the FIFO either
+		}
+		else if (zerocopy) {
+			// read MPEG input directly into the parser's buffer. The parser
+			// keeps whatever it can't use yet, so partial reads are fine.
+			// Producers may vmsplice() gifted pages into the FIFO; this read
+			// is then the only copy the kernel makes on our side.
+			unsigned char *p;
+			int room = FeedInputSpace(&p);
+			long long t = pmb_trace ? PMBTraceClock() : 0;
+			rd = read(src_fd,p,room);
 			if (rd > 0) {
+				if (pmb_trace) PMBTraceSpan(PMB_TRACE_READ,t,trace_made,rd);
 				idle = 0;
-				mpegi += rd;
+				stat_bytes_in += rd;
+				es_feeding = 1;
+				FeedInputCommit(rd);
+			}
+			else if (rd == 0 && es_input && es_feeding) {
+				// the writer went away: that's the end of this stream
+				ESFlush();
+				es_feeding = 0;
+			}
+		}
+		else {
+			// read MPEG input. For the MPEG handler's sanity, don't feed it
+			// the stream until we have 2048 bytes ready.
+			if (mpegi < 2048) {
+				int rd = 2048 - mpegi;
+				long long t = pmb_trace ? PMBTraceClock() : 0;
+				rd = read(src_fd,mpeg+mpegi,rd);
+				if (rd > 0) {
+					if (pmb_trace) PMBTraceSpan(PMB_TRACE_READ,t,trace_made,rd);
+					idle = 0;
+					if (mpegi == 0) staged = MPEGHostClock();
+					mpegi += rd;
+					stat_bytes_in += rd;
+					es_feeding = 1;
+				}
+				else if (rd == 0 && es_input && es_feeding) {
+					// the writer went away: that's the end of this stream
+					FeedInput(mpeg,mpegi);
+					mpegi = 0;
+					ESFlush();
+					es_feeding = 0;
+				}
+			}
+			if (mpegi == 2048) {
+				MPEGLatencyAdd(&lat_input,MPEGHostClock() - staged);
+				FeedInput(mpeg,mpegi);
+				mpegi = 0;
 			}
 		}
-		if (mpegi == 2048) {
-			MPEGInput(mpeg,mpegi);
-			mpegi = 0;
+
+		// live: don't sit on a partial pack waiting for data that isn't coming yet
+		if (live && idle) {
+			long long since = MPEGPendingSince();
+			if (since >= 0 && (MPEGHostClock() - since) >= LIVE_HOLD)
+				MPEGFlushPartial();
+		}
+
+		// paired audio elementary stream
+		if (audio_fd >= 0 && !hold) {
+			rd = read(audio_fd,input,2048);
+			if (rd > 0) {
+				idle = 0;
+				stat_bytes_in += rd;
+				audio_feeding = 1;
+				ESAudioInput(input,rd);
+			}
+			else if (rd == 0 && audio_feeding) {
+				ESAudioEnd();
+				audio_feeding = 0;
+			}
 		}
 
 		// read command input
 		rd = read(cmd_fd,input,2048);
 		if (rd > 0) {
 			idle = 0;
+			pthread_mutex_lock(&pipe_lock);
 			CMDInput(input,rd);
+			pthread_mutex_unlock(&pipe_lock);
+		}
+
+		// and what the command thread left for us, between two packs
+		if (cmdsock && PMBCmdServerPoll() > 0)
+			idle = 0;
+
+		if (idle && use_ring) {
+			// sleep until the ring producer kicks us (or 1ms passes, the
+			// FIFOs still have to be polled)
+			struct timeval tv;
+			fd_set rfds;
+			int fds[4],nfds,maxfd = -1;
+
+			PMBRingServerIdle();
+			FD_ZERO(&rfds);
+			nfds = PMBRingServerFds(fds,4);
+			for (i=0;i < nfds;i++) {
+				FD_SET(fds[i],&rfds);
+				if (fds[i] > maxfd) maxfd = fds[i];
+			}
+			tv.tv_sec = 0;
+			tv.tv_usec = IdleUsec();
+			long long t = MPEGHostClock();
+			long us = tv.tv_usec;
+			if (select(maxfd+1,&rfds,NULL,NULL,&tv) == 0)
+				WakeLatency(t,us);
+		}
+		else if (idle) {
+			long long t = MPEGHostClock();
+			long us = IdleUsec();
+			usleep(us);	// try not to suck up all CPU power
+			WakeLatency(t,us);
 		}
 
-		if (idle)
-			usleep(1000);		// try not to suck up all CPU power
+		if (flush_request) {
+			flush_request = 0;
+			pthread_mutex_lock(&pipe_lock);
+			Flush();
+			pthread_mutex_unlock(&pipe_lock);
+		}
+
+		if (seek_request) {
+			seek_request = 0;
+			pthread_mutex_lock(&pipe_lock);
+			Seek(seek_gop,seek_where);
+			pthread_mutex_unlock(&pipe_lock);
+		}
 
 		if (reset_ding) {
 			reset_ding=0;
-			mpeg_outi=0;		// just throw the junk away on behalf of the stupid thing
+			MPEGDiscardOutput();	// just throw the junk away on behalf of the stupid thing
+		}
+
+		if (report_stats) {
+			report_stats=0;
+			ReportStats();
+		}
+
+		if (metrics) {
+			long long now = MPEGHostClock();
+			if (rate_at < 0 || (now - rate_at) >= 27000000LL) {
+				if (rate_at >= 0)
+					input_rate = (stat_bytes_in - rate_bytes) * 27000000.0 / (now - rate_at);
+				rate_at = now;
+				rate_bytes = stat_bytes_in;
+			}
+			PMBMetricsPoll(Metrics);
 		}
 	}
 
+	ReportStats();
+	if (trace_file != NULL)
+		PMBTraceDump(trace_file,1);
+
+	if (cmdsock) PMBCmdServerClose();
+	CueClear();
 	PinnacleMovieBoxFree();
+	if (pmb_state) pmb_state->flags &= ~PMB_STATE_DEVICE_UP;
+	if (state) PMBStateClose();
+	PMBLogClose();
+	if (playlist) PlaylistClose();
+	if (use_ring) PMBRingServerClose();
+	if (metrics) PMBMetricsClose();
+	if (audio_fd >= 0) close(audio_fd);
 	close(cmd_fd);
 	close(src_fd);
 	unlink("/var/video/mpeg.pes.feed.fifo");
 	unlink("/var/video/command.fifo");
+	if (es_audio) unlink("/var/video/mpeg.audio.fifo");
 	rmdir("/var/video");
 }
 
@@ -1,23 +1,320 @@
 /* Pinnacle Moviebox USB playback program
  * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Streams a program stream file to the MovieBox. A reader thread keeps a
+ * queue of large buffers filled ahead of the USB writes, so that a slow or
+ * bursty source (a network mount) doesn't starve the device as long as it
+ * keeps up on average.
  */
 
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <usb.h>
 
 #include "libpmb.h"
+#include "pmbmpeg.h"
+#include "pmbindex.h"
+
+// the queue between the reader and the USB writes. buffers are a whole
+// number of packs, and big enough that one read brings in a lot.
+#define PLAY_SLOT		(256 * 1024)
+#define PLAY_QUEUE_MB		8
+
+// file read ahead of the reader by the kernel
+#define PLAY_READAHEAD		(16 * 1024 * 1024)
+
+struct play_slot {
+	unsigned char		*data;
+	int			len;
+};
+
+static struct play_slot *slots = NULL;
+static int nslots = 0;
+static int slot_head = 0,slot_count = 0;	// next to write out, and how many are full
+static int slot_fill = 0;			// the one the reader is filling (slot_head + slot_count)
+static int reader_done = 0;
+static pthread_mutex_t play_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t play_full = PTHREAD_COND_INITIALIZER;	// a slot was filled
+static pthread_cond_t play_free = PTHREAD_COND_INITIALIZER;	// a slot was written out
+
+static const char *path = NULL;
+static int src_fd = -1;
+static int loop = 0;
+static volatile int die = 0;
+static struct pmb_index_builder *build = NULL;
+
+static unsigned long long stat_read = 0,stat_written = 0;
+static unsigned long long stat_underruns = 0,stat_loops = 0;
+
+static void sigma(int x)
+{
+	die = 1;
+}
+
+// room in the slot being filled, waiting for one if the queue is full. 0 if
+// we're stopping.
+static int QueueSpace(unsigned char **p)
+{
+	struct play_slot *s;
+
+	pthread_mutex_lock(&play_lock);
+	while (slot_count >= nslots && !die)
+		pthread_cond_wait(&play_free,&play_lock);
+	pthread_mutex_unlock(&play_lock);
+	if (die)
+		return 0;
+
+	s = &slots[slot_fill];
+	*p = s->data + s->len;
+	return PLAY_SLOT - s->len;
+}
+
+// the slot goes out once it's full
+static void QueueCommit(int len)
+{
+	struct play_slot *s = &slots[slot_fill];
+
+	s->len += len;
+	if (s->len < PLAY_SLOT)
+		return;
+
+	pthread_mutex_lock(&play_lock);
+	slot_count++;
+	slot_fill = (slot_fill + 1) % nslots;
+	pthread_cond_signal(&play_full);
+	pthread_mutex_unlock(&play_lock);
+}
+
+// finished packs from the parser, when looping
+static void QueuePack(unsigned char *pack,int len)
+{
+	unsigned char *p;
+	int n;
+
+	while (len > 0 && (n = QueueSpace(&p)) > 0) {
+		if (n > len) n = len;
+		memcpy(p,pack,n);
+		QueueCommit(n);
+		pack += n;
+		len -= n;
+	}
+}
+
+static void *Reader(void *arg)
+{
+	static unsigned char buf[PLAY_SLOT];
+	off_t pos = lseek(src_fd,0,SEEK_CUR);
+	struct pmb_index *index;
+	unsigned char *p;
+	int n,rd;
+
+	if (pos < 0) pos = 0;		// a pipe
+	while (!die) {
+		// with -loop everything goes through the parser, so the clock
+		// carries on across the restart instead of jumping back
+		if (loop) {
+			n = sizeof(buf);
+			p = buf;
+		}
+		else if ((n = QueueSpace(&p)) <= 0) {
+			break;
+		}
+
+		rd = read(src_fd,p,n);
+		if (rd < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"\nError reading %s: %s\n",path,strerror(errno));
+			break;
+		}
+
+		if (rd == 0) {
+			if (build != NULL) {
+				// played from the start to the end, the index is done
+				if ((index = PMBIndexEnd(build)) != NULL) {
+					PMBIndexSave(index,path);
+					PMBIndexFree(index);
+				}
+				build = NULL;
+			}
+			if (!loop || pos == 0)
+				break;
+
+			stat_loops++;
+			lseek(src_fd,0,SEEK_SET);
+			posix_fadvise(src_fd,0,PLAY_READAHEAD,POSIX_FADV_WILLNEED);
+			pos = 0;
+			continue;
+		}
+
+		// keep the kernel reading ahead of us
+		if (((pos + rd) / PLAY_READAHEAD) != (pos / PLAY_READAHEAD))
+			posix_fadvise(src_fd,pos + rd,PLAY_READAHEAD,POSIX_FADV_WILLNEED);
+		if (build != NULL)
+			PMBIndexFeed(build,p,rd);
+		pos += rd;
+		stat_read += rd;
+
+		if (loop)
+			MPEGInput(buf,rd);
+		else
+			QueueCommit(rd);
+	}
+
+	if (loop)
+		FlushMPEGOut();
+
+	// and what's left over. if the queue is full, the slot after the
+	// last one is the writer's, not a partly filled one of ours.
+	pthread_mutex_lock(&play_lock);
+	if (slot_count < nslots && slots[slot_fill].len > 0) {
+		slot_count++;
+		slot_fill = (slot_fill + 1) % nslots;
+	}
+	reader_done = 1;
+	pthread_cond_signal(&play_full);
+	pthread_mutex_unlock(&play_lock);
+	return NULL;
+}
+
+static void Progress(unsigned long long size,long long t,long long dt,unsigned long long dbytes,int last)
+{
+	fprintf(stderr,"\r%.1fMB",stat_written / 1048576.0);
+	if (!loop && size > 0)
+		fprintf(stderr," of %.1fMB (%.0f%%)",size / 1048576.0,stat_written * 100.0 / size);
+	if (loop)
+		fprintf(stderr,", %llu loops",stat_loops);
+	fprintf(stderr,", %.2fMB/s, queue %d/%d, %llu underruns   ",
+		dt > 0 ? (dbytes / 1048576.0) / (dt / 27000000.0) : 0.0,
+		slot_count,nslots,stat_underruns);
+	if (last) fprintf(stderr,"\n");
+}
+
+static void usage()
+{
+	fprintf(stderr,"pmbplay [options] FILE\n");
+	fprintf(stderr,"  -index      just make FILE%s, the index seeking uses\n",PMB_INDEX_SUFFIX);
+	fprintf(stderr,"  -seek SECS  start this far into the file, at the GOP it falls in\n");
+	fprintf(stderr,"  -gop N      start at the N-th GOP (from 0)\n");
+	fprintf(stderr,"  -loop       start over at the end, until interrupted\n");
+	fprintf(stderr,"  -buffer MB  read this far ahead of the device (default %d)\n",PLAY_QUEUE_MB);
+	fprintf(stderr,"  -q          no progress report\n");
+}
 
-static unsigned char buffer[2048];
 int main(int argc,char **argv)
 {
-	int src_fd = open(argv[1],O_RDONLY);
-	if (src_fd < 0) return 1;
-	int s,f=0;
+	struct pmb_index *index = NULL;
+	struct play_slot *s;
+	struct stat st;
+	pthread_t reader;
+	int index_only = 0,quiet = 0,buffer_mb = PLAY_QUEUE_MB;
+	double seek_secs = -1;
+	long long seek_gop = -1,at = 0,n;
+	long long t,t0,last_t;
+	unsigned long long last_written = 0;
+	int i,ret = 0,started = 0;
+
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-index"))
+			index_only = 1;
+		else if (!strcmp(argv[i],"-seek") && (i+1) < argc)
+			seek_secs = atof(argv[++i]);
+		else if (!strcmp(argv[i],"-gop") && (i+1) < argc)
+			seek_gop = atoll(argv[++i]);
+		else if (!strcmp(argv[i],"-loop"))
+			loop = 1;
+		else if (!strcmp(argv[i],"-buffer") && (i+1) < argc)
+			buffer_mb = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-q"))
+			quiet = 1;
+		else if (argv[i][0] != '-' && path == NULL)
+			path = argv[i];
+		else {
+			usage();
+			return 1;
+		}
+	}
+	if (path == NULL) {
+		usage();
+		return 1;
+	}
+
+	if ((src_fd = open(path,O_RDONLY)) < 0 || fstat(src_fd,&st) < 0) {
+		fprintf(stderr,"Cannot open %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode) && !S_ISCHR(st.st_mode)) {
+		fprintf(stderr,"%s is not a file\n",path);
+		return 1;
+	}
+	if (!S_ISREG(st.st_mode) && (loop || index_only || seek_secs >= 0 || seek_gop >= 0)) {
+		fprintf(stderr,"%s is not a regular file, cannot seek in it\n",path);
+		return 1;
+	}
+
+	if (index_only || seek_secs >= 0 || seek_gop >= 0) {
+		if (!index_only)
+			index = PMBIndexLoad(path);
+		if (index == NULL) {
+			// one pass over the file, kept for next time
+			if ((index = PMBIndexBuild(path)) == NULL) {
+				fprintf(stderr,"Cannot index %s\n",path);
+				return 1;
+			}
+			PMBIndexSave(index,path);
+		}
+		if (index_only) {
+			fprintf(stderr,"%s: %llu packs, %.1fs\n",path,index->hdr.entries,
+				index->e[index->hdr.entries-1].st / 27000000.0);
+			PMBIndexFree(index);
+			return 0;
+		}
+
+		if (seek_gop >= 0)
+			n = PMBIndexSeekGOP(index,seek_gop);
+		else
+			n = PMBIndexSeekTime(index,(unsigned long long)(seek_secs * 27000000.0));
+		if (n < 0) {
+			fprintf(stderr,"Cannot seek there in %s\n",path);
+			return 1;
+		}
+		at = index->e[n].offset;
+		PMBIndexFree(index);
+	}
+	else if (S_ISREG(st.st_mode) && (index = PMBIndexLoad(path)) != NULL) {
+		PMBIndexFree(index);
+	}
+	else if (S_ISREG(st.st_mode)) {
+		// no index yet. make one on the way through.
+		build = PMBIndexBegin();
+	}
+
+	if (at > 0 && lseek(src_fd,at,SEEK_SET) != at) {
+		fprintf(stderr,"Cannot seek in %s\n",path);
+		return 1;
+	}
+	posix_fadvise(src_fd,0,0,POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(src_fd,at,PLAY_READAHEAD,POSIX_FADV_WILLNEED);
+
+	if (buffer_mb < 1) buffer_mb = 1;
+	nslots = (buffer_mb * 1024 * 1024) / PLAY_SLOT;
+	if (nslots < 2) nslots = 2;
+	if ((slots = calloc(nslots,sizeof(*slots))) == NULL)
+		return 1;
+	for (i=0;i < nslots;i++) {
+		if ((slots[i].data = malloc(PLAY_SLOT)) == NULL) {
+			fprintf(stderr,"Out of memory for a %dMB buffer\n",buffer_mb);
+			return 1;
+		}
+	}
 
 	// initialize libusb
 	usb_init();
@@ -29,12 +326,74 @@ int main(int argc,char **argv)
 		return 1;
 	}
 
-	do {
-		while ((s = read(src_fd,buffer,2048)) > 0) {
-			PinnacleMovieBoxWriteVideo(buffer,s);
+	signal(SIGINT,sigma);
+	signal(SIGTERM,sigma);
+	signal(SIGQUIT,sigma);
+
+	MPEGOutput = QueuePack;
+	if (pthread_create(&reader,NULL,Reader,NULL) != 0) {
+		fprintf(stderr,"Cannot start reader thread\n");
+		PinnacleMovieBoxFree();
+		return 1;
+	}
+
+	t0 = last_t = MPEGHostClock();
+	while (!die) {
+		pthread_mutex_lock(&play_lock);
+		// fill the queue before starting, that's what carries us
+		// over the source's slow moments
+		while (!started && slot_count < nslots && !reader_done && !die)
+			pthread_cond_wait(&play_full,&play_lock);
+		if (slot_count == 0 && !reader_done && started)
+			stat_underruns++;	// the device is waiting on the source
+		while (slot_count == 0 && !reader_done && !die)
+			pthread_cond_wait(&play_full,&play_lock);
+		if (slot_count == 0) {
+			pthread_mutex_unlock(&play_lock);
+			break;			// all of it is out
+		}
+		s = &slots[slot_head];
+		pthread_mutex_unlock(&play_lock);
+
+		if (s->len > 0 && PinnacleMovieBoxWriteVideo(s->data,s->len) < 0) {
+			fprintf(stderr,"\nCannot write to the MovieBox\n");
+			ret = 1;
+			die = 1;
+		}
+		stat_written += s->len;
+		started = 1;
+
+		pthread_mutex_lock(&play_lock);
+		s->len = 0;
+		slot_head = (slot_head + 1) % nslots;
+		slot_count--;
+		pthread_cond_signal(&play_free);
+		pthread_mutex_unlock(&play_lock);
+
+		t = MPEGHostClock();
+		if (!quiet && (t - last_t) >= 27000000LL) {
+			Progress(st.st_size,t,t - last_t,stat_written - last_written,0);
+			last_t = t;
+			last_written = stat_written;
 		}
-	} while (1);
+	}
+
+	// let the reader go if it's waiting on us
+	pthread_mutex_lock(&play_lock);
+	die = 1;
+	pthread_cond_broadcast(&play_free);
+	pthread_mutex_unlock(&play_lock);
+	pthread_join(reader,NULL);
 
+	t = MPEGHostClock();
+	if (!quiet)
+		Progress(st.st_size,t,t - t0,stat_written,1);
+
+	if (build != NULL) PMBIndexAbort(build);
 	PinnacleMovieBoxFree();
+	close(src_fd);
+	for (i=0;i < nslots;i++)
+		free(slots[i].data);
+	free(slots);
+	return ret;
 }
-
@@ -0,0 +1,515 @@
+/* Pinnacle Moviebox USB gapless playlist
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Concatenating MPEGs through the feed FIFO works, but the switch between
+ * files relies on the producer and on the SCR delta guessing in the pack
+ * header handler. Here pmbpipe reads the files itself. While one plays, a
+ * thread opens the next, reads its first stretch into memory and scans its
+ * head and tail for timestamps, so that when the current file ends the next
+ * one can be spliced on with its SCR and PTS exactly where they belong.
+ *
+ * A file with an entry in the pmbcache directory is played from the entry
+ * instead, around the parser: its packs are copied out, the timestamps at
+ * the marked places moved, and handed to PlaylistCacheOutput as they are.
+ *
+ * Files with an index (see pmbindex.h) can be sought in. Files without one
+ * get one made on the side while they play through to the end.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbcache.h"
+#include "pmbindex.h"
+#include "pmbplaylist.h"
+
+// read into memory ahead of time, and scanned for the starting timestamps
+#define PL_HEAD			(512 * 1024)
+
+// scanned for the ending timestamps
+#define PL_TAIL			(256 * 1024)
+
+// how far a skipped file is played on looking for a GOP to cut it at
+#define PL_CUT_MAX		(2 * 1024 * 1024)
+
+// packs sent from a cache entry per poll
+#define PL_CACHE_BURST		16
+
+#define PL_QUEUED		0
+#define PL_LOADING		1
+#define PL_READY		2
+#define PL_FAILED		3
+
+struct pl_item {
+	struct pl_item *next;
+	char *path;
+	int state;
+	int cancel;			// cleared while loading, the thread frees it
+	int fd;
+	unsigned char *head;
+	int head_len,head_pos;
+	struct mpeg_times times;
+
+	// played from the cache: next pack, timestamp offset, and where the
+	// last pack sent leaves the clock
+	struct pmb_cache *cache;
+	unsigned long long cache_pack;
+	unsigned long long cache_off;
+	unsigned long long cache_end;
+	unsigned long long cache_max_PTS;
+	int cache_have_PTS;
+
+	// its index if it has one, or the one being made as it plays
+	struct pmb_index *index;
+	struct pmb_index_builder *build;
+};
+
+unsigned long long stat_pl_items = 0,stat_pl_stalls = 0,stat_pl_failed = 0;
+unsigned long long stat_pl_cached = 0;
+
+// -cache DIR
+char *pl_cache_dir = NULL;
+void (*PlaylistCacheOutput)(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures) = NULL;
+
+// the queue is shared with the read ahead thread. what's playing belongs
+// to the main thread alone.
+static pthread_mutex_t pl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pl_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t pl_thread;
+static int pl_running = 0,pl_quit = 0;
+static struct pl_item *pl_queue = NULL;		// the head plays next
+
+static struct pl_item *pl_cur = NULL;
+static int pl_skip = 0,pl_skip_left = 0;
+static int pl_waiting = 0;			// one ended, the next isn't ready
+static int pl_stalled = 0;
+
+// PlaylistSeek(): the current file goes on from somewhere else, as a new
+// stream starting there
+static int pl_seek = 0;
+static struct mpeg_times pl_seek_times;
+
+static void PlaylistFree(struct pl_item *it)
+{
+	if (it->fd >= 0) close(it->fd);
+	if (it->cache != NULL) PMBCacheClose(it->cache);
+	if (it->index != NULL) PMBIndexFree(it->index);
+	if (it->build != NULL) PMBIndexAbort(it->build);
+	free(it->head);
+	free(it->path);
+	free(it);
+}
+
+// open, read ahead and scan one file. runs on the thread, without the lock.
+static int PlaylistLoad(struct pl_item *it)
+{
+	struct mpeg_times tail;
+	struct stat st;
+	unsigned char *buf;
+	off_t at;
+	int rd;
+
+	if (pl_cache_dir != NULL && (it->cache = PMBCacheOpen(pl_cache_dir,it->path)) != NULL) {
+		PMBCacheTimes(it->cache,&it->times);
+		return 0;
+	}
+
+	if ((it->fd = open(it->path,O_RDONLY)) < 0) {
+		PMBLog(PMB_LOG_ERR,"Playlist: cannot open %s: %s\n",it->path,strerror(errno));
+		return -1;
+	}
+	if ((it->index = PMBIndexLoad(it->path)) == NULL)
+		it->build = PMBIndexBegin();
+	posix_fadvise(it->fd,0,0,POSIX_FADV_SEQUENTIAL);
+
+	if ((it->head = malloc(PL_HEAD)) == NULL)
+		return -1;
+	while (it->head_len < PL_HEAD) {
+		rd = read(it->fd,it->head+it->head_len,PL_HEAD-it->head_len);
+		if (rd < 0 && errno == EINTR) continue;
+		if (rd <= 0) break;
+		it->head_len += rd;
+	}
+
+	memset(&it->times,0,sizeof(it->times));
+	MPEGScanTimes(it->head,it->head_len,&it->times);
+	if (!it->times.have_SCR) {
+		PMBLog(PMB_LOG_ERR,"Playlist: %s is not a MPEG program stream\n",it->path);
+		return -1;
+	}
+
+	// the end of the file, for the record. the start is what splicing needs.
+	if (fstat(it->fd,&st) == 0 && st.st_size > it->head_len && (buf = malloc(PL_TAIL)) != NULL) {
+		at = st.st_size - PL_TAIL;
+		if (at < it->head_len) at = it->head_len;
+		rd = pread(it->fd,buf,PL_TAIL,at);
+		if (rd > 0) {
+			memset(&tail,0,sizeof(tail));
+			MPEGScanTimes(buf,rd,&tail);
+			if (tail.have_SCR)
+				it->times.last_SCR = tail.last_SCR;
+			if (tail.have_PTS && (!it->times.have_PTS || tail.last_PTS > it->times.last_PTS)) {
+				it->times.last_PTS = tail.last_PTS;
+				if (!it->times.have_PTS) it->times.first_PTS = tail.first_PTS;
+				it->times.have_PTS = 1;
+			}
+		}
+		free(buf);
+
+		// and get the kernel going on what comes after the head
+		posix_fadvise(it->fd,it->head_len,PL_HEAD * 4,POSIX_FADV_WILLNEED);
+	}
+
+	return 0;
+}
+
+static void *PlaylistThread(void *arg)
+{
+	struct pl_item *it;
+	int r;
+
+	pthread_mutex_lock(&pl_lock);
+	while (!pl_quit) {
+		// only the file that plays next is read ahead
+		it = pl_queue;
+		if (it == NULL || it->state != PL_QUEUED) {
+			pthread_cond_wait(&pl_wake,&pl_lock);
+			continue;
+		}
+
+		it->state = PL_LOADING;
+		pthread_mutex_unlock(&pl_lock);
+		r = PlaylistLoad(it);
+		pthread_mutex_lock(&pl_lock);
+
+		if (it->cancel)
+			PlaylistFree(it);
+		else
+			it->state = (r < 0) ? PL_FAILED : PL_READY;
+	}
+	pthread_mutex_unlock(&pl_lock);
+
+	return NULL;
+}
+
+int PlaylistOpen()
+{
+	pl_quit = 0;
+	if (pthread_create(&pl_thread,NULL,PlaylistThread,NULL) != 0) {
+		PMBLog(PMB_LOG_ERR,"Playlist: cannot start read ahead thread\n");
+		return -1;
+	}
+
+	pl_running = 1;
+	return 0;
+}
+
+void PlaylistClose()
+{
+	if (!pl_running)
+		return;
+
+	pthread_mutex_lock(&pl_lock);
+	pl_quit = 1;
+	pthread_cond_broadcast(&pl_wake);
+	pthread_mutex_unlock(&pl_lock);
+	pthread_join(pl_thread,NULL);
+	pl_running = 0;
+
+	PlaylistClear();
+	if (pl_cur != NULL) {
+		PlaylistFree(pl_cur);
+		pl_cur = NULL;
+	}
+}
+
+int PlaylistEnqueue(const char *path)
+{
+	struct pl_item *it,**pp;
+
+	if (!pl_running)
+		return -1;
+	if ((it = calloc(1,sizeof(*it))) == NULL)
+		return -1;
+	if ((it->path = strdup(path)) == NULL) {
+		free(it);
+		return -1;
+	}
+	it->fd = -1;
+	it->state = PL_QUEUED;
+
+	pthread_mutex_lock(&pl_lock);
+	for (pp=&pl_queue;*pp != NULL;pp=&(*pp)->next);
+	*pp = it;
+	pthread_cond_signal(&pl_wake);
+	pthread_mutex_unlock(&pl_lock);
+	return 0;
+}
+
+// drop everything that hasn't started playing yet
+void PlaylistClear()
+{
+	struct pl_item *it;
+
+	pthread_mutex_lock(&pl_lock);
+	while ((it = pl_queue) != NULL) {
+		pl_queue = it->next;
+		if (it->state == PL_LOADING)
+			it->cancel = 1;
+		else
+			PlaylistFree(it);
+	}
+	pthread_mutex_unlock(&pl_lock);
+}
+
+int PlaylistActive()
+{
+	int r;
+
+	if (pl_cur != NULL)
+		return 1;
+
+	pthread_mutex_lock(&pl_lock);
+	r = (pl_queue != NULL);
+	pthread_mutex_unlock(&pl_lock);
+	return r;
+}
+
+// files waiting to be played, not counting the current one
+int PlaylistQueued()
+{
+	struct pl_item *it;
+	int n = 0;
+
+	pthread_mutex_lock(&pl_lock);
+	for (it=pl_queue;it != NULL;it=it->next)
+		n++;
+	pthread_mutex_unlock(&pl_lock);
+	return n;
+}
+
+// the current file is done with, by reaching the end or by being skipped.
+// don't leave half a PES of it in the parser for whatever comes next.
+static void PlaylistEnd()
+{
+	struct pl_item *it = pl_cur;
+
+	pl_cur = NULL;
+	pl_skip = 0;
+	pl_seek = 0;
+	pl_waiting = 1;
+	MPEGEndStream();
+	if (it->cache != NULL)
+		MPEGExternalEnd(it->cache_end,it->cache_have_PTS,it->cache_max_PTS,it->times.frame_ticks);
+	PlaylistFree(it);
+}
+
+// the current file is cut at its next GOP, which is usually only a few
+// hundred KB away
+void PlaylistSkip()
+{
+	if (pl_cur != NULL && !pl_skip) {
+		PMBLog(PMB_LOG_INFO,"Playlist: skipping %s\n",pl_cur->path);
+		pl_skip = 1;
+		pl_skip_left = PL_CUT_MAX;
+		if (pl_cur->cache == NULL)
+			MPEGCut();
+		if (pl_cur->build != NULL) {
+			PMBIndexAbort(pl_cur->build);
+			pl_cur->build = NULL;
+		}
+	}
+}
+
+// go on with the current file from the GOP a time (27MHz ticks from its
+// start) falls in, or from its n-th GOP. what has been sent of it so far is
+// the caller's to get rid of before the next PlaylistPoll().
+int PlaylistSeek(int gop,unsigned long long where)
+{
+	struct pl_item *it = pl_cur;
+	unsigned long long at;
+	long long i;
+
+	if (it == NULL)
+		return -1;
+	if (it->index == NULL) {
+		PMBLog(PMB_LOG_WARNING,"Playlist: %s has no index, cannot seek in it\n",it->path);
+		return -1;
+	}
+
+	i = gop ? PMBIndexSeekGOP(it->index,where) : PMBIndexSeekTime(it->index,where);
+	if (i < 0) {
+		PMBLog(PMB_LOG_WARNING,"Playlist: %s isn't that long\n",it->path);
+		return -1;
+	}
+
+	// what was read ahead may still be of use
+	at = it->index->e[i].offset;
+	if (at < (unsigned long long)it->head_len) {
+		if (lseek(it->fd,it->head_len,SEEK_SET) < 0)
+			return -1;
+		it->head_pos = at;
+	}
+	else {
+		if (lseek(it->fd,at,SEEK_SET) < 0)
+			return -1;
+		it->head_pos = it->head_len;
+	}
+
+	PMBLog(PMB_LOG_INFO,"Playlist: %s from %.1fs\n",it->path,
+		it->index->e[i].st / 27000000.0);
+	PMBIndexTimes(it->index,i,&pl_seek_times);
+	pl_seek = 1;
+	pl_skip = 0;
+	return 0;
+}
+
+// everything, the file playing now included, goes right away
+void PlaylistStop()
+{
+	PlaylistClear();
+	if (pl_cur != NULL)
+		PlaylistEnd();
+}
+
+// start the next file, if it's been read ahead
+static int PlaylistNext()
+{
+	struct pl_item *it;
+	long long off;
+
+	pthread_mutex_lock(&pl_lock);
+	while ((it = pl_queue) != NULL && it->state == PL_FAILED) {
+		pl_queue = it->next;
+		stat_pl_failed++;
+		PlaylistFree(it);
+		pthread_cond_signal(&pl_wake);	// on to reading the one after
+	}
+	if (it == NULL || it->state != PL_READY) {
+		if (it != NULL && pl_waiting && !pl_stalled) {
+			stat_pl_stalls++;
+			pl_stalled = 1;
+		}
+		pthread_mutex_unlock(&pl_lock);
+		return -1;
+	}
+	pl_queue = it->next;
+	pthread_cond_signal(&pl_wake);		// on to reading the one after
+	pthread_mutex_unlock(&pl_lock);
+
+	if (it->cache != NULL) {
+		PMBLog(PMB_LOG_INFO,"Playlist: playing %s from the cache\n",it->path);
+		off = MPEGSpliceExternal(&it->times);
+		it->cache_off = (off < 0) ? (off + MPEG_CLOCK_WRAP) : off;
+		it->cache_end = it->cache_off;
+		stat_pl_cached++;
+	}
+	else {
+		PMBLog(PMB_LOG_INFO,"Playlist: playing %s\n",it->path);
+		MPEGSplice(&it->times);
+	}
+	pl_cur = it;
+	pl_waiting = pl_stalled = 0;
+	stat_pl_items++;
+	return 0;
+}
+
+// a few packs from the cache entry. a skip ends it in front of the pack
+// where the next GOP starts.
+static int PlaylistPollCache()
+{
+	static unsigned char pack[2048];
+	struct pmb_cache *c = pl_cur->cache;
+	struct pmb_cache_pack info;
+	unsigned long long trim = (scr_trim >> 9) * 300ULL;
+	unsigned long mux_rate = c->hdr->mux_rate;
+	int n;
+
+	for (n=0;n < PL_CACHE_BURST;n++) {
+		if (pl_cur->cache_pack >= c->hdr->packs) {
+			PlaylistEnd();
+			break;
+		}
+
+		PMBCachePack(c,pl_cur->cache_pack,pack,pl_cur->cache_off,trim,&info);
+		if (pl_skip && (info.gop || (pl_skip_left -= 2048) <= 0)) {
+			PlaylistEnd();
+			break;
+		}
+		pl_cur->cache_pack++;
+
+		pl_cur->cache_end = info.SCR;
+		if (mux_rate != 0)
+			pl_cur->cache_end += (2048ULL * 27000000ULL) / (mux_rate * 50ULL);
+		if (info.have_PTS && (!pl_cur->cache_have_PTS || info.max_PTS > pl_cur->cache_max_PTS)) {
+			pl_cur->cache_max_PTS = info.max_PTS;
+			pl_cur->cache_have_PTS = 1;
+		}
+
+		if (PlaylistCacheOutput != NULL)
+			PlaylistCacheOutput(pack,info.SCR,mux_rate,info.pictures);
+	}
+
+	return n * 2048;
+}
+
+int PlaylistPoll()
+{
+	unsigned char *p;
+	int n,rd;
+
+	if (pl_cur == NULL && PlaylistNext() < 0)
+		return 0;
+	if (pl_cur->cache != NULL)
+		return PlaylistPollCache();
+	if (pl_seek) {
+		MPEGSplice(&pl_seek_times);
+		pl_seek = 0;
+	}
+
+	if ((n = MPEGInputSpace(&p)) <= 0) {
+		MPEGInputCommit(0);
+		return 0;
+	}
+
+	if (pl_cur->head_pos < pl_cur->head_len) {
+		rd = pl_cur->head_len - pl_cur->head_pos;
+		if (rd > n) rd = n;
+		memcpy(p,pl_cur->head+pl_cur->head_pos,rd);
+		stat_bytes_copied += rd;
+		pl_cur->head_pos += rd;
+	}
+	else {
+		rd = read(pl_cur->fd,p,n);
+		if (rd < 0 && errno == EINTR)
+			return 0;
+		if (rd <= 0) {
+			if (rd < 0) PMBLog(PMB_LOG_ERR,"Playlist: error reading %s: %s\n",pl_cur->path,strerror(errno));
+			if (rd == 0 && pl_cur->build != NULL) {
+				// played through from the start, the index is complete
+				if ((pl_cur->index = PMBIndexEnd(pl_cur->build)) != NULL)
+					PMBIndexSave(pl_cur->index,pl_cur->path);
+				pl_cur->build = NULL;
+			}
+			PlaylistEnd();
+			return 0;
+		}
+	}
+
+	if (pl_cur->build != NULL)
+		PMBIndexFeed(pl_cur->build,p,rd);
+	MPEGInputCommit(rd);
+	if (pl_skip && (MPEGCutDone() || (pl_skip_left -= rd) <= 0))
+		PlaylistEnd();
+	return rd;
+}
@@ -0,0 +1,34 @@
+// gapless playlist (pmbplaylist.c)
+//
+// Program stream files queued from the command FIFO are played one after
+// the other by pmbpipe itself. The next file is opened, read ahead and
+// scanned for its timestamps by a background thread while the current one
+// plays, so it can be spliced on (see MPEGSplice()) without a gap.
+
+int PlaylistOpen();
+void PlaylistClose();
+
+int PlaylistEnqueue(const char *path);
+void PlaylistSkip();
+void PlaylistClear();
+void PlaylistStop();
+int PlaylistSeek(int gop,unsigned long long where);
+
+// set while there is something playing or queued. the playlist owns the
+// parser then, the feed FIFO waits.
+int PlaylistActive();
+int PlaylistQueued();
+
+// feed the parser from the current file, moving on to the next one at
+// the end. returns how many bytes went in.
+int PlaylistPoll();
+
+// accounting. stalls are times the next file wasn't read ahead yet when
+// the current one ended.
+extern unsigned long long stat_pl_items,stat_pl_stalls,stat_pl_failed;
+extern unsigned long long stat_pl_cached;
+
+// pmbcache directory to look files up in (-cache), and where packs played
+// from a cache entry go. they are in the MovieBox's byte order already.
+extern char *pl_cache_dir;
+extern void (*PlaylistCacheOutput)(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures);
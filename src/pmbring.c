@@ -0,0 +1,382 @@
+/* Pinnacle Moviebox USB shared memory input ring
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbring.h. Both halves live here: the client library producers link
+ * against, and the consumer side pmbpipe uses.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "pmbring.h"
+
+static void Wake(int efd)
+{
+	uint64_t one = 1;
+	write(efd,&one,sizeof(one));
+}
+
+static void Drain(int efd)
+{
+	uint64_t v;
+	read(efd,&v,sizeof(v));
+}
+
+// ---------------------------------------------------------------- producer
+
+int PMBRingConnect(struct pmb_ring_client *c,const char *path)
+{
+	struct sockaddr_un sa;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char cbuf[CMSG_SPACE(sizeof(int)*3)];
+	char tag;
+	int fds[3];
+
+	memset(c,0,sizeof(*c));
+	c->sock = c->mem_fd = c->data_efd = c->space_efd = -1;
+
+	if ((c->sock = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+		return -1;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path,path ? path : PMB_RING_SOCKET,sizeof(sa.sun_path)-1);
+	if (connect(c->sock,(struct sockaddr*)&sa,sizeof(sa)) < 0) {
+		fprintf(stderr,"PMBRingConnect: cannot connect to %s: %s\n",sa.sun_path,strerror(errno));
+		PMBRingClose(c);
+		return -1;
+	}
+
+	// pmbpipe answers with one byte and the memfd + eventfds
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(c->sock,&msg,0) < 1) {
+		fprintf(stderr,"PMBRingConnect: pmbpipe refused the connection (another producer attached?)\n");
+		PMBRingClose(c);
+		return -1;
+	}
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (cm == NULL || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(int)*3)) {
+		fprintf(stderr,"PMBRingConnect: bad handshake\n");
+		PMBRingClose(c);
+		return -1;
+	}
+	memcpy(fds,CMSG_DATA(cm),sizeof(int)*3);
+	c->mem_fd = fds[0];
+	c->data_efd = fds[1];
+	c->space_efd = fds[2];
+
+	c->ring = mmap(NULL,sizeof(struct pmb_ring),PROT_READ|PROT_WRITE,MAP_SHARED,c->mem_fd,0);
+	if (c->ring == MAP_FAILED) {
+		c->ring = NULL;
+		PMBRingClose(c);
+		return -1;
+	}
+	if (c->ring->magic != PMB_RING_MAGIC || c->ring->slots != PMB_RING_SLOTS) {
+		fprintf(stderr,"PMBRingConnect: ring layout mismatch\n");
+		PMBRingClose(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+// returns the next free slot, sleeping on space_efd if the ring is full
+unsigned char *PMBRingAcquire(struct pmb_ring_client *c)
+{
+	struct pmb_ring *r = c->ring;
+	unsigned int head = r->head;
+
+	while ((head - __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE)) >= r->slots) {
+		struct pollfd pfd;
+
+		__atomic_store_n(&r->producer_waiting,1,__ATOMIC_SEQ_CST);
+		if ((head - __atomic_load_n(&r->tail,__ATOMIC_SEQ_CST)) < r->slots)
+			break;
+
+		pfd.fd = c->space_efd;
+		pfd.events = POLLIN;
+		if (poll(&pfd,1,1000) > 0)
+			Drain(c->space_efd);
+
+		// pmbpipe went away?
+		pfd.fd = c->sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd,1,0) > 0 && (pfd.revents & (POLLHUP|POLLIN)))
+			return NULL;
+	}
+	__atomic_store_n(&r->producer_waiting,0,__ATOMIC_RELAXED);
+
+	return r->data[head & (r->slots - 1)];
+}
+
+void PMBRingCommit(struct pmb_ring_client *c,int len)
+{
+	struct pmb_ring *r = c->ring;
+	unsigned int head = r->head;
+
+	r->len[head & (r->slots - 1)] = len;
+	__atomic_store_n(&r->head,head + 1,__ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (r->consumer_waiting)
+		Wake(c->data_efd);
+}
+
+// convenience wrapper for producers that don't build packs in place
+int PMBRingWrite(struct pmb_ring_client *c,unsigned char *buf,int len)
+{
+	int done = 0;
+
+	while (len > 0) {
+		int s = len > PMB_RING_PACK ? PMB_RING_PACK : len;
+		unsigned char *slot = PMBRingAcquire(c);
+		if (slot == NULL)
+			return done ? done : -1;
+
+		memcpy(slot,buf,s);
+		PMBRingCommit(c,s);
+		buf += s;
+		len -= s;
+		done += s;
+	}
+
+	return done;
+}
+
+void PMBRingClose(struct pmb_ring_client *c)
+{
+	if (c->ring) munmap(c->ring,sizeof(struct pmb_ring));
+	if (c->mem_fd >= 0) close(c->mem_fd);
+	if (c->data_efd >= 0) close(c->data_efd);
+	if (c->space_efd >= 0) close(c->space_efd);
+	if (c->sock >= 0) close(c->sock);
+	c->ring = NULL;
+	c->sock = c->mem_fd = c->data_efd = c->space_efd = -1;
+}
+
+// ---------------------------------------------------------------- consumer
+
+static struct pmb_ring *srv_ring = NULL;
+static int srv_listen = -1;
+static int srv_conn = -1;
+static int srv_mem_fd = -1;
+static int srv_data_efd = -1;
+static int srv_space_efd = -1;
+static char srv_path[108];
+
+int PMBRingServerOpen(const char *path)
+{
+	struct sockaddr_un sa;
+
+	strncpy(srv_path,path ? path : PMB_RING_SOCKET,sizeof(srv_path)-1);
+
+	srv_mem_fd = memfd_create("pmbring",MFD_CLOEXEC);
+	if (srv_mem_fd < 0) {
+		fprintf(stderr,"Cannot create ring memfd: %s\n",strerror(errno));
+		return -1;
+	}
+	if (ftruncate(srv_mem_fd,sizeof(struct pmb_ring)) < 0) {
+		fprintf(stderr,"Cannot size ring memfd: %s\n",strerror(errno));
+		return -1;
+	}
+	srv_ring = mmap(NULL,sizeof(struct pmb_ring),PROT_READ|PROT_WRITE,MAP_SHARED,srv_mem_fd,0);
+	if (srv_ring == MAP_FAILED) {
+		srv_ring = NULL;
+		fprintf(stderr,"Cannot map ring memfd: %s\n",strerror(errno));
+		return -1;
+	}
+	srv_ring->magic = PMB_RING_MAGIC;
+	srv_ring->slots = PMB_RING_SLOTS;
+
+	srv_data_efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	srv_space_efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (srv_data_efd < 0 || srv_space_efd < 0) {
+		fprintf(stderr,"Cannot create ring eventfds: %s\n",strerror(errno));
+		return -1;
+	}
+
+	if ((srv_listen = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0)) < 0)
+		return -1;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,srv_path);
+	unlink(srv_path);
+	if (bind(srv_listen,(struct sockaddr*)&sa,sizeof(sa)) < 0 || listen(srv_listen,4) < 0) {
+		fprintf(stderr,"Cannot listen on %s: %s\n",srv_path,strerror(errno));
+		return -1;
+	}
+	chmod(srv_path,0777);
+
+	return 0;
+}
+
+// descriptors the caller should select() on while idle
+int PMBRingServerFds(int *fds,int max)
+{
+	int n = 0;
+
+	if (srv_listen >= 0 && n < max) fds[n++] = srv_listen;
+	if (srv_conn >= 0 && n < max) fds[n++] = srv_conn;
+	if (srv_data_efd >= 0 && n < max) fds[n++] = srv_data_efd;
+	return n;
+}
+
+static void ServerAccept()
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char cbuf[CMSG_SPACE(sizeof(int)*3)];
+	char tag = 'R';
+	int fds[3];
+	int s;
+
+	while ((s = accept(srv_listen,NULL,NULL)) >= 0) {
+		if (srv_conn >= 0) {
+			// single producer only. closing without the handshake tells the
+			// newcomer to go away.
+			close(s);
+			continue;
+		}
+
+		// fresh producer, fresh ring
+		srv_ring->head = srv_ring->tail = 0;
+		srv_ring->consumer_waiting = srv_ring->producer_waiting = 0;
+
+		fds[0] = srv_mem_fd;
+		fds[1] = srv_data_efd;
+		fds[2] = srv_space_efd;
+		memset(&msg,0,sizeof(msg));
+		iov.iov_base = &tag;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int)*3);
+		memcpy(CMSG_DATA(cm),fds,sizeof(int)*3);
+
+		if (sendmsg(s,&msg,MSG_NOSIGNAL) < 1) {
+			fprintf(stderr,"Ring: handshake with producer failed: %s\n",strerror(errno));
+			close(s);
+			continue;
+		}
+
+		fcntl(s,F_SETFL,O_NONBLOCK);
+		srv_conn = s;
+		fprintf(stderr,"Ring: producer attached\n");
+	}
+}
+
+// hand up to max_packs packs to consume(). the data path is plain loads and
+// stores on shared memory; syscalls only happen on attach/detach and when the
+// producer is asleep waiting for room.
+int PMBRingServerPoll(void (*consume)(unsigned char *buf,int len),int max_packs)
+{
+	unsigned int tail,head;
+	int n = 0;
+
+	if (srv_ring == NULL)
+		return 0;
+
+	ServerAccept();
+	if (srv_ring->consumer_waiting) {
+		srv_ring->consumer_waiting = 0;
+		Drain(srv_data_efd);
+	}
+
+	tail = srv_ring->tail;
+	head = __atomic_load_n(&srv_ring->head,__ATOMIC_ACQUIRE);
+	while (tail != head && n < max_packs) {
+		unsigned int slot = tail & (srv_ring->slots - 1);
+		int len = srv_ring->len[slot];
+
+		if (len > PMB_RING_PACK) len = PMB_RING_PACK;
+		consume(srv_ring->data[slot],len);
+		__atomic_store_n(&srv_ring->tail,++tail,__ATOMIC_RELEASE);
+		n++;
+	}
+
+	if (n > 0) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (srv_ring->producer_waiting)
+			Wake(srv_space_efd);
+	}
+	else if (srv_conn >= 0) {
+		// ring is empty. has the producer gone away?
+		char c;
+		int r = read(srv_conn,&c,1);
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			fprintf(stderr,"Ring: producer detached\n");
+			close(srv_conn);
+			srv_conn = -1;
+		}
+	}
+
+	return n;
+}
+
+int PMBRingServerAttached()
+{
+	return srv_conn >= 0;
+}
+
+// packs the producer has put in that we haven't taken out yet
+int PMBRingServerQueued()
+{
+	if (srv_ring == NULL || srv_conn < 0)
+		return 0;
+
+	return (int)(__atomic_load_n(&srv_ring->head,__ATOMIC_ACQUIRE) - srv_ring->tail);
+}
+
+// called before the consumer goes to sleep so the producer knows to kick
+// data_efd on its next commit.
+void PMBRingServerIdle()
+{
+	if (srv_ring == NULL)
+		return;
+
+	__atomic_store_n(&srv_ring->consumer_waiting,1,__ATOMIC_SEQ_CST);
+	if (srv_ring->head != srv_ring->tail)
+		Wake(srv_data_efd);	// raced with a commit, don't sleep
+}
+
+void PMBRingServerClose()
+{
+	if (srv_conn >= 0) close(srv_conn);
+	if (srv_listen >= 0) close(srv_listen);
+	if (srv_ring) munmap(srv_ring,sizeof(struct pmb_ring));
+	if (srv_mem_fd >= 0) close(srv_mem_fd);
+	if (srv_data_efd >= 0) close(srv_data_efd);
+	if (srv_space_efd >= 0) close(srv_space_efd);
+	if (srv_listen >= 0) unlink(srv_path);
+	srv_ring = NULL;
+	srv_conn = srv_listen = srv_mem_fd = srv_data_efd = srv_space_efd = -1;
+}
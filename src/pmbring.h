@@ -0,0 +1,52 @@
+/* Pinnacle Moviebox USB shared memory input ring
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * A second way to feed pmbpipe. Instead of write()ing MPEG into the feed
+ * FIFO, a co-located producer connects to the ring socket and receives a
+ * memfd holding a ring of 2048-byte packs plus two eventfds. Packs are
+ * written straight into shared memory; the eventfds are only touched when
+ * one side is actually asleep waiting for the other.
+ *
+ * There is exactly one producer at a time.
+ */
+
+#define PMB_RING_SOCKET		"/var/video/mpeg.ring.sock"
+#define PMB_RING_MAGIC		0x504D4252	/* 'PMBR' */
+#define PMB_RING_PACK		2048
+#define PMB_RING_SLOTS		256		/* must be a power of 2 */
+
+struct pmb_ring {
+	unsigned int		magic;
+	unsigned int		slots;
+	volatile unsigned int	head;			// next slot the producer fills
+	volatile unsigned int	tail;			// next slot the consumer reads
+	volatile unsigned int	consumer_waiting;	// consumer sleeps on data_efd
+	volatile unsigned int	producer_waiting;	// producer sleeps on space_efd
+	unsigned int		reserved[10];		// keep the counters on their own cache line
+	unsigned short		len[PMB_RING_SLOTS];	// valid bytes in each slot
+	unsigned char		data[PMB_RING_SLOTS][PMB_RING_PACK];
+};
+
+// producer side (the client library)
+struct pmb_ring_client {
+	int			sock;
+	int			mem_fd;
+	int			data_efd;
+	int			space_efd;
+	struct pmb_ring		*ring;
+};
+
+int PMBRingConnect(struct pmb_ring_client *c,const char *path);
+unsigned char *PMBRingAcquire(struct pmb_ring_client *c);
+void PMBRingCommit(struct pmb_ring_client *c,int len);
+int PMBRingWrite(struct pmb_ring_client *c,unsigned char *buf,int len);
+void PMBRingClose(struct pmb_ring_client *c);
+
+// consumer side (pmbpipe)
+int PMBRingServerOpen(const char *path);
+int PMBRingServerFds(int *fds,int max);
+int PMBRingServerPoll(void (*consume)(unsigned char *buf,int len),int max_packs);
+int PMBRingServerAttached();
+int PMBRingServerQueued();
+void PMBRingServerIdle();
+void PMBRingServerClose();
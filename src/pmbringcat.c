@@ -0,0 +1,49 @@
+/* Pinnacle Moviebox USB shared memory ring producer
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Copies MPEG from a file (or stdin) into a running pmbpipe -ring.
+ * Mostly here as an example of the client library.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pmbring.h"
+
+int main(int argc,char **argv)
+{
+	struct pmb_ring_client ring;
+	int src_fd = 0;
+
+	if (argc > 1 && (src_fd = open(argv[1],O_RDONLY)) < 0) {
+		fprintf(stderr,"Cannot open %s\n",argv[1]);
+		return 1;
+	}
+
+	if (PMBRingConnect(&ring,PMB_RING_SOCKET) < 0)
+		return 1;
+
+	// read() straight into the shared slots, no intermediate buffer
+	while (1) {
+		unsigned char *slot = PMBRingAcquire(&ring);
+		int rd = 0,s;
+
+		if (slot == NULL) {
+			fprintf(stderr,"pmbpipe went away\n");
+			break;
+		}
+
+		while (rd < PMB_RING_PACK && (s = read(src_fd,slot+rd,PMB_RING_PACK-rd)) > 0)
+			rd += s;
+		if (rd > 0)
+			PMBRingCommit(&ring,rd);
+		if (rd < PMB_RING_PACK)
+			break;
+	}
+
+	PMBRingClose(&ring);
+	if (src_fd != 0) close(src_fd);
+	return 0;
+}
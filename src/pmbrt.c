@@ -0,0 +1,271 @@
+/* Pinnacle Moviebox USB real-time profile
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbrt.h. Every failure is reported along with what is most likely
+ * missing (CAP_SYS_NICE, RLIMIT_RTPRIO, RLIMIT_MEMLOCK, isolcpus), and the
+ * profile is read back from the kernel afterwards rather than assumed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "pmbrt.h"
+
+int rt_policy = SCHED_OTHER;
+int rt_priority = PMB_RT_PRIO;
+int rt_mlock = 0;
+int rt_have_cpus = 0;
+cpu_set_t rt_cpus;
+
+int PMBRTParsePolicy(const char *s)
+{
+	if (!strcasecmp(s,"fifo")) return SCHED_FIFO;
+	if (!strcasecmp(s,"rr")) return SCHED_RR;
+	if (!strcasecmp(s,"other")) return SCHED_OTHER;
+	return -1;
+}
+
+const char *PMBRTPolicyName(int policy)
+{
+	if (policy == SCHED_FIFO) return "SCHED_FIFO";
+	if (policy == SCHED_RR) return "SCHED_RR";
+	if (policy == SCHED_OTHER) return "SCHED_OTHER";
+	return "?";
+}
+
+int PMBRTParseCPUs(const char *s,cpu_set_t *set)
+{
+	char *e;
+	long a,b;
+
+	CPU_ZERO(set);
+	while (*s) {
+		a = b = strtol(s,&e,10);
+		if (e == s || a < 0) return -1;
+		s = e;
+		if (*s == '-') {
+			b = strtol(++s,&e,10);
+			if (e == s || b < a) return -1;
+			s = e;
+		}
+		if (b >= CPU_SETSIZE) return -1;
+		for (;a <= b;a++) CPU_SET(a,set);
+
+		if (*s == ',') s++;
+		else if (*s) return -1;
+	}
+
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void CPUList(cpu_set_t *set,char *buf,int len)
+{
+	int i,n = 0;
+
+	buf[0] = 0;
+	for (i=0;i < CPU_SETSIZE && n < (len - 8);i++) {
+		if (CPU_ISSET(i,set))
+			n += snprintf(buf+n,len-n,"%s%d",n ? "," : "",i);
+	}
+}
+
+static const char *Limit(int resource,char *buf,int len)
+{
+	struct rlimit rl;
+
+	if (getrlimit(resource,&rl) < 0)
+		return "?";
+	if (rl.rlim_cur == RLIM_INFINITY)
+		return "unlimited";
+
+	snprintf(buf,len,"%llu",(unsigned long long)rl.rlim_cur);
+	return buf;
+}
+
+// touch the stack the data path will use, so it's there and locked
+static void Prefault()
+{
+	unsigned char stack[PMB_RT_STACK];
+
+	memset(stack,0,sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory");	// don't optimize it away
+}
+
+static int ApplyMemory(int *locked)
+{
+	char lim[32];
+
+	// freed memory stays with us (locked), big blocks come from the heap
+	// instead of fresh mappings that would fault on first use
+	mallopt(M_TRIM_THRESHOLD,-1);
+	mallopt(M_MMAP_MAX,0);
+
+	// everything there is now, faulted in
+	if (mlockall(MCL_CURRENT) < 0) {
+		fprintf(stderr,"RT: cannot lock memory: %s (RLIMIT_MEMLOCK is %s)\n",
+			strerror(errno),Limit(RLIMIT_MEMLOCK,lim,sizeof(lim)));
+		return 1;
+	}
+	*locked = 1;
+	Prefault();
+
+	// and whatever is mapped later, as it's used. without MCL_ONFAULT a
+	// pmbcache entry would be read in whole the moment it's mapped.
+#ifdef MCL_ONFAULT
+	if (mlockall(MCL_CURRENT|MCL_FUTURE|MCL_ONFAULT) == 0)
+		return 0;
+#endif
+	fprintf(stderr,"RT: memory allocated from now on is not locked: %s\n",strerror(errno));
+	return 1;
+}
+
+// every thread but this one off our CPUs, if there are others left
+static int ApplyHelpers(cpu_set_t *others)
+{
+	struct dirent *d;
+	DIR *dir;
+	pid_t self = gettid(),tid;
+	int bad = 0;
+
+	if ((dir = opendir("/proc/self/task")) == NULL)
+		return 1;
+
+	while ((d = readdir(dir)) != NULL) {
+		if ((tid = atoi(d->d_name)) <= 0 || tid == self)
+			continue;
+		if (sched_setaffinity(tid,sizeof(*others),others) < 0) {
+			fprintf(stderr,"RT: cannot move thread %d off the playback CPUs: %s\n",tid,strerror(errno));
+			bad++;
+		}
+	}
+
+	closedir(dir);
+	return bad;
+}
+
+static void CheckIsolated()
+{
+	char buf[256],want[256],*nl;
+	cpu_set_t iso;
+	FILE *fp;
+	int i;
+
+	CPU_ZERO(&iso);
+	if ((fp = fopen("/sys/devices/system/cpu/isolated","r")) != NULL) {
+		if (fgets(buf,sizeof(buf),fp) != NULL) {
+			if ((nl = strchr(buf,'\n')) != NULL) *nl = 0;
+			if (buf[0] != 0 && PMBRTParseCPUs(buf,&iso) < 0)
+				CPU_ZERO(&iso);
+		}
+		fclose(fp);
+	}
+
+	for (i=0;i < CPU_SETSIZE;i++) {
+		if (CPU_ISSET(i,&rt_cpus) && !CPU_ISSET(i,&iso)) {
+			CPUList(&rt_cpus,want,sizeof(want));
+			fprintf(stderr,"RT: CPU %s not isolated (isolcpus=), the kernel still schedules other processes there\n",want);
+			return;
+		}
+	}
+}
+
+static int ApplyCPUs()
+{
+	cpu_set_t all,others;
+	char want[256];
+	int i,bad = 0;
+
+	// whatever we're allowed to run on now, minus ours
+	CPU_ZERO(&others);
+	if (sched_getaffinity(0,sizeof(all),&all) == 0) {
+		for (i=0;i < CPU_SETSIZE;i++) {
+			if (CPU_ISSET(i,&all) && !CPU_ISSET(i,&rt_cpus))
+				CPU_SET(i,&others);
+		}
+	}
+
+	if (sched_setaffinity(0,sizeof(rt_cpus),&rt_cpus) < 0) {
+		CPUList(&rt_cpus,want,sizeof(want));
+		fprintf(stderr,"RT: cannot run on CPU %s: %s\n",want,strerror(errno));
+		return 1;
+	}
+	if (CPU_COUNT(&others) == 0)
+		fprintf(stderr,"RT: no CPU left for the other threads, they share the playback CPUs\n");
+	else
+		bad += ApplyHelpers(&others);
+
+	CheckIsolated();
+	return bad;
+}
+
+static int ApplyPolicy()
+{
+	struct sched_param sp;
+	char lim[32];
+	int min,max;
+
+	if (rt_policy == SCHED_OTHER) {
+		// the old way
+		errno = 0;
+		if (nice(-20) == -1 && errno != 0) {
+			fprintf(stderr,"RT: cannot raise priority: %s\n",strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+
+	min = sched_get_priority_min(rt_policy);
+	max = sched_get_priority_max(rt_policy);
+	if (rt_priority < min) rt_priority = min;
+	if (rt_priority > max) rt_priority = max;
+
+	memset(&sp,0,sizeof(sp));
+	sp.sched_priority = rt_priority;
+	if (sched_setscheduler(0,rt_policy,&sp) < 0) {
+		fprintf(stderr,"RT: cannot switch to %s priority %d: %s (needs CAP_SYS_NICE, RLIMIT_RTPRIO is %s)\n",
+			PMBRTPolicyName(rt_policy),rt_priority,strerror(errno),Limit(RLIMIT_RTPRIO,lim,sizeof(lim)));
+		return 1;
+	}
+
+	return 0;
+}
+
+int PMBRTApply()
+{
+	struct sched_param sp;
+	char cpus[256];
+	cpu_set_t set;
+	int bad = 0,policy,locked = 0;
+
+	// memory first: the rest can fault in pages too
+	if (rt_mlock)
+		bad += ApplyMemory(&locked);
+	if (rt_have_cpus)
+		bad += ApplyCPUs();
+	bad += ApplyPolicy();
+
+	// what we actually got
+	policy = sched_getscheduler(0);
+	memset(&sp,0,sizeof(sp));
+	sched_getparam(0,&sp);
+	CPU_ZERO(&set);
+	sched_getaffinity(0,sizeof(set),&set);
+	CPUList(&set,cpus,sizeof(cpus));
+	fprintf(stderr,"RT: playback thread %s priority %d nice %d on CPU %s, memory %slocked%s\n",
+		PMBRTPolicyName(policy),sp.sched_priority,getpriority(PRIO_PROCESS,gettid()),cpus,
+		locked ? "" : "not ",
+		bad ? ", PROFILE NOT FULLY APPLIED" : "");
+
+	return bad;
+}
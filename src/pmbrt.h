@@ -0,0 +1,31 @@
+/* Pinnacle Moviebox USB real-time profile
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * What it takes for the thread doing the USB writes not to be late: a
+ * real-time scheduling class, its memory locked and faulted in ahead of
+ * time so the data path never takes a page fault, and CPUs of its own with
+ * the other threads moved off them. PMBRTApply() puts the calling thread on
+ * the profile and says what it couldn't do and why.
+ */
+
+#include <sched.h>
+
+#define PMB_RT_PRIO		50
+#define PMB_RT_STACK		(256 * 1024)	// stack faulted in ahead of time
+
+// SCHED_OTHER is no real-time class (then nice -20 is tried instead)
+extern int rt_policy;
+extern int rt_priority;
+extern int rt_mlock;
+extern int rt_have_cpus;
+extern cpu_set_t rt_cpus;
+
+// "fifo", "rr" or "other". -1 if it's neither.
+int PMBRTParsePolicy(const char *s);
+// "2", "2,3", "0-1,4". -1 if it doesn't parse.
+int PMBRTParseCPUs(const char *s,cpu_set_t *set);
+
+// call with every other thread of the process already started: those are
+// moved off rt_cpus. returns how many parts of the profile didn't apply.
+int PMBRTApply();
+const char *PMBRTPolicyName(int policy);
@@ -0,0 +1,162 @@
+/* Pinnacle Moviebox USB real-time check
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Measures what the real-time profile (pmbrt.h) is worth on this machine
+ * before trusting playback to it: a thread on the profile pmbpipe would
+ * use wakes up every interval on an absolute timer, and how late it
+ * actually wakes is recorded, while other threads keep every CPU busy.
+ * Run it once with and once without the profile to see the difference.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pmbrt.h"
+
+// microsecond buckets, everything later in the last one
+#define HIST_US			10000
+
+static unsigned long long hist[HIST_US + 1];
+static volatile int load_stop = 0;
+
+// a CPU hog that also keeps the caches stirred up
+static void *Load(void *arg)
+{
+	static __thread unsigned char churn[1024 * 1024];
+	unsigned long long x = 0;
+	int i;
+
+	while (!load_stop) {
+		for (i=0;i < 1000000;i++)
+			x = (x * 6364136223846793005ULL) + 1442695040888963407ULL;
+		memset(churn,(int)x,sizeof(churn));
+	}
+
+	return NULL;
+}
+
+static long long Nsec(struct timespec *ts)
+{
+	return ((long long)ts->tv_sec * 1000000000LL) + ts->tv_nsec;
+}
+
+static void usage()
+{
+	fprintf(stderr,"pmbrtcheck [options]\n");
+	fprintf(stderr,"  -rt POLICY  fifo or rr, as pmbpipe -rt\n");
+	fprintf(stderr,"  -rtprio N   with -rt, at priority N (default %d)\n",PMB_RT_PRIO);
+	fprintf(stderr,"  -mlock      lock all memory, as pmbpipe -mlock\n");
+	fprintf(stderr,"  -cpu LIST   measure on these CPUs, as pmbpipe -cpu\n");
+	fprintf(stderr,"  -load N     keep N threads busy (default one per CPU, 0 for none)\n");
+	fprintf(stderr,"  -t SECS     measure this long (default 10)\n");
+	fprintf(stderr,"  -i USEC     wake up this often (default 1000, pmbpipe's idle sleep)\n");
+}
+
+int main(int argc,char **argv)
+{
+	int load = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int secs = 10,interval = 1000;
+	unsigned long long count = 0,sum = 0,max = 0,min = ~0ULL,over = 0,n;
+	long long p99 = -1,p999 = -1;
+	struct timespec next,now;
+	pthread_t *tid;
+	long long late,end;
+	int i,bad;
+
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-rt") && (i+1) < argc) {
+			if ((rt_policy = PMBRTParsePolicy(argv[++i])) < 0) {
+				usage();
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i],"-rtprio") && (i+1) < argc)
+			rt_priority = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-mlock"))
+			rt_mlock = 1;
+		else if (!strcmp(argv[i],"-cpu") && (i+1) < argc) {
+			if (PMBRTParseCPUs(argv[++i],&rt_cpus) < 0) {
+				usage();
+				return 1;
+			}
+			rt_have_cpus = 1;
+		}
+		else if (!strcmp(argv[i],"-load") && (i+1) < argc)
+			load = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-t") && (i+1) < argc)
+			secs = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-i") && (i+1) < argc)
+			interval = atoi(argv[++i]);
+		else {
+			usage();
+			return 1;
+		}
+	}
+	if (load < 0) load = 0;
+	if (secs < 1) secs = 1;
+	if (interval < 50) interval = 50;
+
+	// the load first, so the profile moves it off our CPUs like it does
+	// pmbpipe's other threads
+	if ((tid = calloc(load + 1,sizeof(*tid))) == NULL)
+		return 1;
+	for (i=0;i < load;i++) {
+		if (pthread_create(&tid[i],NULL,Load,NULL) != 0) {
+			fprintf(stderr,"Cannot start load thread\n");
+			load = i;
+			break;
+		}
+	}
+	bad = PMBRTApply();
+
+	fprintf(stderr,"Measuring %ds at %dus intervals with %d load threads...\n",secs,interval,load);
+	clock_gettime(CLOCK_MONOTONIC,&next);
+	end = Nsec(&next) + (secs * 1000000000LL);
+	for (;;) {
+		next.tv_nsec += interval * 1000L;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL);
+		clock_gettime(CLOCK_MONOTONIC,&now);
+
+		late = Nsec(&now) - Nsec(&next);
+		if (late < 0) late = 0;
+		late /= 1000;
+		hist[late > HIST_US ? HIST_US : late]++;
+		if ((unsigned long long)late < min) min = late;
+		if ((unsigned long long)late > max) max = late;
+		if (late >= interval) over++;
+		sum += late;
+		count++;
+
+		if (Nsec(&now) >= end)
+			break;
+	}
+
+	load_stop = 1;
+	for (i=0;i < load;i++)
+		pthread_join(tid[i],NULL);
+	free(tid);
+
+	for (i=0,n=0;i <= HIST_US;i++) {
+		n += hist[i];
+		if (p99 < 0 && n * 100 >= count * 99) p99 = i;
+		if (p999 < 0 && n * 1000 >= count * 999) p999 = i;
+	}
+
+	printf("Wake-up latency: %llu samples, min %lluus, avg %.1fus, 99%% %lldus, 99.9%% %lldus, max %lluus%s\n",
+		count,min,count ? (double)sum / count : 0.0,p99,p999,max,max >= HIST_US ? " (or more)" : "");
+	printf("Missed intervals: %llu\n",over);
+	if (bad)
+		printf("The real-time profile was not fully applied, see above\n");
+
+	return bad ? 2 : 0;
+}
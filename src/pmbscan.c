@@ -0,0 +1,523 @@
+/* Pinnacle Moviebox USB media library scanner
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * Goes through program stream files ahead of time with the same pack and
+ * PES header checks pmbpipe's parser uses, so that files it would choke on
+ * turn up here instead of on air, and writes their index (see pmbindex.h)
+ * while at it. Directories are walked. Files are handed out to a pool of
+ * threads, one file per thread at a time, and read through a window mapped
+ * from the file that slides along with the scan.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "pmbmpeg.h"
+#include "pmbindex.h"
+
+// how much of a file is mapped at a time. windows start every SCAN_WINDOW
+// bytes and reach SCAN_OVERLAP further, so any one packet is in one of them.
+#define SCAN_WINDOW		(64ULL << 20)
+#define SCAN_OVERLAP		(128ULL << 10)
+
+// ISO 13818-1 wants an SCR at least every 0.7 seconds. anything further
+// apart, or going backwards, is a discontinuity.
+#define SCAN_SCR_GAP		(27000000ULL * 7 / 10)
+
+// the mux rate is measured over this much stream time
+#define SCAN_RATE_WINDOW	(27000000ULL / 2)
+
+struct scan {
+	const char		*path;
+	int			fd;
+	unsigned long long	size;
+	unsigned char		*map;
+	unsigned long long	map_at;
+	size_t			map_len;
+
+	// index being made, and how far it has been fed
+	struct pmb_index_builder *build;
+	unsigned long long	fed;
+
+	// what was found
+	unsigned long long	packs,errors;
+	unsigned long long	min_pack,max_pack;
+	unsigned long long	last_pack,last_ticks;	// where and when the last good pack was
+	unsigned long long	discontinuities,first_discontinuity;
+	unsigned long long	duration,bytes;		// stream time, and bytes sent in it
+	unsigned long long	window_bytes,window_ticks;
+	unsigned long		mux_declared;		// peak, 50 bytes/sec
+	double			mux_peak;		// bytes/sec
+	unsigned int		video,audio;		// streams E0-EF and C0-DF seen
+	unsigned char		private1[256];		// sub streams of 0xBD seen
+	char			problem[160];
+};
+
+static int threads = 0;
+static int no_index = 0;
+static int quiet = 0;
+
+static char **files = NULL;
+static int nfiles = 0,files_alloc = 0;
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_file = 0;
+static unsigned long long stat_ok = 0,stat_warn = 0,stat_bad = 0,stat_bytes = 0;
+
+// the first thing wrong with the file is kept, the rest are counted
+static void Problem(struct scan *s,unsigned long long at,const char *fmt,...)
+{
+	va_list va;
+	int n;
+
+	s->errors++;
+	if (s->problem[0] != 0)
+		return;
+
+	n = snprintf(s->problem,sizeof(s->problem),"at %llu: ",at);
+	va_start(va,fmt);
+	vsnprintf(s->problem+n,sizeof(s->problem)-n,fmt,va);
+	va_end(va);
+}
+
+// need bytes of the file from pos on. need is at most SCAN_OVERLAP, and has
+// to be there.
+static unsigned char *ScanAt(struct scan *s,unsigned long long pos,unsigned long long need)
+{
+	unsigned long long at;
+
+	if (s->map != NULL && pos >= s->map_at && (pos + need) <= (s->map_at + s->map_len))
+		return s->map + (pos - s->map_at);
+
+	at = pos - (pos % SCAN_WINDOW);
+	if (s->map != NULL) {
+		// the index sees every byte once, in order, before it's unmapped
+		if (s->build != NULL && s->fed < at) {
+			PMBIndexFeed(s->build,s->map + (s->fed - s->map_at),at - s->fed);
+			s->fed = at;
+		}
+		munmap(s->map,s->map_len);
+		s->map = NULL;
+	}
+
+	s->map_at = at;
+	s->map_len = SCAN_WINDOW + SCAN_OVERLAP;
+	if (s->map_len > (s->size - at))
+		s->map_len = s->size - at;
+	s->map = mmap(NULL,s->map_len,PROT_READ,MAP_SHARED,s->fd,at);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return NULL;
+	}
+	madvise(s->map,s->map_len,MADV_SEQUENTIAL);
+	return s->map + (pos - s->map_at);
+}
+
+// the next pack start code at or after pos
+static unsigned long long Resync(struct scan *s,unsigned long long pos)
+{
+	unsigned long long n,i;
+	unsigned char *p;
+
+	while ((pos + 4) <= s->size) {
+		n = s->size - pos;
+		if (n > SCAN_OVERLAP) n = SCAN_OVERLAP;
+		if ((p = ScanAt(s,pos,n)) == NULL)
+			break;
+
+		for (i=0;(i+4) <= n;i++) {
+			if (p[i] == 0x00 && p[i+1] == 0x00 && p[i+2] == 0x01 && p[i+3] == 0xBA)
+				return pos + i;
+		}
+		pos += n - 3;
+	}
+
+	return s->size;
+}
+
+static void ScanPack(struct scan *s,unsigned long long pos,struct mpeg_pack *pk)
+{
+	unsigned long long size,delta;
+	double rate;
+
+	if (pk->mux_rate > s->mux_declared)
+		s->mux_declared = pk->mux_rate;
+
+	if (s->packs++ == 0) {
+		s->last_pack = pos;
+		s->last_ticks = pk->ticks;
+		return;
+	}
+
+	size = pos - s->last_pack;
+	if (s->min_pack == 0 || size < s->min_pack) s->min_pack = size;
+	if (size > s->max_pack) s->max_pack = size;
+
+	// the last pack's bytes went out while the clock went from its SCR
+	// to this one's
+	if (pk->ticks < s->last_ticks || (pk->ticks - s->last_ticks) > SCAN_SCR_GAP) {
+		if (s->discontinuities++ == 0)
+			s->first_discontinuity = pos;
+		s->window_bytes = s->window_ticks = 0;
+	}
+	else {
+		delta = pk->ticks - s->last_ticks;
+		s->duration += delta;
+		s->bytes += size;
+		s->window_ticks += delta;
+		s->window_bytes += size;
+		if (s->window_ticks >= SCAN_RATE_WINDOW) {
+			rate = (double)s->window_bytes * 27000000.0 / s->window_ticks;
+			if (rate > s->mux_peak) s->mux_peak = rate;
+			s->window_bytes = s->window_ticks = 0;
+		}
+	}
+
+	s->last_pack = pos;
+	s->last_ticks = pk->ticks;
+}
+
+static void ScanPES(struct scan *s,unsigned long long pos,unsigned char *p,int len)
+{
+	struct mpeg_pes pes;
+	int r;
+
+	if ((r = MPEGParsePES(p+4,len-4,&pes)) < 0) {
+		Problem(s,pos,"PES packet 0x%02X cut off by the end of the file",p[3]);
+		return;
+	}
+	if (r == 0) {
+		Problem(s,pos,"PES packet 0x%02X: %s",p[3],pes.err);
+		return;
+	}
+
+	if (p[3] >= 0xE0)
+		s->video |= 1U << (p[3] - 0xE0);
+	else if (p[3] >= 0xC0)
+		s->audio |= 1U << (p[3] - 0xC0);
+	else if ((4 + pes.payload) < len)		// 0xBD: the sub stream comes first
+		s->private1[p[4+pes.payload]] = 1;
+}
+
+static void ScanFile(struct scan *s)
+{
+	unsigned long long pos = 0,need;
+	struct mpeg_pack pk;
+	unsigned char *p;
+	int r,len;
+
+	while ((pos + 4) <= s->size) {
+		need = s->size - pos;
+		if (need > SCAN_OVERLAP) need = SCAN_OVERLAP;
+		if ((p = ScanAt(s,pos,need)) == NULL) {
+			Problem(s,pos,"cannot map: %s",strerror(errno));
+			return;
+		}
+
+		if (p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01 || p[3] < 0xB9) {
+			// not where a packet should be. pick up again at the
+			// next pack.
+			unsigned long long next = Resync(s,pos+1);
+
+			Problem(s,pos,"%llu bytes of junk",next - pos);
+			pos = next;
+			continue;
+		}
+
+		if (p[3] == 0xB9) {			// program end code
+			pos += 4;
+		}
+		else if (p[3] == 0xBA) {
+			if ((r = MPEGParsePack(p+4,need-4,&pk)) <= 0) {
+				if (r < 0)
+					Problem(s,pos,"pack header cut off by the end of the file");
+				else
+					Problem(s,pos,"pack header marker bits don't line up");
+				pos = Resync(s,pos+4);
+				continue;
+			}
+			ScanPack(s,pos,&pk);
+			pos += 4 + r;
+		}
+		else {
+			// everything else has its length up front
+			if (need < 6) {
+				Problem(s,pos,"packet 0x%02X cut off by the end of the file",p[3]);
+				break;
+			}
+			len = 6 + ((((int)p[4]) << 8) | ((int)p[5]));
+			if ((unsigned long long)len > need) {
+				Problem(s,pos,"packet 0x%02X cut off by the end of the file",p[3]);
+				break;
+			}
+			if (p[3] == 0xBD || p[3] >= 0xC0)
+				ScanPES(s,pos,p,len);
+			pos += len;
+		}
+	}
+}
+
+static void ScanReport(struct scan *s)
+{
+	char streams[256],*w = streams;
+	const char *verdict;
+	int i,ac3 = 0;
+
+	// anything that throws packets away is bad. no MPEG audio (the daemon
+	// drops AC-3) or a clock that jumps still plays, but should be looked at.
+	for (i=0x80;i < 0x88;i++)
+		ac3 |= s->private1[i];
+	if (s->packs == 0)
+		snprintf(s->problem,sizeof(s->problem),"not a MPEG program stream");
+	if (s->problem[0] != 0)
+		verdict = "BAD";
+	else if (s->discontinuities > 0 || (s->audio == 0 && ac3))
+		verdict = "WARN";
+	else
+		verdict = "OK";
+
+	*w = 0;
+	for (i=0;i < 16;i++)
+		if (s->video & (1U << i)) w += sprintf(w," %02X",0xE0+i);
+	for (i=0;i < 32;i++)
+		if (s->audio & (1U << i)) w += sprintf(w," %02X",0xC0+i);
+	for (i=0x80;i < 0x88;i++)
+		if (s->private1[i]) w += sprintf(w," AC-3:%02X",i);
+	for (i=0;i < 256;i++)
+		if (s->private1[i] && (i < 0x80 || i >= 0x88) && (w - streams) < 200) w += sprintf(w," BD:%02X",i);
+
+	pthread_mutex_lock(&scan_lock);
+	if (!quiet || strcmp(verdict,"OK")) {
+		printf("%s: %s",s->path,verdict);
+		if (s->problem[0] != 0)
+			printf(" (%s, %llu problems)",s->problem,s->errors);
+		printf(", %llu packs of %llu-%llu bytes, %.1fs, mux %.0f/%.0f kbit/s avg/peak (%.0f declared), %llu SCR jumps",
+			s->packs,s->min_pack,s->max_pack,s->duration / 27000000.0,
+			s->duration ? ((double)s->bytes * 27000000.0 / s->duration * 8.0 / 1000.0) : 0.0,
+			s->mux_peak * 8.0 / 1000.0,s->mux_declared * 50.0 * 8.0 / 1000.0,
+			s->discontinuities);
+		if (s->discontinuities > 0)
+			printf(" (first at %llu)",s->first_discontinuity);
+		printf(", streams%s\n",streams[0] ? streams : " none");
+		fflush(stdout);
+	}
+	if (verdict[0] == 'B') stat_bad++;
+	else if (verdict[0] == 'W') stat_warn++;
+	else stat_ok++;
+	stat_bytes += s->size;
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void ScanOne(const char *path)
+{
+	struct pmb_index *x;
+	struct scan s;
+	struct stat st;
+
+	memset(&s,0,sizeof(s));
+	s.path = path;
+	if ((s.fd = open(path,O_RDONLY)) < 0 || fstat(s.fd,&st) < 0) {
+		snprintf(s.problem,sizeof(s.problem),"cannot open: %s",strerror(errno));
+		if (s.fd >= 0) close(s.fd);
+		ScanReport(&s);
+		return;
+	}
+	s.size = st.st_size;
+
+	if (!no_index) {
+		if ((x = PMBIndexLoad(path)) != NULL)
+			PMBIndexFree(x);	// still good
+		else
+			s.build = PMBIndexBegin();
+	}
+
+	posix_fadvise(s.fd,0,0,POSIX_FADV_SEQUENTIAL);
+	ScanFile(&s);
+
+	if (s.build != NULL) {
+		// whatever the scan didn't need to look at yet
+		while (s.fed < s.size && s.problem[0] == 0) {
+			unsigned long long n = s.size - s.fed;
+			unsigned char *p;
+
+			if (n > SCAN_OVERLAP) n = SCAN_OVERLAP;
+			if ((p = ScanAt(&s,s.fed,n)) == NULL)
+				break;
+			PMBIndexFeed(s.build,p,n);
+			s.fed += n;
+		}
+
+		// no use indexing what won't play
+		if (s.problem[0] == 0 && s.packs > 0 && (x = PMBIndexEnd(s.build)) != NULL) {
+			PMBIndexSave(x,path);
+			PMBIndexFree(x);
+		}
+		else {
+			PMBIndexAbort(s.build);
+		}
+	}
+
+	if (s.map != NULL) munmap(s.map,s.map_len);
+	close(s.fd);
+	ScanReport(&s);
+}
+
+static void *ScanThread(void *arg)
+{
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&scan_lock);
+		i = next_file++;
+		pthread_mutex_unlock(&scan_lock);
+		if (i >= nfiles)
+			break;
+
+		ScanOne(files[i]);
+	}
+
+	return NULL;
+}
+
+static void AddFile(const char *path)
+{
+	char **n;
+
+	if (nfiles >= files_alloc) {
+		files_alloc = files_alloc ? (files_alloc * 2) : 1024;
+		if ((n = realloc(files,files_alloc * sizeof(*n))) == NULL) {
+			fprintf(stderr,"Out of memory\n");
+			exit(1);
+		}
+		files = n;
+	}
+	files[nfiles++] = strdup(path);
+}
+
+// our own files that live next to the media are not media
+static int OurFile(const char *name)
+{
+	int l = strlen(name),sl = strlen(PMB_INDEX_SUFFIX);
+
+	if (l >= sl && !strcmp(name+l-sl,PMB_INDEX_SUFFIX))
+		return 1;
+	if (l >= 4 && !strcmp(name+l-4,".tmp"))
+		return 1;
+
+	return 0;
+}
+
+static void AddPath(const char *path)
+{
+	struct dirent *d;
+	struct stat st;
+	char *sub;
+	DIR *dir;
+
+	if (stat(path,&st) < 0) {
+		fprintf(stderr,"Cannot stat %s: %s\n",path,strerror(errno));
+		return;
+	}
+	if (S_ISREG(st.st_mode)) {
+		if (!OurFile(path))
+			AddFile(path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return;
+
+	if ((dir = opendir(path)) == NULL) {
+		fprintf(stderr,"Cannot open %s: %s\n",path,strerror(errno));
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		if ((sub = malloc(strlen(path) + strlen(d->d_name) + 2)) == NULL)
+			continue;
+		sprintf(sub,"%s/%s",path,d->d_name);
+		AddPath(sub);
+		free(sub);
+	}
+	closedir(dir);
+}
+
+static void usage()
+{
+	fprintf(stderr,"pmbscan [options] FILE|DIR...\n");
+	fprintf(stderr,"  -j N        scan N files at a time (default: one per CPU)\n");
+	fprintf(stderr,"  -n          don't write indexes (FILE%s)\n",PMB_INDEX_SUFFIX);
+	fprintf(stderr,"  -q          only list files that aren't OK\n");
+}
+
+int main(int argc,char **argv)
+{
+	pthread_t *tid;
+	long long t0,t;
+	int i,paths = 0;
+
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-j") && (i+1) < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-n"))
+			no_index = 1;
+		else if (!strcmp(argv[i],"-q"))
+			quiet = 1;
+		else if (argv[i][0] == '-') {
+			usage();
+			return 1;
+		}
+		else {
+			AddPath(argv[i]);
+			paths++;
+		}
+	}
+	if (paths == 0) {
+		usage();
+		return 1;
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > nfiles)
+		threads = nfiles > 0 ? nfiles : 1;
+
+	t0 = MPEGHostClock();
+	if ((tid = calloc(threads,sizeof(*tid))) == NULL)
+		return 1;
+	for (i=0;i < threads;i++) {
+		if (pthread_create(&tid[i],NULL,ScanThread,NULL) != 0) {
+			fprintf(stderr,"Cannot start scan thread\n");
+			threads = i;
+			break;
+		}
+	}
+	if (threads == 0)
+		ScanThread(NULL);
+	for (i=0;i < threads;i++)
+		pthread_join(tid[i],NULL);
+	t = MPEGHostClock() - t0;
+
+	fprintf(stderr,"%d files: %llu OK, %llu to look at, %llu bad. %.1fMB in %.1fs with %d threads, %.1fMB/s\n",
+		nfiles,stat_ok,stat_warn,stat_bad,stat_bytes / 1048576.0,t / 27000000.0,threads,
+		t > 0 ? (stat_bytes / 1048576.0) / (t / 27000000.0) : 0.0);
+
+	for (i=0;i < nfiles;i++)
+		free(files[i]);
+	free(files);
+	free(tid);
+	return stat_bad ? 1 : 0;
+}
@@ -0,0 +1,368 @@
+/* Pinnacle Moviebox USB MPEG stream massaging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * SCR paced output scheduler. Left to itself pmbpipe pushes packs as fast
+ * as the feed supplies them and the MovieBox's buffer plus blocking bulk
+ * writes do the pacing, which is how it ends up overrun and stalled. Here
+ * packs wait in a queue until the host clock, slaved to the (already
+ * rebased) SCR, says the decoder will want them within sched_lead.
+ *
+ * Pausing holds the queue at a picture boundary. The host clock goes on, so
+ * when packs go out again everything left is slid forward in time by as
+ * long as the pause lasted, SCR and PTS/DTS alike, and to the decoder it
+ * looks as if the stream had just carried on.
+ *
+ * What was sent before the pause can't be taken back, so the decoder plays
+ * on through up to sched_lead of it and stops there. Only the time after
+ * that is slid over, and by then the decoder is sched_pause_lead (about a
+ * picture) short of the end of what it has, not sched_lead: a step shows
+ * one picture a picture later, and a resume refills the lead in one go.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbsched.h"
+
+#define SCHED_PACKS		1024
+
+// a jump in SCR bigger than this is not something to wait out
+#define SCHED_MAX_GAP		(27000000ULL * 2)
+
+// lateness below this is just the host clock's jitter
+#define SCHED_JITTER		27000LL
+
+void (*SchedWrite)(unsigned char *packs,int len) = NULL;
+void (*SchedWriteRaw)(unsigned char *packs,int len) = NULL;
+
+unsigned long long sched_lead = 27000000ULL / 2;
+unsigned long long sched_pause_lead = 27000000ULL / 25;
+int sched_burst = 16;
+
+unsigned long long stat_sched_packs = 0,stat_sched_late = 0,stat_sched_resyncs = 0;
+unsigned long long stat_sched_max_late = 0;
+int stat_sched_max_queue = 0;
+unsigned long long stat_sched_pauses = 0,stat_sched_steps = 0,stat_sched_paused = 0;
+
+// how long packs sit in the queue
+struct mpeg_latency lat_queue = { 0, 0, 0 };
+
+static unsigned char sched_buf[SCHED_PACKS][2048];
+static unsigned long long sched_st[SCHED_PACKS];	// stream time of each pack
+static unsigned long long sched_SCR[SCHED_PACKS];	// and its SCR, 27MHz ticks
+static long long sched_queued[SCHED_PACKS];		// host clock when it was queued
+static unsigned char sched_pic[SCHED_PACKS];		// pictures starting in it
+static unsigned char sched_raw[SCHED_PACKS];		// in the MovieBox's byte order already
+static unsigned long sched_pic_sync = ~0UL;
+static int sched_head = 0,sched_count = 0;
+
+// stream time is the pack SCR unwrapped and smoothed over discontinuities,
+// in 27MHz ticks from the first pack. host time sched_host0 is stream time 0.
+static int sched_have_clock = 0;
+static unsigned long long sched_last_SCR = 0;
+static unsigned long long sched_last_st = 0;
+static long long sched_host0 = 0;
+
+// stream time and SCR of the last pack released, and the furthest
+// SchedClock() has said the decoder got
+static int sched_have_sent = 0;
+static unsigned long long sched_sent_st = 0,sched_sent_SCR = 0;
+static long long sched_clock_st = 0;
+
+// paused: only sched_step_pictures more pictures may go out. the time the
+// decoder spent stopped is added to sched_offset, which all packs get on
+// their way out.
+int sched_paused = 0;
+static int sched_step_pictures = 0;
+static unsigned long long sched_offset = 0;
+
+// a flush doesn't undo a pause, nor move the timestamps back
+void SchedReset()
+{
+	sched_head = sched_count = 0;
+	sched_have_clock = 0;
+	sched_have_sent = 0;
+	sched_pic_sync = ~0UL;
+}
+
+// slide the clock so that the decoder, having played out what it was sent,
+// is sched_pause_lead short of the end of it now. while it still has more
+// than that to play there's nothing to do. with nothing sent since a flush
+// the first pack waiting stands in for the end.
+static void SchedSlide()
+{
+	long long now = MPEGHostClock(),at;
+	unsigned long long d,lead,end;
+
+	if (sched_have_sent)
+		end = sched_sent_st;
+	else if (sched_have_clock && sched_count > 0)
+		end = sched_st[sched_head];
+	else
+		return;
+
+	lead = sched_pause_lead < sched_lead ? sched_pause_lead : sched_lead;
+	at = sched_host0 + (long long)end - (long long)lead;
+	if (now <= at)
+		return;
+
+	d = (unsigned long long)(now - at);
+	d -= d % 300ULL;		// whole 90KHz ticks, PTS can't do better
+	sched_offset = (sched_offset + d) % MPEG_CLOCK_WRAP;
+	sched_host0 += (long long)d;
+	stat_sched_paused += d;
+}
+
+// the picture going out now is finished, then nothing more
+void SchedPause()
+{
+	if (sched_paused)
+		return;
+
+	sched_paused = 1;
+	sched_step_pictures = 1;
+	stat_sched_pauses++;
+}
+
+void SchedResume()
+{
+	if (!sched_paused)
+		return;
+
+	SchedSlide();
+	sched_paused = 0;
+	sched_step_pictures = 0;
+}
+
+// let n more pictures out. pauses first if playing.
+void SchedStep(int n)
+{
+	SchedPause();
+	SchedSlide();
+	sched_step_pictures += n;
+	stat_sched_steps += n;
+}
+
+int SchedSpace()
+{
+	return SCHED_PACKS - sched_count;
+}
+
+int SchedQueued()
+{
+	return sched_count;
+}
+
+static void SchedQueue(unsigned char *pack,int len,int have_clock,unsigned long long SCR,unsigned long mux_rate,int pictures,int raw)
+{
+	unsigned long long d,st;
+	int i;
+
+	while (sched_count >= SCHED_PACKS) {
+		// the feed got ahead of us. wait for the head of the queue to come due
+		if (sched_paused) {
+			PMBLog(PMB_LOG_NOTICE,"Scheduler: queue full while paused, resuming\n");
+			SchedResume();
+		}
+		long us = SchedIdleUsec();
+		if (us > 0) usleep(us);
+		SchedRun();
+	}
+
+	if (len > 2048) len = 2048;
+	if (!have_clock) {
+		SCR = sched_last_SCR;
+		mux_rate = 0;
+	}
+
+	if (!sched_have_clock) {
+		st = 0;
+		sched_host0 = MPEGHostClock();
+		sched_have_clock = 1;
+	}
+	else {
+		d = (SCR + MPEG_CLOCK_WRAP - sched_last_SCR) % MPEG_CLOCK_WRAP;
+		if (d == 0 || d > SCHED_MAX_GAP) {
+			// SCR stood still, went backwards, or jumped. go on at the
+			// mux rate from where we were.
+			if (d != 0) stat_sched_resyncs++;
+			d = mux_rate ? ((2048ULL * 27000000ULL) / (mux_rate * 50ULL)) : 0;
+		}
+		st = sched_last_st + d;
+	}
+	sched_last_SCR = SCR;
+	sched_last_st = st;
+
+	i = (sched_head + sched_count) % SCHED_PACKS;
+	memcpy(sched_buf[i],pack,len);
+	if (len < 2048) memset(sched_buf[i]+len,0xFF,2048-len);
+	stat_bytes_copied += len;
+	sched_st[i] = st;
+	sched_SCR[i] = SCR;
+	sched_pic[i] = pictures;
+	sched_raw[i] = raw;
+	sched_queued[i] = MPEGHostClock();
+	sched_count++;
+	if (sched_count > stat_sched_max_queue)
+		stat_sched_max_queue = sched_count;
+}
+
+void SchedOutput(unsigned char *pack,int len)
+{
+	unsigned long long SCR = 0;
+	unsigned long mux_rate = 0;
+	int have_clock,pictures;
+
+	have_clock = MPEGPackClock(pack,&SCR,&mux_rate);
+	pictures = MPEGPackPictures(pack,len,&sched_pic_sync);
+	SchedQueue(pack,len,have_clock,SCR,mux_rate,pictures,0);
+}
+
+// a pack in the MovieBox's byte order, from a pmbcache entry. what we'd
+// otherwise read out of it comes along.
+void SchedOutputRaw(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures)
+{
+	SchedQueue(pack,2048,1,SCR,mux_rate,pictures,1);
+}
+
+// the pause offset has to be applied to a pack on its way out. byte swapped
+// packs are swapped back for it, which only happens once there was a pause.
+static void SchedRetime(unsigned char *pack,int raw)
+{
+	unsigned char tmp[2048];
+	int k;
+
+	if (!raw) {
+		MPEGRetime(pack,2048,sched_offset);
+		return;
+	}
+
+	for (k=0;k < 2048;k += 2) {
+		tmp[k] = pack[k+1];
+		tmp[k+1] = pack[k];
+	}
+	MPEGRetime(tmp,2048,sched_offset);
+	for (k=0;k < 2048;k += 2) {
+		pack[k] = tmp[k+1];
+		pack[k+1] = tmp[k];
+	}
+}
+
+// host time at which a pack of the given stream time may go out
+static long long SchedDue(unsigned long long st)
+{
+	return sched_host0 + (long long)st - (long long)sched_lead;
+}
+
+// release whatever is due, up to sched_burst packs. returns how many went out.
+int SchedRun()
+{
+	long long now = MPEGHostClock(),late;
+	int n = 0,i,j;
+
+	while (n < sched_burst && n < sched_count && (sched_head + n) < SCHED_PACKS) {
+		i = sched_head + n;
+		if (sched_paused) {
+			// up to and including the pack where the next picture starts,
+			// which is where the one before it is complete. it all goes
+			// right away, the clock has been slid up to now.
+			if (sched_step_pictures <= 0)
+				break;
+			sched_step_pictures -= sched_pic[i];
+			MPEGLatencyAdd(&lat_queue,now - sched_queued[i]);
+			n++;
+			continue;
+		}
+
+		if (now < SchedDue(sched_st[i]))
+			break;
+
+		// the decoder is already past this pack's SCR
+		late = now - (sched_host0 + (long long)sched_st[i]);
+		if (late > SCHED_JITTER) {
+			stat_sched_late++;
+			if ((unsigned long long)late > stat_sched_max_late)
+				stat_sched_max_late = late;
+
+			// way behind (the feed stalled, or we're just starting after
+			// a pause). don't try to catch up, carry on from here.
+			if ((unsigned long long)late > sched_lead) {
+				sched_host0 += late;
+				stat_sched_resyncs++;
+			}
+		}
+		MPEGLatencyAdd(&lat_queue,now - sched_queued[i]);
+		n++;
+	}
+
+	if (n == 0)
+		return 0;
+
+	// in runs of the same byte order
+	for (i=0;i < n;i=j) {
+		for (j=i;j < n && sched_raw[sched_head+j] == sched_raw[sched_head+i];j++) {
+			if (sched_offset != 0)
+				SchedRetime(sched_buf[sched_head+j],sched_raw[sched_head+j]);
+		}
+
+		if (sched_raw[sched_head+i]) {
+			if (SchedWriteRaw != NULL)
+				SchedWriteRaw(sched_buf[sched_head+i],(j - i) * 2048);
+		}
+		else if (SchedWrite != NULL) {
+			SchedWrite(sched_buf[sched_head+i],(j - i) * 2048);
+		}
+	}
+	stat_sched_packs += n;
+	sched_sent_st = sched_st[sched_head+n-1];
+	sched_sent_SCR = sched_SCR[sched_head+n-1];
+	if (!sched_have_sent) sched_clock_st = 0;
+	sched_have_sent = 1;
+	sched_head = (sched_head + n) % SCHED_PACKS;
+	sched_count -= n;
+	return n;
+}
+
+// how long until the next pack is due, for the idle sleep. -1 if the queue
+// is empty.
+long SchedIdleUsec()
+{
+	long long t;
+
+	if (sched_count == 0 || (sched_paused && sched_step_pictures <= 0))
+		return -1;
+	if (sched_paused)
+		return 0;
+
+	t = SchedDue(sched_st[sched_head]) - MPEGHostClock();
+	if (t <= 0)
+		return 0;
+
+	return (long)(t / 27LL);
+}
+
+// where the decoder is now, on the clock of the packs as they were queued
+// (before any pause offset), in 27MHz ticks. -1 before the first pack.
+// it can't get past what it was sent, which is where it stops while
+// paused, and it doesn't go back when a resume slides the clock back to
+// where the pause started.
+long long SchedClock()
+{
+	long long st;
+
+	if (!sched_have_clock || !sched_have_sent)
+		return -1;
+
+	st = MPEGHostClock() - sched_host0;
+	if (st > (long long)sched_sent_st) st = (long long)sched_sent_st;
+	if (st < sched_clock_st) st = sched_clock_st;
+	sched_clock_st = st;
+
+	// back from the last pack sent, st is never past it
+	return (long long)((sched_sent_SCR + MPEG_CLOCK_WRAP - (sched_sent_st - (unsigned long long)st)) % MPEG_CLOCK_WRAP);
+}
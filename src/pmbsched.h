@@ -0,0 +1,49 @@
+// SCR paced output scheduler (pmbsched.c)
+//
+// Finished packs are queued with SchedOutput() and released to SchedWrite
+// against the host clock by SchedRun(), at most sched_lead ahead of when the
+// decoder needs them according to their SCR.
+
+// where released packs go. several consecutive packs may come in one call.
+// packs queued with SchedOutputRaw() (already in the MovieBox's byte order)
+// go to SchedWriteRaw.
+extern void (*SchedWrite)(unsigned char *packs,int len);
+extern void (*SchedWriteRaw)(unsigned char *packs,int len);
+
+void SchedOutput(unsigned char *pack,int len);
+void SchedOutputRaw(unsigned char *pack,unsigned long long SCR,unsigned long mux_rate,int pictures);
+int SchedRun();
+int SchedSpace();
+int SchedQueued();
+long SchedIdleUsec();
+long long SchedClock();
+void SchedReset();
+
+// hold the queue at the next picture boundary, go on from there, or let
+// n more pictures out. the time spent paused is added to the timestamps of
+// everything that goes out afterwards.
+//
+// there is no stopping the decoder itself: a pause takes hold on screen
+// only once it has played what it was sent, up to sched_lead after the
+// command. from then on it is kept sched_pause_lead short of the end of its
+// buffer, so a step shows up within that.
+void SchedPause();
+void SchedResume();
+void SchedStep(int n);
+extern int sched_paused;
+
+// how far ahead of the decoder we run, 27MHz ticks, and how far while
+// paused (about one picture, never more than sched_lead)
+extern unsigned long long sched_lead;
+extern unsigned long long sched_pause_lead;
+// most packs released at once
+extern int sched_burst;
+
+// accounting. late packs went out after their SCR had already passed on
+// the host clock, resyncs are re-anchorings of the host clock to the stream.
+extern unsigned long long stat_sched_packs,stat_sched_late,stat_sched_resyncs;
+extern unsigned long long stat_sched_max_late;		// 27MHz ticks
+extern int stat_sched_max_queue;
+extern unsigned long long stat_sched_pauses,stat_sched_steps;
+extern unsigned long long stat_sched_paused;		// 27MHz ticks the decoder stood still
+extern struct mpeg_latency lat_queue;
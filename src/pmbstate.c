@@ -0,0 +1,119 @@
+/* Pinnacle Moviebox USB daemon state
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbstate.h.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pmbmpeg.h"
+#include "pmbstate.h"
+
+struct pmb_state *pmb_state = NULL;
+static int state_fd = -1;
+
+static long long StateNow()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return ((long long)tv.tv_sec * 1000000LL) + (long long)tv.tv_usec;
+}
+
+int PMBStateOpen(const char *path,struct pmb_state *prev)
+{
+	struct stat st;
+	int ok = 0;
+
+	memset(prev,0,sizeof(*prev));
+	if ((state_fd = open(path ? path : PMB_STATE_FILE,O_RDWR|O_CREAT|O_CLOEXEC,0644)) < 0) {
+		fprintf(stderr,"Cannot open state file: %s\n",strerror(errno));
+		return -1;
+	}
+	if (fstat(state_fd,&st) < 0 || (st.st_size < (off_t)sizeof(struct pmb_state) && ftruncate(state_fd,sizeof(struct pmb_state)) < 0)) {
+		fprintf(stderr,"Cannot size state file: %s\n",strerror(errno));
+		PMBStateClose();
+		return -1;
+	}
+	pmb_state = mmap(NULL,sizeof(struct pmb_state),PROT_READ|PROT_WRITE,MAP_SHARED,state_fd,0);
+	if (pmb_state == MAP_FAILED) {
+		pmb_state = NULL;
+		fprintf(stderr,"Cannot map state file: %s\n",strerror(errno));
+		PMBStateClose();
+		return -1;
+	}
+
+	memcpy(prev,pmb_state,sizeof(*prev));
+	prev->device[sizeof(prev->device)-1] = 0;
+	// saved_at stays 0 until the first pack: a run that never got that far
+	// left nothing to carry on from
+	if (prev->magic == PMB_STATE_MAGIC && prev->version == PMB_STATE_VERSION && prev->saved_at > 0)
+		ok = 1;
+	else
+		memset(prev,0,sizeof(*prev));
+
+	// as of now nothing has been sent, and the device isn't ours yet
+	memset(pmb_state,0,sizeof(*pmb_state));
+	pmb_state->magic = PMB_STATE_MAGIC;
+	pmb_state->version = PMB_STATE_VERSION;
+	if (ok) {
+		pmb_state->SCR = prev->SCR;
+		pmb_state->last_SCR = prev->last_SCR;
+		pmb_state->last_SCR_delta = prev->last_SCR_delta;
+		pmb_state->last_SCR_difference = prev->last_SCR_difference;
+		pmb_state->saved_at = prev->saved_at;
+	}
+
+	return ok;
+}
+
+void PMBStateClose()
+{
+	if (pmb_state) {
+		munmap(pmb_state,sizeof(struct pmb_state));
+		pmb_state = NULL;
+	}
+	if (state_fd >= 0) {
+		close(state_fd);
+		state_fd = -1;
+	}
+}
+
+void PMBStateSave(unsigned long long SCR)
+{
+	if (!pmb_state)
+		return;
+
+	pmb_state->SCR = SCR;
+	pmb_state->last_SCR = last_SCR;
+	pmb_state->last_SCR_delta = last_SCR_delta;
+	pmb_state->last_SCR_difference = last_SCR_difference;
+	pmb_state->saved_at = StateNow();
+}
+
+long long PMBStateResume(struct pmb_state *prev)
+{
+	unsigned long long t;
+	long long gone;
+
+	gone = (StateNow() - prev->saved_at) * 27LL;
+	if (gone < 0) gone = 0;		// the wall clock was set back
+
+	t = (prev->SCR + (unsigned long long)gone) % MPEG_CLOCK_WRAP;
+	monotonic_SCR = ((t / 300ULL) << 9) | (t % 300ULL);
+	last_SCR = prev->last_SCR;
+	last_SCR_delta = prev->last_SCR_delta;
+	last_SCR_difference = monotonic_SCR - last_SCR;
+
+	PMBStateSave(t);
+	return gone;
+}
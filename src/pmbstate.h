@@ -0,0 +1,53 @@
+/* Pinnacle Moviebox USB daemon state
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * What pmbpipe needs to carry on where a previous run left off (-state):
+ * the SCR of the last pack the device got, the parser's rebasing, and
+ * whether it left the MovieBox running. The file is mapped and brought up
+ * to date with every pack written to the device, so it's as good as the
+ * last pack even if pmbpipe is killed; each field is one aligned store, so
+ * at worst a crash leaves them a pack apart.
+ *
+ * A new run carries the SCR on from the saved one plus however long it has
+ * been since, so the device never sees it go backwards even if its clock
+ * kept running. A MovieBox the file says was left running is restarted
+ * without uploading its firmware again, if the device itself still has it
+ * (libpmb.h).
+ */
+
+#define PMB_STATE_FILE		"/var/video/pmbpipe.state"
+#define PMB_STATE_MAGIC		0x53424D50	/* 'PMBS' */
+#define PMB_STATE_VERSION	2
+
+struct pmb_state {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned long long	SCR;			// of the last pack written, 27MHz ticks
+	unsigned long long	last_SCR;
+	unsigned long long	last_SCR_delta;
+	unsigned long long	last_SCR_difference;
+	long long		saved_at;		// wall clock, microseconds
+	unsigned int		flags;
+	unsigned int		reserved;
+	char			device[32];		// pmb_device of the MovieBox
+};
+#define PMB_STATE_DEVICE_UP	0x01			// initialized and not closed since
+
+// NULL unless PMBStateOpen() worked
+extern struct pmb_state *pmb_state;
+
+// maps the file, creating it if need be. what it held is copied to *prev;
+// returns 1 if that is a state to carry on from, 0 if there was none (or
+// something else was in the file), -1 if it can't be used.
+int PMBStateOpen(const char *path,struct pmb_state *prev);
+void PMBStateClose();
+
+// SCR is the last pack's as it went to the device (with -pace, moved on by
+// the time spent paused, which monotonic_SCR doesn't know about). the rest
+// is as pmbmpeg.c has it now.
+void PMBStateSave(unsigned long long SCR);
+
+// pmbmpeg.c's clock from *prev: monotonic_SCR carries on from the SCR last
+// written, moved on by the time since it was saved. returns how long that
+// was, in 27MHz ticks.
+long long PMBStateResume(struct pmb_state *prev);
@@ -0,0 +1,178 @@
+/* Pinnacle Moviebox USB pack tracing
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * See pmbtrace.h. A span is 24 bytes in a static ring, nothing is
+ * formatted until the dump. The dump copies the ring and leaves the writing
+ * to a thread of its own, so a trace can be taken from a daemon that's
+ * playing without a hole in the output.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pmbtrace.h"
+
+struct trace_event {
+	long long		start,end;		// CLOCK_MONOTONIC, ns
+	unsigned int		pack;
+	unsigned short		n;			// packs, or bytes for read and parse
+	unsigned char		stage;
+	unsigned char		reserved;
+};
+
+struct trace_dump {
+	char			*path;
+	unsigned int		count;
+	struct trace_event	e[PMB_TRACE_EVENTS];
+};
+
+int pmb_trace = 0;
+unsigned int trace_made = 0,trace_sent = 0;
+
+static struct trace_event trace_ring[PMB_TRACE_EVENTS];
+static unsigned int trace_head = 0;
+
+static const char *trace_names[PMB_TRACE_STAGES] = {
+	"read","parse","rewrite","assemble","flush","swap","bulk"
+};
+
+// what each span's n is, and which track it goes on: the playback thread,
+// or the packs being filled (they overlap what the thread is doing)
+static const char *trace_n[PMB_TRACE_STAGES] = {
+	"bytes","bytes","bytes","packs","packs","packs","packs"
+};
+static const int trace_tid[PMB_TRACE_STAGES] = {
+	1,1,1,2,1,1,1
+};
+
+long long PMBTraceClock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+// a span from start until now
+void PMBTraceSpan(int stage,long long start,unsigned int pack,unsigned int n)
+{
+	struct trace_event *e = &trace_ring[trace_head++ & (PMB_TRACE_EVENTS - 1)];
+
+	e->start = start;
+	e->end = PMBTraceClock();
+	e->pack = pack;
+	e->n = (n > 0xFFFF) ? 0xFFFF : n;
+	e->stage = stage;
+}
+
+// packs made but never written (a flush, a reset) would shift every pack
+// number on the device side after them
+void PMBTraceResync()
+{
+	trace_sent = trace_made;
+}
+
+void PMBTraceClear()
+{
+	trace_head = 0;
+	PMBTraceResync();
+}
+
+// spans are recorded when they end. the viewer wants them by start.
+static int TraceCompare(const void *a,const void *b)
+{
+	const struct trace_event *x = a,*y = b;
+
+	if (x->start != y->start)
+		return (x->start < y->start) ? -1 : 1;
+	return (x->end > y->end) ? -1 : (x->end < y->end);	// outer span first
+}
+
+static void *TraceWrite(void *arg)
+{
+	struct trace_dump *d = arg;
+	struct trace_event *e;
+	long long t0;
+	unsigned int i;
+	FILE *fp;
+
+	qsort(d->e,d->count,sizeof(d->e[0]),TraceCompare);
+	t0 = d->count ? d->e[0].start : 0;
+
+	if ((fp = fopen(d->path,"w")) == NULL) {
+		fprintf(stderr,"Trace: cannot write %s: %s\n",d->path,strerror(errno));
+		goto done;
+	}
+
+	fprintf(fp,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fp,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"pmbpipe\"}},\n");
+	fprintf(fp,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"playback\"}},\n");
+	fprintf(fp,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"packs\"}}");
+	for (i=0;i < d->count;i++) {
+		e = &d->e[i];
+		fprintf(fp,",\n{\"name\":\"%s\",\"cat\":\"pmb\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pack\":%u,\"%s\":%u}}",
+			trace_names[e->stage],trace_tid[e->stage],
+			(e->start - t0) / 1000.0,(e->end - e->start) / 1000.0,
+			e->pack,trace_n[e->stage],e->n);
+	}
+	fprintf(fp,"\n]}\n");
+
+	if (fclose(fp) != 0)
+		fprintf(stderr,"Trace: cannot write %s: %s\n",d->path,strerror(errno));
+	else
+		fprintf(stderr,"Trace: %u spans written to %s\n",d->count,d->path);
+done:
+	free(d->path);
+	free(d);
+	return NULL;
+}
+
+// writes what's in the ring to path, oldest first. wait says whether to
+// return only once it's written (at exit).
+int PMBTraceDump(const char *path,int wait)
+{
+	struct trace_dump *d;
+	struct sched_param sp;
+	pthread_attr_t attr;
+	unsigned int first,i;
+	pthread_t t;
+	int r;
+
+	if ((d = malloc(sizeof(*d))) == NULL)
+		return -1;
+	if ((d->path = strdup(path)) == NULL) {
+		free(d);
+		return -1;
+	}
+
+	d->count = (trace_head > PMB_TRACE_EVENTS) ? PMB_TRACE_EVENTS : trace_head;
+	first = trace_head - d->count;
+	for (i=0;i < d->count;i++)
+		d->e[i] = trace_ring[(first + i) & (PMB_TRACE_EVENTS - 1)];
+
+	if (wait) {
+		TraceWrite(d);
+		return 0;
+	}
+
+	// not at the real-time priority of the playback thread (pmbrt.h)
+	memset(&sp,0,sizeof(sp));
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr,SCHED_OTHER);
+	pthread_attr_setschedparam(&attr,&sp);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&t,&attr,TraceWrite,d);
+	pthread_attr_destroy(&attr);
+	if (r != 0)
+		TraceWrite(d);
+
+	return 0;
+}
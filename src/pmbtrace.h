@@ -0,0 +1,38 @@
+/* Pinnacle Moviebox USB pack tracing
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * While pmb_trace is set, every stage a pack goes through on its way to the
+ * MovieBox leaves a span (start and end on the host clock) in a fixed size
+ * ring in memory, the oldest overwritten first. PMBTraceDump() writes the
+ * ring out as Chrome trace event JSON (chrome://tracing, Perfetto).
+ *
+ * Packs are numbered in the order they leave the parser; the device side
+ * counts the packs it writes the same way, so the number in a bulk write's
+ * span is the number its first pack had when it was made. Call
+ * PMBTraceResync() wherever packs in between are thrown away.
+ *
+ * Only the playback thread traces. Off, each stage costs a test of
+ * pmb_trace.
+ */
+
+#define PMB_TRACE_EVENTS	65536		// must be a power of 2
+
+#define PMB_TRACE_READ		0		// read() of the feed FIFO
+#define PMB_TRACE_PARSE		1		// MPEGInputCommit()
+#define PMB_TRACE_REWRITE	2		// CheckModPacket(): PES header check and timestamp rewrite
+#define PMB_TRACE_ASSEMBLE	3		// first byte of a pack to FlushMPEGOut()
+#define PMB_TRACE_FLUSH		4		// FlushMPEGOut() handing it on
+#define PMB_TRACE_SWAP		5		// byte swap in PinnacleMovieBoxWriteVideo()
+#define PMB_TRACE_BULK		6		// bulk write submitted until it completed
+#define PMB_TRACE_STAGES	7
+
+extern int pmb_trace;
+
+// packs made by the parser, and packs written to the device
+extern unsigned int trace_made,trace_sent;
+
+long long PMBTraceClock();
+void PMBTraceSpan(int stage,long long start,unsigned int pack,unsigned int n);
+void PMBTraceResync();
+void PMBTraceClear();
+int PMBTraceDump(const char *path,int wait);
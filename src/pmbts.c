@@ -0,0 +1,540 @@
+/* Pinnacle Moviebox USB MPEG stream massaging
+ * (C) 2006 Jonathan Campbell Impact Studio Pro
+ *
+ * MPEG transport stream input. Picks one program out of the PAT/PMT,
+ * reassembles its video and audio PES from 188 byte packets and turns
+ * the PCR into pack SCRs. What comes out is a program stream of 2048
+ * byte packs that goes through MPEGInput() like anything else, so the
+ * timestamp rebasing there applies to TS sources too.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pmbmpeg.h"
+#include "pmblog.h"
+#include "pmbts.h"
+
+#define TS_PACKET		188
+#define TS_PCR_WRAP		MPEG_CLOCK_WRAP
+
+int ts_program = 0;
+
+unsigned long long stat_ts_packets = 0,stat_ts_resyncs = 0;
+unsigned long long stat_ts_cc_errors = 0,stat_ts_dropped = 0;
+
+static unsigned char ts_in[TS_PACKET*64];
+static int ts_in_remain = 0;
+static int ts_lost_sync = 0;
+static unsigned char ts_cc[8192];	// last continuity_counter + 1 per PID, 0 if none yet
+
+// PSI sections (PAT, PMT) can span TS packets
+struct ts_section {
+	int len,need;
+	unsigned char buf[3+1021];
+};
+static struct ts_section ts_pat,ts_pmt;
+static int pmt_pid = -1;		// -1 until the PAT tells us
+static int pcr_pid = -1;
+static int pmt_program = 0;
+
+// one elementary stream we pass along. PES packets are cut into pieces that
+// fill exactly one 2048 byte pack each: the first piece carries the original
+// PES header (PTS/DTS), the rest a minimal one, same as the repacketizer does.
+struct ts_stream {
+	int pid;
+	unsigned long sync;		// stream_id we put on the output
+	int state;			// 0 = waiting for a PES start, 1 = PES header, 2 = payload
+	unsigned char hdr[9+255];	// PES header up to and including the optional fields
+	int hdr_len,hdr_need;
+	int first;			// next piece carries hdr
+	long remain;			// payload left according to PES_packet_length, -1 if unbounded
+	unsigned char data[2048];
+	int data_len;
+};
+static struct ts_stream ts_video = { -1 },ts_audio = { -1 };
+
+// the PCR, and how far into the transport stream we were when it arrived.
+// pack SCRs are extrapolated from it at the TS byte rate.
+static int have_pcr = 0;
+static unsigned long long pcr_ticks = 0;
+static unsigned long long pcr_pos = 0;
+static unsigned long long ts_pos = 0;
+static unsigned long long ts_rate = 0;		// bytes/sec, 0 until two PCRs tell us
+static unsigned long long last_scr_ticks = 0;
+static int have_scr = 0;
+
+static unsigned long TSCRC32(unsigned char *p,int len)
+{
+	unsigned long crc = 0xFFFFFFFFUL;
+	int i;
+
+	while (len-- > 0) {
+		crc ^= ((unsigned long)(*p++)) << 24;
+		for (i=0;i < 8;i++)
+			crc = ((crc << 1) ^ ((crc & 0x80000000UL) ? 0x04C11DB7UL : 0)) & 0xFFFFFFFFUL;
+	}
+
+	return crc;
+}
+
+static void TSStreamReset(struct ts_stream *st,int pid,unsigned long sync)
+{
+	st->pid = pid;
+	st->sync = sync;
+	st->state = 0;
+	st->hdr_len = st->hdr_need = 0;
+	st->first = 0;
+	st->remain = -1;
+	st->data_len = 0;
+}
+
+void TSReset()
+{
+	memset(ts_cc,0,sizeof(ts_cc));
+	ts_pat.len = ts_pat.need = 0;
+	ts_pmt.len = ts_pmt.need = 0;
+	pmt_pid = pcr_pid = -1;
+	pmt_program = 0;
+	TSStreamReset(&ts_video,-1,0);
+	TSStreamReset(&ts_audio,-1,0);
+	have_pcr = 0;
+	have_scr = 0;
+	ts_rate = 0;
+	ts_in_remain = 0;
+	ts_lost_sync = 0;
+}
+
+// SCR for the current position in the transport stream
+static unsigned long long TSClock()
+{
+	unsigned long long t = pcr_ticks,d;
+
+	if (ts_rate > 0)
+		t = (t + ((ts_pos - pcr_pos) * 27000000ULL) / ts_rate) % TS_PCR_WRAP;
+
+	// extrapolating past the next PCR and then stepping back would look like
+	// a clock reset to the rebasing code. hold the clock instead, unless it
+	// went back by so much that it really is a new timeline.
+	if (have_scr) {
+		d = (last_scr_ticks + TS_PCR_WRAP - t) % TS_PCR_WRAP;
+		if (d > 0 && d < 27000000ULL)
+			t = last_scr_ticks;
+	}
+	last_scr_ticks = t;
+	have_scr = 1;
+	return t;
+}
+
+// payload room in one pack for the next piece of this stream
+static int TSRoom(struct ts_stream *st)
+{
+	return 2048 - 14 - 6 - (st->first ? (st->hdr_len - 6) : 3);
+}
+
+// wrap up what we have of the stream's PES as one pack and pass it on
+static void TSEmit(struct ts_stream *st)
+{
+	unsigned char pack[2048];
+	unsigned char cont[3],*h;
+	int i,h_len;
+
+	if (st->data_len == 0 && !st->first)
+		return;
+
+	if (st->first) {
+		h = st->hdr + 6;
+		h_len = st->hdr_len - 6;
+	}
+	else {
+		cont[0] = st->hdr[6] & ~0x04;	// data_alignment_indicator no longer holds
+		cont[1] = 0x00;			// no PTS/DTS/ESCR/etc.
+		cont[2] = 0x00;			// PES_header_data_length
+		h = cont;
+		h_len = 3;
+	}
+
+	i = MPEGPackHeader(pack,TSClock(),ts_rate ? (ts_rate / 50) : 25200);
+	pack[i++] = st->sync >> 24;
+	pack[i++] = st->sync >> 16;
+	pack[i++] = st->sync >>  8;
+	pack[i++] = st->sync      ;
+	pack[i++] = (h_len + st->data_len) >> 8;
+	pack[i++] = (h_len + st->data_len);
+	memcpy(pack+i,h,h_len);
+	i += h_len;
+	memcpy(pack+i,st->data,st->data_len);
+	i += st->data_len;
+	stat_bytes_copied += st->data_len;
+
+	st->first = 0;
+	st->data_len = 0;
+	MPEGInput(pack,i);
+}
+
+// throw away the PES in progress, we lost part of it
+static void TSStreamDrop(struct ts_stream *st)
+{
+	if (st->state != 0) stat_ts_dropped++;
+	st->state = 0;
+	st->data_len = 0;
+	st->first = 0;
+}
+
+static void TSStreamPayload(struct ts_stream *st,unsigned char *p,int len,int pusi)
+{
+	if (pusi) {
+		// the previous PES ends where this one starts
+		if (st->state == 2)
+			TSEmit(st);
+		else if (st->state == 1)
+			stat_ts_dropped++;
+
+		st->state = 1;
+		st->hdr_len = 0;
+		st->hdr_need = 9;
+		st->data_len = 0;
+	}
+
+	while (len > 0 && st->state != 0) {
+		if (st->state == 1) {
+			int n = st->hdr_need - st->hdr_len;
+
+			if (n > len) n = len;
+			memcpy(st->hdr+st->hdr_len,p,n);
+			st->hdr_len += n;
+			p += n;
+			len -= n;
+			if (st->hdr_len < st->hdr_need)
+				break;
+
+			if (st->hdr_need == 9) {
+				if (	st->hdr[0] != 0x00 || st->hdr[1] != 0x00 || st->hdr[2] != 0x01 ||
+					(st->hdr[6] >> 6) != 2) {
+					PMBLog(PMB_LOG_WARNING,"TS: PID 0x%04X does not start with a MPEG-2 PES header, dropping\n",st->pid);
+					TSStreamDrop(st);
+					break;
+				}
+
+				st->hdr_need = 9 + st->hdr[8];
+				if (st->hdr_len < st->hdr_need)
+					continue;
+			}
+
+			// header complete
+			int pkt_len = (st->hdr[4] << 8) | st->hdr[5];
+			if (pkt_len == 0) {
+				st->remain = -1;		// video in TS usually leaves it open
+			}
+			else if (pkt_len < (st->hdr_need - 6)) {
+				PMBLog(PMB_LOG_WARNING,"TS: PID 0x%04X PES header longer than the packet, dropping\n",st->pid);
+				TSStreamDrop(st);
+				break;
+			}
+			else {
+				st->remain = pkt_len - (st->hdr_need - 6);
+			}
+
+			st->first = 1;
+			st->data_len = 0;
+			st->state = 2;
+			if (st->remain == 0) {		// nothing but the header
+				TSEmit(st);
+				st->state = 0;
+			}
+		}
+		else {
+			int room = TSRoom(st) - st->data_len;
+			int n = len;
+
+			if (n > room) n = room;
+			if (st->remain >= 0 && n > st->remain) n = st->remain;
+			memcpy(st->data+st->data_len,p,n);
+			st->data_len += n;
+			p += n;
+			len -= n;
+			if (st->remain >= 0) st->remain -= n;
+
+			if (st->remain == 0) {
+				TSEmit(st);
+				st->state = 0;
+			}
+			else if (st->data_len >= TSRoom(st)) {
+				TSEmit(st);
+			}
+		}
+	}
+}
+
+static void TSSectionDone(int pid,unsigned char *s,int len)
+{
+	int i;
+
+	if (TSCRC32(s,len) != 0) {
+		PMBLog(PMB_LOG_WARNING,"TS: CRC error in PSI section on PID 0x%04X\n",pid);
+		return;
+	}
+	if ((s[5] & 0x01) == 0)		// current_next_indicator: not in effect yet
+		return;
+
+	if (pid == 0x0000 && s[0] == 0x00) {		// PAT
+		int found = -1,program = 0;
+
+		for (i=8;(i+4) <= (len-4);i += 4) {
+			int pn = (s[i] << 8) | s[i+1];
+			int pp = ((s[i+2] & 0x1F) << 8) | s[i+3];
+
+			if (pn == 0) continue;			// network PID
+			if (ts_program == 0 || pn == ts_program) {
+				found = pp;
+				program = pn;
+				break;
+			}
+		}
+
+		if (found < 0) {
+			if (pmt_pid < 0)
+				PMBLog(PMB_LOG_WARNING,"TS: program %d not in PAT\n",ts_program);
+			return;
+		}
+		if (found != pmt_pid || program != pmt_program) {
+			PMBLog(PMB_LOG_INFO,"TS: program %d, PMT on PID 0x%04X\n",program,found);
+			pmt_pid = found;
+			pmt_program = program;
+			ts_pmt.len = ts_pmt.need = 0;
+		}
+	}
+	else if (pid == pmt_pid && s[0] == 0x02) {	// PMT
+		int video = -1,video_type = 0,audio = -1,audio_type = 0;
+		int pn = (s[3] << 8) | s[4];
+		int info_len;
+
+		if (pn != pmt_program)
+			return;
+
+		pcr_pid = ((s[8] & 0x1F) << 8) | s[9];
+		info_len = ((s[10] & 0x0F) << 8) | s[11];
+		for (i=12+info_len;(i+5) <= (len-4);) {
+			int type = s[i];
+			int es_pid = ((s[i+1] & 0x1F) << 8) | s[i+2];
+			int es_info_len = ((s[i+3] & 0x0F) << 8) | s[i+4];
+
+			if ((type == 0x01 || type == 0x02) && video < 0) {
+				video = es_pid;
+				video_type = type;
+			}
+			else if ((type == 0x03 || type == 0x04) && audio < 0) {
+				audio = es_pid;
+				audio_type = type;
+			}
+			i += 5 + es_info_len;
+		}
+
+		if (video != ts_video.pid || audio != ts_audio.pid) {
+			PMBLog(PMB_LOG_INFO,"TS: PCR on PID 0x%04X, video PID 0x%04X (type 0x%02X), audio PID 0x%04X (type 0x%02X)\n",
+				pcr_pid,video,video_type,audio,audio_type);
+			if (video < 0)
+				PMBLog(PMB_LOG_WARNING,"WARNING: No MPEG-1/2 video in this program. The MovieBox can't decode anything else.\n");
+			if (ts_video.pid != video)
+				TSStreamReset(&ts_video,video,0x000001E0);
+			if (ts_audio.pid != audio)
+				TSStreamReset(&ts_audio,audio,0x000001C0);
+		}
+	}
+}
+
+static void TSSectionData(struct ts_section *sec,int pid,unsigned char *p,int len)
+{
+	while (len > 0 && sec->need > 0) {
+		int n = sec->need - sec->len;
+
+		if (n > len) n = len;
+		memcpy(sec->buf+sec->len,p,n);
+		sec->len += n;
+		p += n;
+		len -= n;
+		if (sec->len < sec->need)
+			break;
+
+		if (sec->need == 3) {
+			if (sec->buf[0] == 0xFF) {		// stuffing, no more sections in this packet
+				sec->need = 0;
+				break;
+			}
+			sec->need = 3 + (((sec->buf[1] & 0x0F) << 8) | sec->buf[2]);
+			if (sec->need < (3+5+4) || sec->need > (int)sizeof(sec->buf)) {
+				sec->need = 0;
+				break;
+			}
+		}
+		else {
+			TSSectionDone(pid,sec->buf,sec->len);
+
+			// another section may follow in the same packet
+			sec->len = 0;
+			sec->need = (len > 0) ? 3 : 0;
+		}
+	}
+}
+
+static void TSSectionPayload(struct ts_section *sec,int pid,unsigned char *p,int len,int pusi)
+{
+	if (pusi) {
+		int pointer = p[0];
+
+		p++;
+		len--;
+		if (pointer > len) {
+			sec->len = sec->need = 0;
+			return;
+		}
+		if (sec->need > 0)			// tail end of the previous section
+			TSSectionData(sec,pid,p,pointer);
+
+		sec->len = 0;
+		sec->need = 3;
+		TSSectionData(sec,pid,p+pointer,len-pointer);
+	}
+	else if (sec->need > 0) {
+		TSSectionData(sec,pid,p,len);
+	}
+}
+
+static void TSPacket(unsigned char *p)
+{
+	int pid = ((p[1] & 0x1F) << 8) | p[2];
+	int pusi = p[1] & 0x40;
+	int afc = (p[3] >> 4) & 3;
+	int cc = p[3] & 0x0F;
+	int discontinuity = 0;
+	int payload = 4;
+	struct ts_stream *st = NULL;
+
+	stat_ts_packets++;
+	if (p[1] & 0x80)			// transport_error_indicator
+		goto next;
+	if (pid == 0x1FFF)			// null packet
+		goto next;
+
+	if (pid == ts_video.pid) st = &ts_video;
+	else if (pid == ts_audio.pid) st = &ts_audio;
+
+	if (afc & 2) {
+		int af_len = p[4];
+
+		payload = 5 + af_len;
+		if (payload > TS_PACKET) goto next;
+
+		if (af_len > 0) {
+			discontinuity = p[5] & 0x80;
+			if ((p[5] & 0x10) && af_len >= 7 && pid == pcr_pid) {
+				unsigned long long base,t;
+
+				base =	(((unsigned long long)p[6]) << 25) |
+					(((unsigned long long)p[7]) << 17) |
+					(((unsigned long long)p[8]) <<  9) |
+					(((unsigned long long)p[9]) <<  1) |
+					(((unsigned long long)p[10]) >> 7);
+				t = base * 300ULL + ((((unsigned long long)p[10] & 1) << 8) | p[11]);
+
+				// measure the byte rate between two PCRs of the same timeline
+				if (have_pcr && !discontinuity) {
+					unsigned long long dt = (t + TS_PCR_WRAP - pcr_ticks) % TS_PCR_WRAP;
+
+					if (dt > 0 && dt < 27000000ULL && ts_pos > pcr_pos) {
+						unsigned long long r = ((ts_pos - pcr_pos) * 27000000ULL) / dt;
+						if (r >= 50) ts_rate = r;
+					}
+				}
+
+				pcr_ticks = t;
+				pcr_pos = ts_pos;
+				have_pcr = 1;
+			}
+		}
+	}
+
+	if (!(afc & 1) || payload >= TS_PACKET)
+		goto next;
+
+	// continuity_counter only advances on packets with payload
+	if (ts_cc[pid] != 0 && !discontinuity) {
+		if (cc == ts_cc[pid] - 1)	// duplicate packet, allowed once
+			goto next;
+		if (cc != (ts_cc[pid] & 0x0F)) {
+			stat_ts_cc_errors++;
+			if (st != NULL) TSStreamDrop(st);
+			else if (pid == 0x0000) ts_pat.need = 0;
+			else if (pid == pmt_pid) ts_pmt.need = 0;
+		}
+	}
+	ts_cc[pid] = cc + 1;
+
+	if (p[3] & 0xC0)			// scrambled, nothing we can do with it
+		goto next;
+
+	if (pid == 0x0000)
+		TSSectionPayload(&ts_pat,pid,p+payload,TS_PACKET-payload,pusi);
+	else if (pid == pmt_pid)
+		TSSectionPayload(&ts_pmt,pid,p+payload,TS_PACKET-payload,pusi);
+	else if (st != NULL && have_pcr)	// no clock to stamp packs with until the first PCR
+		TSStreamPayload(st,p+payload,TS_PACKET-payload,pusi);
+
+next:
+	ts_pos += TS_PACKET;
+}
+
+int TSInputSpace(unsigned char **p)
+{
+	*p = ts_in + ts_in_remain;
+	return sizeof(ts_in) - ts_in_remain;
+}
+
+void TSInputCommit(int clen)
+{
+	unsigned char *buf = ts_in;
+	int len = ts_in_remain + clen;
+
+	while (len >= TS_PACKET) {
+		// sync byte, and the next packet's too if it's here already
+		if (buf[0] != 0x47 || (len >= (TS_PACKET+1) && buf[TS_PACKET] != 0x47)) {
+			if (!ts_lost_sync) {
+				PMBLog(PMB_LOG_WARNING,"TS: lost sync\n");
+				stat_ts_resyncs++;
+				ts_lost_sync = 1;
+			}
+			buf++;
+			len--;
+			continue;
+		}
+
+		ts_lost_sync = 0;
+		TSPacket(buf);
+		buf += TS_PACKET;
+		len -= TS_PACKET;
+	}
+
+	ts_in_remain = len;
+	if (len > 0 && buf != ts_in) {
+		memmove(ts_in,buf,len);
+		stat_bytes_copied += len;
+	}
+}
+
+void TSInput(unsigned char *cbuf,int clen)
+{
+	while (clen > 0) {
+		unsigned char *p;
+		int n = TSInputSpace(&p);
+
+		if (n > clen) n = clen;
+		memcpy(p,cbuf,n);
+		stat_bytes_copied += n;
+		TSInputCommit(n);
+		cbuf += n;
+		clen -= n;
+	}
+}
@@ -0,0 +1,16 @@
+// MPEG transport stream input (pmbts.c)
+//
+// Transport stream bytes go in here instead of MPEGInput(). One program is
+// picked out of the PAT/PMT and handed to MPEGInput() as a program stream.
+
+void TSInput(unsigned char *buf,int len);
+int TSInputSpace(unsigned char **p);
+void TSInputCommit(int len);
+void TSReset();
+
+// program_number to play, 0 means the first one in the PAT
+extern int ts_program;
+
+// accounting
+extern unsigned long long stat_ts_packets,stat_ts_resyncs;
+extern unsigned long long stat_ts_cc_errors,stat_ts_dropped;